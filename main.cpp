@@ -10,230 +10,10431 @@
 #include <iomanip>
 #include <sstream>
 #include <map>
+#include <array>
 #include <optional>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <unordered_map>
+#include <unordered_set>
+#include <string_view>
+#include <csignal>
+#include <random>
+
+#ifdef FLAMEUP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// SSE2 is part of x86-64, AVX2 kernels are picked at runtime
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define FLAMEUP_HAVE_X86_SIMD
+#endif
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0A00
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <vss.h>
+#include <vswriter.h>
+#include <vsbackup.h>
+#ifdef FLAMEUP_BENCH
+#include <psapi.h>
+#endif
+#else
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/vfs.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/magic.h>
+#include <linux/btrfs.h>
+#endif
+#endif
 
 namespace fs = std::filesystem;
 
+// How a snapshot stores file data
+enum class SnapshotFormat : uint32_t {
+    Directory = 0,  // plain copy of the source tree
+    Chunked = 1,    // chunk references into the shared chunk store
+    Archive = 2     // single compressed archive file
+};
+
+// How the source is frozen before a backup reads it (see SourceSnapshot)
+enum class SourceSnapshotMethod {
+    None,   // read the live tree
+    Auto,   // VSS on Windows; btrfs, ZFS or LVM on Linux, whichever holds the source
+    Btrfs,
+    Zfs,
+    Lvm,
+    Vss
+};
+
+// How a restore replaces an existing target
+enum class RestoreMode {
+    Copy,  // delete the target, then copy the snapshot into place
+    Swap,  // check the snapshot out next to the target, then swap it in with one rename
+    Diff   // rewrite only entries that differ from the snapshot and delete extra ones
+};
+
 struct BackupConfig {
     std::string sourcePath;
     std::string backupRoot = "CopiedFiles";
     std::string configFile = "paths.txt";
     size_t maxBackups = 10;
+    std::string retention;         // tiered retention spec (see parse_retention); replaces maxBackups when set
     std::chrono::minutes interval{30};
     bool daemon = false;
     bool instant = false;
     bool verbose = false;
     bool help = false;
     bool listBackups = false;
+    std::string sourceName;        // --source: the named source whose backups --list/--restore/... act on
+    bool incremental = false;
+    bool hashCompare = false;
+    bool hashCopies = true;        // record a content hash for every copied file (off: in-kernel copies stay unhashed)
+    size_t jobs = 0; // 0 = one worker per hardware thread
+    bool watch = false; // daemon reacts to filesystem change notifications instead of polling
+    std::chrono::seconds quietPeriod{2}; // watch mode: wait this long after the last change
+    std::chrono::seconds maxLatency{60}; // watch mode: never delay a change longer than this
+    double maxMBps = 0;            // copy rate limit in MiB/s (0 = unlimited)
+    double maxFilesPerSecond = 0;  // file rate limit (0 = unlimited)
+    bool adaptiveThrottle = false; // slow down while source read latency is elevated
+    bool idlePriority = false;     // run at idle CPU and I/O priority
+    std::string statusFile;        // JSON status file (empty = <backupRoot>/.flameup_status.json)
+    std::string metricsListen;     // [address:]port for the Prometheus endpoint (empty = off)
+    std::vector<std::string> filterRules; // gitignore-style rules; "!" re-includes
+    std::string remoteTarget;      // flameup://host[:port][/dir] or ssh://[user@]host[:port]/path (empty = off)
+    std::string remoteDirectory;   // subdirectory on the remote for this source (set per source)
+    std::string remoteToken;       // shared secret between a flameup:// client and server
+    std::string remoteCommand = "FlameUp"; // program started on the far end of ssh://
+    size_t remoteStreams = 4;      // flameup:// connections a snapshot is sent over in parallel
+    std::string serveListen;       // [address:]port to receive replicated snapshots on (empty = off)
+    bool serveStdio = false;       // receive one replicated snapshot over stdin/stdout (used by ssh://)
+    SnapshotFormat format = SnapshotFormat::Directory;
+    SourceSnapshotMethod sourceSnapshot = SourceSnapshotMethod::None;
+    RestoreMode restoreMode = RestoreMode::Copy;
     std::optional<std::string> restoreBackup;
+    std::vector<std::string> restorePaths; // paths or globs inside the backup (empty = everything)
     std::optional<std::string> deleteBackup;
+    std::optional<std::string> verifyBackup; // snapshot name or "all"
+    size_t verifySample = 0;       // check only this many random files (daemon: per idle check)
+    uint64_t packThreshold = 0;    // directory snapshots: pack files smaller than this many bytes (0 = off)
+    bool asyncIo = false;          // batch small-file I/O through io_uring / IOCP
+};
+
+// Function to get timestamp-based folder name
+std::string make_timestamp_folder_name() {
+    auto now = std::chrono::system_clock::now();
+    auto time_t = std::chrono::system_clock::to_time_t(now);
+    std::tm tm_buf;
+
+    // Use localtime_s instead of localtime
+#ifdef _WIN32
+    if (localtime_s(&tm_buf, &time_t) != 0) {
+        // Handle error - maybe return a default name or throw
+        return "Backup_Error";
+    }
+#else
+    if (localtime_r(&time_t, &tm_buf) == nullptr) {
+        return "Backup_Error";
+    }
+#endif
+
+    std::ostringstream oss;
+    oss << "Backup_" << std::put_time(&tm_buf, "%Y-%m-%d_%H-%M-%S");
+    return oss.str();
+}
+
+// Function to trim whitespace from both ends of a string
+std::string trim_whitespace(std::string s) {
+    s.erase(0, s.find_first_not_of(" \t\r\n"));
+    s.erase(s.find_last_not_of(" \t\r\n") + 1);
+    return s;
+}
+
+// How snapshots inside one age range are thinned out
+enum class RetentionBucket {
+    All,       // keep every snapshot
+    Interval,  // keep one per calendar-aligned interval of bucketSeconds
+    Monthly,   // keep one per calendar month
+    Yearly     // keep one per calendar year
+};
+
+// One tier of a retention policy: snapshots younger than maxAge (and older than the previous
+// tier's maxAge) keep one snapshot per bucket
+struct RetentionTier {
+    RetentionBucket bucket = RetentionBucket::All;
+    int64_t bucketSeconds = 0;
+    int64_t maxAge = 0;
+};
+
+// Function to parse a duration such as 90m, 36h, 30d, 12w or 2y into seconds
+int64_t parse_retention_duration(const std::string& text) {
+    size_t digits = 0;
+    while (digits < text.size() && std::isdigit(static_cast<unsigned char>(text[digits]))) digits++;
+    if (digits == 0 || digits + 1 != text.size()) {
+        throw std::runtime_error("Invalid duration '" + text + "' (expected a number followed by m, h, d, w or y)");
+    }
+    int64_t count = std::stoll(text.substr(0, digits));
+    switch (text.back()) {
+        case 'm': return count * 60;
+        case 'h': return count * 3600;
+        case 'd': return count * 86400;
+        case 'w': return count * 7 * 86400;
+        case 'y': return count * 365 * 86400;
+        default:
+            throw std::runtime_error("Invalid duration '" + text + "' (expected a number followed by m, h, d, w or y)");
+    }
+}
+
+// Function to parse a retention spec: comma-separated <bucket>:<age> tiers, e.g.
+// "all:1h,hourly:1d,daily:30d" keeps everything from the last hour, one snapshot per hour for a
+// day and one per day for a month. A bucket is all, hourly, daily, weekly, monthly, yearly or a
+// duration (6h). Snapshots older than the last tier are removed. Tiers come back sorted by age.
+std::vector<RetentionTier> parse_retention(const std::string& spec) {
+    std::vector<RetentionTier> tiers;
+    std::istringstream fields(spec);
+    std::string field;
+    while (std::getline(fields, field, ',')) {
+        field = trim_whitespace(field);
+        if (field.empty()) continue;
+        size_t colon = field.find(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("Invalid retention tier '" + field + "' (expected <bucket>:<age>)");
+        }
+        std::string bucket = trim_whitespace(field.substr(0, colon));
+        RetentionTier tier;
+        tier.maxAge = parse_retention_duration(trim_whitespace(field.substr(colon + 1)));
+        if (bucket == "all") {
+            tier.bucket = RetentionBucket::All;
+        } else if (bucket == "monthly") {
+            tier.bucket = RetentionBucket::Monthly;
+        } else if (bucket == "yearly") {
+            tier.bucket = RetentionBucket::Yearly;
+        } else {
+            tier.bucket = RetentionBucket::Interval;
+            tier.bucketSeconds = bucket == "hourly" ? 3600 : bucket == "daily" ? 86400 :
+                                 bucket == "weekly" ? 7 * 86400 : parse_retention_duration(bucket);
+        }
+        if (tier.maxAge <= 0 || (tier.bucket == RetentionBucket::Interval && tier.bucketSeconds <= 0)) {
+            throw std::runtime_error("Invalid retention tier '" + field + "'");
+        }
+        tiers.push_back(tier);
+    }
+    if (tiers.empty()) {
+        throw std::runtime_error("Empty retention spec");
+    }
+    std::sort(tiers.begin(), tiers.end(), [](const auto& a, const auto& b) { return a.maxAge < b.maxAge; });
+    return tiers;
+}
+
+// One source directory from paths.txt with its own retention and schedule
+struct SourceSpec {
+    std::string path;
+    std::string name; // subdirectory of the backup root; empty = the backup root itself
+    size_t maxBackups = 10;
+    std::string retention; // tiered retention spec, replaces maxBackups when set
+    std::chrono::minutes interval{30};
+    std::vector<std::string> filterRules; // applied after the global --exclude/--include rules
+};
+
+// Function to check that a source name is one plain directory name, so a source's backup root
+// can neither leave the shared root nor land on its bookkeeping files
+void validate_source_name(const std::string& name, const std::string& context) {
+    if (name.empty() || name == "." || name == ".." || name.starts_with(".flameup") ||
+        name.find_first_of("/\\:") != std::string::npos || fs::path(name).is_absolute()) {
+        throw std::runtime_error("Invalid source name '" + name + "' in " + context);
+    }
+}
+
+// Function to read all source paths from file. Each line is a path, optionally followed by
+// "| key=value" settings: name (backup subdirectory), max (backups to keep), retain (tiered
+// retention spec, see parse_retention), interval (minutes),
+// exclude and include (comma-separated gitignore-style patterns, applied in line order).
+std::vector<SourceSpec> read_sources_from_file(const std::string& txtFilePath, const BackupConfig& defaults) {
+    std::ifstream in(txtFilePath);
+    if (!in.is_open()) {
+        throw std::runtime_error("Cannot open config file: " + txtFilePath);
+    }
+
+    std::vector<SourceSpec> sources;
+    std::string line;
+    bool anyNamed = false;
+
+    while (std::getline(in, line)) {
+        line = trim_whitespace(line);
+
+        if (line.empty()) continue;
+
+        // Skip comment lines
+        if (line.starts_with("#") ||
+            line.starts_with("//") ||
+            line.starts_with("--")) {
+            continue;
+        }
+
+        SourceSpec source;
+        source.maxBackups = defaults.maxBackups;
+        source.retention = defaults.retention;
+        source.interval = defaults.interval;
+
+        std::istringstream fields(line);
+        std::string field;
+        std::getline(fields, field, '|');
+        source.path = trim_whitespace(field);
+
+        while (std::getline(fields, field, '|')) {
+            field = trim_whitespace(field);
+            size_t eq = field.find('=');
+            if (eq == std::string::npos) {
+                throw std::runtime_error("Invalid setting '" + field + "' in " + txtFilePath);
+            }
+            std::string key = trim_whitespace(field.substr(0, eq));
+            std::string value = trim_whitespace(field.substr(eq + 1));
+            if (key == "name") {
+                validate_source_name(value, txtFilePath);
+                source.name = value;
+                anyNamed = true;
+            } else if (key == "max") {
+                source.maxBackups = std::stoul(value);
+                if (source.maxBackups == 0) {
+                    throw std::runtime_error("max must be at least 1 in " + txtFilePath);
+                }
+                source.retention.clear();
+            } else if (key == "retain") {
+                parse_retention(value);
+                source.retention = value;
+            } else if (key == "interval") {
+                source.interval = std::chrono::minutes(std::stoul(value));
+            } else if (key == "exclude" || key == "include") {
+                std::istringstream patterns(value);
+                std::string pattern;
+                while (std::getline(patterns, pattern, ',')) {
+                    pattern = trim_whitespace(pattern);
+                    if (!pattern.empty()) {
+                        source.filterRules.push_back(key == "include" ? "!" + pattern : pattern);
+                    }
+                }
+            } else {
+                throw std::runtime_error("Unknown setting '" + key + "' in " + txtFilePath);
+            }
+        }
+        sources.push_back(source);
+    }
+
+    if (sources.empty()) {
+        throw std::runtime_error("No valid path found in file: " + txtFilePath);
+    }
+
+    // A single unnamed source keeps backing up straight into the backup root
+    if (sources.size() == 1 && !anyNamed) {
+        return sources;
+    }
+
+    // Several sources each get a subdirectory, named after the source folder unless set explicitly
+    std::vector<std::string> used;
+    for (size_t i = 0; i < sources.size(); i++) {
+        std::string base = sources[i].name;
+        if (base.empty()) {
+            base = fs::path(sources[i].path).lexically_normal().filename().string();
+            if (base.empty() || base == "." || base == "..") {
+                base = fs::path(sources[i].path).lexically_normal().parent_path().filename().string();
+            }
+            if (base.empty()) {
+                base = "source" + std::to_string(i + 1);
+            }
+        }
+
+        std::string name = base;
+        for (int suffix = 2; std::find(used.begin(), used.end(), name) != used.end(); suffix++) {
+            name = base + "-" + std::to_string(suffix);
+        }
+        used.push_back(name);
+        sources[i].name = name;
+    }
+    return sources;
+}
+
+
+// Streaming XXH64 state used for optional content comparison
+struct Xxh64State {
+    static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t v[4];
+    uint64_t totalLen = 0;
+    unsigned char buffer[32];
+    size_t bufferSize = 0;
+
+    explicit Xxh64State(uint64_t seed = 0) : v{seed + P1 + P2, seed + P2, seed, seed - P1} {}
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t x;
+        std::memcpy(&x, p, 8);
+        return x;
+    }
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t x;
+        std::memcpy(&x, p, 4);
+        return x;
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * P2;
+        acc = rotl(acc, 31);
+        return acc * P1;
+    }
+
+    static uint64_t merge(uint64_t acc, uint64_t val) {
+        acc ^= round(0, val);
+        return acc * P1 + P4;
+    }
+
+    void update(const unsigned char* data, size_t len) {
+        totalLen += len;
+
+        if (bufferSize + len < 32) {
+            std::memcpy(buffer + bufferSize, data, len);
+            bufferSize += len;
+            return;
+        }
+
+        if (bufferSize > 0) {
+            size_t fill = 32 - bufferSize;
+            std::memcpy(buffer + bufferSize, data, fill);
+            for (int i = 0; i < 4; i++) {
+                v[i] = round(v[i], read64(buffer + i * 8));
+            }
+            data += fill;
+            len -= fill;
+            bufferSize = 0;
+        }
+
+        while (len >= 32) {
+            for (int i = 0; i < 4; i++) {
+                v[i] = round(v[i], read64(data + i * 8));
+            }
+            data += 32;
+            len -= 32;
+        }
+
+        if (len > 0) {
+            std::memcpy(buffer, data, len);
+            bufferSize = len;
+        }
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (totalLen >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (int i = 0; i < 4; i++) {
+                h = merge(h, v[i]);
+            }
+        } else {
+            h = v[2] + P5;
+        }
+        h += totalLen;
+
+        const unsigned char* p = buffer;
+        size_t len = bufferSize;
+        while (len >= 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * P1 + P4;
+            p += 8;
+            len -= 8;
+        }
+        if (len >= 4) {
+            h ^= static_cast<uint64_t>(read32(p)) * P1;
+            h = rotl(h, 23) * P2 + P3;
+            p += 4;
+            len -= 4;
+        }
+        while (len > 0) {
+            h ^= (*p) * P5;
+            h = rotl(h, 11) * P1;
+            p++;
+            len--;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+// XXH3 (64-bit, default secret, no seed), used for file content hashes. Its 64-byte stripe
+// loop runs on AVX2 when the CPU has it, otherwise on SSE2, otherwise in scalar code.
+constexpr size_t XXH3_STRIPE_LEN = 64;
+constexpr size_t XXH3_SECRET_SIZE = 192;
+constexpr size_t XXH3_SECRET_LIMIT = XXH3_SECRET_SIZE - XXH3_STRIPE_LEN;
+constexpr size_t XXH3_STRIPES_PER_BLOCK = XXH3_SECRET_LIMIT / 8;
+constexpr size_t XXH3_MIDSIZE_MAX = 240;
+constexpr size_t XXH3_BUFFER_SIZE = 256;
+
+alignas(64) constexpr unsigned char XXH3_SECRET[XXH3_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+// Stripe kernels: accumulate runs nbStripes 64-byte stripes into the eight accumulators, each
+// stripe using the secret 8 bytes further on; scramble mixes the accumulators after a block
+struct Xxh3Kernels {
+    void (*accumulate)(uint64_t* acc, const unsigned char* input, const unsigned char* secret, size_t nbStripes);
+    void (*scramble)(uint64_t* acc, const unsigned char* secret);
+    const char* name;
+};
+
+struct Xxh3Scalar {
+    static constexpr uint64_t PRIME32_1 = 0x9E3779B1U;
+
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t x;
+        std::memcpy(&x, p, 8);
+        return x;
+    }
+
+    static void accumulate(uint64_t* acc, const unsigned char* input, const unsigned char* secret, size_t nbStripes) {
+        for (size_t n = 0; n < nbStripes; n++) {
+            const unsigned char* in = input + n * XXH3_STRIPE_LEN;
+            const unsigned char* key = secret + n * 8;
+            for (size_t lane = 0; lane < 8; lane++) {
+                uint64_t dataVal = read64(in + lane * 8);
+                uint64_t dataKey = dataVal ^ read64(key + lane * 8);
+                acc[lane ^ 1] += dataVal;
+                acc[lane] += (dataKey & 0xFFFFFFFF) * (dataKey >> 32);
+            }
+        }
+    }
+
+    static void scramble(uint64_t* acc, const unsigned char* secret) {
+        for (size_t lane = 0; lane < 8; lane++) {
+            uint64_t a = acc[lane];
+            a ^= a >> 47;
+            a ^= read64(secret + lane * 8);
+            a *= PRIME32_1;
+            acc[lane] = a;
+        }
+    }
+};
+
+#ifdef FLAMEUP_HAVE_X86_SIMD
+struct Xxh3Sse2 {
+    static void accumulate(uint64_t* acc, const unsigned char* input, const unsigned char* secret, size_t nbStripes) {
+        __m128i a[4];
+        for (int i = 0; i < 4; i++) a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + i);
+        for (size_t n = 0; n < nbStripes; n++) {
+            const auto* in = reinterpret_cast<const __m128i*>(input + n * XXH3_STRIPE_LEN);
+            const auto* key = reinterpret_cast<const __m128i*>(secret + n * 8);
+            for (int i = 0; i < 4; i++) {
+                __m128i dataVec = _mm_loadu_si128(in + i);
+                __m128i dataKey = _mm_xor_si128(dataVec, _mm_loadu_si128(key + i));
+                __m128i product = _mm_mul_epu32(dataKey, _mm_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1)));
+                __m128i swapped = _mm_shuffle_epi32(dataVec, _MM_SHUFFLE(1, 0, 3, 2));
+                a[i] = _mm_add_epi64(product, _mm_add_epi64(a[i], swapped));
+            }
+        }
+        for (int i = 0; i < 4; i++) _mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + i, a[i]);
+    }
+
+    static void scramble(uint64_t* acc, const unsigned char* secret) {
+        const __m128i prime = _mm_set1_epi32(static_cast<int>(Xxh3Scalar::PRIME32_1));
+        for (int i = 0; i < 4; i++) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + i);
+            a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+            __m128i dataKey = _mm_xor_si128(a, _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret) + i));
+            __m128i productLo = _mm_mul_epu32(dataKey, prime);
+            __m128i productHi = _mm_mul_epu32(_mm_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + i,
+                             _mm_add_epi64(productLo, _mm_slli_epi64(productHi, 32)));
+        }
+    }
+};
+
+#if defined(__GNUC__) || defined(__AVX2__)
+// Compiled for AVX2 regardless of the target flags and only called after a CPU check
+#ifdef __GNUC__
+#define FLAMEUP_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FLAMEUP_TARGET_AVX2
+#endif
+struct Xxh3Avx2 {
+    FLAMEUP_TARGET_AVX2
+    static void accumulate(uint64_t* acc, const unsigned char* input, const unsigned char* secret, size_t nbStripes) {
+        __m256i a[2];
+        for (int i = 0; i < 2; i++) a[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc) + i);
+        for (size_t n = 0; n < nbStripes; n++) {
+            const auto* in = reinterpret_cast<const __m256i*>(input + n * XXH3_STRIPE_LEN);
+            const auto* key = reinterpret_cast<const __m256i*>(secret + n * 8);
+            for (int i = 0; i < 2; i++) {
+                __m256i dataVec = _mm256_loadu_si256(in + i);
+                __m256i dataKey = _mm256_xor_si256(dataVec, _mm256_loadu_si256(key + i));
+                __m256i product = _mm256_mul_epu32(dataKey, _mm256_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1)));
+                __m256i swapped = _mm256_shuffle_epi32(dataVec, _MM_SHUFFLE(1, 0, 3, 2));
+                a[i] = _mm256_add_epi64(product, _mm256_add_epi64(a[i], swapped));
+            }
+        }
+        for (int i = 0; i < 2; i++) _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc) + i, a[i]);
+    }
+
+    FLAMEUP_TARGET_AVX2
+    static void scramble(uint64_t* acc, const unsigned char* secret) {
+        const __m256i prime = _mm256_set1_epi32(static_cast<int>(Xxh3Scalar::PRIME32_1));
+        for (int i = 0; i < 2; i++) {
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc) + i);
+            a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+            __m256i dataKey = _mm256_xor_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret) + i));
+            __m256i productLo = _mm256_mul_epu32(dataKey, prime);
+            __m256i productHi = _mm256_mul_epu32(_mm256_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc) + i,
+                                _mm256_add_epi64(productLo, _mm256_slli_epi64(productHi, 32)));
+        }
+    }
+};
+#define FLAMEUP_HAVE_AVX2_KERNEL
+#endif
+#endif
+
+// Function to pick the fastest stripe kernels this CPU supports, once
+const Xxh3Kernels& xxh3_kernels() {
+    static const Xxh3Kernels kernels = [] {
+#ifdef FLAMEUP_HAVE_AVX2_KERNEL
+#ifdef __GNUC__
+        if (__builtin_cpu_supports("avx2")) {
+#endif
+            return Xxh3Kernels{Xxh3Avx2::accumulate, Xxh3Avx2::scramble, "avx2"};
+#ifdef __GNUC__
+        }
+#endif
+#endif
+#ifdef FLAMEUP_HAVE_X86_SIMD
+        return Xxh3Kernels{Xxh3Sse2::accumulate, Xxh3Sse2::scramble, "sse2"};
+#else
+        return Xxh3Kernels{Xxh3Scalar::accumulate, Xxh3Scalar::scramble, "scalar"};
+#endif
+    }();
+    return kernels;
+}
+
+// Streaming XXH3-64 state; produces the same digests as the reference XXH3_64bits()
+struct Xxh3State {
+    static constexpr uint64_t PRIME32_1 = 0x9E3779B1U;
+    static constexpr uint64_t PRIME32_2 = 0x85EBCA77U;
+    static constexpr uint64_t PRIME32_3 = 0xC2B2AE3DU;
+    static constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+    static constexpr uint64_t PRIME_MX1 = 0x165667919E3779F9ULL;
+    static constexpr uint64_t PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+    alignas(32) uint64_t acc[8] = {PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+                                   PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1};
+    alignas(32) unsigned char buffer[XXH3_BUFFER_SIZE];
+    size_t bufferSize = 0;
+    size_t stripesSoFar = 0; // stripes of the current block already accumulated
+    uint64_t totalLen = 0;
+
+    void update(const unsigned char* data, size_t len) {
+        totalLen += len;
+        if (len <= XXH3_BUFFER_SIZE - bufferSize) {
+            std::memcpy(buffer + bufferSize, data, len);
+            bufferSize += len;
+            return;
+        }
+
+        const unsigned char* end = data + len;
+        if (bufferSize > 0) {
+            size_t fill = XXH3_BUFFER_SIZE - bufferSize;
+            std::memcpy(buffer + bufferSize, data, fill);
+            data += fill;
+            consume_stripes(acc, stripesSoFar, buffer, XXH3_BUFFER_SIZE / XXH3_STRIPE_LEN);
+            bufferSize = 0;
+        }
+        // Keep at least one byte buffered: the last stripe is handled by digest()
+        if (static_cast<size_t>(end - data) > XXH3_BUFFER_SIZE) {
+            size_t stripes = static_cast<size_t>(end - 1 - data) / XXH3_STRIPE_LEN;
+            data = consume_stripes(acc, stripesSoFar, data, stripes);
+            std::memcpy(buffer + XXH3_BUFFER_SIZE - XXH3_STRIPE_LEN, data - XXH3_STRIPE_LEN, XXH3_STRIPE_LEN);
+        }
+        std::memcpy(buffer, data, static_cast<size_t>(end - data));
+        bufferSize = static_cast<size_t>(end - data);
+    }
+
+    uint64_t digest() const {
+        if (totalLen <= XXH3_MIDSIZE_MAX) {
+            return hash_short(buffer, static_cast<size_t>(totalLen));
+        }
+
+        alignas(32) uint64_t a[8];
+        std::memcpy(a, acc, sizeof(a));
+        const unsigned char* lastStripe;
+        unsigned char catchup[XXH3_STRIPE_LEN];
+        if (bufferSize >= XXH3_STRIPE_LEN) {
+            size_t stripes = (bufferSize - 1) / XXH3_STRIPE_LEN;
+            size_t soFar = stripesSoFar;
+            consume_stripes(a, soFar, buffer, stripes);
+            lastStripe = buffer + bufferSize - XXH3_STRIPE_LEN;
+        } else {
+            // The last stripe reaches back into bytes already consumed from the buffer
+            size_t back = XXH3_STRIPE_LEN - bufferSize;
+            std::memcpy(catchup, buffer + XXH3_BUFFER_SIZE - back, back);
+            std::memcpy(catchup + back, buffer, bufferSize);
+            lastStripe = catchup;
+        }
+        xxh3_kernels().accumulate(a, lastStripe, XXH3_SECRET + XXH3_SECRET_LIMIT - 7, 1);
+        return merge_accs(a, totalLen * PRIME64_1);
+    }
+
+    // One-shot hash of a buffer
+    static uint64_t hash(const unsigned char* data, size_t len) {
+        if (len <= XXH3_MIDSIZE_MAX) {
+            return hash_short(data, len);
+        }
+        Xxh3State state;
+        size_t blockLen = XXH3_STRIPE_LEN * XXH3_STRIPES_PER_BLOCK;
+        size_t blocks = (len - 1) / blockLen;
+        const Xxh3Kernels& kernels = xxh3_kernels();
+        for (size_t n = 0; n < blocks; n++) {
+            kernels.accumulate(state.acc, data + n * blockLen, XXH3_SECRET, XXH3_STRIPES_PER_BLOCK);
+            kernels.scramble(state.acc, XXH3_SECRET + XXH3_SECRET_LIMIT);
+        }
+        size_t stripes = ((len - 1) - blockLen * blocks) / XXH3_STRIPE_LEN;
+        kernels.accumulate(state.acc, data + blocks * blockLen, XXH3_SECRET, stripes);
+        kernels.accumulate(state.acc, data + len - XXH3_STRIPE_LEN, XXH3_SECRET + XXH3_SECRET_LIMIT - 7, 1);
+        return merge_accs(state.acc, len * PRIME64_1);
+    }
+
+private:
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t x;
+        std::memcpy(&x, p, 8);
+        return x;
+    }
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t x;
+        std::memcpy(&x, p, 4);
+        return x;
+    }
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    static uint64_t swap64(uint64_t x) {
+        x = ((x << 8) & 0xFF00FF00FF00FF00ULL) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+        x = ((x << 16) & 0xFFFF0000FFFF0000ULL) | ((x >> 16) & 0x0000FFFF0000FFFFULL);
+        return (x << 32) | (x >> 32);
+    }
+
+    // Low and high halves of the 128-bit product, xored together
+    static uint64_t mul128_fold64(uint64_t lhs, uint64_t rhs) {
+#if defined(__SIZEOF_INT128__)
+        __extension__ using uint128 = unsigned __int128;
+        uint128 product = static_cast<uint128>(lhs) * rhs;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        uint64_t high = 0;
+        uint64_t low = _umul128(lhs, rhs, &high);
+        return low ^ high;
+#else
+        uint64_t loLo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+        uint64_t hiLo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+        uint64_t loHi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+        uint64_t hiHi = (lhs >> 32) * (rhs >> 32);
+        uint64_t cross = (loLo >> 32) + (hiLo & 0xFFFFFFFF) + loHi;
+        uint64_t upper = (hiLo >> 32) + (cross >> 32) + hiHi;
+        uint64_t lower = (cross << 32) | (loLo & 0xFFFFFFFF);
+        return lower ^ upper;
+#endif
+    }
+
+    static uint64_t xxh64_avalanche(uint64_t h) {
+        h ^= h >> 33;
+        h *= PRIME64_2;
+        h ^= h >> 29;
+        h *= PRIME64_3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    static uint64_t avalanche(uint64_t h) {
+        h ^= h >> 37;
+        h *= PRIME_MX1;
+        h ^= h >> 32;
+        return h;
+    }
+
+    static uint64_t rrmxmx(uint64_t h, uint64_t len) {
+        h ^= rotl(h, 49) ^ rotl(h, 24);
+        h *= PRIME_MX2;
+        h ^= (h >> 35) + len;
+        h *= PRIME_MX2;
+        return h ^ (h >> 28);
+    }
+
+    static uint64_t mix16(const unsigned char* input, const unsigned char* secret) {
+        return mul128_fold64(read64(input) ^ read64(secret), read64(input + 8) ^ read64(secret + 8));
+    }
+
+    static uint64_t hash_short(const unsigned char* input, size_t len) {
+        const unsigned char* secret = XXH3_SECRET;
+        if (len > 128) {
+            uint64_t acc = len * PRIME64_1;
+            for (size_t i = 0; i < 8; i++) {
+                acc += mix16(input + 16 * i, secret + 16 * i);
+            }
+            uint64_t accEnd = mix16(input + len - 16, secret + 136 - 17);
+            acc = avalanche(acc);
+            for (size_t i = 8; i < len / 16; i++) {
+                accEnd += mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+            }
+            return avalanche(acc + accEnd);
+        }
+        if (len > 16) {
+            uint64_t acc = len * PRIME64_1;
+            if (len > 32) {
+                if (len > 64) {
+                    if (len > 96) {
+                        acc += mix16(input + 48, secret + 96);
+                        acc += mix16(input + len - 64, secret + 112);
+                    }
+                    acc += mix16(input + 32, secret + 64);
+                    acc += mix16(input + len - 48, secret + 80);
+                }
+                acc += mix16(input + 16, secret + 32);
+                acc += mix16(input + len - 32, secret + 48);
+            }
+            acc += mix16(input, secret);
+            acc += mix16(input + len - 16, secret + 16);
+            return avalanche(acc);
+        }
+        if (len > 8) {
+            uint64_t lo = read64(input) ^ (read64(secret + 24) ^ read64(secret + 32));
+            uint64_t hi = read64(input + len - 8) ^ (read64(secret + 40) ^ read64(secret + 48));
+            return avalanche(len + swap64(lo) + hi + mul128_fold64(lo, hi));
+        }
+        if (len >= 4) {
+            uint64_t input64 = read32(input + len - 4) + (static_cast<uint64_t>(read32(input)) << 32);
+            return rrmxmx(input64 ^ (read64(secret + 8) ^ read64(secret + 16)), len);
+        }
+        if (len > 0) {
+            uint32_t combined = (static_cast<uint32_t>(input[0]) << 16) | (static_cast<uint32_t>(input[len >> 1]) << 24) |
+                                static_cast<uint32_t>(input[len - 1]) | (static_cast<uint32_t>(len) << 8);
+            return xxh64_avalanche(combined ^ static_cast<uint64_t>(read32(secret) ^ read32(secret + 4)));
+        }
+        return xxh64_avalanche(read64(secret + 56) ^ read64(secret + 64));
+    }
+
+    static uint64_t merge_accs(const uint64_t* a, uint64_t start) {
+        uint64_t result = start;
+        for (size_t i = 0; i < 4; i++) {
+            result += mul128_fold64(a[2 * i] ^ read64(XXH3_SECRET + 11 + 16 * i),
+                                    a[2 * i + 1] ^ read64(XXH3_SECRET + 11 + 16 * i + 8));
+        }
+        return avalanche(result);
+    }
+
+    // Accumulates whole stripes, scrambling at each block boundary; returns the end of input
+    static const unsigned char* consume_stripes(uint64_t* a, size_t& soFar, const unsigned char* input,
+                                                size_t stripes) {
+        const Xxh3Kernels& kernels = xxh3_kernels();
+        if (stripes >= XXH3_STRIPES_PER_BLOCK - soFar) {
+            size_t take = XXH3_STRIPES_PER_BLOCK - soFar;
+            const unsigned char* secret = XXH3_SECRET + soFar * 8;
+            do {
+                kernels.accumulate(a, input, secret, take);
+                kernels.scramble(a, XXH3_SECRET + XXH3_SECRET_LIMIT);
+                input += take * XXH3_STRIPE_LEN;
+                stripes -= take;
+                take = XXH3_STRIPES_PER_BLOCK;
+                secret = XXH3_SECRET;
+            } while (stripes >= XXH3_STRIPES_PER_BLOCK);
+            soFar = 0;
+        }
+        if (stripes > 0) {
+            kernels.accumulate(a, input, XXH3_SECRET + soFar * 8, stripes);
+            input += stripes * XXH3_STRIPE_LEN;
+            soFar += stripes;
+        }
+        return input;
+    }
+};
+
+enum class EntryType : uint8_t {
+    File = 0,
+    Directory = 1,
+    Symlink = 2,
+    Other = 3
+};
+
+struct FileInfo {
+    EntryType type = EntryType::Other;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    uint64_t fileId = 0;
+    uint32_t mode = 0;
 };
 
-// Function to get timestamp-based folder name
-std::string make_timestamp_folder_name() {
-    auto now = std::chrono::system_clock::now();
-    auto time_t = std::chrono::system_clock::to_time_t(now);
-    std::tm tm_buf;
+#ifdef _WIN32
+// Function to convert a FILETIME to nanoseconds since the Unix epoch
+int64_t filetime_to_unix_ns(const FILETIME& ft) {
+    uint64_t ticks = (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    return (static_cast<int64_t>(ticks) - 116444736000000000LL) * 100;
+}
+
+FILETIME unix_ns_to_filetime(int64_t ns) {
+    uint64_t ticks = static_cast<uint64_t>(ns / 100 + 116444736000000000LL);
+    FILETIME ft;
+    ft.dwLowDateTime = static_cast<DWORD>(ticks & 0xFFFFFFFF);
+    ft.dwHighDateTime = static_cast<DWORD>(ticks >> 32);
+    return ft;
+}
+#endif
+
+#ifndef _WIN32
+// Function to fill a FileInfo from the result of lstat/fstatat
+void file_info_from_stat(const struct stat& st, FileInfo& info) {
+    if (S_ISREG(st.st_mode)) {
+        info.type = EntryType::File;
+    } else if (S_ISDIR(st.st_mode)) {
+        info.type = EntryType::Directory;
+    } else if (S_ISLNK(st.st_mode)) {
+        info.type = EntryType::Symlink;
+    } else {
+        info.type = EntryType::Other;
+    }
+    info.size = static_cast<uint64_t>(st.st_size);
+    info.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+    info.fileId = static_cast<uint64_t>(st.st_ino);
+    info.mode = static_cast<uint32_t>(st.st_mode & 07777);
+}
+#endif
+
+#ifdef __linux__
+// Function to fill a FileInfo from the result of statx, as file_info_from_stat does
+void file_info_from_statx(const struct statx& st, FileInfo& info) {
+    if (S_ISREG(st.stx_mode)) {
+        info.type = EntryType::File;
+    } else if (S_ISDIR(st.stx_mode)) {
+        info.type = EntryType::Directory;
+    } else if (S_ISLNK(st.stx_mode)) {
+        info.type = EntryType::Symlink;
+    } else {
+        info.type = EntryType::Other;
+    }
+    info.size = st.stx_size;
+    info.mtimeNs = static_cast<int64_t>(st.stx_mtime.tv_sec) * 1000000000LL + st.stx_mtime.tv_nsec;
+    info.fileId = st.stx_ino;
+    info.mode = static_cast<uint32_t>(st.stx_mode & 07777);
+}
+#endif
+
+// Function to read type, size, mtime and file id of a path without following symlinks
+bool read_file_info(const fs::path& filePath, FileInfo& info) {
+#ifdef _WIN32
+    HANDLE h = CreateFileW(filePath.c_str(), FILE_READ_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    BY_HANDLE_FILE_INFORMATION bhfi;
+    BOOL ok = GetFileInformationByHandle(h, &bhfi);
+    CloseHandle(h);
+    if (!ok) {
+        return false;
+    }
+
+    if (bhfi.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+        info.type = EntryType::Symlink;
+    } else if (bhfi.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+        info.type = EntryType::Directory;
+    } else {
+        info.type = EntryType::File;
+    }
+    info.size = (static_cast<uint64_t>(bhfi.nFileSizeHigh) << 32) | bhfi.nFileSizeLow;
+    info.mtimeNs = filetime_to_unix_ns(bhfi.ftLastWriteTime);
+    info.fileId = (static_cast<uint64_t>(bhfi.nFileIndexHigh) << 32) | bhfi.nFileIndexLow;
+    info.mode = (bhfi.dwFileAttributes & FILE_ATTRIBUTE_READONLY) ? 0555 : 0777;
+    return true;
+#else
+    struct stat st;
+    if (::lstat(filePath.c_str(), &st) != 0) {
+        return false;
+    }
+    file_info_from_stat(st, info);
+    return true;
+#endif
+}
+
+// Function to set the modification time of a file
+void set_file_mtime(const fs::path& filePath, int64_t mtimeNs) {
+#ifdef _WIN32
+    HANDLE h = CreateFileW(filePath.c_str(), FILE_WRITE_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    FILETIME ft = unix_ns_to_filetime(mtimeNs);
+    SetFileTime(h, nullptr, nullptr, &ft);
+    CloseHandle(h);
+#else
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = static_cast<time_t>(mtimeNs / 1000000000LL);
+    times[1].tv_nsec = static_cast<long>(mtimeNs % 1000000000LL);
+    ::utimensat(AT_FDCWD, filePath.c_str(), times, AT_SYMLINK_NOFOLLOW);
+#endif
+}
+
+// Snapshot manifest stored as MANIFEST_FILE_NAME in the root of every backup
+constexpr const char* MANIFEST_FILE_NAME = ".flameup_manifest";
+constexpr uint32_t MANIFEST_MAGIC = 0x464D4C46; // "FLMF"
+constexpr uint32_t MANIFEST_VERSION = 5;
+constexpr uint8_t MANIFEST_FLAG_HASHED = 0x80; // set on the type byte when the entry carries a hash
+
+struct ManifestEntry {
+    std::string path;        // relative path in generic (forward slash) UTF-8 form
+    EntryType type = EntryType::File;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    uint64_t fileId = 0;
+    uint32_t mode = 0;
+    uint64_t hash = 0;
+    bool hasHash = false;    // false when the data was copied in-kernel and never read, or hashed before v5
+    std::string linkTarget;  // only set for symlinks
+};
+
+struct ManifestHeader {
+    uint32_t version = MANIFEST_VERSION;
+    uint64_t entryCount = 0;
+    uint64_t fileCount = 0;
+    uint64_t totalBytes = 0;
+    SnapshotFormat format = SnapshotFormat::Directory; // version 3+
+    uint64_t storedBytes = 0; // version 4+: bytes of new data this snapshot wrote to disk
+    uint64_t durationMs = 0;  // version 4+: time taken to create the snapshot
+};
+
+// Function to convert a relative path to the string form used in manifests
+std::string to_manifest_path(const fs::path& p) {
+    auto u8 = p.generic_u8string();
+    return std::string(u8.begin(), u8.end());
+}
+
+// Function to convert a manifest path string back to a filesystem path
+fs::path from_manifest_path(const std::string& s) {
+    return fs::path(std::u8string(s.begin(), s.end()));
+}
+
+// Function to order manifest paths the way manifests store them (parents first,
+// siblings by name), i.e. comparing component by component
+bool manifest_path_less(const std::string& a, const std::string& b) {
+    size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; i++) {
+        unsigned char ca = a[i] == '/' ? 0 : static_cast<unsigned char>(a[i]);
+        unsigned char cb = b[i] == '/' ? 0 : static_cast<unsigned char>(b[i]);
+        if (ca != cb) return ca < cb;
+    }
+    return a.size() < b.size();
+}
+
+// Set of manifest paths held as a tree of interned components, for the places that need every
+// path of a snapshot in memory at once (archive indexes, restore cleanup, resume checkpoints).
+// Each distinct component name is stored once in a single arena string, and nodes are flat
+// parent/name arrays looked up through open-addressing tables, so a path costs a few tens of
+// bytes instead of its own heap string plus a hash node. Node ids are dense and stable: callers
+// keep per-path data in parallel vectors indexed by node id.
+class PathTree {
+public:
+    static constexpr uint32_t ROOT = 0;
+
+    PathTree() {
+        nameOffsets_.push_back(0);
+        nameLengths_.push_back(0);
+        parents_.push_back(ROOT);
+        names_.push_back(0);
+        present_.push_back(0);
+    }
+
+    // Number of nodes, including the root and intermediate directories never inserted
+    size_t size() const { return parents_.size(); }
+
+    // Function to add a path and return its node id; adding it again returns the same id
+    uint32_t insert(std::string_view path) {
+        uint32_t node = ROOT;
+        for_each_component(path, [&](std::string_view component) {
+            uint32_t name = intern(component);
+            uint32_t child = find_child(node, name);
+            if (child == NONE) {
+                child = static_cast<uint32_t>(parents_.size());
+                parents_.push_back(node);
+                names_.push_back(name);
+                present_.push_back(0);
+                insert_child_slot(child);
+            }
+            node = child;
+        });
+        present_[node] = 1;
+        return node;
+    }
+
+    // Function to look up a path that was inserted
+    std::optional<uint32_t> find(std::string_view path) const {
+        uint32_t node = ROOT;
+        for_each_component(path, [&](std::string_view component) {
+            if (node == NONE) return;
+            uint32_t name = find_name(component);
+            node = name == NONE ? NONE : find_child(node, name);
+        });
+        if (node == NONE || !present_[node]) {
+            return std::nullopt;
+        }
+        return node;
+    }
+
+    bool contains(std::string_view path) const { return find(path).has_value(); }
+
+    // Function to rebuild the full path of a node
+    std::string path(uint32_t node) const {
+        std::vector<uint32_t> chain;
+        for (; node != ROOT; node = parents_[node]) {
+            chain.push_back(node);
+        }
+        std::string out;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            if (!out.empty()) out.push_back('/');
+            out.append(name_of(names_[*it]));
+        }
+        return out;
+    }
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    template <typename Visit>
+    static void for_each_component(std::string_view path, Visit&& visit) {
+        size_t start = 0;
+        while (start < path.size()) {
+            size_t end = std::min(path.find('/', start), path.size());
+            if (end > start) visit(path.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+    std::string_view name_of(uint32_t name) const {
+        return std::string_view(arena_).substr(nameOffsets_[name], nameLengths_[name]);
+    }
+
+    static size_t child_hash(uint32_t parent, uint32_t name) {
+        uint64_t key = (static_cast<uint64_t>(parent) << 32 | name) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(key ^ (key >> 29));
+    }
+
+    // Slots hold id + 1, 0 = empty; tables are kept at most half full
+    uint32_t find_name(std::string_view component) const {
+        if (nameSlots_.empty()) return NONE;
+        size_t mask = nameSlots_.size() - 1;
+        for (size_t i = std::hash<std::string_view>{}(component) & mask; nameSlots_[i]; i = (i + 1) & mask) {
+            if (name_of(nameSlots_[i] - 1) == component) return nameSlots_[i] - 1;
+        }
+        return NONE;
+    }
+
+    uint32_t intern(std::string_view component) {
+        uint32_t name = find_name(component);
+        if (name != NONE) return name;
+        name = static_cast<uint32_t>(nameOffsets_.size());
+        nameOffsets_.push_back(static_cast<uint32_t>(arena_.size()));
+        nameLengths_.push_back(static_cast<uint32_t>(component.size()));
+        arena_.append(component);
+        if (nameOffsets_.size() * 2 > nameSlots_.size()) {
+            std::vector<uint32_t> slots(std::max<size_t>(nameSlots_.size() * 2, 64), 0);
+            nameSlots_.swap(slots);
+            for (uint32_t id = 1; id < nameOffsets_.size(); id++) {
+                place(nameSlots_, std::hash<std::string_view>{}(name_of(id)), id);
+            }
+        } else {
+            place(nameSlots_, std::hash<std::string_view>{}(component), name);
+        }
+        return name;
+    }
+
+    uint32_t find_child(uint32_t parent, uint32_t name) const {
+        if (childSlots_.empty()) return NONE;
+        size_t mask = childSlots_.size() - 1;
+        for (size_t i = child_hash(parent, name) & mask; childSlots_[i]; i = (i + 1) & mask) {
+            uint32_t node = childSlots_[i] - 1;
+            if (parents_[node] == parent && names_[node] == name) return node;
+        }
+        return NONE;
+    }
+
+    void insert_child_slot(uint32_t node) {
+        if (parents_.size() * 2 > childSlots_.size()) {
+            std::vector<uint32_t> slots(std::max<size_t>(childSlots_.size() * 2, 64), 0);
+            childSlots_.swap(slots);
+            for (uint32_t id = 1; id < parents_.size(); id++) {
+                place(childSlots_, child_hash(parents_[id], names_[id]), id);
+            }
+        } else {
+            place(childSlots_, child_hash(parents_[node], names_[node]), node);
+        }
+    }
+
+    static void place(std::vector<uint32_t>& slots, size_t hash, uint32_t id) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+
+    std::string arena_;                  // all component names back to back
+    std::vector<uint32_t> nameOffsets_;  // name id -> offset into arena_
+    std::vector<uint32_t> nameLengths_;
+    std::vector<uint32_t> nameSlots_;
+    std::vector<uint32_t> parents_;      // node id -> parent node id
+    std::vector<uint32_t> names_;        // node id -> name id
+    std::vector<uint8_t> present_;       // node was inserted itself, not only as a parent
+    std::vector<uint32_t> childSlots_;
+};
+
+// Function to match a manifest path against a glob: * and ? stay within one path component,
+// ** spans components ("**/" also matches no directory at all) and [...] is a character class
+bool glob_match(std::string_view pattern, std::string_view text) {
+    size_t p = 0;
+    size_t t = 0;
+    while (p < pattern.size()) {
+        char c = pattern[p];
+        if (c == '*') {
+            bool deep = p + 1 < pattern.size() && pattern[p + 1] == '*';
+            size_t next = p + (deep ? 2 : 1);
+            if (deep && next < pattern.size() && pattern[next] == '/' &&
+                glob_match(pattern.substr(next + 1), text.substr(t))) {
+                return true;
+            }
+            for (size_t end = t;; end++) {
+                if (glob_match(pattern.substr(next), text.substr(end))) return true;
+                if (end >= text.size() || (!deep && text[end] == '/')) return false;
+            }
+        }
+
+        if (t >= text.size()) return false;
+
+        if (c == '?') {
+            if (text[t] == '/') return false;
+        } else if (c == '[' && pattern.find(']', p + 2) != std::string_view::npos) {
+            size_t close = pattern.find(']', p + 2);
+            size_t i = p + 1;
+            bool negate = pattern[i] == '!' || pattern[i] == '^';
+            if (negate) i++;
+            bool matched = false;
+            for (; i < close; i++) {
+                if (i + 2 < close && pattern[i + 1] == '-') {
+                    matched |= text[t] >= pattern[i] && text[t] <= pattern[i + 2];
+                    i += 2;
+                } else {
+                    matched |= text[t] == pattern[i];
+                }
+            }
+            if (matched == negate || text[t] == '/') return false;
+            p = close;
+        } else if (c != text[t]) {
+            return false;
+        }
+        p++;
+        t++;
+    }
+    return t == text.size();
+}
+
+void write_varint(std::ostream& out, uint64_t value) {
+    unsigned char buf[10];
+    size_t n = 0;
+    do {
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        if (value) byte |= 0x80;
+        buf[n++] = byte;
+    } while (value);
+    out.write(reinterpret_cast<const char*>(buf), static_cast<std::streamsize>(n));
+}
+
+bool read_varint(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == EOF) return false;
+        value |= static_cast<uint64_t>(c & 0x7F) << shift;
+        if (!(c & 0x80)) return true;
+    }
+    return false;
+}
+
+void write_u32(std::ostream& out, uint32_t value) {
+    unsigned char buf[4];
+    for (int i = 0; i < 4; i++) buf[i] = static_cast<unsigned char>(value >> (i * 8));
+    out.write(reinterpret_cast<const char*>(buf), 4);
+}
+
+void write_u64(std::ostream& out, uint64_t value) {
+    unsigned char buf[8];
+    for (int i = 0; i < 8; i++) buf[i] = static_cast<unsigned char>(value >> (i * 8));
+    out.write(reinterpret_cast<const char*>(buf), 8);
+}
+
+bool read_u32(std::istream& in, uint32_t& value) {
+    unsigned char buf[4];
+    if (!in.read(reinterpret_cast<char*>(buf), 4)) return false;
+    value = 0;
+    for (int i = 0; i < 4; i++) value |= static_cast<uint32_t>(buf[i]) << (i * 8);
+    return true;
+}
+
+bool read_u64(std::istream& in, uint64_t& value) {
+    unsigned char buf[8];
+    if (!in.read(reinterpret_cast<char*>(buf), 8)) return false;
+    value = 0;
+    for (int i = 0; i < 8; i++) value |= static_cast<uint64_t>(buf[i]) << (i * 8);
+    return true;
+}
+
+void write_string(std::ostream& out, const std::string& s) {
+    write_varint(out, s.size());
+    out.write(s.data(), static_cast<std::streamsize>(s.size()));
+}
+
+bool read_string(std::istream& in, std::string& s, uint64_t maxLength = 1u << 20) {
+    uint64_t length = 0;
+    if (!read_varint(in, length) || length > maxLength) return false;
+    s.resize(static_cast<size_t>(length));
+    return static_cast<bool>(in.read(s.data(), static_cast<std::streamsize>(length)));
+}
+
+// Writes manifest entries, prefix-compressing each path against the previous one
+class ManifestWriter {
+public:
+    explicit ManifestWriter(const fs::path& manifestPath, SnapshotFormat format = SnapshotFormat::Directory)
+        : finalPath_(manifestPath), tempPath_(manifestPath.string() + ".tmp") {
+        header_.format = format;
+        out_.open(tempPath_, std::ios::binary | std::ios::trunc);
+        if (!out_.is_open()) {
+            throw std::runtime_error("Cannot create manifest: " + tempPath_.string());
+        }
+        write_header();
+    }
+
+    void add(const ManifestEntry& entry) {
+        size_t shared = 0;
+        size_t limit = std::min(entry.path.size(), lastPath_.size());
+        while (shared < limit && entry.path[shared] == lastPath_[shared]) shared++;
+
+        out_.put(static_cast<char>(static_cast<uint8_t>(entry.type) | (entry.hasHash ? MANIFEST_FLAG_HASHED : 0)));
+        write_varint(out_, shared);
+        write_varint(out_, entry.path.size() - shared);
+        out_.write(entry.path.data() + shared, static_cast<std::streamsize>(entry.path.size() - shared));
+        write_varint(out_, entry.size);
+        write_varint(out_, zigzag(entry.mtimeNs));
+        write_varint(out_, entry.fileId);
+        write_varint(out_, entry.mode);
+        if (entry.hasHash) {
+            write_u64(out_, entry.hash);
+        }
+        if (entry.type == EntryType::Symlink) {
+            write_varint(out_, entry.linkTarget.size());
+            out_.write(entry.linkTarget.data(), static_cast<std::streamsize>(entry.linkTarget.size()));
+        }
+
+        lastPath_ = entry.path;
+        header_.entryCount++;
+        if (entry.type == EntryType::File) {
+            header_.fileCount++;
+            header_.totalBytes += entry.size;
+        }
+    }
+
+    // Records what creating the snapshot cost, stored in the header for --list
+    void set_snapshot_stats(uint64_t storedBytes, std::chrono::steady_clock::duration duration) {
+        header_.storedBytes = storedBytes;
+        header_.durationMs = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+    }
+
+    // Rewrites the header with final counts and moves the manifest into place
+    void finish() {
+        out_.seekp(0);
+        write_header();
+        out_.close();
+        if (!out_) {
+            throw std::runtime_error("Failed to write manifest: " + tempPath_.string());
+        }
+        fs::rename(tempPath_, finalPath_);
+    }
+
+    const ManifestHeader& header() const { return header_; }
+
+private:
+    static uint64_t zigzag(int64_t v) {
+        return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+    }
+
+    void write_header() {
+        write_u32(out_, MANIFEST_MAGIC);
+        write_u32(out_, header_.version);
+        write_u64(out_, header_.entryCount);
+        write_u64(out_, header_.fileCount);
+        write_u64(out_, header_.totalBytes);
+        write_u32(out_, static_cast<uint32_t>(header_.format));
+        write_u64(out_, header_.storedBytes);
+        write_u64(out_, header_.durationMs);
+    }
+
+    fs::path finalPath_;
+    fs::path tempPath_;
+    std::ofstream out_;
+    ManifestHeader header_;
+    std::string lastPath_;
+};
+
+// Reads manifest entries sequentially without loading the whole file
+class ManifestReader {
+public:
+    // Returns false if the snapshot has no readable manifest
+    bool open(const fs::path& manifestPath) {
+        in_.open(manifestPath, std::ios::binary);
+        if (!in_.is_open()) {
+            return false;
+        }
+
+        uint32_t magic = 0;
+        if (!read_u32(in_, magic) || magic != MANIFEST_MAGIC ||
+            !read_u32(in_, header_.version) || header_.version > MANIFEST_VERSION ||
+            !read_u64(in_, header_.entryCount) ||
+            !read_u64(in_, header_.fileCount) ||
+            !read_u64(in_, header_.totalBytes)) {
+            in_.close();
+            return false;
+        }
+        if (header_.version >= 3) {
+            uint32_t format = 0;
+            if (!read_u32(in_, format)) {
+                in_.close();
+                return false;
+            }
+            header_.format = static_cast<SnapshotFormat>(format);
+        }
+        if (header_.version >= 4 &&
+            (!read_u64(in_, header_.storedBytes) || !read_u64(in_, header_.durationMs))) {
+            in_.close();
+            return false;
+        }
+        remaining_ = header_.entryCount;
+        return true;
+    }
+
+    const ManifestHeader& header() const { return header_; }
+
+    bool next(ManifestEntry& entry) {
+        if (remaining_ == 0) {
+            return false;
+        }
+
+        int type = in_.get();
+        uint64_t shared = 0, suffixLen = 0, mtime = 0, mode = 0;
+        if (type == EOF || !read_varint(in_, shared) || !read_varint(in_, suffixLen) || shared > lastPath_.size()) {
+            throw std::runtime_error("Corrupt manifest entry");
+        }
+
+        // Version 1 manifests always stored a hash. Before version 5 hashes were XXH64 based and
+        // cannot be compared to current ones, so they are read but not used.
+        bool stored = header_.version < 2 || (type & MANIFEST_FLAG_HASHED);
+        entry.hasHash = stored && header_.version >= 5;
+        entry.type = static_cast<EntryType>(type & ~MANIFEST_FLAG_HASHED);
+        entry.path.assign(lastPath_, 0, static_cast<size_t>(shared));
+        entry.path.resize(static_cast<size_t>(shared + suffixLen));
+        in_.read(entry.path.data() + shared, static_cast<std::streamsize>(suffixLen));
+
+        if (!in_ || !read_varint(in_, entry.size) || !read_varint(in_, mtime) ||
+            !read_varint(in_, entry.fileId) || !read_varint(in_, mode)) {
+            throw std::runtime_error("Corrupt manifest entry");
+        }
+        entry.hash = 0;
+        if (stored && !read_u64(in_, entry.hash)) {
+            throw std::runtime_error("Corrupt manifest entry");
+        }
+        if (!entry.hasHash) {
+            entry.hash = 0;
+        }
+        entry.mtimeNs = static_cast<int64_t>(mtime >> 1) ^ -static_cast<int64_t>(mtime & 1);
+        entry.mode = static_cast<uint32_t>(mode);
+
+        entry.linkTarget.clear();
+        if (entry.type == EntryType::Symlink) {
+            uint64_t targetLen = 0;
+            if (!read_varint(in_, targetLen)) {
+                throw std::runtime_error("Corrupt manifest entry");
+            }
+            entry.linkTarget.resize(static_cast<size_t>(targetLen));
+            in_.read(entry.linkTarget.data(), static_cast<std::streamsize>(targetLen));
+        }
+
+        lastPath_ = entry.path;
+        remaining_--;
+        return true;
+    }
+
+private:
+    std::ifstream in_;
+    ManifestHeader header_;
+    std::string lastPath_;
+    uint64_t remaining_ = 0;
+};
+
+// Function to read only the header of a snapshot's manifest
+std::optional<ManifestHeader> read_manifest_header(const fs::path& backupPath) {
+    ManifestReader reader;
+    if (!reader.open(backupPath / MANIFEST_FILE_NAME)) {
+        return std::nullopt;
+    }
+    return reader.header();
+}
+
+// Files are hashed in fixed segments so large files can be copied and hashed in parallel chunks.
+// A file's hash is the XXH3 of its single segment, or the XXH3 over all segment hashes.
+constexpr uint64_t FILE_HASH_SEGMENT_SIZE = 4ULL << 20;
+constexpr uint64_t COPY_CHUNK_SIZE = 4 * FILE_HASH_SEGMENT_SIZE;
+constexpr uint64_t LARGE_FILE_THRESHOLD = 4 * COPY_CHUNK_SIZE;
+constexpr size_t SMALL_FILE_BATCH_COUNT = 64;
+constexpr uint64_t SMALL_FILE_BATCH_BYTES = 8ULL << 20;
+
+// What identifies a file's contents without reading them: any write changes size, mtime or ctime
+struct FileIdentity {
+    uint64_t device = 0;
+    uint64_t fileId = 0;
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    int64_t ctimeNs = 0;
+
+    bool operator==(const FileIdentity& other) const = default;
+};
+
+#ifdef _WIN32
+// Function to read the identity of an open file; ctime is the NTFS change time
+bool file_identity_from_handle(HANDLE h, FileIdentity& id) {
+    BY_HANDLE_FILE_INFORMATION bhfi;
+    FILE_BASIC_INFO basic;
+    if (!GetFileInformationByHandle(h, &bhfi) ||
+        !GetFileInformationByHandleEx(h, FileBasicInfo, &basic, sizeof(basic))) {
+        return false;
+    }
+    FILETIME change;
+    change.dwLowDateTime = basic.ChangeTime.LowPart;
+    change.dwHighDateTime = static_cast<DWORD>(basic.ChangeTime.HighPart);
+    id.device = bhfi.dwVolumeSerialNumber;
+    id.fileId = (static_cast<uint64_t>(bhfi.nFileIndexHigh) << 32) | bhfi.nFileIndexLow;
+    id.size = (static_cast<uint64_t>(bhfi.nFileSizeHigh) << 32) | bhfi.nFileSizeLow;
+    id.mtimeNs = filetime_to_unix_ns(bhfi.ftLastWriteTime);
+    id.ctimeNs = filetime_to_unix_ns(change);
+    return true;
+}
+#else
+FileIdentity file_identity_from_stat(const struct stat& st) {
+    FileIdentity id;
+    id.device = static_cast<uint64_t>(st.st_dev);
+    id.fileId = static_cast<uint64_t>(st.st_ino);
+    id.size = static_cast<uint64_t>(st.st_size);
+    id.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+    id.ctimeNs = static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000LL + st.st_ctim.tv_nsec;
+    return id;
+}
+#endif
+
+#ifdef __linux__
+FileIdentity file_identity_from_statx(const struct statx& st) {
+    FileIdentity id;
+    id.device = static_cast<uint64_t>(makedev(st.stx_dev_major, st.stx_dev_minor));
+    id.fileId = st.stx_ino;
+    id.size = st.stx_size;
+    id.mtimeNs = static_cast<int64_t>(st.stx_mtime.tv_sec) * 1000000000LL + st.stx_mtime.tv_nsec;
+    id.ctimeNs = static_cast<int64_t>(st.stx_ctime.tv_sec) * 1000000000LL + st.stx_ctime.tv_nsec;
+    return id;
+}
+#endif
+
+// Function to read the identity of a path without opening it for reading
+bool read_file_identity(const fs::path& filePath, FileIdentity& id) {
+#ifdef _WIN32
+    HANDLE h = CreateFileW(filePath.c_str(), FILE_READ_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+    if (h == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool ok = file_identity_from_handle(h, id);
+    CloseHandle(h);
+    return ok;
+#else
+    struct stat st;
+    if (::stat(filePath.c_str(), &st) != 0) {
+        return false;
+    }
+    id = file_identity_from_stat(st);
+    return true;
+#endif
+}
+
+// Thin wrapper around a native file handle supporting positional reads and writes
+class NativeFile {
+public:
+    NativeFile() = default;
+    NativeFile(const NativeFile&) = delete;
+    NativeFile& operator=(const NativeFile&) = delete;
+    NativeFile(NativeFile&& other) noexcept { std::swap(handle_, other.handle_); }
+    NativeFile& operator=(NativeFile&& other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    ~NativeFile() { close(); }
+
+    static NativeFile open_read(const fs::path& filePath) {
+        NativeFile file;
+#ifdef _WIN32
+        file.handle_ = CreateFileW(filePath.c_str(), GENERIC_READ,
+                                   FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                   OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+#else
+        file.handle_ = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+        if (!file.is_open()) {
+            throw std::runtime_error("Cannot open file for reading: " + filePath.string());
+        }
+        return file;
+    }
+
+    static NativeFile open_write(const fs::path& filePath, bool truncate) {
+        NativeFile file;
+#ifdef _WIN32
+        file.handle_ = CreateFileW(filePath.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                   truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+        file.handle_ = ::open(filePath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+#endif
+        if (!file.is_open()) {
+            throw std::runtime_error("Cannot open file for writing: " + filePath.string());
+        }
+        return file;
+    }
+
+#ifdef _WIN32
+    HANDLE native_handle() const { return handle_; }
+#else
+    int native_handle() const { return handle_; }
+#endif
+
+    bool is_open() const {
+#ifdef _WIN32
+        return handle_ != INVALID_HANDLE_VALUE;
+#else
+        return handle_ >= 0;
+#endif
+    }
+
+    void close() {
+        if (!is_open()) return;
+#ifdef _WIN32
+        CloseHandle(handle_);
+        handle_ = INVALID_HANDLE_VALUE;
+#else
+        ::close(handle_);
+        handle_ = -1;
+#endif
+    }
+
+    // Reads up to len bytes at offset, returns 0 at end of file
+    size_t read_at(void* buffer, size_t len, uint64_t offset) {
+#ifdef _WIN32
+        OVERLAPPED ov{};
+        ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+        ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD got = 0;
+        if (!ReadFile(handle_, buffer, static_cast<DWORD>(len), &got, &ov)) {
+            if (GetLastError() == ERROR_HANDLE_EOF) return 0;
+            throw std::runtime_error("Read failed");
+        }
+        return got;
+#else
+        while (true) {
+            ssize_t got = ::pread(handle_, buffer, len, static_cast<off_t>(offset));
+            if (got >= 0) return static_cast<size_t>(got);
+            if (errno != EINTR) throw std::runtime_error(std::string("Read failed: ") + std::strerror(errno));
+        }
+#endif
+    }
+
+    void write_at(const void* buffer, size_t len, uint64_t offset) {
+        const char* p = static_cast<const char*>(buffer);
+        while (len > 0) {
+#ifdef _WIN32
+            OVERLAPPED ov{};
+            ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+            ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD written = 0;
+            if (!WriteFile(handle_, p, static_cast<DWORD>(len), &written, &ov)) {
+                throw std::runtime_error("Write failed");
+            }
+            size_t done = written;
+#else
+            ssize_t written = ::pwrite(handle_, p, len, static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Write failed: ") + std::strerror(errno));
+            }
+            size_t done = static_cast<size_t>(written);
+#endif
+            p += done;
+            len -= done;
+            offset += done;
+        }
+    }
+
+    FileIdentity identity() const {
+        FileIdentity id;
+#ifdef _WIN32
+        if (!file_identity_from_handle(handle_, id)) {
+            throw std::runtime_error("Cannot query file information");
+        }
+#else
+        struct stat st;
+        if (::fstat(handle_, &st) != 0) {
+            throw std::runtime_error(std::string("Cannot query file information: ") + std::strerror(errno));
+        }
+        id = file_identity_from_stat(st);
+#endif
+        return id;
+    }
+
+    void resize(uint64_t size) {
+#ifdef _WIN32
+        FILE_END_OF_FILE_INFO info;
+        info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+        if (!SetFileInformationByHandle(handle_, FileEndOfFileInfo, &info, sizeof(info))) {
+            throw std::runtime_error("Resize failed");
+        }
+#else
+        if (::ftruncate(handle_, static_cast<off_t>(size)) != 0) {
+            throw std::runtime_error(std::string("Resize failed: ") + std::strerror(errno));
+        }
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+    int handle_ = -1;
+#endif
+};
+
+// Async I/O (--async-io): requests kept in flight per thread, the largest file copied that way,
+// and how many small files a copy batch holds when it is on
+constexpr unsigned ASYNC_IO_QUEUE_DEPTH = 256;
+constexpr uint64_t ASYNC_IO_MAX_FILE_SIZE = 1ULL << 20;
+constexpr size_t ASYNC_IO_BATCH_COUNT = 256;
+
+// Function to access the process-wide --async-io switch, set once at startup
+std::atomic<bool>& async_io_enabled() {
+    static std::atomic<bool> enabled{false};
+    return enabled;
+}
+
+// Batched asynchronous file I/O: io_uring driven through raw syscalls on Linux, overlapped I/O
+// on a completion port on Windows. Requests are queued in waves and run() waits for the whole
+// wave, so a single thread keeps up to ASYNC_IO_QUEUE_DEPTH of them in flight instead of blocking
+// on each. Results follow the syscall convention: a count (or 0) on success, negative on failure.
+// Windows has no asynchronous open or stat, so there those finish while being queued.
+// Not thread-safe; every thread uses an instance of its own.
+class AsyncIo {
+public:
+    using Op = size_t;
+    using File = size_t;
+    static constexpr Op NO_OP = SIZE_MAX;
+
+    // Function to set up an instance, or nullptr where the platform or kernel offers none
+    static std::unique_ptr<AsyncIo> create() {
+        std::unique_ptr<AsyncIo> io(new AsyncIo());
+        return io->setup() ? std::move(io) : nullptr;
+    }
+
+    AsyncIo(const AsyncIo&) = delete;
+    AsyncIo& operator=(const AsyncIo&) = delete;
+
+    ~AsyncIo() {
+        try {
+            reset();
+        } catch (const std::exception&) {
+        }
+#ifdef __linux__
+        if (sqRing_ && sqRing_ != MAP_FAILED) ::munmap(sqRing_, sqRingSize_);
+        if (cqRing_ && cqRing_ != MAP_FAILED && cqRing_ != sqRing_) ::munmap(cqRing_, cqRingSize_);
+        if (sqes_ && sqes_ != MAP_FAILED) ::munmap(sqes_, sqesSize_);
+        if (ringFd_ >= 0) ::close(ringFd_);
+#elif defined(_WIN32)
+        if (port_) CloseHandle(port_);
+#endif
+    }
+
+    // Function to start over: waits for anything still in flight, closes files left open and
+    // forgets all requests and files of the previous waves
+    void reset() {
+        run();
+        for (auto& file : files_) {
+            close_now(file);
+        }
+        files_.clear();
+        results_.clear();
+        identities_.clear();
+        paths_.clear();
+#ifdef __linux__
+        statBuffers_.clear();
+#elif defined(_WIN32)
+        requests_.clear();
+#endif
+    }
+
+    // Queues opening a file for reading, or creating (truncating) it for writing
+    File open(const fs::path& path, bool forWrite) {
+        Op op = new_op();
+        files_.push_back(FileSlot{op});
+#ifdef __linux__
+        paths_.push_back(path.native());
+        io_uring_sqe* sqe = next_sqe(op);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(paths_.back().c_str());
+        sqe->len = forWrite ? 0644 : 0;
+        sqe->open_flags = forWrite ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+#elif defined(_WIN32)
+        HANDLE h = CreateFileW(path.c_str(), forWrite ? GENERIC_WRITE : GENERIC_READ,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | (forWrite ? 0 : FILE_SHARE_DELETE), nullptr,
+                               forWrite ? CREATE_ALWAYS : OPEN_EXISTING,
+                               FILE_FLAG_OVERLAPPED | (forWrite ? FILE_ATTRIBUTE_NORMAL : FILE_FLAG_SEQUENTIAL_SCAN),
+                               nullptr);
+        if (h != INVALID_HANDLE_VALUE && !CreateIoCompletionPort(h, port_, 0, 0)) {
+            CloseHandle(h);
+            h = INVALID_HANDLE_VALUE;
+        }
+        files_.back().handle = h;
+        results_[op] = h != INVALID_HANDLE_VALUE ? 0 : -static_cast<int64_t>(GetLastError());
+#else
+        (void)path;
+        (void)forWrite;
+#endif
+        return files_.size() - 1;
+    }
+
+    // Whether an open queued in an earlier wave succeeded
+    bool is_open(File file) const { return results_[files_[file].open] >= 0; }
+
+    Op read(File file, void* buffer, size_t len, uint64_t offset) {
+        return transfer(file, buffer, len, offset, false);
+    }
+
+    Op write(File file, const void* buffer, size_t len, uint64_t offset) {
+        return transfer(file, const_cast<void*>(buffer), len, offset, true);
+    }
+
+    // Queues reading the identity of an open file into *out, which is valid once the op returned 0
+    Op identity(File file, FileIdentity* out) {
+        Op op = new_op();
+#ifdef __linux__
+        statBuffers_.emplace_back();
+        identities_.push_back({op, out, &statBuffers_.back()});
+        io_uring_sqe* sqe = next_sqe(op);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = fd_of(file);
+        sqe->addr = reinterpret_cast<uint64_t>("");
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = reinterpret_cast<uint64_t>(&statBuffers_.back());
+        sqe->statx_flags = AT_EMPTY_PATH;
+#elif defined(_WIN32)
+        results_[op] = is_open(file) && file_identity_from_handle(files_[file].handle, *out) ? 0 : -1;
+#else
+        (void)file;
+        (void)out;
+#endif
+        return op;
+    }
+
+#ifdef __linux__
+    // Queues a stat of name inside the open directory dirFd, not following symlinks
+    Op stat_at(int dirFd, const char* name, struct statx* out) {
+        Op op = new_op();
+        io_uring_sqe* sqe = next_sqe(op);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirFd;
+        sqe->addr = reinterpret_cast<uint64_t>(name);
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME;
+        sqe->off = reinterpret_cast<uint64_t>(out);
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        return op;
+    }
+#endif
+
+    // Function to make the request queued last complete before the next one starts; on Windows
+    // requests already start in the order they are queued
+    void chain() {
+#ifdef __linux__
+        if (lastSqe_) {
+            lastSqe_->flags |= IOSQE_IO_LINK;
+            linkPending_ = true;
+        }
+#endif
+    }
+
+    // Function to close every file opened since reset(), as one more wave
+    void close_all() {
+        run();
+#ifdef __linux__
+        for (auto& file : files_) {
+            if (file.closed || results_[file.open] < 0) continue;
+            file.closed = true;
+            io_uring_sqe* sqe = next_sqe(new_op());
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = static_cast<int>(results_[file.open]);
+        }
+        run();
+#else
+        for (auto& file : files_) {
+            close_now(file);
+        }
+#endif
+    }
+
+    // Function to submit everything queued and wait until all of it has completed
+    void run() {
+#ifdef __linux__
+        while (queued_ > 0 || inFlight_ > 0) {
+            enter(queued_ + inFlight_);
+        }
+        for (const auto& pending : identities_) {
+            if (results_[pending.op] == 0) {
+                *pending.out = file_identity_from_statx(*pending.buffer);
+            }
+        }
+        identities_.clear();
+#elif defined(_WIN32)
+        while (inFlight_ > 0) {
+            reap();
+        }
+#endif
+    }
+
+    int64_t result(Op op) const { return results_[op]; }
+
+private:
+    struct FileSlot {
+        Op open = NO_OP;
+        bool closed = false;
+#ifdef _WIN32
+        HANDLE handle = INVALID_HANDLE_VALUE;
+#endif
+    };
+
+    AsyncIo() = default;
+
+    Op new_op() {
+        results_.push_back(INT64_MIN); // not completed
+        return results_.size() - 1;
+    }
+
+    void close_now(FileSlot& file) {
+        if (file.closed || file.open == NO_OP || results_[file.open] < 0) return;
+        file.closed = true;
+#ifdef __linux__
+        ::close(static_cast<int>(results_[file.open]));
+#elif defined(_WIN32)
+        CloseHandle(file.handle);
+#endif
+    }
+
+#ifdef __linux__
+    struct PendingIdentity {
+        Op op;
+        FileIdentity* out;
+        const struct statx* buffer;
+    };
+
+    bool setup() {
+        io_uring_params params{};
+        ringFd_ = static_cast<int>(::syscall(__NR_io_uring_setup, ASYNC_IO_QUEUE_DEPTH, &params));
+        if (ringFd_ < 0) {
+            return false; // no io_uring in this kernel, or disabled by sysctl or seccomp
+        }
+
+        // Every operation the copy and scan paths use must be there, which needs Linux 5.6
+        std::vector<unsigned char> probeBuffer(sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op));
+        auto* probe = reinterpret_cast<io_uring_probe*>(probeBuffer.data());
+        if (::syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+            return false;
+        }
+        for (int op : {IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        }
+        sqRing_ = ::mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_,
+                         IORING_OFF_SQ_RING);
+        cqRing_ = singleMap ? sqRing_ : ::mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        sqes_ = static_cast<io_uring_sqe*>(::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES));
+        if (sqRing_ == MAP_FAILED || cqRing_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+            return false;
+        }
+
+        auto* sq = static_cast<char*>(sqRing_);
+        auto* cq = static_cast<char*>(cqRing_);
+        sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqEntries_ = params.sq_entries;
+        cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqTailLocal_ = *sqTail_;
+        return true;
+    }
+
+    int fd_of(File file) const {
+        int64_t fd = results_[files_[file].open];
+        return fd >= 0 ? static_cast<int>(fd) : -1;
+    }
+
+    io_uring_sqe* next_sqe(Op op) {
+        // Requests in flight never exceed the submission ring, so the completion ring (twice its
+        // size) cannot overflow. One slot stays spare, so a chained pair is never split.
+        unsigned needed = linkPending_ ? 1 : 2;
+        while (queued_ + inFlight_ + needed > sqEntries_) {
+            enter(1);
+        }
+        linkPending_ = false;
+        unsigned index = sqTailLocal_ & sqMask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = op;
+        sqArray_[index] = index;
+        sqTailLocal_++;
+        queued_++;
+        lastSqe_ = sqe;
+        return sqe;
+    }
+
+    Op transfer(File file, void* buffer, size_t len, uint64_t offset, bool write) {
+        Op op = new_op();
+        io_uring_sqe* sqe = next_sqe(op);
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd_of(file);
+        sqe->addr = reinterpret_cast<uint64_t>(buffer);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->off = offset;
+        return op;
+    }
+
+    // Function to submit what is queued, wait for waitFor completions and collect all there are
+    void enter(unsigned waitFor) {
+        std::atomic_ref<unsigned>(*sqTail_).store(sqTailLocal_, std::memory_order_release);
+        long submitted = ::syscall(__NR_io_uring_enter, ringFd_, queued_, waitFor, IORING_ENTER_GETEVENTS,
+                                   nullptr, 0);
+        if (submitted < 0 && errno != EINTR) {
+            throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+        }
+        if (submitted > 0) {
+            queued_ -= static_cast<unsigned>(submitted);
+            inFlight_ += static_cast<unsigned>(submitted);
+        }
+        lastSqe_ = nullptr;
+
+        unsigned head = *cqHead_;
+        unsigned tail = std::atomic_ref<unsigned>(*cqTail_).load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes_[head & cqMask_];
+            results_[static_cast<size_t>(cqe.user_data)] = cqe.res;
+            inFlight_--;
+        }
+        std::atomic_ref<unsigned>(*cqHead_).store(head, std::memory_order_release);
+    }
+
+    int ringFd_ = -1;
+    void* sqRing_ = nullptr;
+    void* cqRing_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqRingSize_ = 0;
+    size_t cqRingSize_ = 0;
+    size_t sqesSize_ = 0;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqArray_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    unsigned sqTailLocal_ = 0;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    io_uring_sqe* lastSqe_ = nullptr;
+    bool linkPending_ = false;
+    unsigned queued_ = 0;
+    unsigned inFlight_ = 0;
+    std::deque<struct statx> statBuffers_;
+#elif defined(_WIN32)
+    struct PendingIdentity {
+        Op op;
+        FileIdentity* out;
+    };
+
+    struct Request {
+        OVERLAPPED overlapped{};
+        Op op = NO_OP;
+    };
+
+    bool setup() {
+        port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+        return port_ != nullptr;
+    }
+
+    Op transfer(File file, void* buffer, size_t len, uint64_t offset, bool write) {
+        Op op = new_op();
+        if (!is_open(file)) {
+            results_[op] = -1;
+            return op;
+        }
+        while (inFlight_ >= ASYNC_IO_QUEUE_DEPTH) {
+            reap();
+        }
+        Request& request = requests_.emplace_back();
+        request.op = op;
+        request.overlapped.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+        request.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        HANDLE h = files_[file].handle;
+        BOOL ok = write ? WriteFile(h, buffer, static_cast<DWORD>(len), nullptr, &request.overlapped)
+                        : ReadFile(h, buffer, static_cast<DWORD>(len), nullptr, &request.overlapped);
+        DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+        if (ok || error == ERROR_IO_PENDING) {
+            inFlight_++; // a completion is posted to the port either way
+        } else {
+            results_[op] = error == ERROR_HANDLE_EOF ? 0 : -static_cast<int64_t>(error);
+        }
+        return op;
+    }
+
+    // Function to wait for at least one completion and collect all there are
+    void reap() {
+        std::array<OVERLAPPED_ENTRY, 64> entries;
+        ULONG removed = 0;
+        if (!GetQueuedCompletionStatusEx(port_, entries.data(), static_cast<ULONG>(entries.size()), &removed,
+                                         INFINITE, FALSE)) {
+            throw std::runtime_error("Waiting for I/O completions failed");
+        }
+        for (ULONG i = 0; i < removed; i++) {
+            auto* request = CONTAINING_RECORD(entries[i].lpOverlapped, Request, overlapped);
+            uint32_t status = static_cast<uint32_t>(request->overlapped.Internal);
+            constexpr uint32_t STATUS_END_OF_FILE_VALUE = 0xC0000011;
+            results_[request->op] = status == 0 ? static_cast<int64_t>(entries[i].dwNumberOfBytesTransferred)
+                                    : status == STATUS_END_OF_FILE_VALUE ? 0 : -static_cast<int64_t>(status);
+            inFlight_--;
+        }
+    }
+
+    HANDLE port_ = nullptr;
+    std::deque<Request> requests_;
+    unsigned inFlight_ = 0;
+#else
+    struct PendingIdentity {
+        Op op;
+        FileIdentity* out;
+    };
+
+    bool setup() { return false; }
+
+    Op transfer(File, void*, size_t, uint64_t, bool) { return new_op(); }
+#endif
+
+    std::vector<int64_t> results_;
+    std::vector<FileSlot> files_;
+    std::vector<PendingIdentity> identities_;
+    std::deque<std::string> paths_;
+};
+
+// Reads slower than this multiple of the baseline latency (plus LATENCY_BACKOFF_SLACK) count as contention
+constexpr double LATENCY_BACKOFF_FACTOR = 2.0;
+constexpr double LATENCY_BACKOFF_SLACK_MS = 1.0;
+constexpr double MAX_BACKOFF_MS = 200.0;
+// Kernel copies are issued in pieces of this size when throttled, so pacing stays smooth
+constexpr uint64_t THROTTLED_COPY_PIECE = 1024 * 1024;
+
+// Paces copy I/O to a byte and file rate. When adaptive, it also tracks read latency on the source
+// and delays further reads while it rises above the baseline, e.g. because a server is busy on the disk.
+// Thread-safe; shared by all copy workers of a backup.
+class IoThrottle {
+public:
+    IoThrottle(double bytesPerSecond, double filesPerSecond, bool adaptive)
+        : bytesPerSecond_(bytesPerSecond), filesPerSecond_(filesPerSecond), adaptive_(adaptive) {}
+
+    bool enabled() const { return bytesPerSecond_ > 0 || filesPerSecond_ > 0 || adaptive_; }
+
+    void file_started() {
+        if (filesPerSecond_ > 0) {
+            pace(nextFile_, 1.0 / filesPerSecond_);
+        }
+    }
+
+    void bytes_transferred(uint64_t bytes) {
+        if (bytesPerSecond_ > 0 && bytes > 0) {
+            pace(nextByte_, static_cast<double>(bytes) / bytesPerSecond_);
+        }
+    }
+
+    void read_latency(std::chrono::steady_clock::duration latency) {
+        if (!adaptive_) return;
+
+        double ms = std::chrono::duration<double, std::milli>(latency).count();
+        double backoff;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            averageMs_ = samples_ == 0 ? ms : averageMs_ * 0.9 + ms * 0.1;
+            // The baseline follows the fastest reads seen, drifting up slowly to accept a new normal
+            if (samples_ == 0 || averageMs_ < baselineMs_) {
+                baselineMs_ = averageMs_;
+            } else {
+                baselineMs_ += (averageMs_ - baselineMs_) * 0.001;
+            }
+            samples_++;
+
+            if (samples_ > 16 && averageMs_ > baselineMs_ * LATENCY_BACKOFF_FACTOR + LATENCY_BACKOFF_SLACK_MS) {
+                backoffMs_ = std::min(std::max(backoffMs_ * 2.0, 1.0), MAX_BACKOFF_MS);
+            } else {
+                backoffMs_ = backoffMs_ < 0.1 ? 0.0 : backoffMs_ / 2.0;
+            }
+            backoff = backoffMs_;
+        }
+
+        if (backoff > 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(backoff));
+        }
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Reserves the next slot on a virtual clock and sleeps until it; allows a short burst after idle time
+    void pace(Clock::time_point& next, double seconds) {
+        Clock::time_point wakeAt;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto now = Clock::now();
+            auto burst = std::chrono::milliseconds(250);
+            if (next < now - burst) {
+                next = now - burst;
+            }
+            next += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+            wakeAt = next;
+        }
+        std::this_thread::sleep_until(wakeAt);
+    }
+
+    double bytesPerSecond_;
+    double filesPerSecond_;
+    bool adaptive_;
+    std::mutex mutex_;
+    Clock::time_point nextByte_;
+    Clock::time_point nextFile_;
+    double averageMs_ = 0;
+    double baselineMs_ = 0;
+    double backoffMs_ = 0;
+    uint64_t samples_ = 0;
+};
+
+// Function to read from a file while feeding an optional throttle
+size_t throttled_read(NativeFile& in, void* buffer, size_t len, uint64_t offset, IoThrottle* throttle) {
+    if (!throttle) {
+        return in.read_at(buffer, len, offset);
+    }
+    auto start = std::chrono::steady_clock::now();
+    size_t got = in.read_at(buffer, len, offset);
+    throttle->read_latency(std::chrono::steady_clock::now() - start);
+    throttle->bytes_transferred(got);
+    return got;
+}
+
+// Function to combine per-segment hashes into the file hash
+uint64_t combine_segment_hashes(const std::vector<uint64_t>& segmentHashes) {
+    if (segmentHashes.size() == 1) {
+        return segmentHashes.front();
+    }
+
+    std::vector<unsigned char> bytes(segmentHashes.size() * 8);
+    for (size_t n = 0; n < segmentHashes.size(); n++) {
+        for (int i = 0; i < 8; i++) bytes[n * 8 + i] = static_cast<unsigned char>(segmentHashes[n] >> (i * 8));
+    }
+    return Xxh3State::hash(bytes.data(), bytes.size());
+}
+
+// Hashes a stream with the same segment scheme as copy_range_hashed, for readers whose data does
+// not arrive in segment-aligned ranges
+class SegmentHasher {
+public:
+    void update(const char* data, size_t len) {
+        while (len > 0) {
+            size_t take = static_cast<size_t>(std::min<uint64_t>(len, FILE_HASH_SEGMENT_SIZE - fill_));
+            state_.update(reinterpret_cast<const unsigned char*>(data), take);
+            fill_ += take;
+            data += take;
+            len -= take;
+            if (fill_ == FILE_HASH_SEGMENT_SIZE) {
+                segmentHashes_.push_back(state_.digest());
+                state_ = Xxh3State();
+                fill_ = 0;
+            }
+        }
+    }
+
+    uint64_t finish() {
+        if (fill_ > 0 || segmentHashes_.empty()) {
+            segmentHashes_.push_back(state_.digest());
+        }
+        return combine_segment_hashes(segmentHashes_);
+    }
+
+private:
+    Xxh3State state_;
+    uint64_t fill_ = 0;
+    std::vector<uint64_t> segmentHashes_;
+};
+
+// Function to copy (or just hash when out is null) a segment-aligned byte range.
+// Appends one hash per segment and returns the number of bytes processed.
+uint64_t copy_range_hashed(NativeFile& in, NativeFile* out, uint64_t offset, uint64_t length,
+                           std::vector<uint64_t>& segmentHashes, IoThrottle* throttle = nullptr) {
+    thread_local std::vector<char> buffer(1 << 20);
+    uint64_t done = 0;
+
+    while (done < length) {
+        Xxh3State state;
+        uint64_t segmentDone = 0;
+        uint64_t segmentLimit = std::min(FILE_HASH_SEGMENT_SIZE, length - done);
+
+        while (segmentDone < segmentLimit) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(buffer.size(), segmentLimit - segmentDone));
+            size_t got = throttled_read(in, buffer.data(), want, offset + done + segmentDone, throttle);
+            if (got == 0) break;
+            state.update(reinterpret_cast<const unsigned char*>(buffer.data()), got);
+            if (out) {
+                out->write_at(buffer.data(), got, offset + done + segmentDone);
+            }
+            segmentDone += got;
+        }
+
+        if (segmentDone == 0 && (done > 0 || !segmentHashes.empty())) {
+            break;
+        }
+        segmentHashes.push_back(state.digest());
+        done += segmentDone;
+        if (segmentDone < segmentLimit) {
+            break; // end of file
+        }
+    }
+
+    return done;
+}
+
+constexpr const char* HASH_CACHE_FILE_NAME = ".flameup_hashcache";
+constexpr uint32_t HASH_CACHE_MAGIC = 0x43484C46; // "FLHC"
+// Files changed this recently are not cached: a write in the same timestamp tick as the hash
+// would leave size, mtime and ctime as they were
+constexpr int64_t HASH_CACHE_RACY_NS = 2000000000LL;
+// An entry costs about 90 bytes in memory (measured with libstdc++), so this caps the cache near
+// 180 MB; files of larger sources beyond it are simply hashed again on every run
+constexpr size_t HASH_CACHE_MAX_ENTRIES = 2000000;
+
+// Content hashes of source files keyed by device and file id, valid while size, mtime and ctime
+// are unchanged. Kept in the backup root, so --hash runs only read files that actually changed.
+// The whole cache is held in memory, one entry per source file up to HASH_CACHE_MAX_ENTRIES.
+// Thread-safe.
+class FileHashCache {
+public:
+    explicit FileHashCache(const fs::path& backupRoot) : path_(backupRoot / HASH_CACHE_FILE_NAME) {
+        load();
+    }
+
+    FileHashCache(const FileHashCache&) = delete;
+    FileHashCache& operator=(const FileHashCache&) = delete;
+
+    // Files read through a source snapshot report the snapshot's device; this maps it back to the
+    // source's, so cached hashes carry over from one snapshot to the next
+    void alias_device(uint64_t snapshotDevice, uint64_t sourceDevice) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        aliasFrom_ = snapshotDevice;
+        aliasTo_ = sourceDevice;
+    }
+
+    std::optional<uint64_t> lookup(const FileIdentity& id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key_of(id));
+        if (it == entries_.end() || it->second.size != id.size || it->second.mtimeNs != id.mtimeNs ||
+            it->second.ctimeNs != id.ctimeNs) {
+            return std::nullopt;
+        }
+        it->second.used = true;
+        return it->second.hash;
+    }
+
+    std::optional<uint64_t> lookup_path(const fs::path& filePath) {
+        FileIdentity id;
+        if (!read_file_identity(filePath, id)) {
+            return std::nullopt;
+        }
+        return lookup(id);
+    }
+
+    // Records hash for a file read through file, unless it changed while being read
+    void insert_if_unchanged(const NativeFile& file, const FileIdentity& before, uint64_t hash) {
+        insert_if_unchanged(before, file.identity(), hash);
+    }
+
+    // Records hash for a file whose identity was before and after it was read
+    void insert_if_unchanged(const FileIdentity& before, const FileIdentity& after, uint64_t hash) {
+        if (!(after == before)) {
+            return;
+        }
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        if (before.mtimeNs > now - HASH_CACHE_RACY_NS || before.ctimeNs > now - HASH_CACHE_RACY_NS) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        Key key = key_of(before);
+        if (entries_.size() >= HASH_CACHE_MAX_ENTRIES && !entries_.contains(key)) {
+            return;
+        }
+        entries_[key] = Entry{before.size, before.mtimeNs, before.ctimeNs, hash, true};
+        dirty_ = true;
+    }
+
+    // Function to write the cache back. With pruneUnused (after a walk of the whole source),
+    // entries not looked up this run are dropped, so deleted files do not pile up.
+    void save(bool pruneUnused) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pruneUnused) {
+            for (auto it = entries_.begin(); it != entries_.end();) {
+                if (!it->second.used) {
+                    it = entries_.erase(it);
+                    dirty_ = true;
+                } else {
+                    ++it;
+                }
+            }
+        }
+        if (!dirty_) {
+            return;
+        }
+
+        fs::path tmp = path_;
+        tmp += ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("Cannot write hash cache: " + tmp.string());
+        }
+        write_u32(out, HASH_CACHE_MAGIC);
+        write_varint(out, entries_.size());
+        for (const auto& [key, entry] : entries_) {
+            write_u64(out, key.device);
+            write_u64(out, key.fileId);
+            write_varint(out, entry.size);
+            write_u64(out, static_cast<uint64_t>(entry.mtimeNs));
+            write_u64(out, static_cast<uint64_t>(entry.ctimeNs));
+            write_u64(out, entry.hash);
+        }
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Failed to write hash cache: " + tmp.string());
+        }
+        fs::rename(tmp, path_);
+        dirty_ = false;
+    }
+
+private:
+    struct Key {
+        uint64_t device = 0;
+        uint64_t fileId = 0;
+        bool operator==(const Key& other) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return static_cast<size_t>(key.fileId * 0x9E3779B97F4A7C15ULL ^ key.device);
+        }
+    };
+    struct Entry {
+        uint64_t size = 0;
+        int64_t mtimeNs = 0;
+        int64_t ctimeNs = 0;
+        uint64_t hash = 0;
+        bool used = false;
+    };
+
+    Key key_of(const FileIdentity& id) const {
+        return Key{id.device == aliasFrom_ ? aliasTo_ : id.device, id.fileId};
+    }
+
+    // A missing or unreadable cache just starts empty
+    void load() {
+        std::ifstream in(path_, std::ios::binary);
+        uint32_t magic = 0;
+        uint64_t count = 0;
+        if (!in.is_open() || !read_u32(in, magic) || magic != HASH_CACHE_MAGIC || !read_varint(in, count)) {
+            return;
+        }
+        count = std::min<uint64_t>(count, HASH_CACHE_MAX_ENTRIES);
+        entries_.reserve(static_cast<size_t>(count));
+        for (uint64_t i = 0; i < count; i++) {
+            Key key;
+            Entry entry;
+            uint64_t mtime = 0, ctime = 0;
+            if (!read_u64(in, key.device) || !read_u64(in, key.fileId) || !read_varint(in, entry.size) ||
+                !read_u64(in, mtime) || !read_u64(in, ctime) || !read_u64(in, entry.hash)) {
+                break;
+            }
+            entry.mtimeNs = static_cast<int64_t>(mtime);
+            entry.ctimeNs = static_cast<int64_t>(ctime);
+            entries_[key] = entry;
+        }
+    }
+
+    fs::path path_;
+    std::mutex mutex_;
+    std::unordered_map<Key, Entry, KeyHash> entries_;
+    bool dirty_ = false;
+    uint64_t aliasFrom_ = 0;
+    uint64_t aliasTo_ = 0;
+};
+
+// Function to hash the contents of a file
+// With a cache, a file whose identity is cached is not read at all. Large files are hashed on up
+// to jobs threads, each taking a run of whole segments.
+uint64_t hash_file(const fs::path& filePath, IoThrottle* throttle = nullptr, FileHashCache* cache = nullptr,
+                   size_t jobs = 1) {
+    NativeFile in = NativeFile::open_read(filePath);
+    FileIdentity before = in.identity();
+    if (cache) {
+        if (auto cached = cache->lookup(before)) {
+            return *cached;
+        }
+    }
+
+    std::vector<uint64_t> segmentHashes;
+    uint64_t segments = (before.size + FILE_HASH_SEGMENT_SIZE - 1) / FILE_HASH_SEGMENT_SIZE;
+    size_t parts = static_cast<size_t>(std::min<uint64_t>(jobs, segments));
+    if (before.size < LARGE_FILE_THRESHOLD || parts < 2) {
+        copy_range_hashed(in, nullptr, 0, UINT64_MAX, segmentHashes, throttle);
+    } else {
+        // Positional reads let every thread share the handle
+        std::vector<std::vector<uint64_t>> partHashes(parts);
+        std::vector<std::exception_ptr> errors(parts);
+        std::vector<std::thread> threads;
+        uint64_t perPart = (segments + parts - 1) / parts;
+        for (size_t i = 0; i < parts; i++) {
+            threads.emplace_back([&, i] {
+                try {
+                    uint64_t offset = i * perPart * FILE_HASH_SEGMENT_SIZE;
+                    uint64_t length = std::min(perPart * FILE_HASH_SEGMENT_SIZE, before.size - std::min(offset, before.size));
+                    if (length > 0) {
+                        copy_range_hashed(in, nullptr, offset, length, partHashes[i], throttle);
+                    }
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (size_t i = 0; i < parts; i++) {
+            if (errors[i]) std::rethrow_exception(errors[i]);
+            segmentHashes.insert(segmentHashes.end(), partHashes[i].begin(), partHashes[i].end());
+        }
+    }
+
+    uint64_t hash = combine_segment_hashes(segmentHashes);
+    if (cache) {
+        cache->insert_if_unchanged(in, before, hash);
+    }
+    return hash;
+}
+
+// Function to apply mtime and permission bits to a freshly written file
+void finalize_copied_file(const fs::path& target, int64_t mtimeNs, uint32_t mode) {
+    set_file_mtime(target, mtimeNs);
+    std::error_code ec;
+    fs::permissions(target, static_cast<fs::perms>(mode) & fs::perms::mask, ec);
+}
+
+// Fixed-capacity blocking queue used to hand work from the tree walker to copy workers
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [&] { return items_.size() < capacity_ || closed_; });
+        items_.push_back(std::move(item));
+        notEmpty_.notify_one();
+    }
+
+    // Returns nullopt once the queue is closed and drained
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notEmpty_.wait(lock, [&] { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(items_.front());
+        items_.pop_front();
+        notFull_.notify_one();
+        return item;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+};
+
+// Content-defined chunking parameters for the chunk store (FastCDC-style gear hash)
+constexpr const char* CHUNK_STORE_DIR = ".flameup_chunks";
+constexpr const char* CHUNK_REFCOUNT_FILE_NAME = "refcounts";
+constexpr const char* CHUNK_INDEX_FILE_NAME = ".flameup_index";
+constexpr uint32_t CHUNK_INDEX_MAGIC = 0x49434C46;    // "FLCI"
+constexpr uint32_t CHUNK_REFCOUNT_MAGIC = 0x43524C46; // "FLRC"
+constexpr size_t CDC_MIN_CHUNK = 16 * 1024;
+constexpr size_t CDC_AVG_CHUNK = 64 * 1024;
+constexpr size_t CDC_MAX_CHUNK = 256 * 1024;
+constexpr uint64_t CDC_MASK_SMALL = (1ULL << 18) - 1; // harder to cut before the average size
+constexpr uint64_t CDC_MASK_LARGE = (1ULL << 14) - 1; // easier to cut after it
+
+// 128-bit chunk identity: two independently seeded XXH64 digests
+struct ChunkId {
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    bool operator==(const ChunkId& other) const { return hi == other.hi && lo == other.lo; }
+
+    std::string hex() const {
+        std::ostringstream oss;
+        oss << std::hex << std::setfill('0') << std::setw(16) << hi << std::setw(16) << lo;
+        return oss.str();
+    }
+
+    static ChunkId of(const char* data, size_t len) {
+        Xxh64State a(0);
+        Xxh64State b(0x9E3779B97F4A7C15ULL);
+        a.update(reinterpret_cast<const unsigned char*>(data), len);
+        b.update(reinterpret_cast<const unsigned char*>(data), len);
+        return ChunkId{a.digest(), b.digest()};
+    }
+};
+
+struct ChunkIdHash {
+    size_t operator()(const ChunkId& id) const { return static_cast<size_t>(id.lo ^ (id.hi >> 1)); }
+};
+
+struct ChunkRef {
+    ChunkId id;
+    uint32_t length = 0;
+};
+
+void write_chunk_refs(std::ostream& out, const std::vector<ChunkRef>& refs) {
+    write_varint(out, refs.size());
+    for (const auto& ref : refs) {
+        write_u64(out, ref.id.hi);
+        write_u64(out, ref.id.lo);
+        write_varint(out, ref.length);
+    }
+}
+
+bool read_chunk_refs(std::istream& in, std::vector<ChunkRef>& refs) {
+    uint64_t count = 0;
+    if (!read_varint(in, count)) return false;
+    refs.resize(static_cast<size_t>(count));
+    for (auto& ref : refs) {
+        uint64_t length = 0;
+        if (!read_u64(in, ref.id.hi) || !read_u64(in, ref.id.lo) || !read_varint(in, length)) return false;
+        ref.length = static_cast<uint32_t>(length);
+    }
+    return true;
+}
+
+// Gear table for the rolling hash, generated deterministically so chunk boundaries are stable
+const std::array<uint64_t, 256>& gear_table() {
+    static const std::array<uint64_t, 256> table = [] {
+        std::array<uint64_t, 256> t{};
+        uint64_t x = 0x243F6A8885A308D3ULL;
+        for (auto& value : t) {
+            // splitmix64
+            x += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            value = z ^ (z >> 31);
+        }
+        return t;
+    }();
+    return table;
+}
+
+// Deduplicating store: each chunk is written once under its hash in backupRoot/CHUNK_STORE_DIR,
+// and a refcount table tracks how many snapshot references each chunk has
+class ChunkStore {
+public:
+    explicit ChunkStore(const fs::path& backupRoot) : root_(backupRoot / CHUNK_STORE_DIR) {
+        fs::create_directories(root_);
+        load_refcounts();
+    }
+
+    // Splits a file into content-defined chunks and stores the ones not seen before.
+    // Adds one reference per returned chunk. Thread-safe.
+    std::vector<ChunkRef> store_file(const fs::path& source, uint64_t& fileHash, uint64_t& fileSize,
+                                     IoThrottle* throttle = nullptr, FileHashCache* hashCache = nullptr) {
+        NativeFile in = NativeFile::open_read(source);
+        FileIdentity before = hashCache ? in.identity() : FileIdentity{};
+        const auto& gear = gear_table();
+        std::vector<ChunkRef> refs;
+        std::vector<char> chunk;
+        chunk.reserve(CDC_MAX_CHUNK);
+        thread_local std::vector<char> buffer(1 << 20);
+
+        SegmentHasher hasher;
+        uint64_t offset = 0;
+        uint64_t fp = 0;
+
+        while (true) {
+            size_t got = throttled_read(in, buffer.data(), buffer.size(), offset, throttle);
+            if (got == 0) break;
+
+            // File hash follows the same segment scheme as copied files
+            hasher.update(buffer.data(), got);
+
+            size_t start = 0;
+            size_t i = 0;
+            while (i < got) {
+                // No cut points before the minimum size, so skip hashing those bytes
+                if (chunk.size() + (i - start) < CDC_MIN_CHUNK) {
+                    i += std::min(CDC_MIN_CHUNK - (chunk.size() + (i - start)), got - i);
+                    continue;
+                }
+
+                fp = (fp << 1) + gear[static_cast<unsigned char>(buffer[i])];
+                i++;
+                size_t chunkLen = chunk.size() + (i - start);
+                uint64_t mask = chunkLen < CDC_AVG_CHUNK ? CDC_MASK_SMALL : CDC_MASK_LARGE;
+                if ((fp & mask) == 0 || chunkLen >= CDC_MAX_CHUNK) {
+                    chunk.insert(chunk.end(), buffer.data() + start, buffer.data() + i);
+                    refs.push_back(put_chunk(chunk));
+                    chunk.clear();
+                    start = i;
+                    fp = 0;
+                }
+            }
+            chunk.insert(chunk.end(), buffer.data() + start, buffer.data() + got);
+            offset += got;
+        }
+
+        if (!chunk.empty()) {
+            refs.push_back(put_chunk(chunk));
+        }
+
+        fileHash = hasher.finish();
+        fileSize = offset;
+        if (hashCache) {
+            hashCache->insert_if_unchanged(in, before, fileHash);
+        }
+        return refs;
+    }
+
+    // Adds references for chunks reused from a previous snapshot
+    void add_refs(const std::vector<ChunkRef>& refs) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& ref : refs) {
+            refcounts_[ref.id]++;
+        }
+    }
+
+    // Drops references; chunks reaching zero are deleted on commit()
+    void release(const std::vector<ChunkRef>& refs) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& ref : refs) {
+            auto it = refcounts_.find(ref.id);
+            if (it == refcounts_.end()) continue;
+            if (--it->second == 0) {
+                unreferenced_.push_back(ref.id);
+                refcounts_.erase(it);
+            }
+        }
+    }
+
+    // Reads a chunk and checks it against its id
+    void read_chunk(const ChunkRef& ref, std::vector<char>& data) const {
+        fs::path chunkPath = chunk_path(ref.id);
+        NativeFile in = NativeFile::open_read(chunkPath);
+        data.resize(ref.length);
+        size_t done = 0;
+        while (done < data.size()) {
+            size_t got = in.read_at(data.data() + done, data.size() - done, done);
+            if (got == 0) break;
+            done += got;
+        }
+        if (done != ref.length || !(ChunkId::of(data.data(), data.size()) == ref.id)) {
+            throw std::runtime_error("Corrupt chunk: " + chunkPath.string());
+        }
+    }
+
+    // Persists the refcount table, then deletes chunks nothing refers to any more
+    void commit() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fs::path refcountPath = root_ / CHUNK_REFCOUNT_FILE_NAME;
+        fs::path tempPath = refcountPath.string() + ".tmp";
+        {
+            std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                throw std::runtime_error("Cannot write chunk refcounts: " + tempPath.string());
+            }
+            write_u32(out, CHUNK_REFCOUNT_MAGIC);
+            write_u64(out, refcounts_.size());
+            for (const auto& [id, count] : refcounts_) {
+                write_u64(out, id.hi);
+                write_u64(out, id.lo);
+                write_varint(out, count);
+            }
+            out.close();
+            if (!out) {
+                throw std::runtime_error("Failed to write chunk refcounts: " + tempPath.string());
+            }
+        }
+        fs::rename(tempPath, refcountPath);
+
+        std::error_code ec;
+        for (const auto& id : unreferenced_) {
+            fs::remove(chunk_path(id), ec);
+        }
+        unreferenced_.clear();
+    }
+
+    uint64_t chunks_written() const { return chunksWritten_; }
+    uint64_t bytes_written() const { return bytesWritten_; }
+
+    bool has_chunk(const ChunkRef& ref) const {
+        std::error_code ec;
+        return fs::exists(chunk_path(ref.id), ec);
+    }
+
+    // Writes a chunk received from another store without adding a reference.
+    // Returns false when the data does not match the chunk id.
+    bool import_chunk(const ChunkRef& ref, const char* data, size_t size) {
+        if (size != ref.length || !(ChunkId::of(data, size) == ref.id)) {
+            return false;
+        }
+        if (has_chunk(ref)) {
+            return true;
+        }
+
+        fs::path chunkPath = chunk_path(ref.id);
+        fs::create_directories(chunkPath.parent_path());
+        fs::path tempPath = chunkPath.string() + ".tmp";
+        {
+            NativeFile out = NativeFile::open_write(tempPath, true);
+            out.write_at(data, size, 0);
+            flush_chunk(out);
+        }
+        fs::rename(tempPath, chunkPath);
+        chunksWritten_++;
+        bytesWritten_ += size;
+        return true;
+    }
+
+private:
+    fs::path chunk_path(const ChunkId& id) const {
+        std::string name = id.hex();
+        return root_ / name.substr(0, 2) / name;
+    }
+
+    // Windows has no unprivileged sync_filesystem, and publishing only flushes the snapshot
+    // tree, so chunks are flushed as they are written there. Elsewhere publishing covers them.
+    static void flush_chunk(NativeFile& out) {
+#ifdef _WIN32
+        if (!FlushFileBuffers(out.native_handle())) {
+            throw std::runtime_error("Cannot flush chunk: error " + std::to_string(GetLastError()));
+        }
+#else
+        (void)out;
+#endif
+    }
+
+    ChunkRef put_chunk(const std::vector<char>& data) {
+        ChunkRef ref;
+        ref.id = ChunkId::of(data.data(), data.size());
+        ref.length = static_cast<uint32_t>(data.size());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (refcounts_[ref.id]++ > 0) {
+                return ref; // already stored
+            }
+        }
+
+        // An interrupted run may have written the chunk without ever committing a reference
+        fs::path chunkPath = chunk_path(ref.id);
+        std::error_code ec;
+        if (fs::file_size(chunkPath, ec) == data.size() && !ec) {
+            return ref;
+        }
+
+        fs::create_directories(chunkPath.parent_path());
+        fs::path tempPath = chunkPath.string() + ".tmp";
+        {
+            NativeFile out = NativeFile::open_write(tempPath, true);
+            out.write_at(data.data(), data.size(), 0);
+            flush_chunk(out);
+        }
+        fs::rename(tempPath, chunkPath);
+
+        chunksWritten_++;
+        bytesWritten_ += data.size();
+        return ref;
+    }
+
+    void load_refcounts() {
+        std::ifstream in(root_ / CHUNK_REFCOUNT_FILE_NAME, std::ios::binary);
+        if (!in.is_open()) {
+            return; // new store
+        }
+
+        uint32_t magic = 0;
+        uint64_t count = 0;
+        if (!read_u32(in, magic) || magic != CHUNK_REFCOUNT_MAGIC || !read_u64(in, count)) {
+            throw std::runtime_error("Corrupt chunk refcounts in " + root_.string());
+        }
+
+        refcounts_.reserve(static_cast<size_t>(count));
+        for (uint64_t i = 0; i < count; i++) {
+            ChunkId id;
+            uint64_t refs = 0;
+            if (!read_u64(in, id.hi) || !read_u64(in, id.lo) || !read_varint(in, refs)) {
+                throw std::runtime_error("Corrupt chunk refcounts in " + root_.string());
+            }
+            refcounts_[id] = refs;
+        }
+    }
+
+    fs::path root_;
+    mutable std::mutex mutex_;
+    std::unordered_map<ChunkId, uint64_t, ChunkIdHash> refcounts_;
+    std::vector<ChunkId> unreferenced_;
+    std::atomic<uint64_t> chunksWritten_{0};
+    std::atomic<uint64_t> bytesWritten_{0};
+};
+
+// Reads the per-file chunk lists of a chunked snapshot, in manifest order
+class ChunkIndexReader {
+public:
+    bool open(const fs::path& backupPath) {
+        in_.open(backupPath / CHUNK_INDEX_FILE_NAME, std::ios::binary);
+        uint32_t magic = 0;
+        return in_.is_open() && read_u32(in_, magic) && magic == CHUNK_INDEX_MAGIC;
+    }
+
+    // Call once for every File entry of the manifest
+    void next(std::vector<ChunkRef>& refs) {
+        if (!read_chunk_refs(in_, refs)) {
+            throw std::runtime_error("Corrupt chunk index");
+        }
+    }
+
+private:
+    std::ifstream in_;
+};
+
+// Small-file packing (--pack): in directory snapshots, files below the threshold are appended to
+// shared pack files in PACK_DIR_NAME instead of getting a file each. The pack index holds one
+// record per File entry of the manifest, like the chunk index, followed by a table of the packs.
+constexpr const char* PACK_DIR_NAME = ".flameup_packs";
+constexpr const char* PACK_INDEX_FILE_NAME = ".flameup_packindex";
+constexpr uint32_t PACK_INDEX_MAGIC = 0x49504C46; // "FLPI"
+constexpr uint64_t PACK_TARGET_SIZE = 32ULL << 20;
+constexpr uint64_t PACK_MAX_FILE_SIZE = COPY_CHUNK_SIZE; // largest --pack threshold
+constexpr size_t PACK_WRITE_BUFFER = 1 << 20;
+constexpr uint64_t PACK_MIN_LIVE_PERCENT = 50; // emptier packs are not carried into the next snapshot
+
+// Where a file's data lives in its snapshot's packs; pack 0 means it is stored as a file of its own
+struct PackRef {
+    uint64_t pack = 0;
+    uint64_t offset = 0;
+};
+
+// Size of a pack and how many of its bytes the snapshot still refers to
+struct PackSummary {
+    uint64_t size = 0;
+    uint64_t liveBytes = 0;
+};
+
+// Function to get the file name of a pack inside PACK_DIR_NAME
+std::string pack_file_name(uint64_t pack) {
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0') << std::setw(16) << pack << ".pack";
+    return oss.str();
+}
+
+void write_pack_ref(std::ostream& out, const PackRef& ref) {
+    write_u64(out, ref.pack);
+    if (ref.pack != 0) {
+        write_varint(out, ref.offset);
+    }
+}
+
+// Function to write the pack table and trailer that end a pack index
+void write_pack_table(std::ostream& out, const std::unordered_map<uint64_t, PackSummary>& packs) {
+    uint64_t tableOffset = static_cast<uint64_t>(out.tellp());
+    write_varint(out, packs.size());
+    for (const auto& [pack, summary] : packs) {
+        write_u64(out, pack);
+        write_varint(out, summary.size);
+        write_varint(out, summary.liveBytes);
+    }
+    write_u64(out, tableOffset);
+    write_u32(out, PACK_INDEX_MAGIC);
+}
+
+// Reads the pack index of a directory snapshot, in manifest order
+class PackIndexReader {
+public:
+    // Returns false when the snapshot has no pack index; throws when it has a damaged one
+    bool open(const fs::path& backupPath) {
+        fs::path path = backupPath / PACK_INDEX_FILE_NAME;
+        in_.open(path, std::ios::binary);
+        if (!in_.is_open()) {
+            return false;
+        }
+
+        // The pack table is found through the trailer, then reading starts at the first record
+        uint32_t magic = 0;
+        uint64_t tableOffset = 0;
+        uint64_t count = 0;
+        bool valid = read_u32(in_, magic) && magic == PACK_INDEX_MAGIC &&
+                     in_.seekg(-12, std::ios::end) && read_u64(in_, tableOffset) && read_u32(in_, magic) &&
+                     magic == PACK_INDEX_MAGIC && in_.seekg(static_cast<std::streamoff>(tableOffset)) &&
+                     read_varint(in_, count);
+        for (uint64_t i = 0; valid && i < count; i++) {
+            uint64_t pack = 0;
+            PackSummary summary;
+            valid = read_u64(in_, pack) && read_varint(in_, summary.size) && read_varint(in_, summary.liveBytes);
+            packs_[pack] = summary;
+        }
+        if (!valid || !in_.seekg(sizeof(uint32_t))) {
+            throw std::runtime_error("Corrupt pack index: " + path.string());
+        }
+        return true;
+    }
+
+    // Call once for every File entry of the manifest
+    void next(PackRef& ref) {
+        ref = {};
+        if (!read_u64(in_, ref.pack) || (ref.pack != 0 && !read_varint(in_, ref.offset))) {
+            throw std::runtime_error("Corrupt pack index");
+        }
+    }
+
+    // The table entry of a pack, or nullptr
+    const PackSummary* summary(uint64_t pack) const {
+        auto it = packs_.find(pack);
+        return it == packs_.end() ? nullptr : &it->second;
+    }
+
+private:
+    std::ifstream in_;
+    std::unordered_map<uint64_t, PackSummary> packs_;
+};
+
+// Function to hand size bytes at offset of a pack file to sink piece by piece
+void read_pack_range(const fs::path& packPath, uint64_t offset, uint64_t size,
+                     const std::function<void(const char*, size_t)>& sink, IoThrottle* throttle = nullptr) {
+    thread_local std::vector<char> buffer(1 << 20);
+    NativeFile in = NativeFile::open_read(packPath);
+    for (uint64_t done = 0; done < size;) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(buffer.size(), size - done));
+        size_t got = throttled_read(in, buffer.data(), want, offset + done, throttle);
+        if (got == 0) {
+            throw std::runtime_error("Pack is truncated: " + packPath.string());
+        }
+        sink(buffer.data(), got);
+        done += got;
+    }
+}
+
+// Steps through a snapshot's manifest, and for chunked snapshots its chunk index (for packed
+// directory snapshots its pack index), alongside a walk in the same sorted order, so the
+// previous entry of each path is found without holding the old manifest in memory
+class ManifestCursor {
+public:
+    // Returns false unless the snapshot has a readable manifest of the given format
+    bool open(const fs::path& backupPath, SnapshotFormat format) {
+        if (!reader_.open(backupPath / MANIFEST_FILE_NAME) || reader_.header().format != format) {
+            return false;
+        }
+        chunked_ = format == SnapshotFormat::Chunked;
+        if (chunked_ && !index_.open(backupPath)) {
+            return false;
+        }
+        if (format == SnapshotFormat::Directory) {
+            try {
+                packed_ = packs_.open(backupPath);
+            } catch (const std::exception&) {
+                return false;
+            }
+        }
+        advance();
+        return true;
+    }
+
+    // The entry stored for relPath, or nullptr. Paths must be asked for in manifest order.
+    const ManifestEntry* find(const std::string& relPath) {
+        while (valid_ && manifest_path_less(current_.path, relPath)) {
+            advance();
+        }
+        return valid_ && current_.path == relPath ? &current_ : nullptr;
+    }
+
+    // Chunk list of the File entry find() last returned
+    const std::vector<ChunkRef>& chunks() const { return chunks_; }
+
+    // Pack location of the File entry find() last returned
+    const PackRef& pack() const { return pack_; }
+
+    // Table entry of one of the snapshot's packs, or nullptr
+    const PackSummary* pack_summary(uint64_t pack) const { return packed_ ? packs_.summary(pack) : nullptr; }
+
+private:
+    void advance() {
+        valid_ = reader_.next(current_);
+        if (valid_ && chunked_ && current_.type == EntryType::File) {
+            index_.next(chunks_);
+        }
+        if (valid_ && packed_ && current_.type == EntryType::File) {
+            packs_.next(pack_);
+        }
+    }
+
+    ManifestReader reader_;
+    ChunkIndexReader index_;
+    PackIndexReader packs_;
+    ManifestEntry current_;
+    std::vector<ChunkRef> chunks_;
+    PackRef pack_;
+    bool chunked_ = false;
+    bool packed_ = false;
+    bool valid_ = false;
+};
+
+// Function to rebuild a file from its chunks
+uint64_t restore_file_from_chunks(const ChunkStore& store, const std::vector<ChunkRef>& refs, const fs::path& target) {
+    NativeFile out = NativeFile::open_write(target, true);
+    std::vector<char> data;
+    uint64_t offset = 0;
+    for (const auto& ref : refs) {
+        store.read_chunk(ref, data);
+        out.write_at(data.data(), data.size(), offset);
+        offset += data.size();
+    }
+    return offset;
+}
+
+// Streaming archive snapshot: tar-like entry headers followed by independently compressed
+// blocks, with a seekable index at the end so single files can be extracted directly
+constexpr const char* ARCHIVE_FILE_NAME = "snapshot.flar";
+constexpr uint32_t ARCHIVE_MAGIC = 0x52414C46;         // "FLAR"
+constexpr uint32_t ARCHIVE_ENTRY_MAGIC = 0x48454C46;   // "FLEH"
+constexpr uint32_t ARCHIVE_INDEX_MAGIC = 0x58414C46;   // "FLAX"
+constexpr uint32_t ARCHIVE_TRAILER_MAGIC = 0x54414C46; // "FLAT"
+constexpr uint32_t ARCHIVE_VERSION = 1;
+constexpr size_t ARCHIVE_BLOCK_SIZE = 1 << 20;
+constexpr int ARCHIVE_ZSTD_LEVEL = 3;
+
+enum class BlockCodec : uint8_t {
+    Stored = 0,
+    Zstd = 1
+};
+
+struct ArchiveIndexEntry {
+    std::string path;
+    uint64_t offset = 0;   // offset of the entry header
+    uint64_t rawSize = 0;
+};
+
+// Function to append a little-endian integer to a byte string
+void append_u32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back(static_cast<char>(value >> (i * 8)));
+}
+
+void append_varint(std::string& out, uint64_t value) {
+    do {
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        if (value) byte |= 0x80;
+        out.push_back(static_cast<char>(byte));
+    } while (value);
+}
+
+// Function to encode one data block frame: codec, raw length, stored length, checksum, payload
+std::string encode_archive_block(const std::string& raw) {
+    std::string frame;
+    BlockCodec codec = BlockCodec::Stored;
+    std::string payload;
+
+#ifdef FLAMEUP_HAVE_ZSTD
+    payload.resize(ZSTD_compressBound(raw.size()));
+    size_t compressed = ZSTD_compress(payload.data(), payload.size(), raw.data(), raw.size(), ARCHIVE_ZSTD_LEVEL);
+    if (!ZSTD_isError(compressed) && compressed < raw.size()) {
+        payload.resize(compressed);
+        codec = BlockCodec::Zstd;
+    }
+#endif
+    const std::string& data = codec == BlockCodec::Stored ? raw : payload;
+
+    Xxh64State checksum;
+    checksum.update(reinterpret_cast<const unsigned char*>(raw.data()), raw.size());
+
+    frame.push_back(static_cast<char>(codec));
+    append_varint(frame, raw.size());
+    append_varint(frame, data.size());
+    append_u32(frame, static_cast<uint32_t>(checksum.digest()));
+    frame.append(data);
+    return frame;
+}
+
+// Function to decode a block frame; returns false on the end-of-entry marker
+bool decode_archive_block(std::istream& in, std::string& raw) {
+    int codec = in.get();
+    uint64_t rawSize = 0, storedSize = 0;
+    uint32_t checksum = 0;
+    if (codec == EOF || !read_varint(in, rawSize) || !read_varint(in, storedSize) || !read_u32(in, checksum)) {
+        throw std::runtime_error("Truncated archive block");
+    }
+    if (rawSize == 0) {
+        return false;
+    }
+
+    std::string stored(static_cast<size_t>(storedSize), '\0');
+    if (!in.read(stored.data(), static_cast<std::streamsize>(storedSize))) {
+        throw std::runtime_error("Truncated archive block");
+    }
+
+    if (static_cast<BlockCodec>(codec) == BlockCodec::Stored) {
+        raw = std::move(stored);
+    } else if (static_cast<BlockCodec>(codec) == BlockCodec::Zstd) {
+#ifdef FLAMEUP_HAVE_ZSTD
+        raw.resize(static_cast<size_t>(rawSize));
+        size_t got = ZSTD_decompress(raw.data(), raw.size(), stored.data(), stored.size());
+        if (ZSTD_isError(got) || got != rawSize) {
+            throw std::runtime_error("Corrupt compressed archive block");
+        }
+#else
+        throw std::runtime_error("Archive uses zstd but FlameUp was built without zstd support");
+#endif
+    } else {
+        throw std::runtime_error("Unknown archive block codec");
+    }
+
+    Xxh64State state;
+    state.update(reinterpret_cast<const unsigned char*>(raw.data()), raw.size());
+    if (static_cast<uint32_t>(state.digest()) != checksum || raw.size() != rawSize) {
+        throw std::runtime_error("Archive block checksum mismatch");
+    }
+    return true;
+}
+
+// Writes an archive with compression on a pool of worker threads. The caller streams entries in
+// order, blocks are compressed out of order and a writer thread puts them back in sequence.
+class ArchiveWriter {
+public:
+    // Index entry in archive order; the writer thread fills in the offset
+    struct IndexSlot {
+        uint32_t node = 0; // in paths_
+        uint64_t offset = 0;
+        uint64_t rawSize = 0;
+    };
+
+    ArchiveWriter(const fs::path& archivePath, size_t jobs, IoThrottle* throttle = nullptr)
+        : path_(archivePath), jobs_(std::max<size_t>(jobs, 1)), throttle_(throttle), queue_(jobs_ * 2),
+          window_(jobs_ * 4) {
+        out_.open(archivePath, std::ios::binary | std::ios::trunc);
+        if (!out_.is_open()) {
+            throw std::runtime_error("Cannot create archive: " + archivePath.string());
+        }
+        write_u32(out_, ARCHIVE_MAGIC);
+        write_u32(out_, ARCHIVE_VERSION);
+        offset_ = 8;
+
+        for (size_t i = 0; i < jobs_; i++) {
+            workers_.emplace_back([this] { compress_loop(); });
+        }
+        writer_ = std::thread([this] { write_loop(); });
+    }
+
+    ArchiveWriter(const ArchiveWriter&) = delete;
+    ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+    ~ArchiveWriter() {
+        shutdown();
+    }
+
+    void add_entry(const ManifestEntry& entry) {
+        std::string header;
+        append_u32(header, ARCHIVE_ENTRY_MAGIC);
+        append_varint(header, entry.path.size());
+        header.append(entry.path);
+        header.push_back(static_cast<char>(entry.type));
+        append_varint(header, entry.mode);
+        append_varint(header, static_cast<uint64_t>(entry.mtimeNs));
+        if (entry.type == EntryType::Symlink) {
+            append_varint(header, entry.linkTarget.size());
+            header.append(entry.linkTarget);
+        }
+
+        index_.push_back(IndexSlot{paths_.insert(entry.path), 0, 0});
+        submit(std::move(header), false, &index_.back());
+    }
+
+    // Streams a file's data into the archive; returns its content hash and fills size
+    uint64_t add_file(const fs::path& source, uint64_t& size) {
+        NativeFile in = NativeFile::open_read(source);
+        IndexSlot* slot = &index_.back();
+        SegmentHasher hasher;
+        uint64_t offset = 0;
+
+        while (true) {
+            std::string block(ARCHIVE_BLOCK_SIZE, '\0');
+            size_t got = 0;
+            while (got < block.size()) {
+                size_t n = throttled_read(in, block.data() + got, block.size() - got, offset + got, throttle_);
+                if (n == 0) break;
+                got += n;
+            }
+            if (got == 0) break;
+            block.resize(got);
+            hasher.update(block.data(), got);
+
+            offset += got;
+            submit(std::move(block), true, nullptr);
+            if (got < ARCHIVE_BLOCK_SIZE) break;
+        }
+
+        // End-of-entry marker
+        std::string end;
+        end.push_back(static_cast<char>(BlockCodec::Stored));
+        append_varint(end, 0);
+        append_varint(end, 0);
+        append_u32(end, 0);
+        submit(std::move(end), false, nullptr);
+
+        slot->rawSize = offset;
+        size = offset;
+        return hasher.finish();
+    }
+
+    // Flushes all blocks, appends the index and trailer
+    void finish() {
+        shutdown();
+        if (failed_) {
+            throw std::runtime_error(firstError_);
+        }
+
+        uint64_t indexOffset = offset_;
+        write_u32(out_, ARCHIVE_INDEX_MAGIC);
+        write_varint(out_, index_.size());
+        for (const auto& entry : index_) {
+            std::string path = paths_.path(entry.node);
+            write_varint(out_, path.size());
+            out_.write(path.data(), static_cast<std::streamsize>(path.size()));
+            write_varint(out_, entry.offset);
+            write_varint(out_, entry.rawSize);
+        }
+        write_u64(out_, indexOffset);
+        write_u32(out_, ARCHIVE_TRAILER_MAGIC);
+        out_.close();
+        if (!out_) {
+            throw std::runtime_error("Failed to write archive: " + path_.string());
+        }
+    }
+
+private:
+    struct Item {
+        uint64_t seq = 0;
+        std::string data;
+    };
+
+    void submit(std::string data, bool compress, IndexSlot* slot) {
+        if (failed_) {
+            throw std::runtime_error(firstError_);
+        }
+
+        uint64_t seq;
+        {
+            // Keep the reorder buffer bounded
+            std::unique_lock<std::mutex> lock(mutex_);
+            windowCv_.wait(lock, [&] { return nextSeq_ - written_ < window_ || failed_; });
+            if (failed_) {
+                throw std::runtime_error(firstError_);
+            }
+            seq = nextSeq_++;
+            if (slot) {
+                slots_[seq] = slot;
+            }
+        }
+
+        if (compress) {
+            queue_.push(Item{seq, std::move(data)});
+        } else {
+            complete(seq, std::move(data));
+        }
+    }
+
+    void complete(uint64_t seq, std::string data) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_.emplace(seq, std::move(data));
+        readyCv_.notify_all();
+    }
+
+    void compress_loop() {
+        while (auto item = queue_.pop()) {
+            try {
+                complete(item->seq, encode_archive_block(item->data));
+            } catch (const std::exception& e) {
+                fail(e.what());
+            }
+        }
+    }
+
+    void write_loop() {
+        uint64_t seq = 0;
+        while (true) {
+            std::string data;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                readyCv_.wait(lock, [&] { return ready_.count(seq) || (closing_ && seq == nextSeq_) || failed_; });
+                if (failed_ || !ready_.count(seq)) {
+                    return;
+                }
+                data = std::move(ready_[seq]);
+                ready_.erase(seq);
+                auto slot = slots_.find(seq);
+                if (slot != slots_.end()) {
+                    slot->second->offset = offset_;
+                    slots_.erase(slot);
+                }
+            }
+
+            out_.write(data.data(), static_cast<std::streamsize>(data.size()));
+            if (!out_) {
+                fail("Write failed: " + path_.string());
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            offset_ += data.size();
+            written_ = ++seq;
+            windowCv_.notify_all();
+        }
+    }
+
+    void fail(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!failed_) {
+            firstError_ = message;
+            failed_ = true;
+        }
+        readyCv_.notify_all();
+        windowCv_.notify_all();
+    }
+
+    void shutdown() {
+        if (stopped_) return;
+        stopped_ = true;
+        queue_.close();
+        for (auto& worker : workers_) {
+            if (worker.joinable()) worker.join();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+            readyCv_.notify_all();
+        }
+        if (writer_.joinable()) writer_.join();
+    }
+
+    fs::path path_;
+    size_t jobs_;
+    IoThrottle* throttle_;
+    std::ofstream out_;
+    uint64_t offset_ = 0;
+    BoundedQueue<Item> queue_;
+    std::vector<std::thread> workers_;
+    std::thread writer_;
+    PathTree paths_;
+    std::deque<IndexSlot> index_;
+
+    std::mutex mutex_;
+    std::condition_variable readyCv_;
+    std::condition_variable windowCv_;
+    std::map<uint64_t, std::string> ready_;
+    std::map<uint64_t, IndexSlot*> slots_;
+    uint64_t nextSeq_ = 0;
+    uint64_t written_ = 0;
+    uint64_t window_;
+    bool closing_ = false;
+    bool stopped_ = false;
+    std::atomic<bool> failed_{false};
+    std::string firstError_;
+};
+
+// Random-access reader for archive snapshots using the trailing index
+class ArchiveReader {
+public:
+    explicit ArchiveReader(const fs::path& archivePath) : path_(archivePath) {
+        in_.open(archivePath, std::ios::binary);
+        uint32_t magic = 0, version = 0;
+        if (!in_.is_open() || !read_u32(in_, magic) || magic != ARCHIVE_MAGIC ||
+            !read_u32(in_, version) || version > ARCHIVE_VERSION) {
+            throw std::runtime_error("Not a FlameUp archive: " + archivePath.string());
+        }
+
+        uint64_t indexOffset = 0;
+        in_.seekg(-12, std::ios::end);
+        if (!read_u64(in_, indexOffset) || !read_u32(in_, magic) || magic != ARCHIVE_TRAILER_MAGIC) {
+            throw std::runtime_error("Archive is incomplete (missing index): " + archivePath.string());
+        }
+
+        in_.seekg(static_cast<std::streamoff>(indexOffset));
+        uint64_t count = 0;
+        if (!read_u32(in_, magic) || magic != ARCHIVE_INDEX_MAGIC || !read_varint(in_, count)) {
+            throw std::runtime_error("Corrupt archive index: " + archivePath.string());
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            ArchiveIndexEntry entry;
+            uint64_t pathLen = 0;
+            if (!read_varint(in_, pathLen)) throw std::runtime_error("Corrupt archive index");
+            entry.path.resize(static_cast<size_t>(pathLen));
+            in_.read(entry.path.data(), static_cast<std::streamsize>(pathLen));
+            if (!in_ || !read_varint(in_, entry.offset) || !read_varint(in_, entry.rawSize)) {
+                throw std::runtime_error("Corrupt archive index");
+            }
+            uint32_t node = paths_.insert(entry.path);
+            offsets_.resize(paths_.size());
+            rawSizes_.resize(paths_.size());
+            offsets_[node] = entry.offset;
+            rawSizes_[node] = entry.rawSize;
+        }
+    }
+
+    std::optional<ArchiveIndexEntry> find(const std::string& path) const {
+        auto node = paths_.find(path);
+        if (!node) {
+            return std::nullopt;
+        }
+        return ArchiveIndexEntry{path, offsets_[*node], rawSizes_[*node]};
+    }
+
+    // Seeks straight to one file's blocks and decompresses only those
+    uint64_t extract(const ArchiveIndexEntry& entry, const fs::path& target) {
+        NativeFile out = NativeFile::open_write(target, true);
+        uint64_t offset = 0;
+        read_file(entry, [&](const std::string& raw) {
+            out.write_at(raw.data(), raw.size(), offset);
+            offset += raw.size();
+        });
+        return offset;
+    }
+
+    // Decodes one file's blocks, checking their checksums, and hands each to sink
+    uint64_t read_file(const ArchiveIndexEntry& entry, const std::function<void(const std::string&)>& sink) {
+        in_.clear();
+        in_.seekg(static_cast<std::streamoff>(entry.offset));
+
+        uint32_t magic = 0;
+        uint64_t pathLen = 0, mode = 0, mtime = 0;
+        if (!read_u32(in_, magic) || magic != ARCHIVE_ENTRY_MAGIC || !read_varint(in_, pathLen)) {
+            throw std::runtime_error("Corrupt archive entry: " + entry.path);
+        }
+        in_.seekg(static_cast<std::streamoff>(pathLen), std::ios::cur);
+        int type = in_.get();
+        if (type != static_cast<int>(EntryType::File) || !read_varint(in_, mode) || !read_varint(in_, mtime)) {
+            throw std::runtime_error("Archive entry is not a file: " + entry.path);
+        }
+
+        std::string raw;
+        uint64_t size = 0;
+        while (decode_archive_block(in_, raw)) {
+            sink(raw);
+            size += raw.size();
+        }
+        return size;
+    }
+
+private:
+    fs::path path_;
+    std::ifstream in_;
+    // The index by path, kept as columns next to a PathTree
+    PathTree paths_;
+    std::vector<uint64_t> offsets_;
+    std::vector<uint64_t> rawSizes_;
+};
+
+// Function to serialize chunk store updates between backups and background snapshot removal
+// Timed, so a replication receiver can give up instead of stalling its client.
+std::timed_mutex& chunk_store_mutex() {
+    static std::timed_mutex mutex;
+    return mutex;
+}
+
+// Outcome of the last --verify of a snapshot, kept in the catalog (older versions stored it in
+// the snapshot as VERIFY_FILE_NAME)
+constexpr const char* VERIFY_FILE_NAME = ".flameup_verified";
+constexpr uint32_t VERIFY_MAGIC = 0x46564C46; // "FLVF"
+
+struct VerifyRecord {
+    int64_t time = 0;          // seconds since the Unix epoch
+    bool sample = false;       // only a random sample of the files was checked
+    uint64_t entriesChecked = 0;
+    uint64_t entriesFailed = 0;
+    uint64_t bytesChecked = 0;
+    uint64_t entriesUnverifiable = 0; // read back fine, but no content hash was recorded to check against
+
+    // Function to tell whether every checked entry was proven intact
+    bool clean() const { return entriesFailed == 0 && entriesUnverifiable == 0; }
+};
+
+// Function to read the verification record an older version left in a snapshot
+std::optional<VerifyRecord> read_verify_record(const fs::path& backupPath) {
+    std::ifstream in(backupPath / VERIFY_FILE_NAME, std::ios::binary);
+    uint32_t magic = 0;
+    uint64_t time = 0;
+    VerifyRecord record;
+    int sample = 0;
+    if (!in.is_open() || !read_u32(in, magic) || magic != VERIFY_MAGIC || !read_u64(in, time) ||
+        (sample = in.get()) == EOF || !read_varint(in, record.entriesChecked) ||
+        !read_varint(in, record.entriesFailed) || !read_varint(in, record.bytesChecked)) {
+        return std::nullopt;
+    }
+    record.time = static_cast<int64_t>(time);
+    record.sample = sample != 0;
+    return record;
+}
+
+// Function to remove a snapshot using its manifest instead of walking the directory tree
+// backupRoot holds the chunk store, which differs from the parent once a snapshot is in the trash.
+void remove_snapshot(const fs::path& backupPath, const fs::path& backupRoot) {
+    ManifestReader reader;
+    if (reader.open(backupPath / MANIFEST_FILE_NAME)) {
+        std::vector<fs::path> directories;
+        ManifestEntry entry;
+        std::error_code ec;
+
+        // Chunked snapshots only hold an index; drop their chunk references instead
+        std::unique_lock<std::timed_mutex> storeLock(chunk_store_mutex(), std::defer_lock);
+        std::optional<ChunkStore> store;
+        ChunkIndexReader index;
+        if (reader.header().format == SnapshotFormat::Chunked) {
+            storeLock.lock();
+            store.emplace(backupRoot);
+            if (!index.open(backupPath)) {
+                throw std::runtime_error("Missing chunk index in " + backupPath.string());
+            }
+        }
+
+        std::vector<ChunkRef> refs;
+        bool archive = reader.header().format == SnapshotFormat::Archive;
+        while (!archive && reader.next(entry)) {
+            fs::path entryPath = backupPath / from_manifest_path(entry.path);
+            if (store) {
+                if (entry.type == EntryType::File) {
+                    index.next(refs);
+                    store->release(refs);
+                }
+                continue;
+            }
+            if (entry.type == EntryType::Directory) {
+                directories.push_back(entryPath);
+            } else {
+                fs::remove(entryPath, ec);
+            }
+        }
+
+        // Children are listed after their parent, so remove directories in reverse
+        for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+            fs::remove(*it, ec);
+        }
+        fs::remove(backupPath / CHUNK_INDEX_FILE_NAME, ec);
+        fs::remove_all(backupPath / PACK_DIR_NAME, ec);
+        fs::remove(backupPath / PACK_INDEX_FILE_NAME, ec);
+        fs::remove(backupPath / ARCHIVE_FILE_NAME, ec);
+        fs::remove(backupPath / VERIFY_FILE_NAME, ec);
+        fs::remove(backupPath / MANIFEST_FILE_NAME, ec);
+
+        bool removed = fs::remove(backupPath, ec);
+        // Only drop chunks once the snapshot referring to them is gone
+        if (store) {
+            if (!removed) {
+                fs::remove_all(backupPath);
+            }
+            store->commit();
+            return;
+        }
+        if (removed) {
+            return;
+        }
+    }
+
+    // No manifest (or leftovers not listed in it): fall back to a full removal
+    fs::remove_all(backupPath);
+}
+
+// Expired snapshots are renamed into this directory under the backup root and deleted in the background
+constexpr const char* TRASH_DIR_NAME = ".flameup_trash";
+
+// Function to move the calling thread to idle CPU and I/O priority so it only uses spare capacity
+void lower_thread_priority() {
+#ifdef _WIN32
+    // Background mode lowers both scheduling and I/O priority
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+    constexpr int ioprioWhoProcess = 1;  // IOPRIO_WHO_PROCESS
+    constexpr int ioprioClassIdle = 3;   // IOPRIO_CLASS_IDLE
+    constexpr int ioprioClassShift = 13; // IOPRIO_CLASS_SHIFT
+    // Both calls act on the calling thread only when given its thread id (or 0)
+    ::syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassIdle << ioprioClassShift);
+    ::setpriority(PRIO_PROCESS, static_cast<id_t>(::syscall(SYS_gettid)), 19);
+#endif
+}
+
+// Function to move the whole process to idle priority; call before starting threads
+void lower_process_priority() {
+#ifdef _WIN32
+    SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#else
+    // Linux threads inherit CPU and I/O priority from the thread that creates them
+    lower_thread_priority();
+#endif
+}
+
+// Function to move a snapshot into the trash with a single rename; returns false if that is not possible
+bool move_to_trash(const fs::path& backupPath) {
+    std::error_code ec;
+    fs::path trashDir = backupPath.parent_path() / TRASH_DIR_NAME;
+    fs::create_directories(trashDir, ec);
+
+    fs::path target = trashDir / backupPath.filename();
+    for (int suffix = 1; fs::exists(target, ec); suffix++) {
+        target = trashDir / (backupPath.filename().string() + "." + std::to_string(suffix));
+    }
+
+    fs::rename(backupPath, target, ec);
+    return !ec;
+}
+
+// Deletes trashed snapshots on a low-priority background thread
+class TrashCollector {
+public:
+    explicit TrashCollector(const fs::path& backupRoot, bool verbose)
+        : backupRoot_(backupRoot), verbose_(verbose), thread_([this] { run(); }) {}
+
+    TrashCollector(const TrashCollector&) = delete;
+    TrashCollector& operator=(const TrashCollector&) = delete;
+
+    // Finishes deleting whatever is in the trash before returning
+    ~TrashCollector() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            wake_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    // Called after snapshots were moved into the trash
+    void wake() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_ = true;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    void run() {
+        lower_thread_priority();
+
+        // Leftovers from an earlier run are drained right away
+        while (true) {
+            drain();
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!wake_ && stopping_) {
+                return;
+            }
+            cv_.wait(lock, [&] { return wake_; });
+            wake_ = false;
+        }
+    }
+
+    void drain() {
+        fs::path trashDir = backupRoot_ / TRASH_DIR_NAME;
+        std::error_code ec;
+        if (!fs::is_directory(trashDir, ec)) {
+            return;
+        }
+
+        std::vector<fs::path> trashed;
+        for (const auto& entry : fs::directory_iterator(trashDir, ec)) {
+            trashed.push_back(entry.path());
+        }
+
+        for (const auto& path : trashed) {
+            try {
+                remove_snapshot(path, backupRoot_);
+                if (verbose_) {
+                    std::cout << "Removed expired backup: " << path.filename() << "\n";
+                }
+            } catch (const std::exception& e) {
+                // Left in the trash and retried on the next wake-up
+                std::cerr << "Warning: Failed to remove " << path << ": " << e.what() << "\n";
+            }
+        }
+    }
+
+    fs::path backupRoot_;
+    bool verbose_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool wake_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+
+
+// Which in-kernel copy paths work between a pair of filesystems; a path is disabled on its first
+// "not supported" error so later files go straight to the next fastest method
+struct KernelCopySupport {
+    std::atomic<bool> reflink{true};
+    std::atomic<bool> copyRange{true};
+    std::atomic<bool> sendfile{true};
+};
+
+// Copies file data without moving it through userspace: reflinks (FICLONE) on btrfs/XFS,
+// copy_file_range/sendfile elsewhere on Linux, CopyFile2 and ReFS block cloning on Windows.
+// Every method returns nullopt when it cannot be used so the caller falls back to a userspace copy.
+class KernelCopier {
+public:
+    // Copy a whole file, returning the number of bytes copied
+    std::optional<uint64_t> copy_file(const fs::path& source, const fs::path& target, uint64_t sizeHint,
+                                      IoThrottle* throttle) {
+#ifdef _WIN32
+        COPYFILE2_EXTENDED_PARAMETERS params{};
+        params.dwSize = sizeof(params);
+        // Unbuffered I/O keeps large files from evicting the page cache
+        params.dwCopyFlags = sizeHint >= LARGE_FILE_THRESHOLD ? COPY_FILE_NO_BUFFERING : 0;
+        ThrottleProgress progress{throttle, std::chrono::steady_clock::now(), 0};
+        if (throttle) {
+            params.pProgressRoutine = &KernelCopier::throttle_progress;
+            params.pvCallbackContext = &progress;
+        }
+        if (FAILED(CopyFile2(source.c_str(), target.c_str(), &params))) {
+            return std::nullopt;
+        }
+        std::error_code ec;
+        uint64_t size = fs::file_size(target, ec);
+        return ec ? sizeHint : size;
+#else
+        (void)sizeHint;
+        NativeFile in = NativeFile::open_read(source);
+        NativeFile out = NativeFile::open_write(target, true);
+        return copy_range(in, out, 0, UINT64_MAX, true, throttle);
+#endif
+    }
+
+    // Copy one chunk of a pre-sized large file at the same offset in both files
+    std::optional<uint64_t> copy_chunk(NativeFile& in, NativeFile& out, uint64_t offset, uint64_t length,
+                                       IoThrottle* throttle) {
+#ifdef _WIN32
+        // Block cloning shares extents without transferring data, so there is nothing to throttle
+        (void)throttle;
+        return clone_extents(in, out, offset, length);
+#else
+        return copy_range(in, out, offset, length, false, throttle);
+#endif
+    }
+
+    // Reflink a whole file so both names share extents; false when the filesystem cannot
+    bool clone_file(const fs::path& source, const fs::path& target) {
+#ifdef __linux__
+        struct stat inStat, dirStat;
+        if (::stat(source.c_str(), &inStat) != 0 || ::stat(target.parent_path().c_str(), &dirStat) != 0) {
+            return false;
+        }
+        KernelCopySupport& support = support_for(static_cast<uint64_t>(inStat.st_dev),
+                                                 static_cast<uint64_t>(dirStat.st_dev));
+        if (!support.reflink) {
+            return false;
+        }
+
+        NativeFile in = NativeFile::open_read(source);
+        NativeFile out = NativeFile::open_write(target, true);
+        if (::ioctl(out.native_handle(), FICLONE, in.native_handle()) == 0) {
+            return true;
+        }
+        if (is_unsupported(errno)) {
+            support.reflink = false;
+        }
+        out.close();
+        std::error_code ec;
+        fs::remove(target, ec);
+        return false;
+#else
+        (void)source;
+        (void)target;
+        return false;
+#endif
+    }
+
+    // Reflink one chunk of a pre-sized large file at the same offset; false when the filesystem cannot
+    bool clone_chunk(NativeFile& in, NativeFile& out, uint64_t offset, uint64_t length) {
+#ifdef _WIN32
+        return clone_extents(in, out, offset, length).has_value();
+#elif defined(__linux__)
+        struct stat inStat, outStat;
+        if (::fstat(in.native_handle(), &inStat) != 0 || ::fstat(out.native_handle(), &outStat) != 0) {
+            return false;
+        }
+        KernelCopySupport& support = support_for(static_cast<uint64_t>(inStat.st_dev),
+                                                 static_cast<uint64_t>(outStat.st_dev));
+        if (!support.reflink) {
+            return false;
+        }
+        struct file_clone_range range{};
+        range.src_fd = in.native_handle();
+        range.src_offset = offset;
+        range.src_length = length;
+        range.dest_offset = offset;
+        if (::ioctl(out.native_handle(), FICLONERANGE, &range) == 0) {
+            return true;
+        }
+        if (is_unsupported(errno) && errno != EINVAL) {
+            support.reflink = false;
+        }
+        return false;
+#else
+        (void)in;
+        (void)out;
+        (void)offset;
+        (void)length;
+        return false;
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    struct ThrottleProgress {
+        IoThrottle* throttle;
+        std::chrono::steady_clock::time_point chunkStart;
+        uint64_t transferred;
+    };
+
+    // CopyFile2 reports every finished chunk; sleeping here paces the copy
+    static COPYFILE2_MESSAGE_ACTION CALLBACK throttle_progress(const COPYFILE2_MESSAGE* message, PVOID context) {
+        auto* progress = static_cast<ThrottleProgress*>(context);
+        if (message->Type == COPYFILE2_CALLBACK_CHUNK_FINISHED) {
+            uint64_t total = message->Info.ChunkFinished.uliTotalBytesTransferred.QuadPart;
+            auto now = std::chrono::steady_clock::now();
+            progress->throttle->read_latency(now - progress->chunkStart);
+            progress->throttle->bytes_transferred(total - progress->transferred);
+            progress->transferred = total;
+            progress->chunkStart = std::chrono::steady_clock::now();
+        }
+        return COPYFILE2_PROGRESS_CONTINUE;
+    }
+
+    std::optional<uint64_t> clone_extents(NativeFile& in, NativeFile& out, uint64_t offset, uint64_t length) {
+        DWORD serial = 0;
+        DWORD flags = 0;
+        if (!GetVolumeInformationByHandleW(out.native_handle(), nullptr, 0, &serial, nullptr, &flags, nullptr, 0) ||
+            !(flags & FILE_SUPPORTS_BLOCK_REFCOUNTING)) {
+            return std::nullopt;
+        }
+
+        KernelCopySupport& support = support_for(serial, serial);
+        if (!support.reflink) {
+            return std::nullopt;
+        }
+
+        // Cloned ranges must be cluster aligned; chunk offsets already are, round the length up
+        constexpr uint64_t cloneAlignment = 64 * 1024;
+        DUPLICATE_EXTENTS_DATA data{};
+        data.FileHandle = in.native_handle();
+        data.SourceFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        data.TargetFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+        data.ByteCount.QuadPart = static_cast<LONGLONG>((length + cloneAlignment - 1) / cloneAlignment * cloneAlignment);
+
+        DWORD returned = 0;
+        if (!DeviceIoControl(out.native_handle(), FSCTL_DUPLICATE_EXTENTS_TO_FILE, &data, sizeof(data),
+                             nullptr, 0, &returned, nullptr)) {
+            if (GetLastError() == ERROR_NOT_SUPPORTED || GetLastError() == ERROR_INVALID_FUNCTION) {
+                support.reflink = false;
+            }
+            return std::nullopt;
+        }
+        return length;
+    }
+#elif defined(__linux__)
+    static bool is_unsupported(int err) {
+        return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == ENOSYS || err == EINVAL;
+    }
+
+    // Copies in THROTTLED_COPY_PIECE steps when throttled so each step can be paced and timed
+    std::optional<uint64_t> copy_range(NativeFile& in, NativeFile& out, uint64_t offset, uint64_t length,
+                                       bool wholeFile, IoThrottle* throttle) {
+        const uint64_t piece = throttle ? THROTTLED_COPY_PIECE : 1ULL << 30;
+        int inFd = in.native_handle();
+        int outFd = out.native_handle();
+
+        struct stat inStat, outStat;
+        if (::fstat(inFd, &inStat) != 0 || ::fstat(outFd, &outStat) != 0) {
+            return std::nullopt;
+        }
+        KernelCopySupport& support = support_for(static_cast<uint64_t>(inStat.st_dev),
+                                                 static_cast<uint64_t>(outStat.st_dev));
+
+        // Reflink: shares extents, no data is copied at all
+        if (support.reflink) {
+            int rc;
+            if (wholeFile) {
+                rc = ::ioctl(outFd, FICLONE, inFd);
+            } else {
+                struct file_clone_range range{};
+                range.src_fd = inFd;
+                range.src_offset = offset;
+                range.src_length = length;
+                range.dest_offset = offset;
+                rc = ::ioctl(outFd, FICLONERANGE, &range);
+            }
+            if (rc == 0) {
+                return wholeFile ? static_cast<uint64_t>(inStat.st_size) : length;
+            }
+            // Unaligned ranges also fail with EINVAL; only give up on reflinks for whole files
+            if (is_unsupported(errno) && (wholeFile || errno != EINVAL)) {
+                support.reflink = false;
+            }
+        }
+
+        if (support.copyRange) {
+            off_t inOffset = static_cast<off_t>(offset);
+            off_t outOffset = static_cast<off_t>(offset);
+            uint64_t done = 0;
+            bool supported = true;
+
+            while (done < length) {
+                size_t want = static_cast<size_t>(std::min<uint64_t>(length - done, piece));
+                auto start = std::chrono::steady_clock::now();
+                ssize_t n = ::copy_file_range(inFd, &inOffset, outFd, &outOffset, want, 0);
+                if (n > 0) {
+                    done += static_cast<uint64_t>(n);
+                    if (throttle) {
+                        throttle->read_latency(std::chrono::steady_clock::now() - start);
+                        throttle->bytes_transferred(static_cast<uint64_t>(n));
+                    }
+                } else if (n == 0) {
+                    break; // end of file
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (done == 0 && is_unsupported(errno)) {
+                    support.copyRange = false;
+                    supported = false;
+                    break;
+                } else {
+                    throw std::runtime_error(std::string("copy_file_range failed: ") + std::strerror(errno));
+                }
+            }
+            if (supported) {
+                return done;
+            }
+        }
+
+        if (support.sendfile) {
+            if (::lseek(outFd, static_cast<off_t>(offset), SEEK_SET) < 0) {
+                return std::nullopt;
+            }
+            off_t inOffset = static_cast<off_t>(offset);
+            uint64_t done = 0;
+
+            while (done < length) {
+                size_t want = static_cast<size_t>(std::min<uint64_t>(length - done, piece));
+                auto start = std::chrono::steady_clock::now();
+                ssize_t n = ::sendfile(outFd, inFd, &inOffset, want);
+                if (n > 0) {
+                    done += static_cast<uint64_t>(n);
+                    if (throttle) {
+                        throttle->read_latency(std::chrono::steady_clock::now() - start);
+                        throttle->bytes_transferred(static_cast<uint64_t>(n));
+                    }
+                } else if (n == 0) {
+                    break;
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (done == 0 && is_unsupported(errno)) {
+                    support.sendfile = false;
+                    return std::nullopt;
+                } else {
+                    throw std::runtime_error(std::string("sendfile failed: ") + std::strerror(errno));
+                }
+            }
+            return done;
+        }
+
+        return std::nullopt;
+    }
+#else
+    std::optional<uint64_t> copy_range(NativeFile&, NativeFile&, uint64_t, uint64_t, bool, IoThrottle*) {
+        return std::nullopt;
+    }
+#endif
+
+    KernelCopySupport& support_for(uint64_t sourceDevice, uint64_t targetDevice) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& slot = support_[{sourceDevice, targetDevice}];
+        if (!slot) {
+            slot = std::make_unique<KernelCopySupport>();
+        }
+        return *slot;
+    }
+
+    std::mutex mutex_;
+    std::map<std::pair<uint64_t, uint64_t>, std::unique_ptr<KernelCopySupport>> support_;
+};
+
+// Shared state for a large file that is copied as several chunks by different workers
+struct LargeFileCopy {
+    fs::path target;
+    std::atomic<bool> allHashed{true};
+    int64_t mtimeNs = 0;
+    uint32_t mode = 0;
+    ManifestEntry* entry = nullptr;
+    std::vector<uint64_t> segmentHashes;
+    std::atomic<size_t> chunksLeft{0};
+};
+
+// Appends small files to packs of about PACK_TARGET_SIZE in a snapshot's pack directory, with
+// writes buffered so packing a file costs no write of its own. Not thread-safe: every copy worker
+// packs into a writer of its own.
+class PackWriter {
+public:
+    explicit PackWriter(const fs::path& dir) : dir_(dir), random_(std::random_device{}()) {}
+
+    PackRef append(const char* data, size_t size) {
+        if (!file_.is_open() || size_ + buffer_.size() >= PACK_TARGET_SIZE) {
+            roll();
+        }
+        PackRef ref{pack_, size_ + buffer_.size()};
+        buffer_.append(data, size);
+        if (buffer_.size() >= PACK_WRITE_BUFFER) {
+            flush();
+        }
+        return ref;
+    }
+
+    // Function to write out and close the open pack
+    void close() {
+        if (!file_.is_open()) return;
+        flush();
+        file_.close();
+        written_.emplace_back(pack_, size_);
+    }
+
+    // Closed packs as pack id and size
+    const std::vector<std::pair<uint64_t, uint64_t>>& written() const { return written_; }
+
+private:
+    void roll() {
+        close();
+        // Packs carried over from older snapshots share the directory, so names are never reused
+        do {
+            pack_ = random_();
+        } while (pack_ == 0 || fs::exists(dir_ / pack_file_name(pack_)));
+        file_ = NativeFile::open_write(dir_ / pack_file_name(pack_), true);
+        size_ = 0;
+    }
+
+    void flush() {
+        file_.write_at(buffer_.data(), buffer_.size(), size_);
+        size_ += buffer_.size();
+        buffer_.clear();
+    }
+
+    fs::path dir_;
+    std::mt19937_64 random_;
+    NativeFile file_;
+    uint64_t pack_ = 0;
+    uint64_t size_ = 0;
+    std::string buffer_;
+    std::vector<std::pair<uint64_t, uint64_t>> written_;
+};
+
+struct CopyTask {
+    enum class Kind { Copy, Link, Chunk, Store, Rebuild, Checkout, Pack, Unpack };
+
+    Kind kind = Kind::Copy;
+    fs::path source;
+    fs::path target;
+    fs::path linkSource;         // Link: existing file to hardlink from
+    bool verifyHash = false;     // Link: only link if the source still hashes to entry->hash
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    uint32_t mode = 0;
+    ManifestEntry* entry = nullptr;  // receives hash and final size when set
+    std::shared_ptr<LargeFileCopy> largeFile;
+    size_t chunkIndex = 0;
+    std::vector<ChunkRef>* chunksOut = nullptr;  // Store: receives the file's chunk list
+    std::vector<ChunkRef> chunks;                // Rebuild: chunks to reassemble into target
+    uint64_t packOffset = 0;                     // Unpack: where the file starts in the source pack
+    PackRef* packOut = nullptr;                  // Pack: receives where the file was packed
+    bool finished = false;                       // already done by the async I/O backend
+};
+
+// Function to flush all written data on the filesystem holding path to disk
+// Windows has no unprivileged equivalent, so there this does nothing.
+void sync_filesystem(const fs::path& path) {
+#ifdef __linux__
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || ::syncfs(fd) != 0) {
+        ::sync();
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+#elif !defined(_WIN32)
+    (void)path;
+    ::sync();
+#else
+    (void)path;
+#endif
+}
+
+constexpr const char* CHECKPOINT_FILE_NAME = ".flameup_checkpoint";
+constexpr uint32_t CHECKPOINT_MAGIC = 0x324B4C46; // "FLK2", XXH3 hashes
+constexpr auto CHECKPOINT_INTERVAL = std::chrono::seconds(5);
+
+// Work an interrupted run had finished, keyed by manifest path. Entries only apply while the
+// source file still has the recorded size and mtime.
+struct CheckpointState {
+    struct File {
+        uint64_t size = 0;
+        int64_t mtimeNs = 0;
+        bool hasHash = false;
+        uint64_t hash = 0;
+        const std::vector<ChunkRef>* chunks = nullptr; // chunked snapshots: the file's chunk list
+    };
+    struct LargeFile {
+        uint64_t size = 0;
+        int64_t mtimeNs = 0;
+        std::map<size_t, std::vector<uint64_t>> chunks; // copy chunk -> segment hashes (empty = unhashed)
+    };
+
+    // Finished files as columns indexed by their node in filePaths
+    PathTree filePaths;
+    std::vector<uint64_t> fileSizes;
+    std::vector<int64_t> fileMtimes;
+    std::vector<uint64_t> fileHashes;
+    std::vector<uint8_t> fileFlags;            // 1 = has hash, 2 = has chunks
+    std::vector<std::vector<ChunkRef>> fileChunks; // only grown once a file has chunks
+    // Only files above LARGE_FILE_THRESHOLD are checkpointed by chunk, so these stay few
+    std::unordered_map<std::string, LargeFile> largeFiles;
+
+    void add_file(const std::string& path, const File& file, std::vector<ChunkRef>&& chunks) {
+        uint32_t node = filePaths.insert(path);
+        if (fileSizes.size() < filePaths.size()) {
+            fileSizes.resize(filePaths.size());
+            fileMtimes.resize(filePaths.size());
+            fileHashes.resize(filePaths.size());
+            fileFlags.resize(filePaths.size());
+        }
+        fileSizes[node] = file.size;
+        fileMtimes[node] = file.mtimeNs;
+        fileHashes[node] = file.hash;
+        fileFlags[node] = static_cast<uint8_t>((file.hasHash ? 1 : 0) | (file.chunks ? 2 : 0));
+        if (file.chunks) {
+            if (fileChunks.size() <= node) fileChunks.resize(filePaths.size());
+            fileChunks[node] = std::move(chunks);
+        }
+    }
+
+    std::optional<File> find_file(const std::string& path) const {
+        auto node = filePaths.find(path);
+        if (!node) {
+            return std::nullopt;
+        }
+        File file;
+        file.size = fileSizes[*node];
+        file.mtimeNs = fileMtimes[*node];
+        file.hasHash = fileFlags[*node] & 1;
+        file.hash = fileHashes[*node];
+        file.chunks = fileFlags[*node] & 2 ? &fileChunks[*node] : nullptr;
+        return file;
+    }
+};
+
+// Append-only log of finished files and large-file chunks kept in a snapshot stage
+// Records are buffered and written every CHECKPOINT_INTERVAL, each batch only after syncing the
+// filesystem, so a record on disk never describes data that could still be lost in a crash.
+// A torn last record is simply ignored by load().
+class CheckpointLog {
+public:
+    explicit CheckpointLog(const fs::path& stagePath)
+        : stagePath_(stagePath), path_(stagePath / CHECKPOINT_FILE_NAME),
+          lastFlush_(std::chrono::steady_clock::now()) {
+        // A log from another version is started over; its hashes would not match ours
+        bool fresh = true;
+        {
+            std::ifstream in(path_, std::ios::binary);
+            uint32_t magic = 0;
+            fresh = !in.is_open() || !read_u32(in, magic) || magic != CHECKPOINT_MAGIC;
+        }
+        out_.open(path_, std::ios::binary | (fresh ? std::ios::trunc : std::ios::app));
+        if (!out_.is_open()) {
+            throw std::runtime_error("Cannot create checkpoint: " + path_.string());
+        }
+        if (fresh) {
+            write_u32(out_, CHECKPOINT_MAGIC);
+            out_.flush();
+        }
+    }
+
+    CheckpointLog(const CheckpointLog&) = delete;
+    CheckpointLog& operator=(const CheckpointLog&) = delete;
+
+    // Function to read what earlier runs recorded in a stage directory
+    static CheckpointState load(const fs::path& stagePath) {
+        CheckpointState state;
+        std::ifstream in(stagePath / CHECKPOINT_FILE_NAME, std::ios::binary);
+        uint32_t magic = 0;
+        if (!in.is_open() || !read_u32(in, magic) || magic != CHECKPOINT_MAGIC) {
+            return state;
+        }
+
+        while (true) {
+            char kind = 0;
+            std::string path;
+            uint64_t size = 0;
+            uint64_t mtime = 0;
+            if (!in.get(kind) || !read_string(in, path) || !read_varint(in, size) || !read_u64(in, mtime)) {
+                break;
+            }
+
+            if (kind == 'F') {
+                CheckpointState::File file;
+                file.size = size;
+                file.mtimeNs = static_cast<int64_t>(mtime);
+                char flags = 0;
+                if (!in.get(flags)) break;
+                file.hasHash = flags & 1;
+                std::vector<ChunkRef> chunks;
+                if (file.hasHash && !read_u64(in, file.hash)) break;
+                if ((flags & 2) && !read_chunk_refs(in, chunks)) break;
+                file.chunks = flags & 2 ? &chunks : nullptr;
+                state.add_file(path, file, std::move(chunks));
+            } else if (kind == 'C') {
+                uint64_t chunkIndex = 0;
+                uint64_t count = 0;
+                if (!read_varint(in, chunkIndex) || !read_varint(in, count)) break;
+                std::vector<uint64_t> hashes(static_cast<size_t>(count));
+                bool complete = true;
+                for (auto& hash : hashes) {
+                    complete = complete && read_u64(in, hash);
+                }
+                if (!complete) break;
+
+                CheckpointState::LargeFile& large = state.largeFiles[path];
+                if (large.size != size || large.mtimeNs != static_cast<int64_t>(mtime)) {
+                    large = {};
+                    large.size = size;
+                    large.mtimeNs = static_cast<int64_t>(mtime);
+                }
+                large.chunks[static_cast<size_t>(chunkIndex)] = std::move(hashes);
+            } else {
+                break;
+            }
+        }
+        return state;
+    }
+
+    // Thread-safe; chunks is only set for chunked snapshots
+    void file_done(const std::string& path, uint64_t size, int64_t mtimeNs, bool hasHash, uint64_t hash,
+                   const std::vector<ChunkRef>* chunks) {
+        std::ostringstream record;
+        record.put('F');
+        write_record_header(record, path, size, mtimeNs);
+        record.put(static_cast<char>((hasHash ? 1 : 0) | (chunks ? 2 : 0)));
+        if (hasHash) write_u64(record, hash);
+        if (chunks) write_chunk_refs(record, *chunks);
+        append(record.str());
+    }
+
+    // Thread-safe; segmentHashes is empty when the chunk was copied in-kernel
+    void large_chunk_done(const std::string& path, uint64_t size, int64_t mtimeNs, size_t chunkIndex,
+                          const std::vector<uint64_t>& segmentHashes) {
+        std::ostringstream record;
+        record.put('C');
+        write_record_header(record, path, size, mtimeNs);
+        write_varint(record, chunkIndex);
+        write_varint(record, segmentHashes.size());
+        for (uint64_t hash : segmentHashes) {
+            write_u64(record, hash);
+        }
+        append(record.str());
+    }
+
+    // Function to close the log and delete it once the snapshot is complete
+    void discard() {
+        out_.close();
+        std::error_code ec;
+        fs::remove(path_, ec);
+    }
+
+private:
+    static void write_record_header(std::ostream& out, const std::string& path, uint64_t size, int64_t mtimeNs) {
+        write_string(out, path);
+        write_varint(out, size);
+        write_u64(out, static_cast<uint64_t>(mtimeNs));
+    }
+
+    void append(const std::string& record) {
+        std::string batch;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_ += record;
+            auto now = std::chrono::steady_clock::now();
+            if (flushing_ || now - lastFlush_ < CHECKPOINT_INTERVAL) {
+                return;
+            }
+            flushing_ = true;
+            lastFlush_ = now;
+            batch.swap(pending_);
+        }
+
+        // Only this thread flushes; the others keep buffering meanwhile
+        sync_filesystem(stagePath_);
+        out_.write(batch.data(), static_cast<std::streamsize>(batch.size()));
+        out_.flush();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        flushing_ = false;
+    }
+
+    fs::path stagePath_;
+    fs::path path_;
+    std::ofstream out_;
+    std::mutex mutex_;
+    std::string pending_;
+    bool flushing_ = false;
+    std::chrono::steady_clock::time_point lastFlush_;
+};
+
+struct CopyEngineStats {
+    std::atomic<size_t> filesCopied{0};
+    std::atomic<size_t> filesLinked{0};
+    std::atomic<uintmax_t> bytesCopied{0};
+    std::atomic<size_t> filesAsync{0}; // copied or packed through AsyncIo
+};
+
+// Multi-threaded copy engine: the caller walks the tree once and submits per-file work,
+// small files are batched, large files are split into chunks across the worker pool.
+// With needHashes, every copy that fills a manifest entry records its content hash: files are
+// reflinked and hashed from the copy where the filesystem allows, otherwise copied through
+// userspace and hashed on the way. Without it, data is copied in-kernel and left unhashed.
+// With a chunk store attached, files can also be stored into / rebuilt from deduplicated chunks.
+// With --async-io (and no throttle), each worker runs the small copies and packs of a batch
+// through AsyncIo, hashing them on the way since the data passes through userspace anyway.
+class CopyEngine {
+public:
+    CopyEngine(size_t jobs, bool verbose, bool needHashes, ChunkStore* store = nullptr, IoThrottle* throttle = nullptr,
+               CheckpointLog* checkpoint = nullptr, FileHashCache* hashCache = nullptr)
+        : queue_(std::max<size_t>(jobs, 1) * 4), verbose_(verbose), needHashes_(needHashes), store_(store),
+          throttle_(throttle && throttle->enabled() ? throttle : nullptr), checkpoint_(checkpoint),
+          hashCache_(hashCache) {
+        async_ = async_io_enabled() && !throttle_;
+        batchCount_ = async_ ? ASYNC_IO_BATCH_COUNT : SMALL_FILE_BATCH_COUNT;
+        for (size_t i = 0; i < std::max<size_t>(jobs, 1); i++) {
+            workers_.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+
+    CopyEngine(const CopyEngine&) = delete;
+    CopyEngine& operator=(const CopyEngine&) = delete;
+
+    ~CopyEngine() {
+        queue_.close();
+        for (auto& worker : workers_) {
+            if (worker.joinable()) worker.join();
+        }
+    }
+
+    // Queue a full copy of source to target
+    // With resumeFrom, a large file's chunks recorded there are kept from the existing target.
+    void copy(const fs::path& source, const fs::path& target, uint64_t size, int64_t mtimeNs,
+              uint32_t mode, ManifestEntry* entry, const CheckpointState::LargeFile* resumeFrom = nullptr) {
+        if (size >= LARGE_FILE_THRESHOLD) {
+            copy_large(source, target, size, mtimeNs, mode, entry, resumeFrom);
+            return;
+        }
+
+        CopyTask task;
+        task.kind = CopyTask::Kind::Copy;
+        task.source = source;
+        task.target = target;
+        task.size = size;
+        task.mtimeNs = mtimeNs;
+        task.mode = mode;
+        task.entry = entry;
+        add_to_batch(std::move(task));
+    }
+
+    // Queue a hardlink from an existing snapshot file, copying from source if linking fails
+    void link(const fs::path& linkSource, const fs::path& source, const fs::path& target, uint64_t size,
+              int64_t mtimeNs, uint32_t mode, ManifestEntry* entry, bool verifyHash) {
+        CopyTask task;
+        task.kind = CopyTask::Kind::Link;
+        task.linkSource = linkSource;
+        task.source = source;
+        task.target = target;
+        task.size = size;
+        task.mtimeNs = mtimeNs;
+        task.mode = mode;
+        task.entry = entry;
+        task.verifyHash = verifyHash;
+        add_to_batch(std::move(task));
+    }
+
+    // Queue placing a snapshot file at target as a reflink where the filesystem supports it,
+    // otherwise as a regular copy. Restored files never share an inode with the snapshot.
+    void checkout(const fs::path& snapshotFile, const fs::path& target, uint64_t size, int64_t mtimeNs,
+                  uint32_t mode) {
+        CopyTask task;
+        task.kind = CopyTask::Kind::Checkout;
+        task.source = snapshotFile;
+        task.target = target;
+        task.size = size;
+        task.mtimeNs = mtimeNs;
+        task.mode = mode;
+        add_to_batch(std::move(task));
+    }
+
+    // Queue splitting a file into the chunk store
+    void store(const fs::path& source, uint64_t size, ManifestEntry* entry, std::vector<ChunkRef>* chunksOut) {
+        CopyTask task;
+        task.kind = CopyTask::Kind::Store;
+        task.source = source;
+        task.size = size;
+        task.entry = entry;
+        task.chunksOut = chunksOut;
+        add_to_batch(std::move(task));
+    }
+
+    // Queue reassembling a file from the chunk store
+    void rebuild(std::vector<ChunkRef> chunks, const fs::path& target, uint64_t size, int64_t mtimeNs,
+                 uint32_t mode) {
+        CopyTask task;
+        task.kind = CopyTask::Kind::Rebuild;
+        task.source = target;
+        task.target = target;
+        task.size = size;
+        task.mtimeNs = mtimeNs;
+        task.mode = mode;
+        task.chunks = std::move(chunks);
+        add_to_batch(std::move(task));
+    }
+
+    // Pack small files into packDir from now on, each worker into packs of its own
+    void pack_into(const fs::path& packDir) {
+        for (size_t i = 0; i < workers_.size(); i++) {
+            packWriters_.push_back(std::make_unique<PackWriter>(packDir));
+        }
+    }
+
+    // Queue appending a file to a pack; needs pack_into()
+    void pack(const fs::path& source, uint64_t size, ManifestEntry* entry, PackRef* packOut) {
+        CopyTask task;
+        task.kind = CopyTask::Kind::Pack;
+        task.source = source;
+        task.size = size;
+        task.entry = entry;
+        task.packOut = packOut;
+        add_to_batch(std::move(task));
+    }
+
+    // Queue extracting a packed file of size bytes at offset in packFile to target
+    void unpack(const fs::path& packFile, uint64_t offset, const fs::path& target, uint64_t size, int64_t mtimeNs,
+                uint32_t mode) {
+        CopyTask task;
+        task.kind = CopyTask::Kind::Unpack;
+        task.source = packFile;
+        task.packOffset = offset;
+        task.target = target;
+        task.size = size;
+        task.mtimeNs = mtimeNs;
+        task.mode = mode;
+        add_to_batch(std::move(task));
+    }
+
+    // Packs written, as pack id and size; complete once finish() has returned
+    std::vector<std::pair<uint64_t, uint64_t>> packs_written() const {
+        std::vector<std::pair<uint64_t, uint64_t>> packs;
+        for (const auto& writer : packWriters_) {
+            packs.insert(packs.end(), writer->written().begin(), writer->written().end());
+        }
+        return packs;
+    }
+
+    // Wait until everything queued so far is done, keeping the workers running
+    void drain() {
+        flush_batch();
+        std::unique_lock<std::mutex> lock(mutex_);
+        drained_.wait(lock, [this] { return batchesDone_ == batchesQueued_; });
+    }
+
+    // Wait for all queued work; rethrows the first worker error
+    void finish() {
+        flush_batch();
+        queue_.close();
+        for (auto& worker : workers_) {
+            if (worker.joinable()) worker.join();
+        }
+        if (failed_) {
+            throw std::runtime_error(firstError_);
+        }
+    }
+
+    const CopyEngineStats& stats() const { return stats_; }
+
+private:
+    void copy_large(const fs::path& source, const fs::path& target, uint64_t size, int64_t mtimeNs,
+                    uint32_t mode, ManifestEntry* entry, const CheckpointState::LargeFile* resumeFrom) {
+        auto large = std::make_shared<LargeFileCopy>();
+        large->target = target;
+        large->mtimeNs = mtimeNs;
+        large->mode = mode;
+        large->entry = entry;
+        large->segmentHashes.resize(static_cast<size_t>((size + FILE_HASH_SEGMENT_SIZE - 1) / FILE_HASH_SEGMENT_SIZE));
+
+        size_t chunks = static_cast<size_t>((size + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE);
+
+        // Chunks finished by an interrupted run are already in the target; take their hashes
+        std::vector<bool> done(chunks, false);
+        if (resumeFrom) {
+            for (const auto& [index, hashes] : resumeFrom->chunks) {
+                if (index >= chunks) continue;
+                done[index] = true;
+                if (hashes.empty()) {
+                    large->allHashed = false;
+                }
+                size_t firstSegment = index * static_cast<size_t>(COPY_CHUNK_SIZE / FILE_HASH_SEGMENT_SIZE);
+                for (size_t i = 0; i < hashes.size() && firstSegment + i < large->segmentHashes.size(); i++) {
+                    large->segmentHashes[firstSegment + i] = hashes[i];
+                }
+            }
+        }
+        size_t chunksLeft = static_cast<size_t>(std::count(done.begin(), done.end(), false));
+        large->chunksLeft = chunksLeft;
+
+        // Pre-size the target so chunks can be written independently
+        NativeFile out = NativeFile::open_write(target, !resumeFrom);
+        out.resize(size);
+        out.close();
+
+        if (chunksLeft == 0) {
+            complete_large(*large);
+            return;
+        }
+
+        for (size_t i = 0; i < chunks; i++) {
+            if (done[i]) continue;
+            CopyTask task;
+            task.kind = CopyTask::Kind::Chunk;
+            task.source = source;
+            task.target = target;
+            task.size = size;
+            task.largeFile = large;
+            task.chunkIndex = i;
+            push(std::vector<CopyTask>{std::move(task)});
+        }
+    }
+
+    void push(std::vector<CopyTask> batch) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batchesQueued_++;
+        }
+        queue_.push(std::move(batch));
+    }
+
+    void add_to_batch(CopyTask task) {
+        batchBytes_ += task.size;
+        batch_.push_back(std::move(task));
+        if (batch_.size() >= batchCount_ || batchBytes_ >= SMALL_FILE_BATCH_BYTES) {
+            flush_batch();
+        }
+    }
+
+    void flush_batch() {
+        if (batch_.empty()) return;
+        push(std::move(batch_));
+        batch_ = {};
+        batchBytes_ = 0;
+    }
+
+    void worker_loop(size_t worker) {
+        std::unique_ptr<AsyncIo> io = async_ ? AsyncIo::create() : nullptr;
+        while (auto batch = queue_.pop()) {
+            if (io && !failed_) {
+                try {
+                    run_batch_async(*batch, worker, *io);
+                } catch (const std::exception& e) {
+                    // Whatever it did not finish still goes through run_task
+                    if (verbose_) {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        std::cout << "Async I/O failed (" << e.what() << "), continuing with blocking I/O\n";
+                    }
+                }
+            }
+            for (auto& task : *batch) {
+                if (failed_) break;
+                if (task.finished) continue;
+                try {
+                    run_task(task, worker);
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (!failed_) {
+                        firstError_ = task.source.string() + ": " + e.what();
+                        failed_ = true;
+                    }
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                batchesDone_++;
+            }
+            drained_.notify_all();
+        }
+
+        if (worker < packWriters_.size()) {
+            try {
+                packWriters_[worker]->close();
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!failed_) {
+                    firstError_ = std::string("Writing pack: ") + e.what();
+                    failed_ = true;
+                }
+            }
+        }
+    }
+
+    void run_task(CopyTask& task, size_t worker) {
+        if (task.kind == CopyTask::Kind::Chunk) {
+            run_chunk(task);
+            return;
+        }
+
+        if (throttle_) {
+            throttle_->file_started();
+        }
+
+        if (task.kind == CopyTask::Kind::Pack) {
+            run_pack(task, *packWriters_[worker]);
+            return;
+        }
+
+        if (task.kind == CopyTask::Kind::Unpack) {
+            NativeFile out = NativeFile::open_write(task.target, true);
+            uint64_t written = 0;
+            read_pack_range(task.source, task.packOffset, task.size, [&](const char* data, size_t size) {
+                out.write_at(data, size, written);
+                written += size;
+            });
+            out.close();
+            finalize_copied_file(task.target, task.mtimeNs, task.mode);
+            stats_.filesCopied++;
+            stats_.bytesCopied += written;
+            return;
+        }
+
+        if (task.kind == CopyTask::Kind::Store) {
+            uint64_t size = 0;
+            *task.chunksOut = store_->store_file(task.source, task.entry->hash, size, throttle_, hashCache_);
+            task.entry->hasHash = true;
+            task.entry->size = size;
+            if (checkpoint_) {
+                checkpoint_->file_done(task.entry->path, size, task.entry->mtimeNs, true, task.entry->hash,
+                                       task.chunksOut);
+            }
+            stats_.filesCopied++;
+            stats_.bytesCopied += size;
+            return;
+        }
+
+        if (task.kind == CopyTask::Kind::Rebuild) {
+            uint64_t size = restore_file_from_chunks(*store_, task.chunks, task.target);
+            finalize_copied_file(task.target, task.mtimeNs, task.mode);
+            stats_.filesCopied++;
+            stats_.bytesCopied += size;
+            return;
+        }
+
+        // Never a hardlink: writing to the restored file would change the backup itself
+        if (task.kind == CopyTask::Kind::Checkout && kernel_.clone_file(task.source, task.target)) {
+            finalize_copied_file(task.target, task.mtimeNs, task.mode);
+            stats_.filesLinked++;
+            return;
+        }
+
+        if (task.kind == CopyTask::Kind::Link) {
+            bool canLink = true;
+            if (task.verifyHash && task.entry) {
+                uint64_t current = hash_file(task.source, throttle_, hashCache_);
+                uint64_t expected = task.entry->hasHash ? task.entry->hash : hash_file(task.linkSource, throttle_);
+                canLink = current == expected;
+                if (canLink) {
+                    task.entry->hash = current;
+                    task.entry->hasHash = true;
+                }
+            }
+            if (canLink) {
+                std::error_code ec;
+                fs::create_hard_link(task.linkSource, task.target, ec);
+                if (!ec) {
+                    stats_.filesLinked++;
+                    return;
+                }
+                // Fall back to a real copy (e.g. link count limit or filesystem without hardlinks)
+                if (verbose_) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    std::cout << "Hardlink failed for " << display_path(task.target, task.entry) << " (" << ec.message() << "), copying\n";
+                }
+            }
+        }
+
+        bool hashed = needHashes_ && task.entry;
+        std::optional<uint64_t> kernelCopied;
+        if (!hashed) {
+            kernelCopied = kernel_.copy_file(task.source, task.target, task.size, throttle_);
+        }
+
+        uint64_t copied = 0;
+        if (kernelCopied) {
+            copied = *kernelCopied;
+            if (task.entry) {
+                task.entry->hasHash = false;
+            }
+        } else if (hashed && kernel_.clone_file(task.source, task.target)) {
+            // Nothing was copied; read the shared extents once through the snapshot's name
+            NativeFile copy = NativeFile::open_read(task.target);
+            std::vector<uint64_t> segmentHashes;
+            copied = copy_range_hashed(copy, nullptr, 0, UINT64_MAX, segmentHashes, throttle_);
+            task.entry->hash = combine_segment_hashes(segmentHashes);
+            task.entry->hasHash = true;
+        } else {
+            NativeFile in = NativeFile::open_read(task.source);
+            FileIdentity before = hashCache_ ? in.identity() : FileIdentity{};
+            NativeFile out = NativeFile::open_write(task.target, true);
+            std::vector<uint64_t> segmentHashes;
+            copied = copy_range_hashed(in, &out, 0, UINT64_MAX, segmentHashes, throttle_);
+            out.close();
+
+            uint64_t hash = combine_segment_hashes(segmentHashes);
+            if (hashCache_) {
+                hashCache_->insert_if_unchanged(in, before, hash);
+            }
+            if (task.entry) {
+                task.entry->hash = hash;
+                task.entry->hasHash = true;
+            }
+        }
+        copy_done(task, copied);
+    }
+
+    // Files of a snapshot being created are reported by their path in the snapshot, not under
+    // its staging directory, which is renamed once the snapshot is complete
+    static std::string display_path(const fs::path& target, const ManifestEntry* entry) {
+        return entry ? entry->path : target.string();
+    }
+
+    void copy_done(CopyTask& task, uint64_t copied) {
+        finalize_copied_file(task.target, task.mtimeNs, task.mode);
+
+        if (task.entry) {
+            task.entry->size = copied;
+            if (checkpoint_) {
+                checkpoint_->file_done(task.entry->path, copied, task.mtimeNs, task.entry->hasHash,
+                                       task.entry->hash, nullptr);
+            }
+        }
+        stats_.filesCopied++;
+        stats_.bytesCopied += copied;
+
+        if (verbose_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::cout << "  Copied: " << display_path(task.target, task.entry) << "\n";
+        }
+    }
+
+    // Copies and packs the small files of a batch through async I/O: the batch's sources (and
+    // targets) are opened, read, written and closed as one wave of requests each. Other tasks,
+    // and files that fail or change size on the way, are left to run_task, which reports the errors.
+    void run_batch_async(std::vector<CopyTask>& batch, size_t worker, AsyncIo& io) {
+        struct Item {
+            CopyTask* task = nullptr;
+            bool copy = false;
+            size_t data = 0;
+            AsyncIo::File in = 0;
+            AsyncIo::File out = 0;
+            AsyncIo::Op read = AsyncIo::NO_OP;
+            AsyncIo::Op write = AsyncIo::NO_OP;
+            AsyncIo::Op before = AsyncIo::NO_OP;
+            AsyncIo::Op after = AsyncIo::NO_OP;
+            FileIdentity beforeId;
+            FileIdentity afterId;
+        };
+        std::vector<Item> items;
+        size_t bytes = 0;
+        for (auto& task : batch) {
+            bool copy = task.kind == CopyTask::Kind::Copy;
+            if ((copy || task.kind == CopyTask::Kind::Pack) && task.size <= ASYNC_IO_MAX_FILE_SIZE) {
+                Item item;
+                item.task = &task;
+                item.copy = copy;
+                item.data = bytes;
+                items.push_back(item);
+                // One byte more than expected shows whether the file grew since it was listed
+                bytes += static_cast<size_t>(task.size) + 1;
+            }
+        }
+        if (items.empty()) return;
+        thread_local std::vector<char> buffer;
+        buffer.resize(bytes);
+
+        io.reset();
+        for (auto& item : items) {
+            item.in = io.open(item.task->source, false);
+            if (item.copy) {
+                item.out = io.open(item.task->target, true);
+            }
+        }
+        io.run();
+
+        for (auto& item : items) {
+            if (!io.is_open(item.in) || (item.copy && !io.is_open(item.out))) continue;
+            if (hashCache_) {
+                item.before = io.identity(item.in, &item.beforeId);
+                io.chain();
+            }
+            item.read = io.read(item.in, buffer.data() + item.data, static_cast<size_t>(item.task->size) + 1, 0);
+        }
+        io.run();
+
+        for (auto& item : items) {
+            if (item.read == AsyncIo::NO_OP || io.result(item.read) != static_cast<int64_t>(item.task->size)) {
+                item.read = AsyncIo::NO_OP;
+                continue;
+            }
+            if (item.copy) {
+                item.write = io.write(item.out, buffer.data() + item.data, static_cast<size_t>(item.task->size), 0);
+            }
+            if (hashCache_) {
+                item.after = io.identity(item.in, &item.afterId);
+            }
+        }
+        io.run();
+        io.close_all();
+
+        for (auto& item : items) {
+            CopyTask& task = *item.task;
+            if (item.read == AsyncIo::NO_OP ||
+                (item.copy && io.result(item.write) != static_cast<int64_t>(task.size))) {
+                continue;
+            }
+            const char* data = buffer.data() + item.data;
+            size_t size = static_cast<size_t>(task.size);
+            SegmentHasher hasher;
+            hasher.update(data, size);
+            uint64_t hash = hasher.finish();
+            if (hashCache_ && io.result(item.before) == 0 && io.result(item.after) == 0) {
+                hashCache_->insert_if_unchanged(item.beforeId, item.afterId, hash);
+            }
+
+            if (item.copy) {
+                if (task.entry) {
+                    task.entry->hash = hash;
+                    task.entry->hasHash = true;
+                }
+                copy_done(task, size);
+            } else {
+                pack_done(task, *packWriters_[worker], data, size, hash);
+            }
+            task.finished = true;
+            stats_.filesAsync++;
+        }
+    }
+
+    void run_pack(CopyTask& task, PackWriter& writer) {
+        NativeFile in = NativeFile::open_read(task.source);
+        FileIdentity before = hashCache_ ? in.identity() : FileIdentity{};
+
+        // Read to the end, in case the file grew since it was listed
+        thread_local std::vector<char> data;
+        data.resize(static_cast<size_t>(task.size) + 1);
+        size_t size = 0;
+        while (size_t got = throttled_read(in, data.data() + size, data.size() - size, size, throttle_)) {
+            size += got;
+            if (size == data.size()) {
+                data.resize(data.size() * 2);
+            }
+        }
+
+        SegmentHasher hasher;
+        hasher.update(data.data(), size);
+        uint64_t hash = hasher.finish();
+        if (hashCache_) {
+            hashCache_->insert_if_unchanged(in, before, hash);
+        }
+        pack_done(task, writer, data.data(), size, hash);
+    }
+
+    void pack_done(CopyTask& task, PackWriter& writer, const char* data, size_t size, uint64_t hash) {
+        *task.packOut = writer.append(data, size);
+
+        task.entry->hash = hash;
+        task.entry->hasHash = true;
+        task.entry->size = size;
+        stats_.filesCopied++;
+        stats_.bytesCopied += size;
+
+        if (verbose_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::cout << "  Packed: " << task.source << "\n";
+        }
+    }
+
+    void run_chunk(CopyTask& task) {
+        LargeFileCopy& large = *task.largeFile;
+        uint64_t offset = task.chunkIndex * COPY_CHUNK_SIZE;
+        uint64_t length = std::min(COPY_CHUNK_SIZE, task.size - offset);
+
+        NativeFile in = NativeFile::open_read(task.source);
+        NativeFile out = NativeFile::open_write(task.target, false);
+        std::vector<uint64_t> segmentHashes;
+
+        bool hashed = needHashes_ && large.entry;
+        std::optional<uint64_t> kernelCopied;
+        if (!hashed) {
+            kernelCopied = kernel_.copy_chunk(in, out, offset, length, throttle_);
+        }
+
+        uint64_t copied = 0;
+        if (kernelCopied) {
+            copied = *kernelCopied;
+            large.allHashed = false;
+        } else if (hashed && kernel_.clone_chunk(in, out, offset, length)) {
+            NativeFile copy = NativeFile::open_read(task.target);
+            copied = copy_range_hashed(copy, nullptr, offset, length, segmentHashes, throttle_);
+        } else {
+            copied = copy_range_hashed(in, &out, offset, length, segmentHashes, throttle_);
+        }
+        out.close();
+
+        size_t firstSegment = static_cast<size_t>(offset / FILE_HASH_SEGMENT_SIZE);
+        for (size_t i = 0; i < segmentHashes.size() && firstSegment + i < large.segmentHashes.size(); i++) {
+            large.segmentHashes[firstSegment + i] = segmentHashes[i];
+        }
+        stats_.bytesCopied += copied;
+        if (checkpoint_ && large.entry) {
+            checkpoint_->large_chunk_done(large.entry->path, task.size, large.mtimeNs, task.chunkIndex,
+                                          segmentHashes);
+        }
+
+        // The worker finishing the last chunk completes the file
+        if (--large.chunksLeft == 0) {
+            complete_large(large);
+        }
+    }
+
+    void complete_large(LargeFileCopy& large) {
+        finalize_copied_file(large.target, large.mtimeNs, large.mode);
+        if (large.entry) {
+            large.entry->hasHash = large.allHashed;
+            large.entry->hash = large.allHashed ? combine_segment_hashes(large.segmentHashes) : 0;
+            if (checkpoint_) {
+                checkpoint_->file_done(large.entry->path, large.entry->size, large.mtimeNs, large.entry->hasHash,
+                                       large.entry->hash, nullptr);
+            }
+        }
+        stats_.filesCopied++;
+
+        if (verbose_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::cout << "  Copied: " << display_path(large.target, large.entry) << "\n";
+        }
+    }
+
+    BoundedQueue<std::vector<CopyTask>> queue_;
+    std::vector<std::thread> workers_;
+    std::vector<CopyTask> batch_;
+    uint64_t batchBytes_ = 0;
+    bool verbose_;
+    bool needHashes_;
+    ChunkStore* store_;
+    IoThrottle* throttle_;
+    CheckpointLog* checkpoint_;
+    FileHashCache* hashCache_;
+    KernelCopier kernel_;
+    std::vector<std::unique_ptr<PackWriter>> packWriters_; // one per worker once pack_into() was called
+    bool async_ = false;
+    size_t batchCount_ = SMALL_FILE_BATCH_COUNT;
+    CopyEngineStats stats_;
+    std::mutex mutex_;
+    std::condition_variable drained_;
+    uint64_t batchesQueued_ = 0;
+    uint64_t batchesDone_ = 0;
+    std::atomic<bool> failed_{false};
+    std::string firstError_;
+};
+
+// Function to resolve the --jobs setting to a worker count
+size_t resolve_job_count(size_t jobs) {
+    if (jobs > 0) {
+        return jobs;
+    }
+    unsigned int hw = std::thread::hardware_concurrency();
+    return hw > 0 ? hw : 4;
+}
+
+// Function to format a byte count for display (e.g. "1.5 GiB")
+std::string format_bytes(uint64_t bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (value >= 1024.0 && unit + 1 < std::size(units)) {
+        value /= 1024.0;
+        unit++;
+    }
+
+    std::ostringstream out;
+    if (unit == 0) {
+        out << bytes << " B";
+    } else {
+        out << std::fixed << std::setprecision(1) << value << " " << units[unit];
+    }
+    return out.str();
+}
+
+// Function to format a duration in milliseconds for display (e.g. "2m 05s")
+std::string format_duration(uint64_t ms) {
+    std::ostringstream out;
+    if (ms < 1000) {
+        out << ms << "ms";
+    } else if (ms < 60000) {
+        out << std::fixed << std::setprecision(1) << static_cast<double>(ms) / 1000.0 << "s";
+    } else {
+        uint64_t seconds = ms / 1000;
+        out << seconds / 60 << "m " << std::setw(2) << std::setfill('0') << seconds % 60 << "s";
+    }
+    return out.str();
+}
+
+// Suffix of a snapshot that is still being written; it is renamed away once complete
+constexpr const char* PARTIAL_SUFFIX = ".partial";
+constexpr const char* BACKUP_LOCK_FILE_NAME = ".flameup_backup.lock";
+
+// Function to check whether a directory entry is a published snapshot
+bool is_snapshot_dir(const fs::directory_entry& entry) {
+    std::string name = entry.path().filename().string();
+    return entry.is_directory() && name.starts_with("Backup_") && !name.ends_with(PARTIAL_SUFFIX);
+}
+
+// Function to format a Unix time as local "YYYY-MM-DD HH:MM"
+std::string format_local_time(int64_t seconds) {
+    auto time_t = static_cast<std::time_t>(seconds);
+    std::tm tm_buf;
+#ifdef _WIN32
+    if (localtime_s(&tm_buf, &time_t) != 0) {
+        return "?";
+    }
+#else
+    if (localtime_r(&time_t, &tm_buf) == nullptr) {
+        return "?";
+    }
+#endif
+    std::ostringstream oss;
+    oss << std::put_time(&tm_buf, "%Y-%m-%d %H:%M");
+    return oss.str();
+}
+
+// Function to read the local time in a Backup_YYYY-MM-DD_HH-MM-SS name as a Unix time
+std::optional<int64_t> snapshot_name_time(const std::string& name) {
+    std::tm tm_buf{};
+    if (std::sscanf(name.c_str(), "Backup_%4d-%2d-%2d_%2d-%2d-%2d", &tm_buf.tm_year, &tm_buf.tm_mon, &tm_buf.tm_mday,
+                    &tm_buf.tm_hour, &tm_buf.tm_min, &tm_buf.tm_sec) != 6) {
+        return std::nullopt;
+    }
+    tm_buf.tm_year -= 1900;
+    tm_buf.tm_mon -= 1;
+    tm_buf.tm_isdst = -1;
+    std::time_t time = std::mktime(&tm_buf);
+    if (time == static_cast<std::time_t>(-1)) {
+        return std::nullopt;
+    }
+    return static_cast<int64_t>(time);
+}
+
+// Index of the published snapshots in a backup root, kept in the root as CATALOG_FILE_NAME
+constexpr const char* CATALOG_FILE_NAME = ".flameup_catalog";
+constexpr uint32_t CATALOG_MAGIC = 0x47434C46; // "FLCG"
+constexpr uint32_t CATALOG_MAX_RECORD = 1u << 20;
+constexpr uint64_t CATALOG_COMPACT_MIN_RECORDS = 256;
+constexpr const char* CATALOG_LOCK_FILE_NAME = ".flameup_catalog.lock";
+
+struct CatalogEntry {
+    uint64_t id = 0;          // increases with every snapshot added to the root
+    std::string name;
+    int64_t createdNs = 0;    // Unix time the backup started
+    std::string source;       // source directory; empty for replicated snapshots
+    bool hasManifest = false;
+    ManifestHeader header;    // format, counts and sizes when hasManifest
+    std::optional<VerifyRecord> verified;
+};
+
+// Serializes catalog appends and compaction between threads of this process
+std::mutex& catalog_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// Exclusive lock on a lock file in a backup root, shared by every process using the root (a
+// daemon and a --now or --delete run, say): flock / LockFileEx, which also exclude another handle
+// in the same process. Writers of the catalog take CATALOG_LOCK_FILE_NAME, together with
+// catalog_mutex(); backups take BACKUP_LOCK_FILE_NAME from choosing their snapshot name until
+// it is published and retention has run. The lock files are never replaced or deleted.
+class RootFileLock {
+public:
+    // Without wait, gives up at once when another holder has the lock; see held()
+    RootFileLock(const fs::path& backupRoot, const char* fileName, bool wait = true) {
+        fs::path lockPath = backupRoot / fileName;
+#ifdef _WIN32
+        handle_ = CreateFileW(lockPath.c_str(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+        OVERLAPPED overlapped{};
+        DWORD flags = LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+        held_ = handle_ != INVALID_HANDLE_VALUE && LockFileEx(handle_, flags, 0, MAXDWORD, MAXDWORD, &overlapped);
+        bool busy = !held_ && handle_ != INVALID_HANDLE_VALUE && GetLastError() == ERROR_LOCK_VIOLATION;
+#else
+        fd_ = ::open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        int rc = -1;
+        while (fd_ >= 0 && (rc = ::flock(fd_, LOCK_EX | (wait ? 0 : LOCK_NB))) != 0 && errno == EINTR) {
+        }
+        held_ = rc == 0;
+        bool busy = !held_ && fd_ >= 0 && errno == EWOULDBLOCK;
+#endif
+        if (!held_) {
+            close();
+            if (!busy) {
+                throw std::runtime_error("Cannot lock " + lockPath.string());
+            }
+        }
+    }
+
+    RootFileLock(const RootFileLock&) = delete;
+    RootFileLock& operator=(const RootFileLock&) = delete;
+
+    ~RootFileLock() { close(); }
+
+    bool held() const { return held_; }
+
+private:
+    // Closing the handle releases the lock
+    void close() {
+#ifdef _WIN32
+        if (handle_ != INVALID_HANDLE_VALUE) CloseHandle(handle_);
+        handle_ = INVALID_HANDLE_VALUE;
+#else
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+    }
+
+#ifdef _WIN32
+    HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+    int fd_ = -1;
+#endif
+    bool held_ = false;
+};
+
+// Append-only log of snapshots added to and removed from a backup root and their verification
+// results, so listing, retention and deletion never enumerate or sort the root directory.
+// Every record carries its length and an XXH3 checksum and is appended with a single write that
+// is flushed to disk before returning. A crash can at most leave a torn last record, which
+// loading ignores and the next append cuts off. Once most records are obsolete the log is
+// rewritten compactly. A root without a catalog (from an older version, or after the file was
+// deleted) is indexed from its directory once. Writers take the catalog's RootFileLock, and a log that
+// another process compacted meanwhile (a new file) is reloaded whole before appending to it.
+class SnapshotCatalog {
+public:
+    explicit SnapshotCatalog(const fs::path& backupRoot)
+        : root_(backupRoot), path_(backupRoot / CATALOG_FILE_NAME) {
+        if (!read_from(0)) {
+            rebuild();
+        }
+    }
+
+    // Entries by id, oldest first
+    const std::map<uint64_t, CatalogEntry>& entries() const { return entries_; }
+
+    const CatalogEntry* find(const std::string& name) const {
+        auto it = byName_.find(name);
+        return it == byName_.end() ? nullptr : &entries_.at(it->second);
+    }
+
+    const CatalogEntry* latest() const {
+        return entries_.empty() ? nullptr : &entries_.rbegin()->second;
+    }
+
+    // Function to pick a snapshot name not taken yet and reserve it by creating its .partial stage
+    // directory. Backups within the same second get a _2, _3, ... suffix past the newest one's, so
+    // names still sort in the order they were taken. Callers hold the root's backup lock; should
+    // another writer create the stage anyway, the mkdir fails and the next suffix is tried.
+    std::string reserve_name(const std::string& base) const {
+        uint64_t suffix = 1;
+        if (const CatalogEntry* newest = latest()) {
+            if (newest->name == base) {
+                suffix = 2;
+            } else if (newest->name.starts_with(base + "_")) {
+                suffix = std::stoull(newest->name.substr(base.size() + 1)) + 1;
+            }
+        }
+        for (;; suffix++) {
+            std::string name = suffix == 1 ? base : base + "_" + std::to_string(suffix);
+            std::error_code ec;
+            if (byName_.contains(name) || fs::exists(root_ / name, ec)) {
+                continue;
+            }
+            if (fs::create_directory(root_ / (name + PARTIAL_SUFFIX), ec)) {
+                return name;
+            }
+            if (ec) {
+                throw std::runtime_error("Cannot create " + (root_ / (name + PARTIAL_SUFFIX)).string() + ": " +
+                                         ec.message());
+            }
+        }
+    }
+
+    // Function to record a newly published snapshot; assigns its id
+    void add(CatalogEntry entry) {
+        std::lock_guard<std::mutex> lock(catalog_mutex());
+        RootFileLock fileLock(root_, CATALOG_LOCK_FILE_NAME);
+        catch_up();
+        entry.id = nextId_;
+        std::ostringstream record;
+        encode_add(record, entry);
+        append(record.str());
+    }
+
+    void remove(const std::string& name) {
+        std::lock_guard<std::mutex> lock(catalog_mutex());
+        RootFileLock fileLock(root_, CATALOG_LOCK_FILE_NAME);
+        catch_up();
+        if (!byName_.contains(name)) return;
+        std::ostringstream record;
+        record.put('R');
+        write_string(record, name);
+        append(record.str());
+        maybe_compact();
+    }
+
+    // Function to store a verification result and return what stays on record. A failure (or
+    // unverifiable files) stays until a full verify passes, so a later clean sample only updates its time.
+    VerifyRecord record_verify(const std::string& name, VerifyRecord record) {
+        std::lock_guard<std::mutex> lock(catalog_mutex());
+        RootFileLock fileLock(root_, CATALOG_LOCK_FILE_NAME);
+        catch_up();
+        auto it = byName_.find(name);
+        if (it == byName_.end()) {
+            return record;
+        }
+        const auto& previous = entries_.at(it->second).verified;
+        if (record.sample && record.clean() && previous && !previous->clean()) {
+            int64_t time = record.time;
+            record = *previous;
+            record.time = time;
+        }
+        std::ostringstream out;
+        encode_verify(out, name, record);
+        append(out.str());
+        maybe_compact();
+        return record;
+    }
+
+private:
+    static void encode_add(std::ostream& out, const CatalogEntry& entry) {
+        out.put('A');
+        write_varint(out, entry.id);
+        write_string(out, entry.name);
+        write_u64(out, static_cast<uint64_t>(entry.createdNs));
+        write_string(out, entry.source);
+        out.put(entry.hasManifest ? 1 : 0);
+        if (entry.hasManifest) {
+            write_varint(out, entry.header.version);
+            out.put(static_cast<char>(entry.header.format));
+            write_varint(out, entry.header.entryCount);
+            write_varint(out, entry.header.fileCount);
+            write_varint(out, entry.header.totalBytes);
+            write_varint(out, entry.header.storedBytes);
+            write_varint(out, entry.header.durationMs);
+        }
+    }
+
+    static void encode_verify(std::ostream& out, const std::string& name, const VerifyRecord& record) {
+        out.put('V');
+        write_string(out, name);
+        write_u64(out, static_cast<uint64_t>(record.time));
+        out.put(record.sample ? 1 : 0);
+        write_varint(out, record.entriesChecked);
+        write_varint(out, record.entriesFailed);
+        write_varint(out, record.bytesChecked);
+        write_varint(out, record.entriesUnverifiable);
+    }
+
+    // Function to apply one record; false if it does not decode
+    bool apply(const std::string& payload) {
+        std::istringstream in(payload);
+        int kind = in.get();
+        std::string name;
+        if (kind == 'A') {
+            CatalogEntry entry;
+            uint64_t created = 0;
+            int hasManifest = 0;
+            if (!read_varint(in, entry.id) || !read_string(in, entry.name) || !read_u64(in, created) ||
+                !read_string(in, entry.source) || (hasManifest = in.get()) == EOF) {
+                return false;
+            }
+            entry.createdNs = static_cast<int64_t>(created);
+            entry.hasManifest = hasManifest != 0;
+            if (entry.hasManifest) {
+                uint64_t version = 0;
+                int format = 0;
+                if (!read_varint(in, version) || (format = in.get()) == EOF ||
+                    format > static_cast<int>(SnapshotFormat::Archive) || !read_varint(in, entry.header.entryCount) ||
+                    !read_varint(in, entry.header.fileCount) || !read_varint(in, entry.header.totalBytes) ||
+                    !read_varint(in, entry.header.storedBytes) || !read_varint(in, entry.header.durationMs)) {
+                    return false;
+                }
+                entry.header.version = static_cast<uint32_t>(version);
+                entry.header.format = static_cast<SnapshotFormat>(format);
+            }
+            if (auto old = byName_.find(entry.name); old != byName_.end()) {
+                entries_.erase(old->second);
+            }
+            nextId_ = std::max(nextId_, entry.id + 1);
+            byName_[entry.name] = entry.id;
+            entries_[entry.id] = std::move(entry);
+        } else if (kind == 'R') {
+            if (!read_string(in, name)) return false;
+            if (auto it = byName_.find(name); it != byName_.end()) {
+                entries_.erase(it->second);
+                byName_.erase(it);
+            }
+        } else if (kind == 'V') {
+            VerifyRecord record;
+            uint64_t time = 0;
+            int sample = 0;
+            if (!read_string(in, name) || !read_u64(in, time) || (sample = in.get()) == EOF ||
+                !read_varint(in, record.entriesChecked) || !read_varint(in, record.entriesFailed) ||
+                !read_varint(in, record.bytesChecked)) {
+                return false;
+            }
+            // Records written before unverifiable entries were counted end here
+            if (in.peek() != EOF && !read_varint(in, record.entriesUnverifiable)) {
+                return false;
+            }
+            record.time = static_cast<int64_t>(time);
+            record.sample = sample != 0;
+            if (auto it = byName_.find(name); it != byName_.end()) {
+                entries_.at(it->second).verified = record;
+            }
+        } else {
+            return false;
+        }
+        records_++;
+        return true;
+    }
+
+    // Function to read the records from offset on (0 = the whole log). Stops at the first torn
+    // or corrupt record; false when there is no usable catalog at all.
+    bool read_from(uint64_t offset) {
+        FileIdentity identity;
+        if (offset == 0 && !read_file_identity(path_, identity)) {
+            return false;
+        }
+        std::ifstream in(path_, std::ios::binary);
+        if (!in.is_open()) {
+            return false;
+        }
+        if (offset == 0) {
+            loaded_ = identity;
+            uint32_t magic = 0;
+            if (!read_u32(in, magic) || magic != CATALOG_MAGIC) {
+                return false;
+            }
+            offset = 4;
+        } else {
+            in.seekg(static_cast<std::streamoff>(offset));
+        }
+
+        std::string payload;
+        while (true) {
+            uint32_t length = 0;
+            uint64_t checksum = 0;
+            if (!read_u32(in, length) || length == 0 || length > CATALOG_MAX_RECORD) break;
+            payload.resize(length);
+            if (!in.read(payload.data(), length) || !read_u64(in, checksum) ||
+                Xxh3State::hash(reinterpret_cast<const unsigned char*>(payload.data()), length) != checksum ||
+                !apply(payload)) {
+                break;
+            }
+            offset += 4 + length + 8;
+        }
+        validEnd_ = offset;
+        return true;
+    }
+
+    // Function to pick up records other catalog users appended since this one was loaded; runs
+    // under the catalog's RootFileLock. A log that was replaced by another process's compaction, or cut
+    // below what was read of it, is reloaded whole, so appending never extends a stale offset.
+    void catch_up() {
+        FileIdentity current;
+        if (!read_file_identity(path_, current)) {
+            // Deleted under us: the next append writes what this instance knows afresh
+            validEnd_ = 0;
+            return;
+        }
+        if (validEnd_ > 0 && current.device == loaded_.device && current.fileId == loaded_.fileId &&
+            current.size >= validEnd_) {
+            read_from(validEnd_);
+            return;
+        }
+        reset();
+        if (!read_from(0)) {
+            validEnd_ = 0;
+            scan_root();
+        }
+    }
+
+    void reset() {
+        entries_.clear();
+        byName_.clear();
+        records_ = 0;
+        nextId_ = 1;
+        validEnd_ = 0;
+    }
+
+    // Function to index a root that has no catalog yet from its directory listing
+    void rebuild() {
+        reset();
+        std::error_code ec;
+        if (!fs::is_directory(root_, ec)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(catalog_mutex());
+        RootFileLock fileLock(root_, CATALOG_LOCK_FILE_NAME);
+        // Another process may have indexed the root while this one waited for the lock
+        if (read_from(0)) {
+            return;
+        }
+        reset();
+        scan_root();
+        write_compact();
+    }
+
+    // Function to fill the entries from the snapshot directories in the root
+    void scan_root() {
+        std::error_code ec;
+        if (!fs::is_directory(root_, ec)) {
+            return;
+        }
+
+        std::vector<fs::path> backups;
+        for (const auto& entry : fs::directory_iterator(root_)) {
+            if (is_snapshot_dir(entry)) {
+                backups.push_back(entry.path());
+            }
+        }
+        std::sort(backups.begin(), backups.end());
+        for (const auto& backupPath : backups) {
+            CatalogEntry entry;
+            entry.id = nextId_++;
+            entry.name = backupPath.filename().string();
+            auto time = snapshot_name_time(entry.name);
+            entry.createdNs = time ? *time * 1000000000LL : 0;
+            if (auto header = read_manifest_header(backupPath)) {
+                entry.hasManifest = true;
+                entry.header = *header;
+            }
+            entry.verified = read_verify_record(backupPath);
+            byName_[entry.name] = entry.id;
+            entries_[entry.id] = std::move(entry);
+        }
+    }
+
+    // Function to replace the log with one record per live entry and verification result
+    void write_compact() {
+        std::ostringstream out;
+        write_u32(out, CATALOG_MAGIC);
+        records_ = 0;
+        for (const auto& [id, entry] : entries_) {
+            std::ostringstream record;
+            encode_add(record, entry);
+            frame(out, record.str());
+            records_++;
+            if (entry.verified) {
+                std::ostringstream verify;
+                encode_verify(verify, entry.name, *entry.verified);
+                frame(out, verify.str());
+                records_++;
+            }
+        }
+
+        fs::path tmp = path_;
+        tmp += ".tmp";
+        std::string data = out.str();
+        write_durably(tmp, data, false);
+        fs::rename(tmp, path_);
+        validEnd_ = data.size();
+        read_file_identity(path_, loaded_);
+    }
+
+    void maybe_compact() {
+        if (records_ >= CATALOG_COMPACT_MIN_RECORDS && records_ > 2 * entries_.size() + 16) {
+            write_compact();
+        }
+    }
+
+    static void frame(std::ostream& out, const std::string& payload) {
+        write_u32(out, static_cast<uint32_t>(payload.size()));
+        out.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        write_u64(out, Xxh3State::hash(reinterpret_cast<const unsigned char*>(payload.data()), payload.size()));
+    }
+
+    // Function to append one record, first cutting off a torn record a crash may have left
+    void append(const std::string& payload) {
+        std::error_code ec;
+        if (validEnd_ == 0) {
+            // No log on disk yet
+            write_compact();
+        } else if (fs::file_size(path_, ec) > validEnd_ && !ec) {
+            // catch_up() has ruled out a replaced or shorter log, so this only ever shrinks it
+            fs::resize_file(path_, validEnd_);
+        }
+        std::ostringstream out;
+        frame(out, payload);
+        std::string data = out.str();
+        write_durably(path_, data, true);
+        if (!apply(payload)) {
+            throw std::runtime_error("Invalid catalog record");
+        }
+        validEnd_ += data.size();
+    }
+
+    // Function to write data with one call and flush it to disk before returning
+    static void write_durably(const fs::path& path, const std::string& data, bool append) {
+#ifdef _WIN32
+        HANDLE file = CreateFileW(path.c_str(), append ? FILE_APPEND_DATA : GENERIC_WRITE, FILE_SHARE_READ,
+                                  nullptr, append ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        DWORD written = 0;
+        bool ok = file != INVALID_HANDLE_VALUE &&
+                  WriteFile(file, data.data(), static_cast<DWORD>(data.size()), &written, nullptr) &&
+                  written == data.size() && FlushFileBuffers(file);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        bool ok = fd >= 0 && ::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) &&
+                  ::fsync(fd) == 0;
+        if (fd >= 0) ::close(fd);
+#endif
+        if (!ok) {
+            throw std::runtime_error("Cannot write catalog: " + path.string());
+        }
+    }
+
+    fs::path root_;
+    fs::path path_;
+    std::map<uint64_t, CatalogEntry> entries_;
+    std::unordered_map<std::string, uint64_t> byName_;
+    uint64_t nextId_ = 1;
+    uint64_t records_ = 0;
+    uint64_t validEnd_ = 0; // end of the last good record on disk; 0 = no log on disk yet
+    FileIdentity loaded_;   // the log file validEnd_ refers to
+};
+
+// Function to list all backups, newest first
+// Everything shown comes from the catalog, so listing touches neither the snapshots nor the root.
+// "New" is what a backup wrote when it was created and is not updated afterwards: data it shared
+// with a since-deleted backup is now only held by it but still counted as that backup's.
+void list_backups(const fs::path& backupRoot) {
+    if (!fs::exists(backupRoot)) {
+        std::cout << "No backup directory found at: " << backupRoot << "\n";
+        return;
+    }
+
+    SnapshotCatalog catalog(backupRoot);
+    if (catalog.entries().empty()) {
+        std::cout << "No backups found in: " << backupRoot << "\n";
+        return;
+    }
+
+    uint64_t totalLogical = 0;
+    uint64_t totalNew = 0;
+    size_t failedVerification = 0;
+    size_t unverifiable = 0;
+
+    std::cout << "Available backups in " << backupRoot << ":\n";
+    for (auto it = catalog.entries().rbegin(); it != catalog.entries().rend(); ++it) {
+        const CatalogEntry& backup = it->second;
+        const ManifestHeader* header = backup.hasManifest ? &backup.header : nullptr;
+        std::cout << "  " << backup.name;
+        if (!header) {
+            std::cout << " (no manifest)\n";
+            continue;
+        }
+
+        totalLogical += header->totalBytes;
+        std::cout << " (Files: " << header->fileCount << ", Size: " << format_bytes(header->totalBytes);
+        if (header->version >= 4) {
+            totalNew += header->storedBytes;
+            std::cout << ", New: " << format_bytes(header->storedBytes)
+                << ", Took: " << format_duration(header->durationMs);
+        }
+        std::cout << ")";
+
+        if (const auto& verified = backup.verified) {
+            if (verified->entriesFailed > 0) {
+                failedVerification++;
+                std::cout << " FAILED verification: " << verified->entriesFailed << " of " << verified->entriesChecked
+                    << " entries bad";
+            } else if (verified->entriesUnverifiable > 0) {
+                unverifiable++;
+                std::cout << " Unverifiable: " << verified->entriesUnverifiable << " of " << verified->entriesChecked
+                    << " entries have no recorded hash";
+            } else if (verified->sample) {
+                std::cout << " Sample of " << verified->entriesChecked << " files verified";
+            } else {
+                std::cout << " Verified";
+            }
+            std::cout << " (" << format_local_time(verified->time) << ")";
+        }
+        std::cout << "\n";
+    }
+
+    std::cout << "Total: " << catalog.entries().size() << " backups, " << format_bytes(totalLogical) << " logical, "
+        << format_bytes(totalNew) << " new at creation time\n";
+    std::cout << "(New counts what each backup wrote when it was created; data shared with deleted backups\n"
+        << " is not reattributed, so the total can be below the space the backups use now)\n";
+    if (failedVerification > 0) {
+        std::cout << "Warning: " << failedVerification << " backups failed verification\n";
+    }
+    if (unverifiable > 0) {
+        std::cout << "Warning: " << unverifiable << " backups have files whose content cannot be verified\n";
+    }
+}
+
+// Function to find the backup roots of named sources below a backup root (see
+// read_sources_from_file): subdirectories that hold a catalog of their own
+std::vector<std::string> find_source_roots(const fs::path& backupRoot) {
+    std::vector<std::string> names;
+    std::error_code ec;
+    for (fs::directory_iterator it(backupRoot, ec), end; !ec && it != end; it.increment(ec)) {
+        std::error_code statEc;
+        if (!is_snapshot_dir(*it) && it->is_directory(statEc) && fs::exists(it->path() / CATALOG_FILE_NAME, statEc)) {
+            names.push_back(it->path().filename().string());
+        }
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+// Function to pick which of the backup roots holds a backup, for commands given only its name.
+// A name found under several sources has to be disambiguated with --source.
+fs::path locate_backup_root(const std::vector<fs::path>& roots, const std::string& backupName) {
+    std::vector<fs::path> matches;
+    for (const fs::path& root : roots) {
+        std::error_code ec;
+        if (fs::exists(root / backupName, ec)) {
+            matches.push_back(root);
+        }
+    }
+    if (matches.size() > 1) {
+        std::string where;
+        for (const fs::path& match : matches) {
+            where += (where.empty() ? "" : ", ") + match.filename().string();
+        }
+        throw std::runtime_error("Backup " + backupName + " exists in several sources (" + where +
+                                 "), select one with --source");
+    }
+    return matches.empty() ? roots.front() : matches.front();
+}
+
+// Path or glob filters selecting part of a snapshot by manifest path
+// A pattern selects the entries it matches and everything below a matching directory.
+class PathSelector {
+public:
+    PathSelector() = default;
+
+    explicit PathSelector(const std::vector<std::string>& patterns) {
+        for (const std::string& raw : patterns) {
+            std::string pattern = to_manifest_path(fs::path(raw).lexically_normal());
+            while (pattern.starts_with("/")) pattern.erase(0, 1);
+            while (pattern.ends_with("/")) pattern.pop_back();
+            if (pattern.empty() || pattern == ".") {
+                throw std::runtime_error("Empty restore path: " + raw);
+            }
+
+            // Leading components without wildcards bound where matches can appear in the manifest
+            std::string base;
+            for (size_t start = 0; start < pattern.size();) {
+                size_t end = std::min(pattern.find('/', start), pattern.size());
+                if (pattern.find_first_of("*?[", start) < end) break;
+                base = pattern.substr(0, end);
+                start = end + 1;
+            }
+            patterns_.push_back({pattern, base});
+        }
+    }
+
+    bool empty() const { return patterns_.empty(); }
+
+    bool selects(const std::string& path) const {
+        for (const Pattern& pattern : patterns_) {
+            if (glob_match(pattern.glob, path)) return true;
+            for (size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+                if (glob_match(pattern.glob, std::string_view(path).substr(0, pos))) return true;
+            }
+        }
+        return false;
+    }
+
+    // True once a path in manifest order lies past everything any pattern can select, so the
+    // rest of the manifest can be skipped
+    bool passed(const std::string& path) const {
+        for (const Pattern& pattern : patterns_) {
+            if (pattern.base.empty() || !manifest_path_less(pattern.base, path) ||
+                path.starts_with(pattern.base + "/")) {
+                return false;
+            }
+        }
+        return !patterns_.empty();
+    }
+
+private:
+    struct Pattern {
+        std::string glob;
+        std::string base;
+    };
+
+    std::vector<Pattern> patterns_;
+};
+
+// What a restore did to the target tree
+struct RestoreStats {
+    uint64_t entriesWritten = 0;
+    uint64_t entriesUnchanged = 0;
+    uint64_t entriesRemoved = 0;
+};
+
+// Function to check whether a restore target already matches a manifest entry
+// Files match on type, size and mtime, and on content hash too when hashCompare is set.
+bool entry_in_place(const ManifestEntry& entry, const fs::path& target, bool hashCompare, size_t jobs) {
+    FileInfo current;
+    if (!read_file_info(target, current) || current.type != entry.type) {
+        return false;
+    }
+
+    if (entry.type == EntryType::Symlink) {
+        std::error_code ec;
+        fs::path linkTarget = fs::read_symlink(target, ec);
+        return !ec && to_manifest_path(linkTarget) == entry.linkTarget;
+    }
+
+    if (entry.type == EntryType::File) {
+        if (current.size != entry.size || current.mtimeNs != entry.mtimeNs) {
+            return false;
+        }
+        if (hashCompare && entry.hasHash && hash_file(target, nullptr, nullptr, jobs) != entry.hash) {
+            return false;
+        }
+        if (current.mode != entry.mode) {
+            std::error_code ec;
+            fs::permissions(target, static_cast<fs::perms>(entry.mode) & fs::perms::mask, ec);
+        }
+    }
+    return true;
+}
+
+// Function to write a snapshot's tree into targetDir, following its manifest when it has one
+// Swap checks directory-format files out as reflinks where it can instead of copies; Diff keeps
+// entries already in place in targetDir and removes everything the snapshot does not contain.
+// A non-empty selector limits all of this to the selected entries and leaves the rest of
+// targetDir alone.
+RestoreStats materialize_snapshot(const fs::path& backupPath, const fs::path& backupRoot, const fs::path& targetDir,
+                                  size_t jobs, RestoreMode mode, bool hashCompare,
+                                  const PathSelector& selector = {}) {
+    RestoreStats stats;
+    bool checkout = mode == RestoreMode::Swap;
+    bool sync = mode == RestoreMode::Diff;
+    bool partial = !selector.empty();
+
+    ManifestReader reader;
+    if (!reader.open(backupPath / MANIFEST_FILE_NAME)) {
+        if (sync || partial) {
+            throw std::runtime_error("Differential and partial restores need a backup with a manifest");
+        }
+        fs::copy(backupPath, targetDir, checkout ? fs::copy_options::recursive | fs::copy_options::create_hard_links
+                                                 : fs::copy_options::recursive);
+        return stats;
+    }
+
+    // A target that is not a directory is replaced as a whole
+    if (sync && fs::exists(fs::symlink_status(targetDir)) && !fs::is_directory(fs::symlink_status(targetDir))) {
+        fs::remove(targetDir);
+    }
+
+    fs::create_directories(targetDir);
+
+    // Chunked snapshots are rebuilt from the shared chunk store
+    std::optional<ChunkStore> store;
+    ChunkIndexReader index;
+    if (reader.header().format == SnapshotFormat::Chunked) {
+        store.emplace(backupRoot);
+        if (!index.open(backupPath)) {
+            throw std::runtime_error("Chunk index missing in backup: " + backupPath.filename().string());
+        }
+    }
+
+    // Archive snapshots are extracted file by file through the archive index
+    std::optional<ArchiveReader> archive;
+    if (reader.header().format == SnapshotFormat::Archive) {
+        archive.emplace(backupPath / ARCHIVE_FILE_NAME);
+    }
+
+    // Packed files of directory snapshots are extracted from their packs
+    PackIndexReader packs;
+    bool packed = reader.header().format == SnapshotFormat::Directory && packs.open(backupPath);
+
+    CopyEngine engine(resolve_job_count(jobs), false, false, store ? &*store : nullptr);
+
+    ManifestEntry entry;
+    std::vector<ChunkRef> refs;
+    PackRef pack;
+    PathTree expected;
+    while (reader.next(entry)) {
+        fs::path relative = from_manifest_path(entry.path);
+        fs::path target = targetDir / relative;
+
+        if (partial && selector.passed(entry.path)) {
+            break;
+        }
+        if (entry.type == EntryType::File && store) {
+            index.next(refs);
+        }
+        if (entry.type == EntryType::File && packed) {
+            packs.next(pack);
+        }
+        if (partial && !selector.selects(entry.path)) {
+            continue;
+        }
+
+        if (sync || partial) {
+            expected.insert(entry.path);
+            if (sync && entry_in_place(entry, target, hashCompare, resolve_job_count(jobs))) {
+                stats.entriesUnchanged++;
+                continue;
+            }
+            // Never write through an existing name: it may be a hardlink into a snapshot
+            std::error_code ec;
+            fs::file_status status = fs::symlink_status(target, ec);
+            if (fs::exists(status) && !(entry.type == EntryType::Directory && fs::is_directory(status))) {
+                fs::remove_all(target);
+            }
+            if (partial) {
+                fs::create_directories(target.parent_path());
+            }
+        }
+        stats.entriesWritten++;
+
+        if (entry.type == EntryType::Directory) {
+            fs::create_directories(target);
+        } else if (entry.type == EntryType::Symlink) {
+            fs::create_symlink(from_manifest_path(entry.linkTarget), target);
+        } else if (entry.type == EntryType::File && archive) {
+            auto indexed = archive->find(entry.path);
+            if (!indexed) {
+                throw std::runtime_error("File missing from archive: " + entry.path);
+            }
+            archive->extract(*indexed, target);
+            finalize_copied_file(target, entry.mtimeNs, entry.mode);
+        } else if (entry.type == EntryType::File && store) {
+            engine.rebuild(refs, target, entry.size, entry.mtimeNs, entry.mode);
+        } else if (entry.type == EntryType::File && pack.pack != 0) {
+            engine.unpack(backupPath / PACK_DIR_NAME / pack_file_name(pack.pack), pack.offset, target, entry.size,
+                          entry.mtimeNs, entry.mode);
+        } else if (entry.type == EntryType::File && checkout) {
+            engine.checkout(backupPath / relative, target, entry.size, entry.mtimeNs, entry.mode);
+        } else if (entry.type == EntryType::File) {
+            engine.copy(backupPath / relative, target, entry.size, entry.mtimeNs, entry.mode, nullptr);
+        }
+    }
+
+    engine.finish();
+
+    // Like rsync --delete: anything under the target the snapshot does not list goes away
+    if (sync) {
+        std::vector<fs::path> extra;
+        for (auto it = fs::recursive_directory_iterator(targetDir); it != fs::recursive_directory_iterator(); ++it) {
+            std::string relPath = to_manifest_path(it->path().lexically_relative(targetDir));
+            if (partial && !selector.selects(relPath)) {
+                continue;
+            }
+            if (!expected.contains(relPath)) {
+                extra.push_back(it->path());
+                it.disable_recursion_pending();
+            }
+        }
+        for (const fs::path& path : extra) {
+            fs::remove_all(path);
+            stats.entriesRemoved++;
+        }
+    }
+    return stats;
+}
+
+// Function to exchange two directory trees in place
+// Linux swaps both names in one atomic renameat2; elsewhere the target is first renamed aside,
+// leaving a short window in which it does not exist. Returns the path now holding the old tree.
+fs::path swap_into_place(const fs::path& staging, const fs::path& target, const fs::path& aside) {
+#ifdef __linux__
+    if (::syscall(SYS_renameat2, AT_FDCWD, staging.c_str(), AT_FDCWD, target.c_str(), RENAME_EXCHANGE) == 0) {
+        return staging;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+        throw std::runtime_error("Cannot swap " + staging.string() + " into place: " + std::strerror(errno));
+    }
+#endif
+    fs::rename(target, aside);
+    try {
+        fs::rename(staging, target);
+    } catch (...) {
+        std::error_code ec;
+        fs::rename(aside, target, ec);
+        throw;
+    }
+    return aside;
+}
+
+// Function to restore a backup, or only the entries matching restorePaths when it is not empty
+bool restore_backup(const std::string& backupName, const fs::path& backupRoot, const std::string& restorePath,
+                    size_t jobs, RestoreMode mode, bool hashCompare,
+                    const std::vector<std::string>& restorePaths) {
+    try {
+        fs::path backupPath = backupRoot / backupName;
+
+        if (!fs::exists(backupPath)) {
+            std::cerr << "Backup not found: " << backupName << "\n";
+            return false;
+        }
+
+        fs::path targetPath = fs::absolute(restorePath).lexically_normal();
+        if (!targetPath.has_filename()) {
+            targetPath = targetPath.parent_path();
+        }
+
+        // Create parent directories if they don't exist
+        if (targetPath.has_parent_path()) {
+            fs::create_directories(targetPath.parent_path());
+        }
+
+        // Partial restores replace only the selected entries and leave the rest of the target alone
+        PathSelector selector(restorePaths);
+        if (!selector.empty()) {
+            if (mode == RestoreMode::Swap) {
+                std::cerr << "--restore-mode swap replaces the whole target and cannot restore single paths\n";
+                return false;
+            }
+            RestoreStats stats = materialize_snapshot(backupPath, backupRoot, targetPath, jobs, mode, hashCompare,
+                                                      selector);
+            if (stats.entriesWritten + stats.entriesUnchanged == 0) {
+                std::cerr << "No entries in backup '" << backupName << "' match the restore paths\n";
+                return false;
+            }
+            std::cout << "✓ Restored " << stats.entriesWritten << " entries of backup '" << backupName
+                << "' to: " << targetPath;
+            if (mode == RestoreMode::Diff) {
+                std::cout << " (" << stats.entriesUnchanged << " unchanged, " << stats.entriesRemoved << " removed)";
+            }
+            std::cout << "\n";
+            return true;
+        }
+
+        if (mode == RestoreMode::Copy) {
+            // Remove existing target if it exists
+            if (fs::exists(targetPath)) {
+                fs::remove_all(targetPath);
+            }
+
+            materialize_snapshot(backupPath, backupRoot, targetPath, jobs, mode, hashCompare);
+            std::cout << "✓ Restored backup '" << backupName << "' to: " << targetPath << "\n";
+            return true;
+        }
+
+        if (mode == RestoreMode::Diff) {
+            RestoreStats stats = materialize_snapshot(backupPath, backupRoot, targetPath, jobs, mode, hashCompare);
+            std::cout << "✓ Restored backup '" << backupName << "' to: " << targetPath << " ("
+                << stats.entriesWritten << " written, " << stats.entriesUnchanged << " unchanged, "
+                << stats.entriesRemoved << " removed)\n";
+            return true;
+        }
+
+        // Swap: build the new tree beside the target on the same filesystem, so the target is
+        // only replaced once the new tree is complete and the switch is a single rename
+        std::string name = targetPath.filename().string();
+        fs::path staging = targetPath.parent_path() / ("." + name + ".flameup-staging");
+        fs::path aside = targetPath.parent_path() / ("." + name + ".flameup-old");
+        for (const fs::path& stale : {staging, aside}) {
+            if (fs::exists(fs::symlink_status(stale))) {
+                fs::remove_all(stale);
+            }
+        }
+
+        materialize_snapshot(backupPath, backupRoot, staging, jobs, mode, hashCompare);
+
+        std::optional<fs::path> oldTree;
+        if (fs::exists(fs::symlink_status(targetPath))) {
+            oldTree = swap_into_place(staging, targetPath, aside);
+        } else {
+            fs::rename(staging, targetPath);
+        }
+
+        std::cout << "✓ Restored backup '" << backupName << "' to: " << targetPath << "\n";
+
+        // The target is already live; the replaced tree is removed at idle priority
+        if (oldTree) {
+            std::cout << "Removing previous tree in the background...\n";
+            std::thread deleter([tree = *oldTree] {
+                lower_thread_priority();
+                std::error_code ec;
+                fs::remove_all(tree, ec);
+                if (ec) {
+                    std::cerr << "Warning: could not remove " << tree << ": " << ec.message() << "\n";
+                }
+            });
+            deleter.join();
+        }
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error during restore: " << e.what() << "\n";
+        return false;
+    }
+}
+
+// Function to delete a specific backup
+bool delete_backup(const std::string& backupName, const fs::path& backupRoot) {
+    try {
+        fs::path backupPath = backupRoot / backupName;
+        SnapshotCatalog catalog(backupRoot);
+
+        if (!catalog.find(backupName) && !fs::exists(backupPath)) {
+            std::cerr << "Backup not found: " << backupName << "\n";
+            return false;
+        }
+
+        remove_snapshot(backupPath, backupRoot);
+        catalog.remove(backupName);
+        std::cout << "✓ Deleted backup: " << backupName << "\n";
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error deleting backup: " << e.what() << "\n";
+        return false;
+    }
+}
+
+// A file entry handed to a verify worker; chunks is its chunk list in chunked snapshots,
+// pack where it is stored in packed directory snapshots
+struct VerifyItem {
+    ManifestEntry entry;
+    std::vector<ChunkRef> chunks;
+    PackRef pack;
+};
+
+constexpr size_t VERIFY_BATCH_ENTRIES = 64;
+constexpr size_t VERIFY_MAX_REPORTED = 20;
+
+// Function to check a snapshot against its manifest and record the outcome in it.
+// Every file must be readable with its recorded size and content hash; files without a recorded
+// hash (copied with --no-copy-hashes or by an older version) are counted as unverifiable.
+// Chunks are checked against their ids and archive blocks against their checksums on the way,
+// directories and symlinks against the manifest. With sampleFiles, only that many files picked at
+// random are read. Files are checked on jobs threads and reads are paced by throttle.
+VerifyRecord verify_snapshot(const fs::path& backupPath, const fs::path& backupRoot, size_t jobs,
+                             IoThrottle* throttle, size_t sampleFiles) {
+    ManifestReader reader;
+    if (!reader.open(backupPath / MANIFEST_FILE_NAME)) {
+        throw std::runtime_error("No manifest, cannot verify " + backupPath.filename().string());
+    }
+    SnapshotFormat format = reader.header().format;
+    bool chunked = format == SnapshotFormat::Chunked;
+    bool archive = format == SnapshotFormat::Archive;
+    throttle = throttle && throttle->enabled() ? throttle : nullptr;
+
+    // Only read here, so no lock: chunks stay while this snapshot references them
+    std::optional<ChunkStore> store;
+    ChunkIndexReader index;
+    if (chunked) {
+        store.emplace(backupRoot);
+        if (!index.open(backupPath)) {
+            throw std::runtime_error("Missing chunk index in " + backupPath.string());
+        }
+    }
+    fs::path archivePath = backupPath / ARCHIVE_FILE_NAME;
+    PackIndexReader packs;
+    bool packed = format == SnapshotFormat::Directory && packs.open(backupPath);
+
+    VerifyRecord record;
+    record.sample = sampleFiles > 0;
+    std::atomic<uint64_t> checked{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> unverifiable{0};
+    std::atomic<uint64_t> bytes{0};
+    std::mutex reportMutex;
+    auto report = [&](const std::string& path, const std::string& problem) {
+        uint64_t n = ++failed;
+        if (n <= VERIFY_MAX_REPORTED) {
+            std::lock_guard<std::mutex> lock(reportMutex);
+            std::cerr << "  ✗ " << path << ": " << problem << "\n";
+        }
+    };
+
+    // Reads one file back and returns what is wrong with it, or an empty string
+    auto check_file = [&](const VerifyItem& item, std::optional<ArchiveReader>& archiveReader) -> std::string {
+        const ManifestEntry& entry = item.entry;
+        if (throttle) {
+            throttle->file_started();
+        }
+
+        uint64_t size = 0;
+        uint64_t hash = 0;
+        if (chunked) {
+            SegmentHasher hasher;
+            std::vector<char> data;
+            for (const auto& ref : item.chunks) {
+                store->read_chunk(ref, data);
+                if (throttle) throttle->bytes_transferred(data.size());
+                hasher.update(data.data(), data.size());
+                size += data.size();
+            }
+            hash = hasher.finish();
+        } else if (archive) {
+            if (!archiveReader) {
+                archiveReader.emplace(archivePath);
+            }
+            auto slot = archiveReader->find(entry.path);
+            if (!slot) {
+                return "missing from the archive index";
+            }
+            SegmentHasher hasher;
+            size = archiveReader->read_file(*slot, [&](const std::string& raw) {
+                if (throttle) throttle->bytes_transferred(raw.size());
+                hasher.update(raw.data(), raw.size());
+            });
+            hash = hasher.finish();
+        } else if (item.pack.pack != 0) {
+            SegmentHasher hasher;
+            read_pack_range(backupPath / PACK_DIR_NAME / pack_file_name(item.pack.pack), item.pack.offset, entry.size,
+                            [&](const char* data, size_t length) { hasher.update(data, length); }, throttle);
+            size = entry.size;
+            hash = hasher.finish();
+        } else {
+            NativeFile in = NativeFile::open_read(backupPath / from_manifest_path(entry.path));
+            std::vector<uint64_t> segmentHashes;
+            size = copy_range_hashed(in, nullptr, 0, UINT64_MAX, segmentHashes, throttle);
+            hash = combine_segment_hashes(segmentHashes);
+        }
+
+        bytes += size;
+        if (size != entry.size) {
+            return "size is " + std::to_string(size) + " bytes, expected " + std::to_string(entry.size);
+        }
+        if (!entry.hasHash) {
+            // Readable with the right size, but nothing to compare the content against
+            unverifiable++;
+        } else if (hash != entry.hash) {
+            return "content does not match its recorded hash";
+        }
+        return "";
+    };
+
+    BoundedQueue<std::vector<VerifyItem>> queue(std::max<size_t>(jobs, 1) * 4);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::max<size_t>(jobs, 1); i++) {
+        workers.emplace_back([&] {
+            std::optional<ArchiveReader> archiveReader;
+            while (auto batch = queue.pop()) {
+                for (const auto& item : *batch) {
+                    std::string problem;
+                    try {
+                        problem = check_file(item, archiveReader);
+                    } catch (const std::exception& e) {
+                        problem = e.what();
+                    }
+                    checked++;
+                    if (!problem.empty()) {
+                        report(item.entry.path, problem);
+                    }
+                }
+            }
+        });
+    }
+
+    // The manifest is streamed; a sample is drawn from it by reservoir sampling
+    std::mt19937_64 random(std::random_device{}());
+    std::vector<VerifyItem> sample;
+    uint64_t filesSeen = 0;
+    std::vector<VerifyItem> batch;
+    try {
+        VerifyItem item;
+        while (reader.next(item.entry)) {
+            const ManifestEntry& entry = item.entry;
+            if (entry.type == EntryType::File) {
+                if (chunked) {
+                    index.next(item.chunks);
+                }
+                if (packed) {
+                    packs.next(item.pack);
+                }
+                if (record.sample) {
+                    filesSeen++;
+                    if (sample.size() < sampleFiles) {
+                        sample.push_back(item);
+                    } else if (uint64_t slot = random() % filesSeen; slot < sampleFiles) {
+                        sample[static_cast<size_t>(slot)] = item;
+                    }
+                    continue;
+                }
+                batch.push_back(item);
+                if (batch.size() >= VERIFY_BATCH_ENTRIES) {
+                    queue.push(std::move(batch));
+                    batch = {};
+                }
+                continue;
+            }
+
+            // Directories and symlinks only exist as such in directory snapshots
+            if (record.sample || chunked || archive) {
+                continue;
+            }
+            checked++;
+            fs::path entryPath = backupPath / from_manifest_path(entry.path);
+            FileInfo info;
+            if (!read_file_info(entryPath, info) || info.type != entry.type) {
+                report(entry.path, "missing or not a " +
+                                   std::string(entry.type == EntryType::Directory ? "directory" : "symlink"));
+            } else if (entry.type == EntryType::Symlink) {
+                std::error_code ec;
+                fs::path linkTarget = fs::read_symlink(entryPath, ec);
+                if (ec || to_manifest_path(linkTarget) != entry.linkTarget) {
+                    report(entry.path, "symlink target differs from the manifest");
+                }
+            }
+        }
+    } catch (...) {
+        queue.close();
+        for (auto& worker : workers) worker.join();
+        throw;
+    }
+
+    for (auto& item : sample) {
+        batch.push_back(std::move(item));
+        if (batch.size() >= VERIFY_BATCH_ENTRIES) {
+            queue.push(std::move(batch));
+            batch = {};
+        }
+    }
+    if (!batch.empty()) {
+        queue.push(std::move(batch));
+    }
+    queue.close();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    record.time = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.entriesChecked = checked;
+    record.entriesFailed = failed;
+    record.entriesUnverifiable = unverifiable;
+    record.bytesChecked = bytes;
+    if (record.entriesFailed > VERIFY_MAX_REPORTED) {
+        std::cerr << "  ... and " << record.entriesFailed - VERIFY_MAX_REPORTED << " more\n";
+    }
+    return SnapshotCatalog(backupRoot).record_verify(backupPath.filename().string(), record);
+}
+
+// Function to verify one backup by name, or every backup for "all"
+bool verify_backups(const std::string& backupName, const fs::path& backupRoot, size_t jobs, IoThrottle* throttle,
+                    size_t sampleFiles) {
+    std::vector<fs::path> backups;
+    if (backupName == "all") {
+        SnapshotCatalog catalog(backupRoot);
+        for (const auto& [id, entry] : catalog.entries()) {
+            backups.push_back(backupRoot / entry.name);
+        }
+        if (backups.empty()) {
+            std::cout << "No backups found in: " << backupRoot << "\n";
+            return true;
+        }
+    } else {
+        fs::path backupPath = backupRoot / backupName;
+        if (!fs::is_directory(backupPath)) {
+            std::cerr << "Backup not found: " << backupName << "\n";
+            return false;
+        }
+        backups.push_back(backupPath);
+    }
+
+    bool allPassed = true;
+    for (const auto& backupPath : backups) {
+        std::string name = backupPath.filename().string();
+        try {
+            auto start = std::chrono::steady_clock::now();
+            VerifyRecord record = verify_snapshot(backupPath, backupRoot, resolve_job_count(jobs), throttle, sampleFiles);
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            if (record.entriesFailed > 0) {
+                allPassed = false;
+                std::cerr << "✗ Backup " << name << " failed verification: " << record.entriesFailed << " of "
+                          << record.entriesChecked << " entries bad\n";
+            } else if (record.entriesUnverifiable > 0) {
+                allPassed = false;
+                std::cerr << "✗ Backup " << name << " could not be fully verified: " << record.entriesUnverifiable
+                          << " of " << record.entriesChecked
+                          << " entries have no recorded hash, only their size was checked\n";
+            } else {
+                std::cout << "✓ Verified backup: " << name << " (" << record.entriesChecked
+                    << (record.sample ? " sampled" : "") << " entries, " << format_bytes(record.bytesChecked)
+                    << " read in " << format_duration(static_cast<uint64_t>(ms.count())) << ")\n";
+            }
+        } catch (const std::exception& e) {
+            allPassed = false;
+            std::cerr << "Error verifying " << name << ": " << e.what() << "\n";
+        }
+    }
+    return allPassed;
+}
+
+// Function to pick the snapshot whose last check is oldest, never-verified ones first
+std::optional<fs::path> least_recently_verified(const fs::path& backupRoot) {
+    const CatalogEntry* pick = nullptr;
+    SnapshotCatalog catalog(backupRoot);
+    for (const auto& [id, entry] : catalog.entries()) {
+        int64_t time = entry.verified ? entry.verified->time : 0;
+        if (!pick || time < (pick->verified ? pick->verified->time : 0)) {
+            pick = &entry;
+        }
+    }
+    if (!pick) {
+        return std::nullopt;
+    }
+    return backupRoot / pick->name;
+}
+
+// Function to express a Unix time as seconds since 1970-01-01 00:00 local time, so retention
+// buckets line up with local hours and days
+int64_t local_seconds(int64_t unixSeconds) {
+    auto time_t = static_cast<std::time_t>(unixSeconds);
+    std::tm tm_buf;
+#ifdef _WIN32
+    if (localtime_s(&tm_buf, &time_t) != 0) {
+        return unixSeconds;
+    }
+#else
+    if (localtime_r(&time_t, &tm_buf) == nullptr) {
+        return unixSeconds;
+    }
+#endif
+    std::chrono::year_month_day date{std::chrono::year(tm_buf.tm_year + 1900),
+                                     std::chrono::month(static_cast<unsigned>(tm_buf.tm_mon + 1)),
+                                     std::chrono::day(static_cast<unsigned>(tm_buf.tm_mday))};
+    int64_t days = std::chrono::sys_days(date).time_since_epoch().count();
+    return days * 86400 + tm_buf.tm_hour * 3600 + tm_buf.tm_min * 60 + tm_buf.tm_sec;
+}
+
+// Function to get the current time on the local_seconds scale
+int64_t local_now_seconds() {
+    return local_seconds(std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+// Function to name the retention bucket a snapshot taken at localSeconds falls into
+int64_t retention_bucket_key(const RetentionTier& tier, int64_t localSeconds) {
+    using namespace std::chrono;
+    switch (tier.bucket) {
+        case RetentionBucket::Interval: {
+            // Weeks start on Monday; 1970-01-01 was a Thursday
+            int64_t origin = tier.bucketSeconds % (7 * 86400) == 0 ? -3 * 86400 : 0;
+            int64_t shifted = localSeconds - origin;
+            return shifted / tier.bucketSeconds - (shifted % tier.bucketSeconds < 0 ? 1 : 0);
+        }
+        case RetentionBucket::Monthly:
+        case RetentionBucket::Yearly: {
+            year_month_day date{sys_days(days(localSeconds / 86400 - (localSeconds % 86400 < 0 ? 1 : 0)))};
+            int64_t year = static_cast<int>(date.year());
+            return tier.bucket == RetentionBucket::Yearly ? year : year * 12 + static_cast<unsigned>(date.month());
+        }
+        default:
+            return localSeconds;
+    }
+}
+
+// Function to decide, oldest first, which snapshots a tiered policy keeps, given their local
+// times (see local_seconds). Each bucket keeps its oldest snapshot, so a kept snapshot stays kept
+// while newer ones arrive in the same bucket, and every decision only looks at the previous kept
+// snapshot. The newest snapshot is always kept.
+std::vector<bool> plan_tiered_retention(const std::vector<int64_t>& timesOldestFirst,
+                                        const std::vector<RetentionTier>& tiers, int64_t now) {
+    std::vector<bool> keep(timesOldestFirst.size(), false);
+    size_t previousTier = tiers.size();
+    int64_t previousKey = 0;
+    for (size_t i = 0; i < timesOldestFirst.size(); i++) {
+        const int64_t* time = &timesOldestFirst[i];
+        if (i + 1 == timesOldestFirst.size()) {
+            keep[i] = true;
+            continue;
+        }
+        int64_t age = now - *time;
+        size_t tier = 0;
+        while (tier < tiers.size() && age >= tiers[tier].maxAge) tier++;
+        if (tier == tiers.size()) {
+            continue;
+        }
+        int64_t key = retention_bucket_key(tiers[tier], *time);
+        if (tiers[tier].bucket == RetentionBucket::All || tier != previousTier || key != previousKey) {
+            keep[i] = true;
+            previousTier = tier;
+            previousKey = key;
+        }
+    }
+    return keep;
+}
+
+// Function to clean up old backups, keeping the newest maxBackups, or what a tiered retention
+// spec keeps when one is given. The snapshots and their ages come from the catalog. With a trash
+// collector, expired snapshots are only renamed here and deleted in the background.
+void cleanup_old_backups(const fs::path& backupRoot, size_t maxBackups, bool verbose, TrashCollector* trash,
+                         const std::string& retention = {}) {
+    SnapshotCatalog catalog(backupRoot);
+    std::vector<std::string> backups;
+    std::vector<int64_t> times;
+    for (const auto& [id, entry] : catalog.entries()) {
+        backups.push_back(entry.name);
+        times.push_back(local_seconds(entry.createdNs / 1000000000LL));
+    }
+
+    auto expire = [&](const std::string& name) {
+        if (verbose) {
+            std::cout << "Deleting old backup: " << name << "\n";
+        }
+        fs::path backup = backupRoot / name;
+        std::error_code ec;
+        if (fs::exists(backup, ec) && (!trash || !move_to_trash(backup))) {
+            remove_snapshot(backup, backupRoot);
+        }
+        catalog.remove(name);
+    };
+
+    if (!retention.empty()) {
+        std::vector<bool> keep = plan_tiered_retention(times, parse_retention(retention), local_now_seconds());
+        for (size_t i = 0; i < backups.size(); i++) {
+            if (!keep[i]) expire(backups[i]);
+        }
+    } else {
+        // Delete oldest backups if we exceed the limit
+        size_t excess = backups.size() > maxBackups ? backups.size() - maxBackups : 0;
+        for (size_t i = 0; i < excess; i++) {
+            expire(backups[i]);
+        }
+    }
+    if (trash) {
+        trash->wake();
+    }
+}
+
+// Function to find the newest existing backup folder
+std::optional<fs::path> find_latest_backup(const fs::path& backupRoot) {
+    if (!fs::exists(backupRoot)) {
+        return std::nullopt;
+    }
+
+    // Skip catalog entries whose directory was removed by hand
+    SnapshotCatalog catalog(backupRoot);
+    for (auto it = catalog.entries().rbegin(); it != catalog.entries().rend(); ++it) {
+        fs::path latest = backupRoot / it->second.name;
+        std::error_code ec;
+        if (fs::is_directory(latest, ec)) {
+            return latest;
+        }
+    }
+    return std::nullopt;
+}
+
+// Per-source ignore file read from the root of the source tree
+constexpr const char* IGNORE_FILE_NAME = ".flameupignore";
+
+// Gitignore-style include/exclude rules compiled once per backup cycle
+// The last matching rule wins, "!" re-includes, a trailing "/" only matches directories and a
+// pattern without an inner "/" matches the name at any depth. Wildcard-free patterns are
+// looked up in hash tables, "*.ext" patterns become suffix compares and the remaining globs
+// are only tried while they could still beat the best literal match.
+class PathFilter {
+public:
+    void add_rule(std::string line) {
+        while (!line.empty() && (line.back() == ' ' || line.back() == '\t' || line.back() == '\r')) {
+            line.pop_back();
+        }
+        line.erase(0, line.find_first_not_of(" \t"));
+        if (line.empty() || line.starts_with("#")) {
+            return;
+        }
+
+        bool include = line.starts_with("!");
+        if (include || line.starts_with("\\")) {
+            line.erase(0, 1);
+        }
+        bool dirOnly = line.ends_with("/");
+        while (line.ends_with("/")) line.pop_back();
+        bool anchored = line.find('/') != std::string::npos;
+        while (line.starts_with("/")) line.erase(0, 1);
+        if (line.empty()) {
+            return;
+        }
+
+        int index = static_cast<int>(include_.size());
+        include_.push_back(include);
+
+        if (line.find_first_of("*?[") == std::string::npos) {
+            auto& table = anchored ? paths_[dirOnly] : names_[dirOnly];
+            table[line] = index;
+            return;
+        }
+
+        Glob glob;
+        glob.index = index;
+        glob.anchored = anchored;
+        glob.dirOnly = dirOnly;
+        if (!anchored && line.starts_with("*") && line.find_first_of("*?[", 1) == std::string::npos) {
+            glob.suffix = line.substr(1);
+            glob.suffixOnly = true;
+        } else {
+            glob.pattern = line;
+        }
+        globs_.push_back(std::move(glob));
+    }
+
+    // Function to add every rule of an ignore file; a missing file adds nothing
+    void add_rules_from_file(const fs::path& ignoreFile) {
+        std::ifstream in(ignoreFile);
+        std::string line;
+        while (std::getline(in, line)) {
+            add_rule(line);
+        }
+    }
+
+    bool empty() const { return include_.empty(); }
+
+    // True when the entry itself is excluded; its parent directories are assumed to be included
+    bool excludes(const std::string& relPath, bool isDirectory) const {
+        size_t slash = relPath.rfind('/');
+        std::string_view name = slash == std::string::npos ? std::string_view(relPath)
+                                                           : std::string_view(relPath).substr(slash + 1);
+        int best = -1;
+        auto consider = [&](const std::unordered_map<std::string, int>& table, std::string_view key) {
+            auto it = table.find(std::string(key));
+            if (it != table.end()) best = std::max(best, it->second);
+        };
+        consider(paths_[0], relPath);
+        consider(names_[0], name);
+        if (isDirectory) {
+            consider(paths_[1], relPath);
+            consider(names_[1], name);
+        }
+
+        for (auto it = globs_.rbegin(); it != globs_.rend() && it->index > best; ++it) {
+            if (it->dirOnly && !isDirectory) continue;
+            bool matched = it->suffixOnly ? name.ends_with(it->suffix)
+                                          : glob_match(it->pattern, it->anchored ? std::string_view(relPath) : name);
+            if (matched) {
+                best = it->index;
+                break;
+            }
+        }
+        return best >= 0 && !include_[best];
+    }
+
+    // True when the entry or any of its parent directories is excluded
+    bool excludes_path(const std::string& relPath, bool isDirectory) const {
+        for (size_t pos = relPath.find('/'); pos != std::string::npos; pos = relPath.find('/', pos + 1)) {
+            if (excludes(relPath.substr(0, pos), true)) return true;
+        }
+        return excludes(relPath, isDirectory);
+    }
+
+private:
+    struct Glob {
+        int index = 0;
+        bool anchored = false;
+        bool dirOnly = false;
+        bool suffixOnly = false;
+        std::string pattern;
+        std::string suffix;
+    };
+
+    std::vector<bool> include_;                         // per rule: "!" re-includes
+    std::unordered_map<std::string, int> paths_[2];     // anchored literal -> rule, [1] = directories only
+    std::unordered_map<std::string, int> names_[2];     // literal name at any depth -> rule
+    std::vector<Glob> globs_;
+};
+
+using TreeVisitor = std::function<void(const fs::path& fullPath, const std::string& relPath, const FileInfo& info)>;
+
+// Size of the buffer directory entries are read into in one system call
+constexpr size_t DIRECTORY_READ_BUFFER = 256 * 1024;
+
+struct DirectoryChild {
+    std::string name; // in manifest form
+    FileInfo info;
+};
+
+// Function to list a directory's children with their file info, in the order the filesystem
+// returns them. Linux reads entries with getdents64 into a large buffer and stats each one with
+// fstatat relative to the open directory, so no path is resolved again (with --async-io, all
+// entries of a read are stat'ed as one wave of io_uring requests instead); Windows gets size, times
+// and attributes for a whole batch of entries from FindFirstFileExW's large fetches without a
+// per-file call (file ids are left 0 there, which the change checks treat as unknown).
+void read_directory(const fs::path& dir, std::vector<DirectoryChild>& children) {
+    children.clear();
+#ifdef _WIN32
+    WIN32_FIND_DATAW data;
+    HANDLE h = FindFirstFileExW((dir / L"*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr,
+                                FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE) {
+        DWORD error = GetLastError();
+        if (error == ERROR_FILE_NOT_FOUND) return;
+        throw fs::filesystem_error("cannot read directory", dir,
+                                   std::error_code(static_cast<int>(error), std::system_category()));
+    }
+    do {
+        std::wstring_view name(data.cFileName);
+        if (name == L"." || name == L"..") continue;
+
+        DirectoryChild child;
+        child.name = to_manifest_path(fs::path(name));
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+            child.info.type = EntryType::Symlink;
+        } else if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            child.info.type = EntryType::Directory;
+        } else {
+            child.info.type = EntryType::File;
+        }
+        child.info.size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+        child.info.mtimeNs = filetime_to_unix_ns(data.ftLastWriteTime);
+        child.info.mode = (data.dwFileAttributes & FILE_ATTRIBUTE_READONLY) ? 0555 : 0777;
+        children.push_back(std::move(child));
+    } while (FindNextFileW(h, &data));
+    FindClose(h);
+#else
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw fs::filesystem_error("cannot open directory", dir, std::error_code(errno, std::generic_category()));
+    }
+
+    auto add_child = [&](const char* name) {
+        if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) return;
+        struct stat st;
+        if (::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            return; // vanished since it was listed
+        }
+        DirectoryChild child;
+        child.name = name;
+        file_info_from_stat(st, child.info);
+        children.push_back(std::move(child));
+    };
+
+#ifdef __linux__
+    // Reused across calls; a walk only ever reads one directory at a time per thread
+    thread_local std::vector<char> buffer(DIRECTORY_READ_BUFFER);
+    thread_local std::unique_ptr<AsyncIo> io = async_io_enabled() ? AsyncIo::create() : nullptr;
+    thread_local std::vector<const char*> names;
+    thread_local std::vector<struct statx> stats;
+    thread_local std::vector<AsyncIo::Op> ops;
+    while (true) {
+        long n = ::syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (n < 0) {
+            int error = errno;
+            ::close(fd);
+            throw fs::filesystem_error("cannot read directory", dir, std::error_code(error, std::generic_category()));
+        }
+        if (n == 0) break;
+        if (io) {
+            names.clear();
+            for (long pos = 0; pos < n;) {
+                const auto* entry = reinterpret_cast<const dirent64*>(buffer.data() + pos);
+                if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0) {
+                    names.push_back(entry->d_name);
+                }
+                pos += entry->d_reclen;
+            }
+            stats.resize(names.size());
+            ops.resize(names.size());
+            try {
+                io->reset();
+                for (size_t i = 0; i < names.size(); i++) {
+                    ops[i] = io->stat_at(fd, names[i], &stats[i]);
+                }
+                io->run();
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+            for (size_t i = 0; i < names.size(); i++) {
+                if (io->result(ops[i]) != 0) continue; // vanished since it was listed
+                DirectoryChild child;
+                child.name = names[i];
+                file_info_from_statx(stats[i], child.info);
+                children.push_back(std::move(child));
+            }
+            continue;
+        }
+        for (long pos = 0; pos < n;) {
+            const auto* entry = reinterpret_cast<const dirent64*>(buffer.data() + pos);
+            add_child(entry->d_name);
+            pos += entry->d_reclen;
+        }
+    }
+    ::close(fd);
+#else
+    DIR* d = ::fdopendir(fd);
+    if (!d) {
+        int error = errno;
+        ::close(fd);
+        throw fs::filesystem_error("cannot read directory", dir, std::error_code(error, std::generic_category()));
+    }
+    while (const dirent* entry = ::readdir(d)) {
+        add_child(entry->d_name);
+    }
+    ::closedir(d);
+#endif
+#endif
+}
+
+// Function to walk a directory tree with children sorted by name, parents before children
+// Only the listings of the directories on the current path are held, so memory grows with
+// depth and directory size rather than with the size of the tree.
+// Entries the filter excludes are skipped; excluded directories are never opened.
+void walk_tree_sorted(const fs::path& dir, const std::string& relDir, const TreeVisitor& visit,
+                      const PathFilter* filter = nullptr) {
+    std::vector<DirectoryChild> children;
+    read_directory(dir, children);
+
+    std::sort(children.begin(), children.end(), [](const auto& a, const auto& b) {
+        return a.name < b.name;
+    });
+
+    for (const auto& child : children) {
+        std::string relPath = relDir.empty() ? child.name : relDir + "/" + child.name;
+        if (filter && filter->excludes(relPath, child.info.type == EntryType::Directory)) {
+            continue;
+        }
+
+        fs::path fullPath = dir / from_manifest_path(child.name);
+        visit(fullPath, relPath, child.info);
+
+        if (child.info.type == EntryType::Directory) {
+            walk_tree_sorted(fullPath, relPath, visit, filter);
+        }
+    }
+}
+
+// Function to check whether a path or one of its parent directories was reported as changed
+bool is_path_dirty(const std::string& relPath, const std::unordered_set<std::string>& dirtyPaths) {
+    for (size_t pos = relPath.find('/'); pos != std::string::npos; pos = relPath.find('/', pos + 1)) {
+        if (dirtyPaths.count(relPath.substr(0, pos))) return true;
+    }
+    return dirtyPaths.count(relPath) > 0;
+}
+
+// Function to visit the current tree in walk_tree_sorted order while only touching changed paths:
+// everything outside dirtyPaths is streamed from the previous snapshot's manifest without a stat
+// call, and the changed paths are scanned and merged in at their place in the order
+void walk_changed_paths(const fs::path& sourcePath, const fs::path& previousBackup,
+                        const std::unordered_set<std::string>& dirtyPaths, const TreeVisitor& visit,
+                        const PathFilter* filter = nullptr) {
+    // Paths inside a changed directory are picked up by scanning that directory
+    std::vector<std::string> roots;
+    for (const auto& relPath : dirtyPaths) {
+        if (relPath.empty()) continue;
+        size_t slash = relPath.rfind('/');
+        if (slash != std::string::npos && is_path_dirty(relPath.substr(0, slash), dirtyPaths)) continue;
+        roots.push_back(relPath);
+    }
+    std::sort(roots.begin(), roots.end(), manifest_path_less);
+
+    auto scan_root = [&](const std::string& relPath) {
+        fs::path fullPath = sourcePath / from_manifest_path(relPath);
+        FileInfo info;
+        if (!read_file_info(fullPath, info)) {
+            return; // deleted since the previous snapshot
+        }
+        if (filter && filter->excludes_path(relPath, info.type == EntryType::Directory)) {
+            return;
+        }
+        visit(fullPath, relPath, info);
+        if (info.type == EntryType::Directory) {
+            walk_tree_sorted(fullPath, relPath, visit, filter);
+        }
+    };
+
+    ManifestReader reader;
+    if (!reader.open(previousBackup / MANIFEST_FILE_NAME)) {
+        throw std::runtime_error("Cannot read manifest of " + previousBackup.string());
+    }
+
+    size_t nextRoot = 0;
+    ManifestEntry entry;
+    while (reader.next(entry)) {
+        // A changed path sorts before everything below it, and its scan covers all of those
+        while (nextRoot < roots.size() && manifest_path_less(roots[nextRoot], entry.path)) {
+            scan_root(roots[nextRoot++]);
+        }
+        if (is_path_dirty(entry.path, dirtyPaths)) continue;
+        if (filter && filter->excludes_path(entry.path, entry.type == EntryType::Directory)) continue;
+
+        FileInfo info;
+        info.type = entry.type;
+        info.size = entry.size;
+        info.mtimeNs = entry.mtimeNs;
+        info.fileId = entry.fileId;
+        info.mode = entry.mode;
+        visit(sourcePath / from_manifest_path(entry.path), entry.path, info);
+    }
+    while (nextRoot < roots.size()) {
+        scan_root(roots[nextRoot++]);
+    }
+}
+
+// Manifest entries collected before the copy workers are drained and the entries written out
+constexpr size_t MANIFEST_FLUSH_ENTRIES = 1 << 16;
+
+struct SnapshotStats {
+    size_t filesCopied = 0;
+    size_t filesLinked = 0;
+    uintmax_t bytesCopied = 0;
+    uint64_t bytesSkipped = 0; // unchanged data carried over from the previous snapshot
+    uint64_t chunksWritten = 0;
+    uint64_t chunkBytesWritten = 0;
+    double scanSeconds = 0;    // time spent walking the source (copying overlaps with it)
+};
+
+// Function to copy a source tree into a new snapshot and write its manifest.
+// Files unchanged since previousBackup (according to its manifest) are hardlinked instead of copied,
+// or, for chunked snapshots, reuse the previous snapshot's chunk list without being read.
+// When dirtyPaths is given, only those paths are scanned and the rest is carried over unchanged.
+// With packThreshold, smaller files of directory snapshots go into packs; unchanged packed files
+// are carried over by hardlinking their packs.
+SnapshotStats copy_snapshot(const fs::path& sourcePath, const std::optional<fs::path>& previousBackup,
+                            const fs::path& newBackupPath, SnapshotFormat format, bool hashCompare,
+                            size_t jobs, bool verbose, const std::unordered_set<std::string>* dirtyPaths,
+                            IoThrottle* throttle, const PathFilter* filter, bool resume,
+                            FileHashCache* hashCache, uint64_t packThreshold = 0, bool hashCopies = true) {
+    auto startTime = std::chrono::steady_clock::now();
+    bool chunked = format == SnapshotFormat::Chunked;
+    bool packing = packThreshold > 0 && format == SnapshotFormat::Directory;
+
+    // The previous manifest is read alongside the walk, which visits paths in the same order
+    ManifestCursor previous;
+    bool havePrevious = false;
+    if (previousBackup) {
+        havePrevious = previous.open(*previousBackup, format);
+        if (!havePrevious && verbose) {
+            std::cout << "Previous backup has no usable manifest, copying everything\n";
+        }
+    }
+
+    fs::create_directories(newBackupPath);
+
+    std::unique_lock<std::timed_mutex> storeLock(chunk_store_mutex(), std::defer_lock);
+    std::optional<ChunkStore> store;
+    if (chunked) {
+        storeLock.lock();
+        store.emplace(newBackupPath.parent_path());
+    }
+
+    // Completed work is logged into the stage as it happens, so an interrupted run can continue
+    CheckpointState resumeState;
+    if (resume) {
+        resumeState = CheckpointLog::load(newBackupPath);
+    }
+    CheckpointLog checkpoint(newBackupPath);
+
+    // Packs are not checkpointed, so an interrupted run's packs are dropped and their files packed again
+    fs::path packDir = newBackupPath / PACK_DIR_NAME;
+    fs::path packIndexPath = newBackupPath / PACK_INDEX_FILE_NAME;
+    if (resume) {
+        fs::remove_all(packDir);
+        fs::remove(packIndexPath);
+    }
+
+    // Entries are filled in by the copy workers, so keep their addresses stable. Every
+    // MANIFEST_FLUSH_ENTRIES entries the workers are drained and the entries written out, which
+    // keeps memory flat however large the tree is.
+    std::deque<ManifestEntry> entries;
+    std::deque<std::vector<ChunkRef>> chunkLists;
+    std::deque<PackRef> packRefs; // parallel to entries; grown on demand, pack 0 = not packed
+    // Copies are hashed unless the user traded that for plain in-kernel copies
+    CopyEngine engine(resolve_job_count(jobs), verbose, hashCompare || hashCopies, store ? &*store : nullptr, throttle,
+                      &checkpoint, hashCache);
+    uint64_t bytesUnchanged = 0;
+    uint64_t filesResumed = 0;
+    uint64_t chunkedFiles = 0;
+    uint64_t filesCarriedInPacks = 0;
+
+    ManifestWriter writer(newBackupPath / MANIFEST_FILE_NAME, format);
+    std::ofstream index;
+    fs::path indexPath = newBackupPath / CHUNK_INDEX_FILE_NAME;
+    if (chunked) {
+        index.open(indexPath, std::ios::binary | std::ios::trunc);
+        if (!index.is_open()) {
+            throw std::runtime_error("Cannot create chunk index: " + indexPath.string());
+        }
+        write_u32(index, CHUNK_INDEX_MAGIC);
+    }
+
+    std::ofstream packIndex;
+    std::unordered_map<uint64_t, PackSummary> packTable;
+    std::unordered_map<uint64_t, bool> carriedPacks; // previous snapshot's packs: linked into this one?
+    if (packing) {
+        fs::create_directories(packDir);
+        engine.pack_into(packDir);
+        packIndex.open(packIndexPath, std::ios::binary | std::ios::trunc);
+        if (!packIndex.is_open()) {
+            throw std::runtime_error("Cannot create pack index: " + packIndexPath.string());
+        }
+        write_u32(packIndex, PACK_INDEX_MAGIC);
+    }
+
+    auto write_entries = [&] {
+        engine.drain();
+        for (const auto& entry : entries) {
+            writer.add(entry);
+        }
+        for (const auto& refs : chunkLists) {
+            write_chunk_refs(index, refs);
+        }
+        if (packing) {
+            packRefs.resize(entries.size());
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (entries[i].type != EntryType::File) continue;
+                write_pack_ref(packIndex, packRefs[i]);
+                if (packRefs[i].pack != 0) {
+                    packTable[packRefs[i].pack].liveBytes += entries[i].size;
+                }
+            }
+        }
+        entries.clear();
+        chunkLists.clear();
+        packRefs.clear();
+    };
+
+    // Links a pack of the previous snapshot into this one the first time a file in it is carried
+    // over. Packs mostly made of files since changed or deleted are left behind, so what is still
+    // in use gets packed afresh instead of dragging the dead space along.
+    auto carry_pack = [&](uint64_t pack) {
+        auto known = carriedPacks.find(pack);
+        if (known != carriedPacks.end()) {
+            return known->second;
+        }
+        const PackSummary* summary = previous.pack_summary(pack);
+        bool carried = summary && summary->liveBytes * 100 >= summary->size * PACK_MIN_LIVE_PERCENT;
+        if (carried) {
+            std::error_code ec;
+            fs::create_hard_link(*previousBackup / PACK_DIR_NAME / pack_file_name(pack),
+                                 packDir / pack_file_name(pack), ec);
+            carried = !ec;
+            if (carried) {
+                packTable[pack].size = summary->size;
+            }
+        }
+        carriedPacks.emplace(pack, carried);
+        return carried;
+    };
+
+    auto process = [&](const fs::path& fullPath, const std::string& relPath, const FileInfo& info) {
+        fs::path relative = from_manifest_path(relPath);
+        fs::path target = newBackupPath / relative;
+
+        ManifestEntry entry;
+        entry.path = relPath;
+        entry.type = info.type;
+        entry.size = info.size;
+        entry.mtimeNs = info.mtimeNs;
+        entry.fileId = info.fileId;
+        entry.mode = info.mode;
+
+        // Resuming an interrupted stage: files were only given their source mtime once fully
+        // written, so a staged file with the source's size and mtime is complete and is kept,
+        // with its hash taken from the checkpoint. Large files continue from their checkpointed
+        // chunks. Anything else in the way is removed rather than written through, since it
+        // may be a hardlink into an older snapshot.
+        if (resume && info.type == EntryType::File) {
+            auto done = resumeState.find_file(relPath);
+            bool recorded = done && done->size == info.size && done->mtimeNs == info.mtimeNs;
+            if (recorded) {
+                entry.hash = done->hash;
+                entry.hasHash = done->hasHash;
+            }
+
+            if (chunked) {
+                if (recorded && done->chunks &&
+                    std::all_of(done->chunks->begin(), done->chunks->end(),
+                                [&](const ChunkRef& ref) { return store->has_chunk(ref); })) {
+                    entries.push_back(std::move(entry));
+                    store->add_refs(*done->chunks);
+                    chunkLists.push_back(*done->chunks);
+                    chunkedFiles++;
+                    filesResumed++;
+                    bytesUnchanged += info.size;
+                    return;
+                }
+            } else {
+                FileInfo staged;
+                bool exists = read_file_info(target, staged);
+                if (exists && staged.type == EntryType::File && staged.size == info.size &&
+                    staged.mtimeNs == info.mtimeNs) {
+                    entries.push_back(std::move(entry));
+                    filesResumed++;
+                    bytesUnchanged += info.size;
+                    return;
+                }
+
+                auto partial = resumeState.largeFiles.find(relPath);
+                if (exists && staged.type == EntryType::File && staged.size == info.size &&
+                    partial != resumeState.largeFiles.end() && partial->second.size == info.size &&
+                    partial->second.mtimeNs == info.mtimeNs) {
+                    entries.push_back(std::move(entry));
+                    engine.copy(fullPath, target, info.size, info.mtimeNs, info.mode, &entries.back(),
+                                &partial->second);
+                    return;
+                }
+                if (exists) {
+                    fs::remove_all(target);
+                }
+            }
+        } else if (resume && !chunked) {
+            FileInfo staged;
+            if (read_file_info(target, staged) &&
+                !(info.type == EntryType::Directory && staged.type == EntryType::Directory)) {
+                fs::remove_all(target);
+            }
+        }
+
+        if (info.type == EntryType::Directory) {
+            // Directories are created here so workers never race on them
+            if (!chunked) {
+                fs::create_directories(target);
+            }
+            entries.push_back(std::move(entry));
+            return;
+        }
+
+        if (info.type == EntryType::Symlink) {
+            std::error_code ec;
+            fs::path linkTarget = fs::read_symlink(fullPath, ec);
+            if (!ec && !chunked) {
+                fs::copy_symlink(fullPath, target, ec);
+            }
+            if (ec) {
+                std::cerr << "Warning: Skipping link " << fullPath << ": " << ec.message() << "\n";
+                return;
+            }
+            entry.size = 0;
+            entry.linkTarget = to_manifest_path(linkTarget);
+            entries.push_back(std::move(entry));
+            return;
+        }
+
+        if (info.type != EntryType::File) {
+            return;
+        }
+        bool packable = packing && info.size < packThreshold;
+
+        const ManifestEntry* prev = havePrevious ? previous.find(relPath) : nullptr;
+        if (prev) {
+            const ManifestEntry& old = *prev;
+            bool unchanged = old.type == EntryType::File &&
+                             old.size == info.size &&
+                             old.mtimeNs == info.mtimeNs &&
+                             (old.fileId == 0 || info.fileId == 0 || old.fileId == info.fileId);
+
+            // With hashCompare, chunks and packed data are only reused when the cache vouches for
+            // the content
+            bool vouched = !hashCompare || (old.hasHash && hashCache && hashCache->lookup_path(fullPath) == old.hash);
+            bool reuseChunks = unchanged && chunked && vouched;
+            // A file packed before is copied or packed again unless its pack can be carried over
+            bool wasPacked = previous.pack().pack != 0;
+            if (wasPacked && unchanged && packable && vouched && carry_pack(previous.pack().pack)) {
+                entry.hash = old.hash;
+                entry.hasHash = old.hasHash;
+                entries.push_back(std::move(entry));
+                packRefs.resize(entries.size());
+                packRefs.back() = previous.pack();
+                filesCarriedInPacks++;
+                bytesUnchanged += info.size;
+                return;
+            } else if (reuseChunks) {
+                entry.hash = old.hash;
+                entry.hasHash = old.hasHash;
+                entries.push_back(std::move(entry));
+                store->add_refs(previous.chunks());
+                chunkLists.push_back(previous.chunks());
+                chunkedFiles++;
+                bytesUnchanged += info.size;
+                return;
+            } else if (unchanged && !chunked && !wasPacked) {
+                entry.hash = old.hash;
+                entry.hasHash = old.hasHash;
+                entries.push_back(std::move(entry));
+                engine.link(*previousBackup / relative, fullPath, target, info.size, info.mtimeNs,
+                            info.mode, &entries.back(), hashCompare);
+                bytesUnchanged += info.size;
+                return;
+            }
+        }
+
+        entries.push_back(std::move(entry));
+        if (chunked) {
+            // Chunking reads every byte anyway; identical chunks are still only stored once
+            chunkLists.emplace_back();
+            chunkedFiles++;
+            engine.store(fullPath, info.size, &entries.back(), &chunkLists.back());
+        } else if (packable) {
+            packRefs.resize(entries.size());
+            engine.pack(fullPath, info.size, &entries.back(), &packRefs.back());
+        } else {
+            engine.copy(fullPath, target, info.size, info.mtimeNs, info.mode, &entries.back());
+        }
+    };
+    auto process_and_flush = [&](const fs::path& fullPath, const std::string& relPath, const FileInfo& info) {
+        process(fullPath, relPath, info);
+        if (entries.size() >= MANIFEST_FLUSH_ENTRIES) {
+            write_entries();
+        }
+    };
+
+    if (dirtyPaths && havePrevious) {
+        walk_changed_paths(sourcePath, *previousBackup, *dirtyPaths, process_and_flush, filter);
+    } else {
+        walk_tree_sorted(sourcePath, "", process_and_flush, filter);
+    }
+    auto scanEnd = std::chrono::steady_clock::now();
+
+    write_entries();
+    engine.finish();
+
+    checkpoint.discard();
+
+    if (packing) {
+        for (const auto& [pack, size] : engine.packs_written()) {
+            packTable[pack].size = size;
+        }
+        write_pack_table(packIndex, packTable);
+        packIndex.close();
+        if (!packIndex) {
+            throw std::runtime_error("Failed to write pack index: " + packIndexPath.string());
+        }
+    }
+
+    if (store) {
+        // Persist references before the index that relies on them
+        store->commit();
+
+        index.close();
+        if (!index) {
+            throw std::runtime_error("Failed to write chunk index: " + indexPath.string());
+        }
+    }
+
+    // Hardlinked files and reused chunks cost nothing, so only newly written data is counted
+    writer.set_snapshot_stats(store ? store->bytes_written() : engine.stats().bytesCopied.load(),
+                              std::chrono::steady_clock::now() - startTime);
+    writer.finish();
+
+    // Drop whatever the interrupted run staged that is no longer in the source, found by
+    // walking the stage alongside the manifest just written
+    if (resume && !chunked) {
+        ManifestCursor kept;
+        if (!kept.open(newBackupPath, format)) {
+            throw std::runtime_error("Cannot read back manifest of " + newBackupPath.string());
+        }
+        std::vector<fs::path> stale;
+        walk_tree_sorted(newBackupPath, "", [&](const fs::path& fullPath, const std::string& relPath, const FileInfo&) {
+            bool packData = relPath == PACK_INDEX_FILE_NAME || relPath == PACK_DIR_NAME ||
+                            relPath.starts_with(std::string(PACK_DIR_NAME) + "/");
+            if (relPath != MANIFEST_FILE_NAME && !packData && !kept.find(relPath)) {
+                stale.push_back(fullPath);
+            }
+        });
+        for (const fs::path& path : stale) {
+            std::error_code ec;
+            fs::remove_all(path, ec); // may already be gone with a stale parent
+        }
+    }
+
+    SnapshotStats stats;
+    stats.filesCopied = engine.stats().filesCopied;
+    stats.filesLinked = engine.stats().filesLinked + filesResumed + filesCarriedInPacks +
+                        (chunked ? chunkedFiles - stats.filesCopied : 0);
+    stats.bytesCopied = engine.stats().bytesCopied;
+    stats.bytesSkipped = bytesUnchanged;
+    stats.scanSeconds = std::chrono::duration<double>(scanEnd - startTime).count();
+    if (store) {
+        stats.chunksWritten = store->chunks_written();
+        stats.chunkBytesWritten = store->bytes_written();
+    }
+    return stats;
+}
+
+// Past this many distinct changed paths a batch is turned into a full scan
+constexpr size_t WATCH_MAX_DIRTY_PATHS = 100000;
+
+// Collects paths changed under a source tree between backup cycles, using inotify on Linux
+// and ReadDirectoryChangesW on Windows. Paths are relative, in manifest form.
+class ChangeWatcher {
+public:
+    // onChange is called from the watcher thread whenever a change is recorded
+    ChangeWatcher(const fs::path& root, std::function<void()> onChange)
+        : root_(root), onChange_(std::move(onChange)) {
+#ifdef _WIN32
+        dir_ = CreateFileW(root.c_str(), FILE_LIST_DIRECTORY,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+        if (dir_ == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        active_ = true;
+        thread_ = std::thread([this] { run(); });
+#elif defined(__linux__)
+        fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd_ < 0 || ::pipe(stopPipe_) != 0) {
+            return;
+        }
+        active_ = true;
+        add_watch_tree(root_, "");
+        thread_ = std::thread([this] { run(); });
+#endif
+    }
+
+    ChangeWatcher(const ChangeWatcher&) = delete;
+    ChangeWatcher& operator=(const ChangeWatcher&) = delete;
+
+    ~ChangeWatcher() {
+#ifdef _WIN32
+        stopping_ = true;
+        if (dir_ != INVALID_HANDLE_VALUE) {
+            CancelIoEx(dir_, nullptr);
+        }
+        if (thread_.joinable()) thread_.join();
+        if (dir_ != INVALID_HANDLE_VALUE) CloseHandle(dir_);
+#elif defined(__linux__)
+        if (stopPipe_[1] >= 0) {
+            char byte = 0;
+            [[maybe_unused]] auto n = ::write(stopPipe_[1], &byte, 1);
+        }
+        if (thread_.joinable()) thread_.join();
+        if (fd_ >= 0) ::close(fd_);
+        if (stopPipe_[0] >= 0) ::close(stopPipe_[0]);
+        if (stopPipe_[1] >= 0) ::close(stopPipe_[1]);
+#endif
+    }
+
+    // False if change notification is unavailable and the caller should keep polling
+    bool active() const { return active_; }
+
+    // When the pending changes should be backed up, or nothing if there are none. The batch is due
+    // once no change has arrived for quietPeriod, but no later than maxLatency after its first change,
+    // so a burst of writes ends up in a single cycle.
+    std::optional<std::chrono::steady_clock::time_point> batch_due(std::chrono::steady_clock::duration quietPeriod,
+                                                                   std::chrono::steady_clock::duration maxLatency) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!pending()) {
+            return std::nullopt;
+        }
+        return std::min(lastChange_ + quietPeriod, firstChange_ + maxLatency);
+    }
+
+    // Takes the collected paths; overflowed is set when events were lost and a full scan is needed
+    std::unordered_set<std::string> take_changes(bool& overflowed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        overflowed = overflowed_;
+        overflowed_ = false;
+        firstChange_ = {};
+        std::unordered_set<std::string> changes;
+        changes.swap(dirty_);
+        return changes;
+    }
+
+    // Forces the next cycle to rescan everything (e.g. after a failed backup)
+    void request_full_scan() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            note_change();
+            overflowed_ = true;
+            dirty_.clear();
+        }
+        if (onChange_) onChange_();
+    }
+
+private:
+    bool pending() const { return overflowed_ || !dirty_.empty(); }
+
+    // Called with mutex_ held
+    void note_change() {
+        auto now = std::chrono::steady_clock::now();
+        if (!pending()) {
+            firstChange_ = now;
+        }
+        lastChange_ = now;
+    }
+
+    void record(const std::string& relPath) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            note_change();
+            // Repeated writes to the same path collapse into one entry; once a full scan is
+            // coming anyway there is nothing to collect
+            if (!overflowed_) {
+                dirty_.insert(relPath);
+                if (dirty_.size() > WATCH_MAX_DIRTY_PATHS) {
+                    overflowed_ = true;
+                    dirty_.clear();
+                }
+            }
+        }
+        if (onChange_) onChange_();
+    }
+
+#ifdef _WIN32
+    void run() {
+        std::vector<DWORD> buffer(16 * 1024);
+        const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                             FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SIZE |
+                             FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION;
+
+        while (!stopping_) {
+            DWORD bytes = 0;
+            if (!ReadDirectoryChangesW(dir_, buffer.data(), static_cast<DWORD>(buffer.size() * sizeof(DWORD)),
+                                       TRUE, filter, &bytes, nullptr, nullptr)) {
+                break;
+            }
+            if (bytes == 0) {
+                // Notification buffer overflowed, changes were lost
+                request_full_scan();
+                continue;
+            }
+
+            auto* info = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(buffer.data());
+            while (true) {
+                std::wstring name(info->FileName, info->FileNameLength / sizeof(WCHAR));
+                record(to_manifest_path(fs::path(name)));
+                if (info->NextEntryOffset == 0) break;
+                info = reinterpret_cast<FILE_NOTIFY_INFORMATION*>(reinterpret_cast<char*>(info) + info->NextEntryOffset);
+            }
+        }
+    }
+
+    HANDLE dir_ = INVALID_HANDLE_VALUE;
+    std::atomic<bool> stopping_{false};
+#elif defined(__linux__)
+    static constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                           IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                                           IN_ONLYDIR | IN_EXCL_UNLINK;
+
+    // inotify is not recursive, so every directory gets its own watch
+    void add_watch_tree(const fs::path& dir, const std::string& relDir) {
+        add_watch(dir, relDir);
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(dir, fs::directory_options::skip_permission_denied, ec);
+             !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_directory(ec) && !it->is_symlink(ec)) {
+                std::string relPath = to_manifest_path(it->path().lexically_relative(root_));
+                add_watch(it->path(), relPath);
+            }
+        }
+    }
+
+    void add_watch(const fs::path& dir, const std::string& relDir) {
+        int wd = ::inotify_add_watch(fd_, dir.c_str(), WATCH_MASK);
+        if (wd < 0) {
+            if (errno == ENOSPC && !warnedLimit_) {
+                std::cerr << "Warning: inotify watch limit reached (fs.inotify.max_user_watches), "
+                          << "falling back to full scans\n";
+                warnedLimit_ = true;
+            }
+            request_full_scan();
+            return;
+        }
+        watches_[wd] = relDir;
+    }
+
+    void run() {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        struct pollfd fds[2];
+        fds[0].fd = fd_;
+        fds[0].events = POLLIN;
+        fds[1].fd = stopPipe_[0];
+        fds[1].events = POLLIN;
+
+        while (true) {
+            if (::poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (fds[1].revents) {
+                return;
+            }
+
+            ssize_t len = ::read(fd_, buffer, sizeof(buffer));
+            if (len <= 0) continue;
+
+            for (char* p = buffer; p < buffer + len;) {
+                auto* event = reinterpret_cast<struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    request_full_scan();
+                    continue;
+                }
+
+                auto watch = watches_.find(event->wd);
+                if (watch == watches_.end()) continue;
+                if (event->mask & IN_IGNORED) {
+                    watches_.erase(watch);
+                    continue;
+                }
+
+                std::string relPath = watch->second;
+                if (event->len > 0) {
+                    std::string name(event->name);
+                    relPath = relPath.empty() ? name : relPath + "/" + name;
+                }
+
+                // New or moved-in directories need watches of their own; their whole subtree is dirty
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    add_watch_tree(root_ / from_manifest_path(relPath), relPath);
+                }
+
+                if (!relPath.empty()) {
+                    record(relPath);
+                }
+            }
+        }
+    }
+
+    int fd_ = -1;
+    int stopPipe_[2] = {-1, -1};
+    std::unordered_map<int, std::string> watches_;
+    bool warnedLimit_ = false;
+#endif
+
+    fs::path root_;
+    std::function<void()> onChange_;
+    bool active_ = false;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::unordered_set<std::string> dirty_;
+    bool overflowed_ = false;
+    std::chrono::steady_clock::time_point firstChange_;
+    std::chrono::steady_clock::time_point lastChange_;
+};
+
+// Function to write a snapshot as a single compressed archive plus its manifest
+SnapshotStats write_archive_snapshot(const fs::path& sourcePath, const fs::path& newBackupPath, size_t jobs,
+                                     IoThrottle* throttle, const PathFilter* filter) {
+    auto startTime = std::chrono::steady_clock::now();
+    fs::create_directories(newBackupPath);
+
+    SnapshotStats stats;
+    IoThrottle* activeThrottle = throttle && throttle->enabled() ? throttle : nullptr;
+    ArchiveWriter archive(newBackupPath / ARCHIVE_FILE_NAME, resolve_job_count(jobs), activeThrottle);
+    ManifestWriter writer(newBackupPath / MANIFEST_FILE_NAME, SnapshotFormat::Archive);
+
+    walk_tree_sorted(sourcePath, "", [&](const fs::path& fullPath, const std::string& relPath, const FileInfo& info) {
+        ManifestEntry entry;
+        entry.path = relPath;
+        entry.type = info.type;
+        entry.size = info.size;
+        entry.mtimeNs = info.mtimeNs;
+        entry.fileId = info.fileId;
+        entry.mode = info.mode;
+
+        if (info.type == EntryType::Symlink) {
+            std::error_code ec;
+            fs::path linkTarget = fs::read_symlink(fullPath, ec);
+            if (ec) {
+                std::cerr << "Warning: Skipping link " << fullPath << ": " << ec.message() << "\n";
+                return;
+            }
+            entry.size = 0;
+            entry.linkTarget = to_manifest_path(linkTarget);
+        } else if (info.type != EntryType::File && info.type != EntryType::Directory) {
+            return;
+        }
+
+        archive.add_entry(entry);
+        if (info.type == EntryType::File) {
+            if (activeThrottle) {
+                activeThrottle->file_started();
+            }
+            entry.hash = archive.add_file(fullPath, entry.size);
+            entry.hasHash = true;
+            stats.filesCopied++;
+            stats.bytesCopied += entry.size;
+        }
+        writer.add(entry);
+    }, filter);
+
+    archive.finish();
+    writer.set_snapshot_stats(fs::file_size(newBackupPath / ARCHIVE_FILE_NAME),
+                              std::chrono::steady_clock::now() - startTime);
+    writer.finish();
+    return stats;
+}
+
+// Status of the latest cycles, rewritten after every cycle (see --status-file)
+constexpr const char* STATUS_FILE_NAME = ".flameup_status.json";
+// A cycle taking longer than this share of its interval is reported
+constexpr double SLOW_CYCLE_WARNING_RATIO = 0.8;
+// With --verify-sample, each source has one snapshot sampled this often, when no cycle is due soon
+constexpr auto DAEMON_VERIFY_INTERVAL = std::chrono::hours(1);
+constexpr auto DAEMON_VERIFY_MIN_IDLE = std::chrono::minutes(1);
+
+// Timings and counters of one backup cycle
+struct CycleMetrics {
+    std::string source;
+    std::string backupName;
+    bool success = false;
+    std::string error;
+    int64_t finishedAtSeconds = 0; // Unix time
+    double scanSeconds = 0;
+    double cleanupSeconds = 0;
+    double totalSeconds = 0;
+    uint64_t filesCopied = 0;
+    uint64_t filesSkipped = 0;
+    uint64_t bytesCopied = 0;
+    uint64_t bytesSkipped = 0;
+    double intervalSeconds = 0; // 0 in watch mode
+};
+
+// Keeps the latest cycle and running totals per source; publishes them as a JSON status file
+// and in the Prometheus text format. Thread-safe.
+class MetricsRegistry {
+public:
+    explicit MetricsRegistry(fs::path statusFile) : statusFile_(std::move(statusFile)) {}
+
+    void record(const CycleMetrics& cycle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SourceMetrics& source = sources_[cycle.source];
+        source.last = cycle;
+        source.cycles++;
+        if (!cycle.success) {
+            source.failures++;
+        }
+        source.bytesCopiedTotal += cycle.bytesCopied;
+        source.filesCopiedTotal += cycle.filesCopied;
+        write_status_file();
+    }
+
+    std::string prometheus_text() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        auto metric = [&](const char* name, const char* type, const char* help, auto value) {
+            out << "# HELP " << name << " " << help << "\n";
+            out << "# TYPE " << name << " " << type << "\n";
+            for (const auto& [path, source] : sources_) {
+                out << name << "{source=" << json_string(path) << "} " << value(source) << "\n";
+            }
+        };
+
+        metric("flameup_backup_cycles_total", "counter", "Backup cycles run",
+               [](const SourceMetrics& s) { return s.cycles; });
+        metric("flameup_backup_failures_total", "counter", "Backup cycles that failed",
+               [](const SourceMetrics& s) { return s.failures; });
+        metric("flameup_copied_bytes_total", "counter", "Bytes copied by all cycles",
+               [](const SourceMetrics& s) { return s.bytesCopiedTotal; });
+        metric("flameup_copied_files_total", "counter", "Files copied by all cycles",
+               [](const SourceMetrics& s) { return s.filesCopiedTotal; });
+        metric("flameup_last_success", "gauge", "Whether the last cycle succeeded",
+               [](const SourceMetrics& s) { return s.last.success ? 1 : 0; });
+        metric("flameup_last_timestamp_seconds", "gauge", "Unix time the last cycle finished",
+               [](const SourceMetrics& s) { return s.last.finishedAtSeconds; });
+        metric("flameup_last_duration_seconds", "gauge", "Duration of the last cycle",
+               [](const SourceMetrics& s) { return s.last.totalSeconds; });
+        metric("flameup_last_scan_seconds", "gauge", "Time the last cycle spent walking the source",
+               [](const SourceMetrics& s) { return s.last.scanSeconds; });
+        metric("flameup_last_cleanup_seconds", "gauge", "Time the last cycle spent on retention",
+               [](const SourceMetrics& s) { return s.last.cleanupSeconds; });
+        metric("flameup_last_copied_bytes", "gauge", "Bytes copied by the last cycle",
+               [](const SourceMetrics& s) { return s.last.bytesCopied; });
+        metric("flameup_last_skipped_bytes", "gauge", "Unchanged bytes carried over by the last cycle",
+               [](const SourceMetrics& s) { return s.last.bytesSkipped; });
+        metric("flameup_last_copied_files", "gauge", "Files copied by the last cycle",
+               [](const SourceMetrics& s) { return s.last.filesCopied; });
+        metric("flameup_last_skipped_files", "gauge", "Unchanged files carried over by the last cycle",
+               [](const SourceMetrics& s) { return s.last.filesSkipped; });
+        metric("flameup_last_throughput_bytes_per_second", "gauge", "Copy throughput of the last cycle",
+               [](const SourceMetrics& s) { return throughput(s.last); });
+        metric("flameup_interval_seconds", "gauge", "Configured backup interval (0 in watch mode)",
+               [](const SourceMetrics& s) { return s.last.intervalSeconds; });
+        return out.str();
+    }
+
+private:
+    struct SourceMetrics {
+        CycleMetrics last;
+        uint64_t cycles = 0;
+        uint64_t failures = 0;
+        uint64_t bytesCopiedTotal = 0;
+        uint64_t filesCopiedTotal = 0;
+    };
+
+    static double throughput(const CycleMetrics& cycle) {
+        return cycle.totalSeconds > 0 ? static_cast<double>(cycle.bytesCopied) / cycle.totalSeconds : 0.0;
+    }
+
+    static std::string json_string(const std::string& s) {
+        std::ostringstream out;
+        out << '"';
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+            } else {
+                out << c;
+            }
+        }
+        out << '"';
+        return out.str();
+    }
+
+    // Written to a temporary file and renamed so readers never see a partial document
+    void write_status_file() {
+        if (statusFile_.empty()) return;
+
+        std::ostringstream out;
+        out << "{\n  \"sources\": [\n";
+        size_t i = 0;
+        for (const auto& [path, source] : sources_) {
+            const CycleMetrics& c = source.last;
+            out << "    {\n";
+            out << "      \"source\": " << json_string(path) << ",\n";
+            out << "      \"cycles\": " << source.cycles << ",\n";
+            out << "      \"failures\": " << source.failures << ",\n";
+            out << "      \"last_cycle\": {\n";
+            out << "        \"backup\": " << json_string(c.backupName) << ",\n";
+            out << "        \"success\": " << (c.success ? "true" : "false") << ",\n";
+            out << "        \"error\": " << json_string(c.error) << ",\n";
+            out << "        \"finished_at\": " << c.finishedAtSeconds << ",\n";
+            out << "        \"duration_seconds\": " << c.totalSeconds << ",\n";
+            out << "        \"scan_seconds\": " << c.scanSeconds << ",\n";
+            out << "        \"cleanup_seconds\": " << c.cleanupSeconds << ",\n";
+            out << "        \"files_copied\": " << c.filesCopied << ",\n";
+            out << "        \"files_skipped\": " << c.filesSkipped << ",\n";
+            out << "        \"bytes_copied\": " << c.bytesCopied << ",\n";
+            out << "        \"bytes_skipped\": " << c.bytesSkipped << ",\n";
+            out << "        \"throughput_bytes_per_second\": " << throughput(c) << ",\n";
+            out << "        \"interval_seconds\": " << c.intervalSeconds << "\n";
+            out << "      }\n";
+            out << "    }" << (++i < sources_.size() ? ",\n" : "\n");
+        }
+        out << "  ]\n}\n";
+
+        fs::path tempPath = statusFile_.string() + ".tmp";
+        {
+            std::ofstream file(tempPath, std::ios::trunc);
+            file << out.str();
+            if (!file) {
+                std::cerr << "Warning: Could not write status file " << statusFile_ << "\n";
+                return;
+            }
+        }
+        std::error_code ec;
+        fs::rename(tempPath, statusFile_, ec);
+    }
+
+    fs::path statusFile_;
+    std::mutex mutex_;
+    std::map<std::string, SourceMetrics> sources_;
+};
+
+constexpr std::chrono::milliseconds METRICS_CLIENT_TIMEOUT{2000}; // a scraper gets this long per request
+constexpr size_t METRICS_MAX_REQUEST = 8192;                       // bytes read before the request line must end
+
+// Serves MetricsRegistry::prometheus_text() over plain HTTP for Prometheus scrapes
+// Clients are served one at a time, each within METRICS_CLIENT_TIMEOUT, so one that connects
+// and stalls only delays the next scrape briefly.
+class MetricsServer {
+public:
+    MetricsServer(const std::string& address, uint16_t port, MetricsRegistry& registry) : registry_(registry) {
+#ifdef _WIN32
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+            throw std::runtime_error("WSAStartup failed");
+        }
+#else
+        // A scraper hanging up mid-response must not end the daemon
+        ::signal(SIGPIPE, SIG_IGN);
+#endif
+        listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listener_ == INVALID_SOCKET_HANDLE) {
+            throw std::runtime_error("Cannot create metrics socket");
+        }
+        int reuse = 1;
+        ::setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (::inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+            close_socket(listener_);
+            throw std::runtime_error("Invalid metrics address: " + address);
+        }
+        if (::bind(listener_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listener_, 16) != 0) {
+            close_socket(listener_);
+            throw std::runtime_error("Cannot listen on " + address + ":" + std::to_string(port));
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    ~MetricsServer() {
+        stopping_ = true;
+        thread_.join();
+        close_socket(listener_);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    using SocketHandle = SOCKET;
+    static constexpr SocketHandle INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+    static void close_socket(SocketHandle s) { ::closesocket(s); }
+    static int poll_socket(pollfd* fds, int timeoutMs) { return ::WSAPoll(fds, 1, timeoutMs); }
+#else
+    using SocketHandle = int;
+    static constexpr SocketHandle INVALID_SOCKET_HANDLE = -1;
+    static void close_socket(SocketHandle s) { ::close(s); }
+    static int poll_socket(pollfd* fds, int timeoutMs) { return ::poll(fds, 1, timeoutMs); }
+#endif
+
+    void run() {
+        while (!stopping_) {
+            // Wake up periodically to notice shutdown
+            pollfd fds{};
+            fds.fd = listener_;
+            fds.events = POLLIN;
+            if (poll_socket(&fds, 500) <= 0) continue;
+
+            SocketHandle client = ::accept(listener_, nullptr, nullptr);
+            if (client == INVALID_SOCKET_HANDLE) continue;
+            handle(client);
+            close_socket(client);
+        }
+    }
+
+    void handle(SocketHandle client) {
+        // A send larger than the free buffer space blocks past the poll below; bound it too
+#ifdef _WIN32
+        DWORD sendTimeout = static_cast<DWORD>(METRICS_CLIENT_TIMEOUT.count());
+        ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&sendTimeout), sizeof(sendTimeout));
+#else
+        timeval sendTimeout{};
+        sendTimeout.tv_sec = static_cast<time_t>(METRICS_CLIENT_TIMEOUT.count() / 1000);
+        sendTimeout.tv_usec = static_cast<suseconds_t>(METRICS_CLIENT_TIMEOUT.count() % 1000 * 1000);
+        ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+#endif
+
+        // Only the request line matters; wait for it until the deadline, within a size cap
+        auto deadline = std::chrono::steady_clock::now() + METRICS_CLIENT_TIMEOUT;
+        std::string request;
+        char buffer[1024];
+        while (request.find('\n') == std::string::npos) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            pollfd fds{};
+            fds.fd = client;
+            fds.events = POLLIN;
+            if (request.size() >= METRICS_MAX_REQUEST || left.count() <= 0 ||
+                poll_socket(&fds, static_cast<int>(left.count())) <= 0) {
+                return;
+            }
+            int got = static_cast<int>(::recv(client, buffer, sizeof(buffer), 0));
+            if (got <= 0) return;
+            request.append(buffer, static_cast<size_t>(got));
+        }
+
+        std::string body;
+        std::string status = "200 OK";
+        std::string line = request.substr(0, request.find_first_of("\r\n"));
+        if (line.starts_with("GET /metrics ") || line.starts_with("GET / ")) {
+            body = registry_.prometheus_text();
+        } else {
+            status = "404 Not Found";
+            body = "Not found\n";
+        }
+
+        std::string response = "HTTP/1.1 " + status + "\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+#ifdef MSG_NOSIGNAL
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        size_t sent = 0;
+        while (sent < response.size()) {
+            // A client that stops reading is dropped at the same deadline
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            pollfd fds{};
+            fds.fd = client;
+            fds.events = POLLOUT;
+            if (left.count() <= 0 || poll_socket(&fds, static_cast<int>(left.count())) <= 0) {
+                return;
+            }
+            int n = static_cast<int>(::send(client, response.data() + sent, static_cast<int>(response.size() - sent),
+                                            flags));
+            if (n <= 0) break;
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    MetricsRegistry& registry_;
+    SocketHandle listener_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+
+// Optional collaborators for one backup cycle
+struct BackupCycleContext {
+    const std::unordered_set<std::string>* dirtyPaths = nullptr; // limits the scan to these (nullptr = full scan)
+    TrashCollector* trash = nullptr;
+    IoThrottle* throttle = nullptr;
+    CycleMetrics* metrics = nullptr;
+};
+
+// Function to pick up the newest interrupted snapshot stage, discarding any older ones. Only call
+// with the root's BACKUP_LOCK_FILE_NAME lock held: every stage's owner holds it while writing, so
+// a stage found then was left by a run that is gone.
+std::optional<fs::path> take_partial_snapshot(const fs::path& backupRoot, TrashCollector* trash) {
+    std::vector<fs::path> partials;
+    for (const auto& entry : fs::directory_iterator(backupRoot)) {
+        std::string name = entry.path().filename().string();
+        if (entry.is_directory() && name.starts_with("Backup_") && name.ends_with(PARTIAL_SUFFIX)) {
+            partials.push_back(entry.path());
+        }
+    }
+    if (partials.empty()) {
+        return std::nullopt;
+    }
+
+    std::sort(partials.begin(), partials.end());
+    for (size_t i = 0; i + 1 < partials.size(); i++) {
+        if (!trash || !move_to_trash(partials[i])) {
+            remove_snapshot(partials[i], backupRoot);
+        }
+    }
+    return partials.back();
+}
+
+// Function to record a published snapshot in its root's catalog
+void add_to_catalog(const fs::path& root, const std::string& name, int64_t createdNs, const std::string& source) {
+    CatalogEntry entry;
+    entry.name = name;
+    entry.createdNs = createdNs;
+    entry.source = source;
+    if (auto header = read_manifest_header(root / name)) {
+        entry.hasManifest = true;
+        entry.header = *header;
+    }
+    SnapshotCatalog(root).add(std::move(entry));
+}
+
+#ifdef _WIN32
+// Function to flush every file and directory under a staged snapshot with FlushFileBuffers, as
+// Windows has no unprivileged whole-volume flush. Files that cannot be opened for writing are
+// read-only ones, hardlinked from an earlier snapshot or copied read-only; they are skipped.
+void flush_tree(const fs::path& root) {
+    auto flush = [](const fs::path& path, bool directory) {
+        HANDLE handle = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                    nullptr, OPEN_EXISTING, directory ? FILE_FLAG_BACKUP_SEMANTICS : 0, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        bool ok = FlushFileBuffers(handle);
+        CloseHandle(handle);
+        if (!ok) {
+            throw std::runtime_error("Cannot flush " + path.string() + ": error " + std::to_string(GetLastError()));
+        }
+    };
+    for (const auto& entry : fs::recursive_directory_iterator(root)) {
+        if (entry.is_regular_file() || entry.is_directory()) {
+            flush(entry.path(), entry.is_directory());
+        }
+    }
+    flush(root, true);
+}
+#endif
+
+// Function to flush a finished snapshot to disk and publish it under its final name
+// The rename is atomic, so a snapshot is either absent or complete, and it only happens once
+// the data under it is durable. The parent directory is synced afterwards to persist the name.
+// On Linux one syncfs covers the tree and the chunks it added to the store for the price of a
+// single barrier, where an fsync per file would cost hundreds of thousands on big trees. The
+// trade-off is that it also waits for whatever else is dirty on that filesystem, so publishing
+// onto a busy shared volume can take longer than the snapshot's own data needs.
+void publish_snapshot(const fs::path& stagePath, const fs::path& finalPath) {
+#ifdef _WIN32
+    flush_tree(stagePath);
+    if (!MoveFileExW(stagePath.c_str(), finalPath.c_str(), MOVEFILE_WRITE_THROUGH)) {
+        throw std::runtime_error("Cannot publish snapshot " + finalPath.string() + ": error " +
+                                 std::to_string(GetLastError()));
+    }
+#else
+    sync_filesystem(stagePath);
+    fs::rename(stagePath, finalPath);
+    int dirFd = ::open(finalPath.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+#endif
+}
+
+// A replication peer that sends or accepts nothing for this long fails the session
+constexpr std::chrono::seconds NETWORK_IO_TIMEOUT{60};
+// An ssh client still running this long after its session ended is killed
+constexpr std::chrono::seconds PROCESS_EXIT_TIMEOUT{10};
+
+// Byte stream a replication session runs over: a TCP socket, the pipes of an ssh process or
+// the server's own stdin/stdout. Reads and writes fail after NETWORK_IO_TIMEOUT without progress.
+class ByteStream {
+public:
+    virtual ~ByteStream() = default;
+
+    // Returns 0 at the end of the stream
+    virtual size_t read_some(char* data, size_t size) = 0;
+    virtual void write_all(const char* data, size_t size) = 0;
+};
+
+class SocketStream : public ByteStream {
+public:
+#ifdef _WIN32
+    using SocketHandle = SOCKET;
+    static constexpr SocketHandle INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+#else
+    using SocketHandle = int;
+    static constexpr SocketHandle INVALID_SOCKET_HANDLE = -1;
+#endif
+
+    explicit SocketStream(SocketHandle socket) : socket_(socket) {
+        int noDelay = 1;
+        ::setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        set_timeouts(socket_);
+    }
+
+    SocketStream(const SocketStream&) = delete;
+    SocketStream& operator=(const SocketStream&) = delete;
+
+    ~SocketStream() override { close_socket(socket_); }
+
+    // Function to open a TCP connection to host:port
+    static std::unique_ptr<SocketStream> connect(const std::string& host, uint16_t port) {
+#ifdef _WIN32
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+            throw std::runtime_error("WSAStartup failed");
+        }
+#else
+        ::signal(SIGPIPE, SIG_IGN);
+#endif
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* results = nullptr;
+        if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &results) != 0 || !results) {
+            throw std::runtime_error("Cannot resolve " + host);
+        }
+
+        SocketHandle s = INVALID_SOCKET_HANDLE;
+        for (addrinfo* ai = results; ai && s == INVALID_SOCKET_HANDLE; ai = ai->ai_next) {
+            s = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (s != INVALID_SOCKET_HANDLE) {
+                set_timeouts(s);
+            }
+            if (s != INVALID_SOCKET_HANDLE && ::connect(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) != 0) {
+                close_socket(s);
+                s = INVALID_SOCKET_HANDLE;
+            }
+        }
+        ::freeaddrinfo(results);
+        if (s == INVALID_SOCKET_HANDLE) {
+            throw std::runtime_error("Cannot connect to " + host + ":" + std::to_string(port));
+        }
+        return std::make_unique<SocketStream>(s);
+    }
+
+    size_t read_some(char* data, size_t size) override {
+        int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+        while (true) {
+            int n = static_cast<int>(::recv(socket_, data, chunk, 0));
+            if (n >= 0) {
+                return static_cast<size_t>(n);
+            }
+            if (!interrupted()) {
+                throw std::runtime_error(timed_out() ? "Timed out waiting for the peer" : "Connection lost while receiving");
+            }
+        }
+    }
+
+    void write_all(const char* data, size_t size) override {
+#ifdef MSG_NOSIGNAL
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        while (size > 0) {
+            int chunk = static_cast<int>(std::min<size_t>(size, 1 << 30));
+            int n = static_cast<int>(::send(socket_, data, chunk, flags));
+            if (n < 0 && interrupted()) continue;
+            if (n <= 0) {
+                throw std::runtime_error(n < 0 && timed_out() ? "Timed out sending to the peer"
+                                                              : "Connection lost while sending");
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+    static void close_socket(SocketHandle s) {
+#ifdef _WIN32
+        ::closesocket(s);
+#else
+        ::close(s);
+#endif
+    }
+
+private:
+    // Function to make blocking sends and receives (and connects, on Linux) give up after
+    // NETWORK_IO_TIMEOUT
+    static void set_timeouts(SocketHandle s) {
+#ifdef _WIN32
+        DWORD ms = static_cast<DWORD>(std::chrono::milliseconds(NETWORK_IO_TIMEOUT).count());
+        ::setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&ms), sizeof(ms));
+        ::setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&ms), sizeof(ms));
+#else
+        timeval tv{};
+        tv.tv_sec = static_cast<time_t>(NETWORK_IO_TIMEOUT.count());
+        ::setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ::setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+    }
+
+    static bool timed_out() {
+#ifdef _WIN32
+        return WSAGetLastError() == WSAETIMEDOUT;
+#else
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+
+    static bool interrupted() {
+#ifdef _WIN32
+        return false;
+#else
+        return errno == EINTR;
+#endif
+    }
+
+    SocketHandle socket_;
+};
+
+// Stream over a pair of native pipe or console handles
+class PipeStream : public ByteStream {
+public:
+#ifdef _WIN32
+    using Handle = HANDLE;
+#else
+    using Handle = int;
+#endif
+
+    PipeStream(Handle in, Handle out) : in_(in), out_(out) {}
+
+    size_t read_some(char* data, size_t size) override {
+#ifdef _WIN32
+        DWORD got = 0;
+        if (!ReadFile(in_, data, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &got, nullptr)) {
+            return 0; // broken pipe = end of stream
+        }
+        return got;
+#else
+        while (true) {
+            wait_ready(in_, POLLIN);
+            ssize_t n = ::read(in_, data, size);
+            if (n >= 0) return static_cast<size_t>(n);
+            if (errno != EINTR) throw std::runtime_error(std::string("Pipe read failed: ") + std::strerror(errno));
+        }
+#endif
+    }
+
+    void write_all(const char* data, size_t size) override {
+        while (size > 0) {
+#ifdef _WIN32
+            DWORD written = 0;
+            if (!WriteFile(out_, data, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &written, nullptr) ||
+                written == 0) {
+                throw std::runtime_error("Pipe write failed");
+            }
+            size_t n = written;
+#else
+            wait_ready(out_, POLLOUT);
+            ssize_t n = ::write(out_, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::runtime_error(std::string("Pipe write failed: ") + std::strerror(errno));
+#endif
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+    }
+
+protected:
+#ifndef _WIN32
+    // Function to wait until fd can be read or written, failing once the peer has stalled for
+    // NETWORK_IO_TIMEOUT. Windows anonymous pipes cannot be waited on; ssh's keepalives cover them.
+    static void wait_ready(int fd, short events) {
+        pollfd pfd{};
+        pfd.fd = fd;
+        pfd.events = events;
+        while (true) {
+            int rc = ::poll(&pfd, 1, static_cast<int>(std::chrono::milliseconds(NETWORK_IO_TIMEOUT).count()));
+            if (rc > 0) return;
+            if (rc == 0) throw std::runtime_error("Timed out waiting for the peer");
+            if (errno != EINTR) throw std::runtime_error(std::string("poll failed: ") + std::strerror(errno));
+        }
+    }
+#endif
+
+    Handle in_;
+    Handle out_;
+};
+
+// Stream to a child process (the ssh client) through its stdin and stdout
+class ProcessStream : public PipeStream {
+public:
+    explicit ProcessStream(const std::vector<std::string>& args) : PipeStream({}, {}) {
+#ifdef _WIN32
+        SECURITY_ATTRIBUTES sa{sizeof(sa), nullptr, TRUE};
+        HANDLE childIn = nullptr;
+        HANDLE childOut = nullptr;
+        if (!CreatePipe(&childIn, &out_, &sa, 0) || !CreatePipe(&in_, &childOut, &sa, 0)) {
+            throw std::runtime_error("Cannot create pipes for " + args.front());
+        }
+        SetHandleInformation(out_, HANDLE_FLAG_INHERIT, 0);
+        SetHandleInformation(in_, HANDLE_FLAG_INHERIT, 0);
+
+        std::wstring commandLine;
+        for (const std::string& arg : args) {
+            if (!commandLine.empty()) commandLine += L' ';
+            commandLine += L'"' + fs::path(arg).wstring() + L'"';
+        }
+
+        STARTUPINFOW si{};
+        si.cb = sizeof(si);
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = childIn;
+        si.hStdOutput = childOut;
+        si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+        PROCESS_INFORMATION pi{};
+        BOOL started = CreateProcessW(nullptr, commandLine.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr,
+                                      &si, &pi);
+        CloseHandle(childIn);
+        CloseHandle(childOut);
+        if (!started) {
+            CloseHandle(in_);
+            CloseHandle(out_);
+            throw std::runtime_error("Cannot start " + args.front());
+        }
+        CloseHandle(pi.hThread);
+        process_ = pi.hProcess;
+#else
+        // A remote that goes away must surface as a write error, not kill the daemon
+        ::signal(SIGPIPE, SIG_IGN);
+
+        int toChild[2];
+        int fromChild[2];
+        if (::pipe(toChild) != 0 || ::pipe(fromChild) != 0) {
+            throw std::runtime_error("Cannot create pipes for " + args.front());
+        }
+        pid_ = ::fork();
+        if (pid_ == 0) {
+            ::dup2(toChild[0], STDIN_FILENO);
+            ::dup2(fromChild[1], STDOUT_FILENO);
+            ::close(toChild[0]);
+            ::close(toChild[1]);
+            ::close(fromChild[0]);
+            ::close(fromChild[1]);
+            std::vector<char*> argv;
+            for (const std::string& arg : args) {
+                argv.push_back(const_cast<char*>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            ::execvp(argv[0], argv.data());
+            ::_exit(127);
+        }
+        ::close(toChild[0]);
+        ::close(fromChild[1]);
+        if (pid_ < 0) {
+            ::close(toChild[1]);
+            ::close(fromChild[0]);
+            throw std::runtime_error("Cannot start " + args.front());
+        }
+        out_ = toChild[1];
+        in_ = fromChild[0];
+#endif
+    }
+
+    ProcessStream(const ProcessStream&) = delete;
+    ProcessStream& operator=(const ProcessStream&) = delete;
+
+    // Closing its input ends the child; one that still hangs (e.g. ssh waiting on a dead host)
+    // is killed after PROCESS_EXIT_TIMEOUT
+    ~ProcessStream() override {
+#ifdef _WIN32
+        CloseHandle(out_);
+        DWORD timeoutMs = static_cast<DWORD>(std::chrono::milliseconds(PROCESS_EXIT_TIMEOUT).count());
+        if (WaitForSingleObject(process_, timeoutMs) == WAIT_TIMEOUT) {
+            TerminateProcess(process_, 1);
+            WaitForSingleObject(process_, INFINITE);
+        }
+        CloseHandle(in_);
+        CloseHandle(process_);
+#else
+        ::close(out_);
+        int status = 0;
+        auto deadline = std::chrono::steady_clock::now() + PROCESS_EXIT_TIMEOUT;
+        while (::waitpid(pid_, &status, WNOHANG) == 0) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                ::kill(pid_, SIGKILL);
+                ::waitpid(pid_, &status, 0);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        ::close(in_);
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE process_ = nullptr;
+#else
+    pid_t pid_ = -1;
+#endif
+};
+
+constexpr uint32_t REPLICATION_MAGIC = 0x52504C46; // "FLPR"
+constexpr uint32_t REPLICATION_VERSION = 2;
+constexpr uint16_t REPLICATION_DEFAULT_PORT = 7420;
+constexpr size_t REPLICATION_PIECE_SIZE = 1 << 20;       // file data travels in pieces of this size
+constexpr uint64_t REPLICATION_PART_SIZE = 16 << 20;     // larger files are split into parts sent on any stream
+constexpr size_t REPLICATION_SEND_BUFFER = 4 << 20;      // frames are batched up to this many bytes
+constexpr uint64_t REPLICATION_MAX_FRAME = 1ULL << 32;   // manifests are sent as one frame
+constexpr size_t REPLICATION_MAX_STREAMS = 16;           // --remote-streams limit
+constexpr size_t REPLICATION_MAX_CONNECTIONS = 64;       // connections a --serve instance handles at once
+
+// Replication frames. The client drives a session as Hello, Manifest (+ Index), Data..., Commit
+// on its first connection; extra streams send Attach, Data..., Commit and get a Done each.
+enum class FrameType : uint8_t {
+    Hello = 1,    // client: magic, version, token, remote directory, snapshot name, format
+    Ready = 2,    // server: whether the snapshot is already present, and the session id
+    Manifest = 3, // client: the snapshot's manifest file
+    Index = 4,    // client: the chunk index (chunked snapshots)
+    Want = 5,     // server: the items it does not have
+    Data = 6,     // client: one piece of a wanted item
+    Commit = 7,   // client: everything wanted was sent (on this stream)
+    Done = 8,     // server: success flag and message
+    Attach = 9    // client: magic, version, token and session id of an extra data stream
+};
+
+// Framing over a ByteStream: a type byte, a u64 payload length and the payload. Outgoing
+// frames are buffered and only flushed when the buffer fills or before waiting for a reply,
+// so the many small frames of a transfer are pipelined instead of paying a round trip each.
+class FrameChannel {
+public:
+    explicit FrameChannel(ByteStream& stream) : stream_(stream) {}
+
+    void send(FrameType type, const char* data, size_t size) {
+        char header[9];
+        header[0] = static_cast<char>(type);
+        uint64_t length = size;
+        for (int i = 0; i < 8; i++) {
+            header[1 + i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+        }
+        buffer_.append(header, sizeof(header));
+        buffer_.append(data, size);
+        if (buffer_.size() >= REPLICATION_SEND_BUFFER) {
+            flush();
+        }
+    }
+
+    void send(FrameType type, const std::string& payload) { send(type, payload.data(), payload.size()); }
+
+    void flush() {
+        if (buffer_.empty()) return;
+        stream_.write_all(buffer_.data(), buffer_.size());
+        bytesSent_ += buffer_.size();
+        buffer_.clear();
+    }
+
+    // Flushes pending frames, then blocks for the next incoming frame
+    FrameType receive(std::string& payload) {
+        flush();
+        char header[9];
+        read_exact(header, sizeof(header));
+        uint64_t length = 0;
+        for (int i = 0; i < 8; i++) {
+            length |= static_cast<uint64_t>(static_cast<unsigned char>(header[1 + i])) << (8 * i);
+        }
+        if (length > REPLICATION_MAX_FRAME) {
+            throw std::runtime_error("Oversized replication frame");
+        }
+        payload.resize(static_cast<size_t>(length));
+        read_exact(payload.data(), payload.size());
+        return static_cast<FrameType>(header[0]);
+    }
+
+    FrameType receive(std::string& payload, FrameType expected) {
+        FrameType type = receive(payload);
+        if (type != expected) {
+            if (type == FrameType::Done) {
+                throw std::runtime_error("Remote: " + done_message(payload));
+            }
+            throw std::runtime_error("Unexpected replication frame");
+        }
+        return type;
+    }
+
+    // Waits for the peer's Done frame, throwing its message when it reports a failure
+    void receive_done() {
+        std::string payload;
+        receive(payload, FrameType::Done);
+        if (payload.empty() || payload[0] != 1) {
+            throw std::runtime_error("Remote: " + done_message(payload));
+        }
+    }
+
+    // Sends a Done frame and flushes it
+    void send_done(bool ok, const std::string& message) {
+        std::ostringstream done;
+        done.put(ok ? 1 : 0);
+        write_string(done, message);
+        send(FrameType::Done, done.str());
+        flush();
+    }
+
+    uint64_t bytes_sent() const { return bytesSent_; }
+
+private:
+    static std::string done_message(const std::string& payload) {
+        std::istringstream in(payload);
+        in.get();
+        std::string message;
+        read_string(in, message);
+        return message;
+    }
+
+    void read_exact(char* data, size_t size) {
+        while (size > 0) {
+            size_t got = stream_.read_some(data, size);
+            if (got == 0) {
+                throw std::runtime_error("Connection closed by peer");
+            }
+            data += got;
+            size -= got;
+        }
+    }
+
+    ByteStream& stream_;
+    std::string buffer_;
+    uint64_t bytesSent_ = 0;
+};
+
+// Function to read a whole small file, such as a manifest, into memory
+std::string read_whole_file(const fs::path& filePath) {
+    std::ifstream in(filePath, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Cannot read " + filePath.string());
+    }
+    std::ostringstream data;
+    data << in.rdbuf();
+    return data.str();
+}
+
+// Function to write a whole file from memory
+void write_whole_file(const fs::path& filePath, const std::string& data) {
+    std::ofstream out(filePath, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Cannot write " + filePath.string());
+    }
+}
+
+// Function to check that a path received from a peer stays inside the directory it is used in
+bool is_safe_relative_path(const std::string& path) {
+    if (path.empty() || path.front() == '/' || path.find('\\') != std::string::npos ||
+        path.find(':') != std::string::npos) {
+        return false;
+    }
+    for (size_t start = 0; start <= path.size();) {
+        size_t end = std::min(path.find('/', start), path.size());
+        std::string_view component = std::string_view(path).substr(start, end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// Function to compare secrets without an early exit that would tell how much of them matched
+bool constant_time_equal(const std::string& a, const std::string& b) {
+    unsigned char diff = a.size() == b.size() ? 0 : 1;
+    for (size_t i = 0; i < a.size(); i++) {
+        // b[0] of an empty string is its terminator, so the loop runs on a's length either way
+        diff |= static_cast<unsigned char>(a[i] ^ b[b.empty() ? 0 : i % b.size()]);
+    }
+    return diff == 0;
+}
+
+// Function to quote an argument for the remote shell ssh runs commands through
+std::string shell_quote(const std::string& arg) {
+    std::string quoted = "'";
+    for (char c : arg) {
+        quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return quoted + "'";
+}
+
+// Where replicated snapshots go, parsed from --remote
+struct RemoteTarget {
+    enum class Kind { FlameUp, Ssh } kind = Kind::FlameUp;
+    std::string user;
+    std::string host;
+    uint16_t port = 0;
+    std::string path; // flameup://: directory under the server's root; ssh://: remote backup root
+};
+
+// Function to parse flameup://host[:port][/dir] and ssh://[user@]host[:port]/path
+RemoteTarget parse_remote_target(const std::string& url) {
+    RemoteTarget target;
+    std::string rest;
+    if (url.starts_with("flameup://")) {
+        rest = url.substr(10);
+        target.port = REPLICATION_DEFAULT_PORT;
+    } else if (url.starts_with("ssh://")) {
+        target.kind = RemoteTarget::Kind::Ssh;
+        rest = url.substr(6);
+    } else if (url.starts_with("s3://") || url.starts_with("sftp://")) {
+        throw std::runtime_error("Unsupported remote " + url + ": use ssh:// with FlameUp installed on the host, "
+                                 "or flameup:// to a FlameUp --serve instance");
+    } else {
+        throw std::runtime_error("Unknown remote: " + url);
+    }
+
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    target.path = slash == std::string::npos ? "" : rest.substr(slash + 1);
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos) {
+        target.user = authority.substr(0, at);
+        authority = authority.substr(at + 1);
+    }
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos) {
+        target.port = static_cast<uint16_t>(std::stoul(authority.substr(colon + 1)));
+        authority = authority.substr(0, colon);
+    }
+    target.host = authority;
+
+    if (target.host.empty()) {
+        throw std::runtime_error("Remote has no host: " + url);
+    }
+    if (target.kind == RemoteTarget::Kind::Ssh && target.path.empty()) {
+        throw std::runtime_error("ssh:// remote needs a backup directory: " + url);
+    }
+    if (target.kind == RemoteTarget::Kind::FlameUp && !target.path.empty() && !is_safe_relative_path(target.path)) {
+        throw std::runtime_error("Invalid remote directory: " + target.path);
+    }
+    return target;
+}
+
+// One unit of work for a replication stream: a wanted chunk, or a part of a wanted file that
+// goes out as Data pieces of item from offset on
+struct ReplicationPart {
+    uint64_t item = 0;
+    fs::path filePath;
+    uint64_t fileStart = 0; // where the item starts in filePath (packed files)
+    uint64_t offset = 0;    // where this part starts in the item
+    uint64_t length = 0;
+    ChunkRef chunk;
+};
+
+// Function to send parts, taking the next unsent one from next, over channel until none are left
+// or abort is set. store is the chunk store for chunked snapshots, otherwise null.
+void send_replication_parts(FrameChannel& channel, const std::vector<ReplicationPart>& parts,
+                            std::atomic<size_t>& next, const std::atomic<bool>& abort, const ChunkStore* store) {
+    std::vector<char> buffer(REPLICATION_PIECE_SIZE);
+    std::string piece;
+    while (!abort) {
+        size_t index = next++;
+        if (index >= parts.size()) break;
+        const ReplicationPart& part = parts[index];
+
+        if (store) {
+            std::vector<char> data;
+            store->read_chunk(part.chunk, data);
+            std::ostringstream header;
+            write_u64(header, part.chunk.id.hi);
+            write_u64(header, part.chunk.id.lo);
+            piece = header.str();
+            piece.append(data.data(), data.size());
+            channel.send(FrameType::Data, piece);
+            continue;
+        }
+
+        NativeFile in = NativeFile::open_read(part.filePath);
+        for (uint64_t done = 0; done < part.length;) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(buffer.size(), part.length - done));
+            size_t got = in.read_at(buffer.data(), want, part.fileStart + part.offset + done);
+            if (got == 0) {
+                throw std::runtime_error("Snapshot file is shorter than its manifest says: " + part.filePath.string());
+            }
+            std::ostringstream header;
+            write_varint(header, part.item);
+            write_varint(header, part.offset + done);
+            piece = header.str();
+            piece.append(buffer.data(), got);
+            channel.send(FrameType::Data, piece);
+            done += got;
+        }
+    }
+}
+
+// Function to send a finished snapshot to the configured remote
+// The remote answers with what it is missing: chunks not yet in its store, files that differ
+// from its newest snapshot, or the archive, and only those are sent, pipelined. For flameup://
+// the work is spread over config.remoteStreams connections, large files in parts across them.
+// A remote that stalls fails the replication after NETWORK_IO_TIMEOUT.
+bool replicate_snapshot(const fs::path& snapshotPath, const BackupConfig& config) {
+    try {
+        auto startTime = std::chrono::steady_clock::now();
+        RemoteTarget target = parse_remote_target(config.remoteTarget);
+        std::string directory = target.kind == RemoteTarget::Kind::FlameUp ? target.path : "";
+        if (!config.remoteDirectory.empty()) {
+            directory = directory.empty() ? config.remoteDirectory : directory + "/" + config.remoteDirectory;
+        }
+
+        std::unique_ptr<ByteStream> stream;
+        if (target.kind == RemoteTarget::Kind::Ssh) {
+            // Keepalives make ssh itself give up on a host that stopped answering
+            std::vector<std::string> args{"ssh", "-o", "ServerAliveInterval=15", "-o", "ServerAliveCountMax=4"};
+            if (target.port) {
+                args.push_back("-p");
+                args.push_back(std::to_string(target.port));
+            }
+            args.push_back(target.user.empty() ? target.host : target.user + "@" + target.host);
+            args.push_back(config.remoteCommand + " --serve-stdio -o " + shell_quote("/" + target.path) +
+                           " -m " + std::to_string(config.maxBackups) +
+                           (config.retention.empty() ? "" : " --retain " + shell_quote(config.retention)));
+            stream = std::make_unique<ProcessStream>(args);
+        } else {
+            stream = SocketStream::connect(target.host, target.port);
+        }
+        FrameChannel channel(*stream);
+
+        ManifestReader reader;
+        if (!reader.open(snapshotPath / MANIFEST_FILE_NAME)) {
+            throw std::runtime_error("Snapshot has no manifest: " + snapshotPath.string());
+        }
+        SnapshotFormat format = reader.header().format;
+
+        std::ostringstream hello;
+        write_u32(hello, REPLICATION_MAGIC);
+        write_u32(hello, REPLICATION_VERSION);
+        write_string(hello, config.remoteToken);
+        write_string(hello, directory);
+        write_string(hello, snapshotPath.filename().string());
+        write_u32(hello, static_cast<uint32_t>(format));
+        channel.send(FrameType::Hello, hello.str());
+
+        std::string payload;
+        channel.receive(payload, FrameType::Ready);
+        if (!payload.empty() && payload[0]) {
+            std::cout << "✓ " << snapshotPath.filename().string() << " is already on " << config.remoteTarget << "\n";
+            return true;
+        }
+        uint64_t sessionId = 0;
+        std::istringstream ready(payload.size() > 1 ? payload.substr(1) : "");
+        read_u64(ready, sessionId);
+
+        channel.send(FrameType::Manifest, read_whole_file(snapshotPath / MANIFEST_FILE_NAME));
+        if (format == SnapshotFormat::Chunked) {
+            channel.send(FrameType::Index, read_whole_file(snapshotPath / CHUNK_INDEX_FILE_NAME));
+        }
+
+        channel.receive(payload, FrameType::Want);
+        std::istringstream want(payload);
+        uint64_t wantCount = 0;
+        read_varint(want, wantCount);
+
+        // Turn the want list into parts; files are cut into REPLICATION_PART_SIZE pieces so a
+        // large one is spread over all streams
+        std::vector<ReplicationPart> parts;
+        auto add_file = [&](uint64_t item, const fs::path& filePath, uint64_t start, uint64_t size) {
+            for (uint64_t offset = 0; offset < size; offset += REPLICATION_PART_SIZE) {
+                ReplicationPart part;
+                part.item = item;
+                part.filePath = filePath;
+                part.fileStart = start;
+                part.offset = offset;
+                part.length = std::min(REPLICATION_PART_SIZE, size - offset);
+                parts.push_back(std::move(part));
+            }
+        };
+
+        std::optional<ChunkStore> store;
+        if (format == SnapshotFormat::Chunked) {
+            store.emplace(snapshotPath.parent_path());
+            for (uint64_t i = 0; i < wantCount; i++) {
+                ReplicationPart part;
+                uint64_t length = 0;
+                if (!read_u64(want, part.chunk.id.hi) || !read_u64(want, part.chunk.id.lo) ||
+                    !read_varint(want, length)) {
+                    throw std::runtime_error("Corrupt want list from remote");
+                }
+                part.chunk.length = static_cast<uint32_t>(length);
+                parts.push_back(std::move(part));
+            }
+        } else if (format == SnapshotFormat::Archive) {
+            if (wantCount > 0) {
+                fs::path archivePath = snapshotPath / ARCHIVE_FILE_NAME;
+                add_file(0, archivePath, 0, fs::file_size(archivePath));
+            }
+        } else {
+            // Wanted files are numbered by their position among the manifest's files
+            std::vector<uint64_t> wanted(static_cast<size_t>(wantCount));
+            for (auto& item : wanted) {
+                if (!read_varint(want, item)) {
+                    throw std::runtime_error("Corrupt want list from remote");
+                }
+            }
+            std::sort(wanted.begin(), wanted.end());
+
+            // Packed files are sent like the others and arrive as files of their own
+            PackIndexReader packs;
+            bool packed = packs.open(snapshotPath);
+            PackRef pack;
+
+            ManifestEntry entry;
+            uint64_t fileNumber = 0;
+            size_t next = 0;
+            while (next < wanted.size() && reader.next(entry)) {
+                if (entry.type != EntryType::File) continue;
+                if (packed) {
+                    packs.next(pack);
+                }
+                if (fileNumber == wanted[next]) {
+                    if (pack.pack != 0) {
+                        add_file(fileNumber, snapshotPath / PACK_DIR_NAME / pack_file_name(pack.pack), pack.offset,
+                                 entry.size);
+                    } else {
+                        add_file(fileNumber, snapshotPath / from_manifest_path(entry.path), 0, entry.size);
+                    }
+                    next++;
+                }
+                fileNumber++;
+            }
+        }
+
+        // Extra streams attach to the session and take parts from the same list. One that cannot
+        // connect leaves its share to the others; one that fails after taking parts fails the run.
+        size_t streams = target.kind == RemoteTarget::Kind::FlameUp && sessionId != 0
+                             ? std::clamp<size_t>(config.remoteStreams, 1, REPLICATION_MAX_STREAMS) : 1;
+        streams = std::max<size_t>(std::min(streams, parts.size()), 1);
+        std::atomic<size_t> next{0};
+        std::atomic<bool> abort{false};
+        std::atomic<uint64_t> extraBytes{0};
+        std::atomic<size_t> connected{1};
+        std::mutex errorMutex;
+        std::string streamError;
+        std::vector<std::thread> extraStreams;
+        for (size_t i = 1; i < streams; i++) {
+            extraStreams.emplace_back([&] {
+                std::unique_ptr<SocketStream> socket;
+                try {
+                    socket = SocketStream::connect(target.host, target.port);
+                } catch (const std::exception&) {
+                    return;
+                }
+                connected++;
+                try {
+                    FrameChannel extra(*socket);
+                    std::ostringstream attach;
+                    write_u32(attach, REPLICATION_MAGIC);
+                    write_u32(attach, REPLICATION_VERSION);
+                    write_string(attach, config.remoteToken);
+                    write_u64(attach, sessionId);
+                    extra.send(FrameType::Attach, attach.str());
+                    send_replication_parts(extra, parts, next, abort, store ? &*store : nullptr);
+                    extra.send(FrameType::Commit, "");
+                    extra.receive_done();
+                    extraBytes += extra.bytes_sent();
+                } catch (const std::exception& e) {
+                    abort = true;
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    if (streamError.empty()) {
+                        streamError = e.what();
+                    }
+                }
+            });
+        }
+        try {
+            send_replication_parts(channel, parts, next, abort, store ? &*store : nullptr);
+        } catch (...) {
+            abort = true;
+            for (auto& thread : extraStreams) thread.join();
+            throw;
+        }
+        for (auto& thread : extraStreams) {
+            thread.join();
+        }
+        if (!streamError.empty()) {
+            throw std::runtime_error(streamError);
+        }
+
+        // Every extra stream has had its data acknowledged, so the commit covers all of it
+        channel.send(FrameType::Commit, "");
+        channel.receive_done();
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        std::cout << "✓ Replicated " << snapshotPath.filename().string() << " to " << config.remoteTarget << " ("
+            << wantCount << " items, " << format_bytes(channel.bytes_sent() + extraBytes) << " sent over "
+            << connected << (connected == 1 ? " stream" : " streams") << " in "
+            << format_duration(static_cast<uint64_t>(seconds * 1000)) << ")\n";
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error during replication: " << e.what() << "\n";
+        return false;
+    }
+}
+
+// Receiving side of one replication session: what the client was asked for and how much of it
+// has arrived. Data frames can come over any of the session's streams and in any order; each
+// file is written at the offsets its pieces carry and finalized once all its bytes are in.
+// Thread-safe.
+class ReplicationReceiver {
+public:
+    ReplicationReceiver(SnapshotFormat format, fs::path stage) : format_(format), stage_(std::move(stage)) {}
+
+    ReplicationReceiver(const ReplicationReceiver&) = delete;
+    ReplicationReceiver& operator=(const ReplicationReceiver&) = delete;
+
+    // The chunk store chunks are imported into; set up before any data is accepted
+    std::optional<ChunkStore>& store() { return store_; }
+
+    // Function to ask for a chunk; false if it was already asked for
+    bool want_chunk(const ChunkRef& ref) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return missingChunks_.emplace(ref.id, ref.length).second;
+    }
+
+    void want_file(uint64_t item, const ManifestEntry& entry) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wantedFiles_.emplace(item, entry);
+    }
+
+    size_t chunks_wanted() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return missingChunks_.size();
+    }
+
+    size_t files_wanted() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return wantedFiles_.size();
+    }
+
+    // Function to store the data of one Data frame
+    void accept(const std::string& payload) {
+        std::istringstream header(payload);
+        if (format_ == SnapshotFormat::Chunked) {
+            ChunkRef ref;
+            if (!read_u64(header, ref.id.hi) || !read_u64(header, ref.id.lo)) {
+                throw std::runtime_error("Corrupt chunk received");
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto missing = missingChunks_.find(ref.id);
+                if (missing == missingChunks_.end()) {
+                    throw std::runtime_error("Unexpected or repeated chunk received");
+                }
+                ref.length = missing->second;
+                missingChunks_.erase(missing);
+            }
+            size_t offset = static_cast<size_t>(header.tellg());
+            if (!store_->import_chunk(ref, payload.data() + offset, payload.size() - offset)) {
+                throw std::runtime_error("Corrupt chunk received");
+            }
+            return;
+        }
+
+        uint64_t item = 0;
+        uint64_t offset = 0;
+        if (!read_varint(header, item) || !read_varint(header, offset)) {
+            throw std::runtime_error("Corrupt data frame received");
+        }
+        size_t dataStart = static_cast<size_t>(header.tellg());
+        uint64_t length = payload.size() - dataStart;
+
+        Incoming* incoming = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            uint64_t size = UINT64_MAX; // the archive's size is not known up front
+            fs::path target = stage_ / ARCHIVE_FILE_NAME;
+            if (format_ != SnapshotFormat::Archive) {
+                auto wanted = wantedFiles_.find(item);
+                if (wanted == wantedFiles_.end()) {
+                    throw std::runtime_error("Unexpected file received");
+                }
+                size = wanted->second.size;
+                target = stage_ / from_manifest_path(wanted->second.path);
+            } else if (item != 0) {
+                throw std::runtime_error("Unexpected file received");
+            }
+            if (offset > size || length > size - offset) {
+                throw std::runtime_error("Data beyond the end of a file received");
+            }
+            incoming = &incoming_[item];
+            if (!incoming->file) {
+                incoming->file = std::make_unique<NativeFile>(NativeFile::open_write(target, true));
+            }
+            incoming->writers++;
+        }
+
+        bool written = false;
+        try {
+            incoming->file->write_at(payload.data() + dataStart, static_cast<size_t>(length), offset);
+            written = true;
+        } catch (...) {
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        incoming->writers--;
+        if (!written) {
+            throw std::runtime_error("Cannot write received data into " + stage_.string());
+        }
+        incoming->received += length;
+        if (format_ == SnapshotFormat::Archive) {
+            return;
+        }
+        auto wanted = wantedFiles_.find(item);
+        if (incoming->received > wanted->second.size) {
+            throw std::runtime_error("Overlapping data received for " + wanted->second.path);
+        }
+        // Only the last writer closes, so no other thread still holds the file
+        if (incoming->received == wanted->second.size && incoming->writers == 0) {
+            incoming->file->close();
+            incoming_.erase(item);
+            finalize_copied_file(stage_ / from_manifest_path(wanted->second.path), wanted->second.mtimeNs,
+                                 wanted->second.mode);
+            wantedFiles_.erase(wanted);
+        }
+    }
+
+    // Function to record that one of the session's streams failed
+    void fail(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (failure_.empty()) {
+            failure_ = message;
+        }
+    }
+
+    // Function to check, once every stream has committed, that all wanted data arrived
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!failure_.empty()) {
+            throw std::runtime_error("A data stream failed: " + failure_);
+        }
+        if (format_ == SnapshotFormat::Archive) {
+            for (auto& [item, incoming] : incoming_) {
+                incoming.file->close();
+            }
+            incoming_.clear();
+        } else if (format_ == SnapshotFormat::Directory && !wantedFiles_.empty()) {
+            throw std::runtime_error("Client did not send every wanted file");
+        } else if (format_ == SnapshotFormat::Chunked && !missingChunks_.empty()) {
+            throw std::runtime_error("Client did not send every wanted chunk");
+        }
+    }
+
+private:
+    struct Incoming {
+        std::unique_ptr<NativeFile> file;
+        uint64_t received = 0;
+        int writers = 0; // threads writing into file right now
+    };
+
+    SnapshotFormat format_;
+    fs::path stage_;
+    std::optional<ChunkStore> store_;
+    mutable std::mutex mutex_;
+    std::unordered_map<ChunkId, uint32_t, ChunkIdHash> missingChunks_;
+    std::unordered_map<uint64_t, ManifestEntry> wantedFiles_;
+    std::unordered_map<uint64_t, Incoming> incoming_;
+    std::string failure_;
+};
+
+// Replication sessions in progress on this server, so extra streams can find theirs and two
+// clients cannot stage the same snapshot at once
+struct ReplicationSessions {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<ReplicationReceiver>> byId;
+    std::unordered_set<std::string> staging; // final snapshot paths being received
+};
+
+ReplicationSessions& replication_sessions() {
+    static ReplicationSessions sessions;
+    return sessions;
+}
+
+// Function to read and check the version and token that open every replication stream
+void read_replication_greeting(std::istream& in, const BackupConfig& config) {
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    std::string token;
+    if (!read_u32(in, magic) || magic != REPLICATION_MAGIC || !read_u32(in, version)) {
+        throw std::runtime_error("Not a FlameUp replication client");
+    }
+    if (version != REPLICATION_VERSION) {
+        throw std::runtime_error("Unsupported replication protocol version " + std::to_string(version));
+    }
+    if (!read_string(in, token) || !constant_time_equal(token, config.remoteToken)) {
+        throw std::runtime_error("Invalid replication token");
+    }
+}
+
+// Function to receive Data frames for an existing session over one of its extra streams
+void serve_attached_stream(FrameChannel& channel, const std::string& attach, const BackupConfig& config) {
+    std::shared_ptr<ReplicationReceiver> receiver;
+    try {
+        std::istringstream in(attach);
+        read_replication_greeting(in, config);
+        uint64_t sessionId = 0;
+        if (!read_u64(in, sessionId)) {
+            throw std::runtime_error("Not a FlameUp replication client");
+        }
+        {
+            auto& sessions = replication_sessions();
+            std::lock_guard<std::mutex> lock(sessions.mutex);
+            if (auto it = sessions.byId.find(sessionId); it != sessions.byId.end()) {
+                receiver = it->second;
+            }
+        }
+        if (!receiver) {
+            throw std::runtime_error("Unknown replication session");
+        }
+
+        std::string payload;
+        FrameType type;
+        while ((type = channel.receive(payload)) == FrameType::Data) {
+            receiver->accept(payload);
+        }
+        if (type != FrameType::Commit) {
+            throw std::runtime_error("Unexpected replication frame");
+        }
+        channel.send_done(true, "");
+    } catch (const std::exception& e) {
+        if (receiver) {
+            receiver->fail(e.what());
+        }
+        try {
+            channel.send_done(false, e.what());
+        } catch (const std::exception&) {
+            // The client is gone already
+        }
+    }
+}
+
+// Function to receive one replicated snapshot from a client over stream into config.backupRoot
+// The snapshot is staged under .partial and published like a local backup, then retention runs.
+// A stream that opens with Attach instead carries extra data for a session already under way.
+void serve_replication_session(ByteStream& stream, const BackupConfig& config) {
+    FrameChannel channel(stream);
+    std::optional<fs::path> stage;
+    std::optional<RootFileLock> backupLock; // held from before the stage exists until it is gone
+
+    // Unregisters the session however it ends
+    struct Registration {
+        uint64_t id = 0;
+        std::string finalPath;
+        ~Registration() {
+            auto& sessions = replication_sessions();
+            std::lock_guard<std::mutex> lock(sessions.mutex);
+            sessions.byId.erase(id);
+            if (!finalPath.empty()) {
+                sessions.staging.erase(finalPath);
+            }
+        }
+    } registration;
+
+    try {
+        std::string payload;
+        FrameType first = channel.receive(payload);
+        if (first == FrameType::Attach) {
+            serve_attached_stream(channel, payload, config);
+            return;
+        }
+        if (first != FrameType::Hello) {
+            throw std::runtime_error("Not a FlameUp replication client");
+        }
+        std::istringstream hello(payload);
+        read_replication_greeting(hello, config);
+        uint32_t formatValue = 0;
+        std::string directory;
+        std::string name;
+        if (!read_string(hello, directory) || !read_string(hello, name) || !read_u32(hello, formatValue)) {
+            throw std::runtime_error("Not a FlameUp replication client");
+        }
+        if ((!directory.empty() && !is_safe_relative_path(directory)) || !name.starts_with("Backup_") ||
+            !is_safe_relative_path(name) || name.find('/') != std::string::npos || name.ends_with(PARTIAL_SUFFIX) ||
+            formatValue > static_cast<uint32_t>(SnapshotFormat::Archive)) {
+            throw std::runtime_error("Invalid snapshot name or directory");
+        }
+        SnapshotFormat format = static_cast<SnapshotFormat>(formatValue);
+
+        fs::path root = fs::path(config.backupRoot) / from_manifest_path(directory);
+        fs::create_directories(root);
+
+        // The stage is only safe from a local backup's leftover cleanup while the root's backup
+        // lock is held; better to turn the client away than to stall it past its timeout
+        auto lockDeadline = std::chrono::steady_clock::now() + NETWORK_IO_TIMEOUT / 2;
+        while (!backupLock.emplace(root, BACKUP_LOCK_FILE_NAME, false).held()) {
+            if (std::chrono::steady_clock::now() >= lockDeadline) {
+                throw std::runtime_error("Backup directory is busy, try again later");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        fs::path finalPath = root / name;
+        bool present = fs::exists(finalPath);
+        if (present) {
+            channel.send(FrameType::Ready, std::string(1, 1));
+            channel.flush();
+            return;
+        }
+
+        // Register before answering, so the client's extra streams find the session
+        auto receiver = std::make_shared<ReplicationReceiver>(format, root / (name + PARTIAL_SUFFIX));
+        {
+            auto& sessions = replication_sessions();
+            std::lock_guard<std::mutex> lock(sessions.mutex);
+            if (!sessions.staging.insert(finalPath.string()).second) {
+                throw std::runtime_error(name + " is already being received from another client");
+            }
+            registration.finalPath = finalPath.string();
+            do {
+                registration.id = std::random_device{}() | (static_cast<uint64_t>(std::random_device{}()) << 32);
+            } while (registration.id == 0 || sessions.byId.contains(registration.id));
+            sessions.byId[registration.id] = receiver;
+        }
+        std::ostringstream ready;
+        ready.put(0);
+        write_u64(ready, registration.id);
+        channel.send(FrameType::Ready, ready.str());
+
+        stage = root / (name + PARTIAL_SUFFIX);
+        if (fs::exists(*stage)) {
+            fs::remove_all(*stage);
+        }
+        fs::create_directories(*stage);
+
+        channel.receive(payload, FrameType::Manifest);
+        write_whole_file(*stage / MANIFEST_FILE_NAME, payload);
+        if (format == SnapshotFormat::Chunked) {
+            channel.receive(payload, FrameType::Index);
+            write_whole_file(*stage / CHUNK_INDEX_FILE_NAME, payload);
+        }
+
+        ManifestReader reader;
+        if (!reader.open(*stage / MANIFEST_FILE_NAME) || reader.header().format != format) {
+            throw std::runtime_error("Corrupt manifest received");
+        }
+
+        std::unique_lock<std::timed_mutex> storeLock(chunk_store_mutex(), std::defer_lock);
+        std::vector<ChunkRef> allRefs;
+        std::ostringstream want;
+        std::ostringstream wantItems;
+
+        if (format == SnapshotFormat::Chunked) {
+            // Better to turn the client away than to stall it past its timeout
+            if (!storeLock.try_lock_for(NETWORK_IO_TIMEOUT / 2)) {
+                throw std::runtime_error("Chunk store is busy, try again later");
+            }
+            std::optional<ChunkStore>& store = receiver->store();
+            store.emplace(root);
+            ChunkIndexReader index;
+            if (!index.open(*stage)) {
+                throw std::runtime_error("Corrupt chunk index received");
+            }
+            ManifestEntry entry;
+            std::vector<ChunkRef> refs;
+            while (reader.next(entry)) {
+                if (entry.type != EntryType::File) continue;
+                index.next(refs);
+                for (const ChunkRef& ref : refs) {
+                    allRefs.push_back(ref);
+                    if (!store->has_chunk(ref) && receiver->want_chunk(ref)) {
+                        write_u64(wantItems, ref.id.hi);
+                        write_u64(wantItems, ref.id.lo);
+                        write_varint(wantItems, ref.length);
+                    }
+                }
+            }
+            write_varint(want, receiver->chunks_wanted());
+        } else if (format == SnapshotFormat::Archive) {
+            write_varint(want, 1);
+        } else {
+            // Files unchanged since the newest snapshot here are hardlinked instead of sent
+            ManifestCursor previous;
+            std::optional<fs::path> latest = find_latest_backup(root);
+            bool havePrevious = latest && previous.open(*latest, SnapshotFormat::Directory);
+
+            std::unordered_set<std::string> symlinks;
+            ManifestEntry entry;
+            uint64_t fileNumber = 0;
+            while (reader.next(entry)) {
+                if (!is_safe_relative_path(entry.path) || is_path_dirty(entry.path, symlinks)) {
+                    throw std::runtime_error("Unsafe path in manifest: " + entry.path);
+                }
+                fs::path relative = from_manifest_path(entry.path);
+                fs::path target = *stage / relative;
+
+                if (entry.type == EntryType::Directory) {
+                    fs::create_directories(target);
+                } else if (entry.type == EntryType::Symlink) {
+                    symlinks.insert(entry.path);
+                    fs::create_symlink(from_manifest_path(entry.linkTarget), target);
+                } else if (entry.type == EntryType::File) {
+                    const ManifestEntry* prev = havePrevious ? previous.find(entry.path) : nullptr;
+                    bool unchanged = prev && prev->type == EntryType::File && prev->size == entry.size &&
+                                     prev->mtimeNs == entry.mtimeNs &&
+                                     (!prev->hasHash || !entry.hasHash || prev->hash == entry.hash);
+                    std::error_code ec;
+                    if (unchanged) {
+                        fs::create_hard_link(*latest / relative, target, ec);
+                    }
+                    if (!unchanged || ec) {
+                        if (entry.size == 0) {
+                            NativeFile::open_write(target, true).close();
+                            finalize_copied_file(target, entry.mtimeNs, entry.mode);
+                        } else {
+                            write_varint(wantItems, fileNumber);
+                            receiver->want_file(fileNumber, entry);
+                        }
+                    }
+                    fileNumber++;
+                }
+            }
+            write_varint(want, receiver->files_wanted());
+        }
+        channel.send(FrameType::Want, want.str() + wantItems.str());
+
+        // Receive pieces until the client commits; it only does once its extra streams are done
+        FrameType type;
+        while ((type = channel.receive(payload)) == FrameType::Data) {
+            receiver->accept(payload);
+        }
+        if (type != FrameType::Commit) {
+            throw std::runtime_error("Unexpected replication frame");
+        }
+        receiver->finish();
+        if (format == SnapshotFormat::Chunked) {
+            receiver->store()->add_refs(allRefs);
+            receiver->store()->commit();
+        }
+
+        publish_snapshot(*stage, finalPath);
+        stage.reset();
+        // Replicas keep the time the snapshot was taken on the client
+        auto taken = snapshot_name_time(name);
+        add_to_catalog(root, name, taken ? *taken * 1000000000LL : std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count(), "");
+        if (storeLock.owns_lock()) {
+            storeLock.unlock();
+        }
+        cleanup_old_backups(root, config.maxBackups, false, nullptr, config.retention);
+        backupLock.reset();
+
+        channel.send_done(true, "stored " + name);
+        std::cerr << "✓ Received " << (directory.empty() ? name : directory + "/" + name) << "\n";
+
+    } catch (const std::exception& e) {
+        std::cerr << "Error during replication: " << e.what() << "\n";
+        if (stage) {
+            std::error_code ec;
+            fs::remove_all(*stage, ec);
+        }
+        backupLock.reset();
+        try {
+            channel.send_done(false, e.what());
+        } catch (const std::exception&) {
+            // The client is gone already
+        }
+    }
+}
+
+// Function to accept replicated snapshots on a TCP port until the process is stopped
+// Every connection gets a thread of its own, up to REPLICATION_MAX_CONNECTIONS; clients beyond
+// that are told to come back later. Stalled peers time out (NETWORK_IO_TIMEOUT), so one idle
+// connection cannot hold up the others.
+void serve_replication(const BackupConfig& config) {
+    std::string address = "0.0.0.0";
+    std::string port = config.serveListen;
+    size_t colon = port.rfind(':');
+    if (colon != std::string::npos) {
+        address = port.substr(0, colon);
+        port = port.substr(colon + 1);
+    }
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        throw std::runtime_error("WSAStartup failed");
+    }
+#else
+    ::signal(SIGPIPE, SIG_IGN);
+#endif
+    SocketStream::SocketHandle listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == SocketStream::INVALID_SOCKET_HANDLE) {
+        throw std::runtime_error("Cannot create replication socket");
+    }
+    int reuse = 1;
+    ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(std::stoul(port)));
+    if (::inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listener, 16) != 0) {
+        SocketStream::close_socket(listener);
+        throw std::runtime_error("Cannot listen on " + address + ":" + port);
+    }
+    if (config.remoteToken.empty()) {
+        std::cerr << "Warning: no --remote-token set, any client can store snapshots here\n";
+    }
+    std::cout << "Receiving snapshots on " << address << ":" << port << " into " << config.backupRoot << "\n";
+
+    // Shared with the session threads, which may outlive this loop only at process exit
+    static std::atomic<size_t> active{0};
+    while (true) {
+        SocketStream::SocketHandle client = ::accept(listener, nullptr, nullptr);
+        if (client == SocketStream::INVALID_SOCKET_HANDLE) continue;
+        if (active >= REPLICATION_MAX_CONNECTIONS) {
+            SocketStream stream(client);
+            FrameChannel channel(stream);
+            try {
+                channel.send_done(false, "Too many replication sessions, try again later");
+            } catch (const std::exception&) {
+            }
+            continue;
+        }
+        active++;
+        std::thread([client, &config] {
+            {
+                SocketStream stream(client);
+                serve_replication_session(stream, config);
+            }
+            active--;
+        }).detach();
+    }
+}
+
+#ifndef _WIN32
+// Function to run a program and wait for it, returning its exit status (-1 if it did not run).
+// stdout is captured into output when given; stderr goes to ours.
+int run_command(const std::vector<std::string>& args, std::string* output = nullptr) {
+    int pipeFds[2] = {-1, -1};
+    if (output && ::pipe(pipeFds) != 0) {
+        return -1;
+    }
+    pid_t pid = ::fork();
+    if (pid == 0) {
+        if (output) {
+            ::dup2(pipeFds[1], STDOUT_FILENO);
+            ::close(pipeFds[0]);
+            ::close(pipeFds[1]);
+        }
+        std::vector<char*> argv;
+        for (const std::string& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        ::execvp(argv[0], argv.data());
+        ::_exit(127);
+    }
+    if (output) {
+        ::close(pipeFds[1]);
+        if (pid > 0) {
+            char buffer[4096];
+            ssize_t got;
+            while ((got = ::read(pipeFds[0], buffer, sizeof(buffer))) > 0 || (got < 0 && errno == EINTR)) {
+                if (got > 0) output->append(buffer, static_cast<size_t>(got));
+            }
+        }
+        ::close(pipeFds[0]);
+    }
+    if (pid < 0) {
+        return -1;
+    }
+    int status = 0;
+    while (::waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+#endif
+
+#ifdef __linux__
+// The mount a path lives on, from /proc/self/mountinfo
+struct MountInfo {
+    fs::path mountPoint;
+    std::string fsType;
+    std::string device; // mount source: a /dev node, or the dataset for ZFS
+};
+
+// Function to undo the octal escapes (\040 for a space etc.) in mountinfo fields
+std::string unescape_mount_field(const std::string& field) {
+    std::string out;
+    for (size_t i = 0; i < field.size(); i++) {
+        if (field[i] == '\\' && i + 3 < field.size() && std::isdigit(static_cast<unsigned char>(field[i + 1]))) {
+            out.push_back(static_cast<char>(std::stoi(field.substr(i + 1, 3), nullptr, 8)));
+            i += 3;
+        } else {
+            out.push_back(field[i]);
+        }
+    }
+    return out;
+}
+
+// Function to find the mount holding path: the deepest mount point above it on the same device
+std::optional<MountInfo> find_mount(const fs::path& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        return std::nullopt;
+    }
+    std::string device = std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev));
+    std::string pathText = path.string();
+
+    std::ifstream in("/proc/self/mountinfo");
+    std::optional<MountInfo> best;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string id, parent, majorMinor, root, mountPoint, field;
+        if (!(fields >> id >> parent >> majorMinor >> root >> mountPoint) || majorMinor != device) {
+            continue;
+        }
+        while (fields >> field && field != "-") {
+        }
+        MountInfo mount;
+        if (!(fields >> mount.fsType >> mount.device)) {
+            continue;
+        }
+        mount.mountPoint = unescape_mount_field(mountPoint);
+        mount.device = unescape_mount_field(mount.device);
+
+        std::string prefix = mount.mountPoint.string();
+        bool above = prefix == "/" || pathText == prefix || pathText.starts_with(prefix + "/");
+        if (above && (!best || prefix.size() > best->mountPoint.string().size())) {
+            best = std::move(mount);
+        }
+    }
+    return best;
+}
+
+constexpr uint64_t BTRFS_SUBVOLUME_ROOT_INODE = 256;
+constexpr long ZFS_SUPER_MAGIC_VALUE = 0x2FC12FC1;
+#endif
+
+// Source snapshots are named with this prefix, the process id and the time
+constexpr const char* SOURCE_SNAPSHOT_PREFIX = "flameup-source-";
+
+// Read-only, point-in-time view of a source taken before a backup reads it, so files written
+// during the copy cannot tear the backup. VSS shadow copies on Windows; btrfs snapshots, ZFS
+// snapshots or LVM snapshots (mounted read-only in a temporary directory) on Linux. The view
+// is removed again when the object goes away. Most methods need administrator rights.
+class SourceSnapshot {
+public:
+    SourceSnapshot(const SourceSnapshot&) = delete;
+    SourceSnapshot& operator=(const SourceSnapshot&) = delete;
+    ~SourceSnapshot() { release(); }
+
+    // Throws when method cannot snapshot sourcePath; Auto returns nullptr when no method applies
+    static std::unique_ptr<SourceSnapshot> create(const fs::path& sourcePath, SourceSnapshotMethod method) {
+        fs::path source = fs::canonical(sourcePath);
+        if (method == SourceSnapshotMethod::Auto) {
+            method = detect_method(source);
+            if (method == SourceSnapshotMethod::None) {
+                return nullptr;
+            }
+        }
+
+        std::unique_ptr<SourceSnapshot> snapshot(new SourceSnapshot());
+        snapshot->method_ = method;
+        snapshot->name_ = SOURCE_SNAPSHOT_PREFIX + std::to_string(current_process_id()) + "-" +
+                          std::to_string(std::chrono::duration_cast<std::chrono::seconds>(
+                              std::chrono::system_clock::now().time_since_epoch()).count());
+#ifdef _WIN32
+        if (method != SourceSnapshotMethod::Vss) {
+            throw std::runtime_error(std::string(method_name(method)) + " snapshots are not available on Windows");
+        }
+        snapshot->create_vss(source);
+#elif defined(__linux__)
+        if (method == SourceSnapshotMethod::Btrfs) {
+            snapshot->create_btrfs(source);
+        } else if (method == SourceSnapshotMethod::Zfs) {
+            snapshot->create_zfs(source);
+        } else if (method == SourceSnapshotMethod::Lvm) {
+            snapshot->create_lvm(source);
+        } else {
+            throw std::runtime_error("VSS snapshots are only available on Windows");
+        }
+#else
+        throw std::runtime_error(std::string(method_name(method)) + " snapshots are not supported on this platform");
+#endif
+        return snapshot;
+    }
+
+    static const char* method_name(SourceSnapshotMethod method) {
+        switch (method) {
+            case SourceSnapshotMethod::Btrfs: return "btrfs";
+            case SourceSnapshotMethod::Zfs: return "ZFS";
+            case SourceSnapshotMethod::Lvm: return "LVM";
+            case SourceSnapshotMethod::Vss: return "VSS";
+            default: return "no";
+        }
+    }
+
+    // The source directory as seen inside the snapshot
+    const fs::path& path() const { return path_; }
+    SourceSnapshotMethod method() const { return method_; }
+
+private:
+    SourceSnapshot() = default;
+
+    static uint64_t current_process_id() {
+#ifdef _WIN32
+        return GetCurrentProcessId();
+#else
+        return static_cast<uint64_t>(::getpid());
+#endif
+    }
+
+    static SourceSnapshotMethod detect_method(const fs::path& source) {
+#ifdef _WIN32
+        (void)source;
+        return SourceSnapshotMethod::Vss;
+#elif defined(__linux__)
+        struct statfs sfs;
+        if (::statfs(source.c_str(), &sfs) == 0) {
+            if (static_cast<unsigned long>(sfs.f_type) == BTRFS_SUPER_MAGIC) return SourceSnapshotMethod::Btrfs;
+            if (static_cast<long>(sfs.f_type) == ZFS_SUPER_MAGIC_VALUE) return SourceSnapshotMethod::Zfs;
+        }
+        // LVM volumes are device-mapper devices
+        struct stat st;
+        std::error_code ec;
+        if (::stat(source.c_str(), &st) == 0 &&
+            fs::exists("/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" +
+                       std::to_string(minor(st.st_dev)) + "/dm", ec)) {
+            return SourceSnapshotMethod::Lvm;
+        }
+        return SourceSnapshotMethod::None;
+#else
+        (void)source;
+        return SourceSnapshotMethod::None;
+#endif
+    }
+
+    void release() {
+#ifdef _WIN32
+        if (vss_) {
+            IVssAsync* async = nullptr;
+            if (vssComplete_ && SUCCEEDED(vss_->BackupComplete(&async)) && async) {
+                async->Wait();
+                async->Release();
+            }
+            if (!vssComplete_) {
+                vss_->AbortBackup();
+            }
+            LONG deleted = 0;
+            VSS_ID failed = GUID_NULL;
+            vss_->DeleteSnapshots(snapshotSetId_, VSS_OBJECT_SNAPSHOT_SET, TRUE, &deleted, &failed);
+            vss_->Release();
+            vss_ = nullptr;
+        }
+        if (comInitialized_) {
+            CoUninitialize();
+            comInitialized_ = false;
+        }
+#elif defined(__linux__)
+        if (!ownedName_.empty()) {
+            if (method_ == SourceSnapshotMethod::Btrfs) {
+                int dirFd = ::open(btrfsParent_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                btrfs_ioctl_vol_args args{};
+                std::strncpy(args.name, ownedName_.c_str(), BTRFS_PATH_NAME_MAX);
+                if (dirFd < 0 || ::ioctl(dirFd, BTRFS_IOC_SNAP_DESTROY, &args) != 0) {
+                    std::cerr << "Warning: Could not delete btrfs snapshot " << btrfsParent_ / ownedName_ << ": "
+                              << std::strerror(errno) << "\n";
+                }
+                if (dirFd >= 0) ::close(dirFd);
+            } else if (method_ == SourceSnapshotMethod::Zfs) {
+                if (run_command({"zfs", "destroy", ownedName_}) != 0) {
+                    std::cerr << "Warning: Could not destroy ZFS snapshot " << ownedName_ << "\n";
+                }
+            } else if (method_ == SourceSnapshotMethod::Lvm) {
+                if (!mountDir_.empty()) {
+                    if (syscall(SYS_umount2, mountDir_.c_str(), 0) == 0) {
+                        std::error_code ec;
+                        fs::remove(mountDir_, ec);
+                    } else {
+                        std::cerr << "Warning: Could not unmount " << mountDir_ << ": " << std::strerror(errno) << "\n";
+                    }
+                    mountDir_.clear();
+                }
+                if (run_command({"lvremove", "--force", ownedName_}) != 0) {
+                    std::cerr << "Warning: Could not remove LVM snapshot " << ownedName_ << "\n";
+                }
+            }
+            ownedName_.clear();
+        }
+#endif
+    }
+
+#ifdef _WIN32
+    static void check_hr(HRESULT hr, const char* what) {
+        if (FAILED(hr)) {
+            std::ostringstream oss;
+            oss << "VSS " << what << " failed (HRESULT 0x" << std::hex << static_cast<uint32_t>(hr) << ")";
+            throw std::runtime_error(oss.str());
+        }
+    }
 
-    // Use localtime_s instead of localtime
-    if (localtime_s(&tm_buf, &time_t) != 0) {
-        // Handle error - maybe return a default name or throw
-        return "Backup_Error";
+    // Function to wait for an asynchronous VSS call started with hr to finish
+    static void run_async(HRESULT hr, IVssAsync* async, const char* what) {
+        check_hr(hr, what);
+        HRESULT status = S_OK;
+        hr = async->Wait();
+        if (SUCCEEDED(hr)) {
+            hr = async->QueryStatus(&status, nullptr);
+        }
+        async->Release();
+        check_hr(hr, what);
+        if (status != VSS_S_ASYNC_FINISHED) {
+            check_hr(FAILED(status) ? status : E_FAIL, what);
+        }
     }
 
-    std::ostringstream oss;
-    oss << "Backup_" << std::put_time(&tm_buf, "%Y-%m-%d_%H-%M-%S");
-    return oss.str();
-}
+    void create_vss(const fs::path& source) {
+        HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        if (SUCCEEDED(hr)) {
+            comInitialized_ = true;
+        } else if (hr != RPC_E_CHANGED_MODE) {
+            check_hr(hr, "CoInitializeEx");
+        }
 
-// Function to read source path from file
-std::string read_path_from_file(const std::string& txtFilePath) {
-    std::ifstream in(txtFilePath);
-    if (!in.is_open()) {
-        throw std::runtime_error("Cannot open config file: " + txtFilePath);
-    }
+        wchar_t volume[MAX_PATH];
+        if (!GetVolumePathNameW(source.c_str(), volume, MAX_PATH)) {
+            throw std::runtime_error("Cannot find the volume of " + source.string());
+        }
 
-    std::string line;
+        check_hr(CreateVssBackupComponents(&vss_), "CreateVssBackupComponents");
+        check_hr(vss_->InitializeForBackup(), "InitializeForBackup");
+        check_hr(vss_->SetContext(VSS_CTX_BACKUP), "SetContext");
+        // A copy backup leaves the backup history of other tools alone
+        check_hr(vss_->SetBackupState(false, false, VSS_BT_COPY, false), "SetBackupState");
+        IVssAsync* async = nullptr;
+        run_async(vss_->GatherWriterMetadata(&async), async, "GatherWriterMetadata");
 
-    while (std::getline(in, line)) {
-        // Trim whitespace
-        line.erase(0, line.find_first_not_of(" \t\r\n"));
-        line.erase(line.find_last_not_of(" \t\r\n") + 1);
+        check_hr(vss_->StartSnapshotSet(&snapshotSetId_), "StartSnapshotSet");
+        VSS_ID snapshotId;
+        check_hr(vss_->AddToSnapshotSet(volume, GUID_NULL, &snapshotId), "AddToSnapshotSet");
+        async = nullptr;
+        run_async(vss_->PrepareForBackup(&async), async, "PrepareForBackup");
+        async = nullptr;
+        run_async(vss_->DoSnapshotSet(&async), async, "DoSnapshotSet");
+        vssComplete_ = true;
 
-        if (line.empty()) continue;
+        VSS_SNAPSHOT_PROP properties;
+        check_hr(vss_->GetSnapshotProperties(snapshotId, &properties), "GetSnapshotProperties");
+        std::wstring device = properties.m_pwszSnapshotDeviceObject;
+        VssFreeSnapshotProperties(&properties);
+        path_ = fs::path(device + L"\\") / source.lexically_relative(fs::path(volume));
+    }
 
-        // Skip comment lines
-        if (line.starts_with("#") ||
-            line.starts_with("//") ||
-            line.starts_with("--")) {
-            continue;
+    IVssBackupComponents* vss_ = nullptr;
+    VSS_ID snapshotSetId_ = GUID_NULL;
+    bool comInitialized_ = false;
+    bool vssComplete_ = false;
+#elif defined(__linux__)
+    void create_btrfs(const fs::path& source) {
+        // Subvolume roots have inode 256; the source belongs to the nearest one above it
+        fs::path subvolume = source;
+        struct stat st;
+        while (true) {
+            if (::stat(subvolume.c_str(), &st) != 0) {
+                throw std::runtime_error("Cannot stat " + subvolume.string() + ": " + std::strerror(errno));
             }
-        return line;
-    }
+            if (st.st_ino == BTRFS_SUBVOLUME_ROOT_INODE) break;
+            if (subvolume == subvolume.root_path()) {
+                throw std::runtime_error(source.string() + " is not on a btrfs subvolume");
+            }
+            subvolume = subvolume.parent_path();
+        }
+        if (subvolume == subvolume.root_path()) {
+            throw std::runtime_error("Cannot snapshot the btrfs subvolume mounted at /; put the source in its own subvolume");
+        }
 
-    throw std::runtime_error("No valid path found in file: " + txtFilePath);
-}
+        // The snapshot goes next to the subvolume, so it never shows up inside the source
+        btrfsParent_ = subvolume.parent_path();
+        int subvolumeFd = ::open(subvolume.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int parentFd = ::open(btrfsParent_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        btrfs_ioctl_vol_args_v2 args{};
+        args.fd = subvolumeFd;
+        args.flags = BTRFS_SUBVOL_RDONLY;
+        std::strncpy(args.name, name_.c_str(), BTRFS_SUBVOL_NAME_MAX);
+        int rc = subvolumeFd >= 0 && parentFd >= 0 ? ::ioctl(parentFd, BTRFS_IOC_SNAP_CREATE_V2, &args) : -1;
+        int error = errno;
+        if (subvolumeFd >= 0) ::close(subvolumeFd);
+        if (parentFd >= 0) ::close(parentFd);
+        if (rc != 0) {
+            throw std::runtime_error("Cannot create btrfs snapshot of " + subvolume.string() + " in " +
+                                     btrfsParent_.string() + ": " + std::strerror(error));
+        }
+        ownedName_ = name_;
+        path_ = btrfsParent_ / name_ / source.lexically_relative(subvolume);
+    }
 
+    void create_zfs(const fs::path& source) {
+        auto mount = find_mount(source);
+        if (!mount || mount->fsType != "zfs") {
+            throw std::runtime_error(source.string() + " is not on a ZFS dataset");
+        }
+        std::string snapshot = mount->device + "@" + name_;
+        if (run_command({"zfs", "snapshot", snapshot}) != 0) {
+            throw std::runtime_error("zfs snapshot " + snapshot + " failed");
+        }
+        ownedName_ = snapshot;
+        path_ = mount->mountPoint / ".zfs" / "snapshot" / name_ / source.lexically_relative(mount->mountPoint);
+    }
 
-// Function to list all backups
-void list_backups(const fs::path& backupRoot) {
-    std::vector<fs::directory_entry> backups;
+    void create_lvm(const fs::path& source) {
+        auto mount = find_mount(source);
+        if (!mount || !mount->device.starts_with("/dev/")) {
+            throw std::runtime_error(source.string() + " is not on a block device");
+        }
+        std::string output;
+        std::string vg, lv, attributes;
+        if (run_command({"lvs", "--noheadings", "-o", "vg_name,lv_name,lv_attr", mount->device}, &output) != 0 ||
+            !(std::istringstream(output) >> vg >> lv >> attributes)) {
+            throw std::runtime_error(mount->device + " is not an LVM logical volume");
+        }
 
-    if (!fs::exists(backupRoot)) {
-        std::cout << "No backup directory found at: " << backupRoot << "\n";
-        return;
-    }
+        // Thin volumes snapshot without reserving space, but their snapshots skip activation by default
+        bool thin = attributes.front() == 'V';
+        std::vector<std::string> args{"lvcreate", "--snapshot", "--name", name_};
+        if (thin) {
+            args.insert(args.end(), {"--setactivationskip", "n"});
+        } else {
+            args.insert(args.end(), {"--extents", "10%ORIGIN"});
+        }
+        args.push_back(vg + "/" + lv);
+        if (run_command(args) != 0) {
+            throw std::runtime_error("lvcreate of a snapshot of " + vg + "/" + lv + " failed");
+        }
+        ownedName_ = vg + "/" + name_;
 
-    for (const auto& entry : fs::directory_iterator(backupRoot)) {
-        if (entry.is_directory() &&
-            entry.path().filename().string().starts_with("Backup_")) {
-            backups.push_back(entry);
+        // The frozen filesystem still has a dirty journal; mount without replaying it
+        std::string options;
+        if (mount->fsType == "ext3" || mount->fsType == "ext4") {
+            options = "noload";
+        } else if (mount->fsType == "xfs") {
+            options = "nouuid,norecovery";
+        }
+        fs::path dir = fs::temp_directory_path() / name_;
+        fs::create_directories(dir);
+        std::string device = "/dev/" + vg + "/" + name_;
+        if (syscall(SYS_mount, device.c_str(), dir.c_str(), mount->fsType.c_str(), MS_RDONLY,
+                    options.empty() ? nullptr : options.c_str()) != 0) {
+            int error = errno;
+            std::error_code ec;
+            fs::remove(dir, ec);
+            throw std::runtime_error("Cannot mount " + device + ": " + std::strerror(error));
         }
+        mountDir_ = dir;
+        path_ = mountDir_ / source.lexically_relative(mount->mountPoint);
     }
 
-    if (backups.empty()) {
-        std::cout << "No backups found in: " << backupRoot << "\n";
-        return;
-    }
+    std::string ownedName_;   // what release() has to remove
+    fs::path btrfsParent_;
+    fs::path mountDir_;
+#endif
 
-    // Sort by name (newest first)
-    std::sort(backups.begin(), backups.end(), [](const auto& a, const auto& b) {
-        return a.path().filename().string() > b.path().filename().string();
-    });
+    SourceSnapshotMethod method_ = SourceSnapshotMethod::None;
+    std::string name_;
+    fs::path path_;
+};
 
-    std::cout << "Available backups in " << backupRoot << ":\n";
-    for (const auto& backup : backups) {
-        auto size = fs::file_size(backup.path());
-        std::cout << "  " << backup.path().filename().string()
-            << " (Size: " << size << " bytes)\n";
-    }
-}
 
-// Function to restore a backup
-bool restore_backup(const std::string& backupName, const fs::path& backupRoot, const std::string& restorePath) {
+bool perform_backup(const BackupConfig& config, const BackupCycleContext& context = {}) {
+    auto cycleStart = std::chrono::steady_clock::now();
+    CycleMetrics cycle;
+    cycle.source = config.sourcePath;
+    cycle.intervalSeconds = config.watch ? 0.0 : static_cast<double>(
+        std::chrono::duration_cast<std::chrono::seconds>(config.interval).count());
+
+    // Every exit path reports the cycle, successful or not
+    auto report = [&](bool success, const std::string& error) {
+        if (!context.metrics) return success;
+        cycle.success = success;
+        cycle.error = error;
+        cycle.totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - cycleStart).count();
+        cycle.finishedAtSeconds = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        *context.metrics = cycle;
+        return success;
+    };
+
     try {
-        fs::path backupPath = backupRoot / backupName;
+        fs::path sourcePath(config.sourcePath);
 
-        if (!fs::exists(backupPath)) {
-            std::cerr << "Backup not found: " << backupName << "\n";
-            return false;
+        if (!fs::exists(sourcePath) || !fs::is_directory(sourcePath)) {
+            std::cerr << "Warning: Source directory does not exist: " << sourcePath << "\n";
+            return report(false, "Source directory does not exist");
         }
 
-        fs::path targetPath(restorePath);
+        fs::path backupRootPath(config.backupRoot);
+        fs::create_directories(backupRootPath);
 
-        // Create parent directories if they don't exist
-        if (targetPath.has_parent_path()) {
-            fs::create_directories(targetPath.parent_path());
+        // One backup into a root at a time, from picking the name until retention is done, so a
+        // second run neither takes the same name nor mistakes the first one's stage for a leftover
+        std::optional<RootFileLock> backupLock;
+        if (!backupLock.emplace(backupRootPath, BACKUP_LOCK_FILE_NAME, false).held()) {
+            std::cout << "Waiting for another backup into " << backupRootPath << " to finish\n";
+            backupLock.emplace(backupRootPath, BACKUP_LOCK_FILE_NAME);
         }
+        int64_t createdNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
 
-        // Remove existing target if it exists
-        if (fs::exists(targetPath)) {
-            fs::remove_all(targetPath);
+        // The snapshot is written under a .partial name and renamed once complete. A stage left
+        // by an interrupted run is continued from its checkpoint; archives start over. It is
+        // looked for before the new name's own stage is reserved.
+        std::optional<fs::path> partial = take_partial_snapshot(backupRootPath, context.trash);
+        std::string newBackupName = SnapshotCatalog(backupRootPath).reserve_name(make_timestamp_folder_name());
+        fs::path newBackupPath = backupRootPath / newBackupName;
+        cycle.backupName = newBackupName;
+        fs::path stagePath = backupRootPath / (newBackupName + PARTIAL_SUFFIX);
+        bool resume = false;
+        if (partial) {
+            if (config.format != SnapshotFormat::Archive) {
+                std::cout << "Resuming interrupted backup " << partial->filename() << "\n";
+                fs::remove(stagePath); // the empty reservation
+                fs::rename(*partial, stagePath);
+                resume = true;
+            } else {
+                remove_snapshot(*partial, backupRootPath);
+            }
         }
 
-        // Copy backup to target location
-        fs::copy(backupPath, targetPath, fs::copy_options::recursive);
+        if (config.verbose) {
+            std::cout << "Backing up: " << sourcePath << " -> " << newBackupPath << "\n";
+        }
 
-        std::cout << "✓ Restored backup '" << backupName << "' to: " << targetPath << "\n";
-        return true;
+        std::optional<fs::path> previousBackup;
+        if (config.incremental) {
+            previousBackup = find_latest_backup(backupRootPath);
+        }
 
-    } catch (const std::exception& e) {
-        std::cerr << "Error during restore: " << e.what() << "\n";
-        return false;
-    }
-}
+        if (previousBackup && config.verbose) {
+            std::cout << "Incremental against: " << previousBackup->filename() << "\n";
+        }
 
-// Function to delete a specific backup
-bool delete_backup(const std::string& backupName, const fs::path& backupRoot) {
-    try {
-        fs::path backupPath = backupRoot / backupName;
+        // Read from a frozen view of the source when asked, so files changing mid-copy cannot
+        // tear the backup. Auto falls back to the live tree where no snapshot method applies.
+        std::unique_ptr<SourceSnapshot> sourceSnapshot;
+        if (config.sourceSnapshot != SourceSnapshotMethod::None) {
+            sourceSnapshot = SourceSnapshot::create(sourcePath, config.sourceSnapshot);
+            if (!sourceSnapshot) {
+                std::cerr << "Warning: No snapshot method for " << sourcePath << ", reading the live tree\n";
+            } else if (config.verbose) {
+                std::cout << "Reading from " << SourceSnapshot::method_name(sourceSnapshot->method())
+                          << " snapshot: " << sourceSnapshot->path() << "\n";
+            }
+        }
+        const fs::path& readPath = sourceSnapshot ? sourceSnapshot->path() : sourcePath;
 
-        if (!fs::exists(backupPath)) {
-            std::cerr << "Backup not found: " << backupName << "\n";
-            return false;
+        // Command line and paths.txt rules first, so the source's own ignore file has the last word
+        PathFilter filter;
+        for (const std::string& rule : config.filterRules) {
+            filter.add_rule(rule);
         }
+        filter.add_rules_from_file(readPath / IGNORE_FILE_NAME);
+        const PathFilter* activeFilter = filter.empty() ? nullptr : &filter;
 
-        fs::remove_all(backupPath);
-        std::cout << "✓ Deleted backup: " << backupName << "\n";
-        return true;
+        // Remembers source file hashes between --hash runs
+        std::optional<FileHashCache> hashCache;
+        if (config.hashCompare && config.format != SnapshotFormat::Archive) {
+            hashCache.emplace(backupRootPath);
+            FileIdentity snapshotRoot, sourceRoot;
+            if (sourceSnapshot && read_file_identity(readPath, snapshotRoot) && read_file_identity(sourcePath, sourceRoot)) {
+                hashCache->alias_device(snapshotRoot.device, sourceRoot.device);
+            }
+        }
+
+        SnapshotStats stats;
+        if (config.format == SnapshotFormat::Archive) {
+            // Archives are always self-contained full snapshots
+            auto archiveStart = std::chrono::steady_clock::now();
+            stats = write_archive_snapshot(readPath, stagePath, config.jobs, context.throttle, activeFilter);
+            stats.scanSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - archiveStart).count();
+        } else {
+            // Copy directory and record its manifest
+            stats = copy_snapshot(readPath, previousBackup, stagePath, config.format, config.hashCompare,
+                                  config.jobs, config.verbose, context.dirtyPaths, context.throttle, activeFilter,
+                                  resume, hashCache ? &*hashCache : nullptr, config.packThreshold,
+                                  config.hashCopies);
+        }
+        if (hashCache) {
+            // A watch-mode pass only saw the dirty paths, so it keeps everything else
+            hashCache->save(context.dirtyPaths == nullptr);
+        }
+        sourceSnapshot.reset();
+
+        publish_snapshot(stagePath, newBackupPath);
+        add_to_catalog(backupRootPath, newBackupName, createdNs, fs::absolute(sourcePath).string());
+
+        // Retention only runs once the new snapshot is safely in place
+        auto cleanupStart = std::chrono::steady_clock::now();
+        cleanup_old_backups(backupRootPath, config.maxBackups, config.verbose, context.trash, config.retention);
+        cycle.cleanupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - cleanupStart).count();
+        backupLock.reset();
+
+        cycle.scanSeconds = stats.scanSeconds;
+        cycle.filesCopied = stats.filesCopied;
+        cycle.filesSkipped = stats.filesLinked;
+        cycle.bytesCopied = stats.bytesCopied;
+        cycle.bytesSkipped = stats.bytesSkipped;
+
+        if (config.format == SnapshotFormat::Archive) {
+            std::cout << "✓ Created backup: " << newBackupName << " (" << stats.filesCopied
+                << " files archived)\n";
+        } else if (config.format == SnapshotFormat::Chunked) {
+            std::cout << "✓ Created backup: " << newBackupName << " (" << stats.chunksWritten
+                << " new chunks, " << stats.chunkBytesWritten << " bytes stored)\n";
+        } else if (previousBackup) {
+            std::cout << "✓ Created backup: " << newBackupName << " (" << stats.filesCopied
+                << " copied, " << stats.filesLinked << " unchanged)\n";
+        } else {
+            std::cout << "✓ Created backup: " << newBackupName << "\n";
+        }
+
+        // The local snapshot stands even when the copy off-host fails
+        if (!config.remoteTarget.empty() && !replicate_snapshot(newBackupPath, config)) {
+            return report(false, "Replication to " + config.remoteTarget + " failed");
+        }
+        return report(true, "");
 
     } catch (const std::exception& e) {
-        std::cerr << "Error deleting backup: " << e.what() << "\n";
-        return false;
+        std::cerr << "Error during backup: " << e.what() << "\n";
+        return report(false, e.what());
     }
 }
 
-// Function to clean up old backups
-void cleanup_old_backups(const fs::path& backupRoot, size_t maxBackups, bool verbose) {
-    std::vector<fs::directory_entry> backups;
+// Function to list the sources to back up: --path overrides the config file
+std::vector<SourceSpec> resolve_sources(const BackupConfig& config) {
+    if (!config.sourcePath.empty()) {
+        SourceSpec source;
+        source.path = config.sourcePath;
+        source.maxBackups = config.maxBackups;
+        source.retention = config.retention;
+        source.interval = config.interval;
+        return {source};
+    }
+    return read_sources_from_file(config.configFile, config);
+}
 
-    // Collect all backup directories
-    for (const auto& entry : fs::directory_iterator(backupRoot)) {
-        if (entry.is_directory() &&
-            entry.path().filename().string().starts_with("Backup_")) {
-            backups.push_back(entry);
+// Function to derive the settings for backing up one source
+BackupConfig config_for_source(const BackupConfig& config, const SourceSpec& source) {
+    BackupConfig sourceConfig = config;
+    sourceConfig.sourcePath = source.path;
+    sourceConfig.maxBackups = source.maxBackups;
+    sourceConfig.retention = source.retention;
+    sourceConfig.interval = source.interval;
+    sourceConfig.filterRules.insert(sourceConfig.filterRules.end(), source.filterRules.begin(),
+                                    source.filterRules.end());
+    if (!source.name.empty()) {
+        sourceConfig.backupRoot = (fs::path(config.backupRoot) / source.name).string();
+        sourceConfig.remoteDirectory = source.name;
+    }
+    return sourceConfig;
+}
+
+// Function to identify the physical disk a source lives on, so sources sharing a disk are
+// backed up one after another instead of competing for it
+uint64_t source_device_id(const fs::path& sourcePath) {
+#ifdef _WIN32
+    wchar_t mountPoint[MAX_PATH];
+    wchar_t volumeName[MAX_PATH];
+    std::error_code ec;
+    fs::path absolute = fs::absolute(sourcePath, ec);
+    if (!GetVolumePathNameW(absolute.c_str(), mountPoint, MAX_PATH) ||
+        !GetVolumeNameForVolumeMountPointW(mountPoint, volumeName, MAX_PATH)) {
+        return 0;
+    }
+
+    // Volumes on the same disk report the same disk number
+    std::wstring volumeDevice(volumeName);
+    if (!volumeDevice.empty() && volumeDevice.back() == L'\\') {
+        volumeDevice.pop_back();
+    }
+    HANDLE volume = CreateFileW(volumeDevice.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                OPEN_EXISTING, 0, nullptr);
+    if (volume != INVALID_HANDLE_VALUE) {
+        VOLUME_DISK_EXTENTS extents;
+        DWORD bytes = 0;
+        BOOL ok = DeviceIoControl(volume, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, nullptr, 0,
+                                  &extents, sizeof(extents), &bytes, nullptr);
+        CloseHandle(volume);
+        if (ok && extents.NumberOfDiskExtents > 0) {
+            return 0x100000000ULL | extents.Extents[0].DiskNumber;
         }
     }
 
-    // Sort by name (oldest first due to timestamp format)
-    std::sort(backups.begin(), backups.end(), [](const auto& a, const auto& b) {
-        return a.path().filename().string() < b.path().filename().string();
-    });
+    DWORD serial = 0;
+    GetVolumeInformationW(mountPoint, nullptr, 0, &serial, nullptr, nullptr, nullptr, 0);
+    return serial;
+#else
+    struct stat st;
+    if (::stat(sourcePath.c_str(), &st) != 0) {
+        return 0;
+    }
+    uint64_t device = static_cast<uint64_t>(st.st_dev);
+#ifdef __linux__
+    // Partitions share the I/O queue of their disk, which sysfs lists as the parent directory
+    std::error_code ec;
+    fs::path sysDevice = fs::canonical("/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" +
+                                       std::to_string(minor(st.st_dev)), ec);
+    if (!ec && fs::exists(sysDevice / "partition", ec)) {
+        std::ifstream in(sysDevice.parent_path() / "dev");
+        unsigned int diskMajor = 0, diskMinor = 0;
+        char colon = 0;
+        if (in >> diskMajor >> colon >> diskMinor) {
+            device = static_cast<uint64_t>(makedev(diskMajor, diskMinor));
+        }
+    }
+#endif
+    return device;
+#endif
+}
 
-    // Delete oldest backups if we exceed the limit
-    while (backups.size() >= maxBackups) {
-        if (verbose) {
-            std::cout << "Deleting old backup: " << backups.front().path().filename() << "\n";
+// Function to group sources by physical disk, keeping the config file order within each group
+std::vector<std::vector<SourceSpec>> group_sources_by_device(const std::vector<SourceSpec>& sources) {
+    std::vector<std::vector<SourceSpec>> groups;
+    std::vector<uint64_t> devices;
+    for (const auto& source : sources) {
+        uint64_t device = source_device_id(source.path);
+        auto it = std::find(devices.begin(), devices.end(), device);
+        if (it == devices.end()) {
+            devices.push_back(device);
+            groups.emplace_back();
+            it = devices.end() - 1;
         }
-        fs::remove_all(backups.front().path());
-        backups.erase(backups.begin());
+        groups[static_cast<size_t>(it - devices.begin())].push_back(source);
     }
+    return groups;
 }
 
-// Function to perform a single backup operation
-bool perform_backup(const BackupConfig& config) {
-    try {
-        std::string sourceDirPath;
+// Function to back up a group of sources that share a disk, one at a time.
+// With once set, every source is backed up a single time; otherwise this runs the daemon schedule.
+bool run_source_group(const BackupConfig& config, const std::vector<SourceSpec>& group, bool once,
+                      MetricsRegistry& metrics) {
+    struct SourceState {
+        BackupConfig config;
+        std::unique_ptr<TrashCollector> trash;
+        std::unique_ptr<ChangeWatcher> watcher;
+        std::chrono::steady_clock::time_point nextRun;
+        std::chrono::steady_clock::time_point nextVerify;
+    };
 
-        // Determine source path
-        if (!config.sourcePath.empty()) {
-            sourceDirPath = config.sourcePath;
-        } else {
-            sourceDirPath = read_path_from_file(config.configFile);
+    // Watchers wake the scheduler when changes arrive
+    std::mutex wakeMutex;
+    std::condition_variable wakeCv;
+    bool woken = false;
+    auto wake = [&] {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            woken = true;
         }
+        wakeCv.notify_all();
+    };
 
-        fs::path sourcePath(sourceDirPath);
+    // Sources in a group share a disk, so they also share its rate limits
+    IoThrottle throttle(config.maxMBps * 1024 * 1024, config.maxFilesPerSecond, config.adaptiveThrottle);
 
-        if (!fs::exists(sourcePath) || !fs::is_directory(sourcePath)) {
-            std::cerr << "Warning: Source directory does not exist: " << sourcePath << "\n";
-            return false;
+    // Runs one cycle and publishes its metrics
+    auto backup = [&](const SourceState& state, const std::unordered_set<std::string>* dirtyPaths) {
+        CycleMetrics cycle;
+        BackupCycleContext context;
+        context.dirtyPaths = dirtyPaths;
+        context.trash = state.trash.get();
+        context.throttle = &throttle;
+        context.metrics = &cycle;
+        bool success = perform_backup(state.config, context);
+        metrics.record(cycle);
+
+        // Warn before a cycle outgrows its schedule
+        if (!once && cycle.intervalSeconds > 0 && cycle.totalSeconds > cycle.intervalSeconds * SLOW_CYCLE_WARNING_RATIO) {
+            std::cerr << "Warning: Backup of " << state.config.sourcePath << " took "
+                      << format_duration(static_cast<uint64_t>(cycle.totalSeconds * 1000))
+                      << ", close to its interval of " << state.config.interval.count() << " minutes\n";
         }
+        return success;
+    };
 
-        fs::path backupRootPath(config.backupRoot);
+    std::vector<SourceState> states;
+    for (const auto& source : group) {
+        SourceState state;
+        state.config = config_for_source(config, source);
+        fs::create_directories(state.config.backupRoot);
+        // Expired snapshots are deleted in the background, after the new one is in place
+        state.trash = std::make_unique<TrashCollector>(state.config.backupRoot, config.verbose);
 
-        // Clean up old backups before creating new one
-        cleanup_old_backups(backupRootPath, config.maxBackups, config.verbose);
+        if (!once && config.watch && fs::is_directory(source.path)) {
+            // Start watching before the initial backup so nothing changed during it is missed
+            state.watcher = std::make_unique<ChangeWatcher>(source.path, wake);
+            if (state.watcher->active()) {
+                std::cout << "Watching for changes in: " << source.path << "\n";
+            } else {
+                std::cerr << "Warning: Change notification unavailable for " << source.path
+                          << ", falling back to interval backups\n";
+                state.watcher.reset();
+            }
+        }
+        states.push_back(std::move(state));
+    }
 
-        // Generate new backup folder name
-        std::string newBackupName = make_timestamp_folder_name();
-        fs::path newBackupPath = backupRootPath / newBackupName;
+    bool allSucceeded = true;
+    auto startTime = std::chrono::steady_clock::now();
+    for (auto& state : states) {
+        state.nextRun = startTime;
+        state.nextVerify = startTime + DAEMON_VERIFY_INTERVAL;
+    }
 
-        if (config.verbose) {
-            std::cout << "Backing up: " << sourcePath << " -> " << newBackupPath << "\n";
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        auto wakeAt = now + std::chrono::hours(24);
+
+        for (auto& state : states) {
+            // Watched sources are backed up once at start, then whenever a batch of changes is due
+            bool initialRun = state.nextRun != std::chrono::steady_clock::time_point::max();
+            if (state.watcher && !initialRun) {
+                auto due = state.watcher->batch_due(config.quietPeriod, config.maxLatency);
+                if (!due) continue;
+                if (*due > now) {
+                    wakeAt = std::min(wakeAt, *due);
+                    continue;
+                }
+
+                bool fullScan = false;
+                std::unordered_set<std::string> changes = state.watcher->take_changes(fullScan);
+                if (!fullScan && changes.empty()) continue;
+
+                if (config.verbose) {
+                    std::cout << "\n--- Starting backup cycle for " << state.config.sourcePath << " (";
+                    if (fullScan) {
+                        std::cout << "full scan";
+                    } else {
+                        std::cout << changes.size() << " changed paths";
+                    }
+                    std::cout << ") ---\n";
+                }
+
+                if (!backup(state, fullScan ? nullptr : &changes)) {
+                    std::cout << "Backup failed, will retry on the next change.\n";
+                    state.watcher->request_full_scan();
+                }
+                now = std::chrono::steady_clock::now();
+                continue;
+            }
+
+            if (state.nextRun > now) {
+                wakeAt = std::min(wakeAt, state.nextRun);
+                continue;
+            }
+
+            auto cycleStart = std::chrono::steady_clock::now();
+            if (config.verbose) {
+                std::cout << "\n--- Starting backup cycle for " << state.config.sourcePath << " ---\n";
+            }
+
+            bool success = backup(state, nullptr);
+            if (!success) {
+                allSucceeded = false;
+                if (state.watcher) {
+                    state.watcher->request_full_scan();
+                } else if (!once) {
+                    std::cout << "Backup failed, will retry in " << state.config.interval.count() << " minutes.\n";
+                }
+            } else if (config.verbose && !once) {
+                std::cout << "Backup completed successfully.\n";
+            }
+
+            // Calculate next backup time
+            state.nextRun = state.watcher ? std::chrono::steady_clock::time_point::max()
+                                          : cycleStart + state.config.interval;
+            now = std::chrono::steady_clock::now();
+            if (!state.watcher) {
+                if (config.verbose && !once && state.nextRun > now) {
+                    auto waitTime = std::chrono::duration_cast<std::chrono::minutes>(state.nextRun - now);
+                    std::cout << "Next backup of " << state.config.sourcePath << " in " << waitTime.count()
+                        << " minutes...\n";
+                }
+                wakeAt = std::min(wakeAt, state.nextRun);
+            }
         }
 
-        // Copy directory
-        fs::copy(sourcePath, newBackupPath, fs::copy_options::recursive);
+        if (once) {
+            return allSucceeded;
+        }
 
-        std::cout << "✓ Created backup: " << newBackupName << "\n";
-        return true;
+        // Idle time before the next cycle goes into checking a random sample of one snapshot,
+        // the one checked longest ago
+        for (auto& state : states) {
+            if (config.verifySample == 0) break;
+            now = std::chrono::steady_clock::now();
+            if (state.nextVerify > now) {
+                wakeAt = std::min(wakeAt, state.nextVerify);
+                continue;
+            }
+            if (wakeAt - now < DAEMON_VERIFY_MIN_IDLE) {
+                continue;
+            }
 
-    } catch (const std::exception& e) {
-        std::cerr << "Error during backup: " << e.what() << "\n";
-        return false;
+            state.nextVerify = now + DAEMON_VERIFY_INTERVAL;
+            wakeAt = std::min(wakeAt, state.nextVerify);
+            auto snapshot = least_recently_verified(state.config.backupRoot);
+            if (!snapshot) continue;
+            try {
+                VerifyRecord record = verify_snapshot(*snapshot, state.config.backupRoot, 1, &throttle,
+                                                      config.verifySample);
+                if (record.entriesFailed > 0) {
+                    std::cerr << "Warning: Backup " << snapshot->filename().string() << " failed verification: "
+                              << record.entriesFailed << " of " << record.entriesChecked << " sampled files bad\n";
+                } else if (record.entriesUnverifiable > 0) {
+                    std::cerr << "Warning: Backup " << snapshot->filename().string() << " has "
+                              << record.entriesUnverifiable << " of " << record.entriesChecked
+                              << " sampled files without a recorded hash\n";
+                } else if (config.verbose) {
+                    std::cout << "Verified a sample of " << record.entriesChecked << " files in "
+                              << snapshot->filename().string() << "\n";
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "Warning: Could not verify " << snapshot->filename().string() << ": " << e.what() << "\n";
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wakeCv.wait_until(lock, wakeAt, [&] { return woken; });
+        woken = false;
     }
 }
 
+// Function to back up every configured source; sources on different disks run in parallel
+bool run_sources(const BackupConfig& config, bool once) {
+    std::vector<std::vector<SourceSpec>> groups = group_sources_by_device(resolve_sources(config));
+
+    fs::path statusFile = config.statusFile.empty() ? fs::path(config.backupRoot) / STATUS_FILE_NAME
+                                                    : fs::path(config.statusFile);
+    MetricsRegistry metrics(statusFile);
+    std::unique_ptr<MetricsServer> metricsServer;
+    if (!once && !config.metricsListen.empty()) {
+        std::string address = "127.0.0.1";
+        std::string port = config.metricsListen;
+        size_t colon = port.rfind(':');
+        if (colon != std::string::npos) {
+            address = port.substr(0, colon);
+            port = port.substr(colon + 1);
+        }
+        metricsServer = std::make_unique<MetricsServer>(address, static_cast<uint16_t>(std::stoul(port)), metrics);
+        std::cout << "Serving metrics on http://" << address << ":" << port << "/metrics\n";
+    }
+
+    if (groups.size() == 1) {
+        return run_source_group(config, groups.front(), once, metrics);
+    }
+
+    std::vector<std::thread> threads;
+    std::atomic<bool> allSucceeded{true};
+    for (const auto& group : groups) {
+        threads.emplace_back([&config, &group, once, &allSucceeded, &metrics] {
+            try {
+                if (!run_source_group(config, group, once, metrics)) {
+                    allSucceeded = false;
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << "\n";
+                allSucceeded = false;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return allSucceeded;
+}
 
 void print_help(const std::string& programName) {
     std::cout << "FlameUp - Command Line Backup Utility\n";
@@ -241,23 +10442,60 @@ void print_help(const std::string& programName) {
     std::cout << "Options:\n";
     std::cout << "  -h, --help              Show this help message\n";
     std::cout << "  -p, --path <path>       Source path to backup (overrides config file)\n";
-    std::cout << "  -c, --config <file>     Config file path (default: paths.txt)\n";
+    std::cout << "  -c, --config <file>     Config file listing source paths, one per line (default: paths.txt)\n";
     std::cout << "  -o, --output <path>     Backup output directory (default: CopiedFiles)\n";
-    std::cout << "  -m, --max <number>      Maximum number of backups to keep (default: 10)\n";
+    std::cout << "  -m, --max <number>      Maximum number of backups to keep, at least 1 (default: 10)\n";
+    std::cout << "  --retain <tiers>        Tiered retention instead of --max, e.g. all:1h,hourly:1d,daily:30d\n";
     std::cout << "  -i, --interval <min>    Backup interval in minutes for daemon mode (default: 30)\n";
     std::cout << "  -d, --daemon            Run as background daemon (continuous backups)\n";
     std::cout << "  -n, --now               Perform instant backup and exit\n";
     std::cout << "  -v, --verbose           Enable verbose output\n";
-    std::cout << "  -l, --list              List all available backups\n";
+    std::cout << "  --incremental           Only copy files changed since the newest backup (hardlink the rest)\n";
+    std::cout << "  --hash                  Also compare file contents by hash in incremental mode and diff restores\n";
+    std::cout << "  --no-copy-hashes        Copy in-kernel without recording content hashes (--verify cannot check them)\n";
+    std::cout << "  -j, --jobs <number>     Number of parallel copy workers (default: CPU count)\n";
+    std::cout << "  --limit-rate <MB/s>     Limit backup copy throughput\n";
+    std::cout << "  --limit-files <n>       Limit the number of files copied per second\n";
+    std::cout << "  --adaptive              Back off while source read latency is elevated\n";
+    std::cout << "  --idle                  Run at idle CPU and I/O priority\n";
+    std::cout << "  --status-file <path>    JSON status of the latest cycles (default: <output>/.flameup_status.json)\n";
+    std::cout << "  --metrics <[addr:]port> Serve Prometheus metrics over HTTP in daemon mode\n";
+    std::cout << "  --exclude <pattern>     Skip matching files and directories (gitignore syntax, repeatable)\n";
+    std::cout << "  --include <pattern>     Back up matching paths despite an earlier exclude (repeatable)\n";
+    std::cout << "  --format <name>         Snapshot format: directory, chunked (deduplicated) or archive\n";
+    std::cout << "  --pack <KB>             Directory format: store files smaller than this in shared pack files\n";
+    std::cout << "  --async-io              Batch small-file I/O through io_uring (Linux) or IOCP (Windows)\n";
+    std::cout << "  --source-snapshot <m>   Copy from a frozen view of the source: auto, vss, btrfs, zfs, lvm or none\n";
+    std::cout << "  --remote <url>          Also send every new backup to flameup://host[:port][/dir] or\n";
+    std::cout << "                          ssh://[user@]host[:port]/path\n";
+    std::cout << "  --remote-token <secret> Shared secret checked by a --serve instance (sent unencrypted)\n";
+    std::cout << "  --remote-streams <n>    Parallel flameup:// connections per snapshot (default: 4)\n";
+    std::cout << "  --remote-command <cmd>  FlameUp program to start on an ssh:// host (default: FlameUp)\n";
+    std::cout << "  --serve <[addr:]port>   Receive backups sent with --remote into --output\n";
+    std::cout << "  -w, --watch             Daemon backs up on filesystem changes instead of a fixed interval\n";
+    std::cout << "  --quiet-period <sec>    Watch mode: start a cycle after this long without changes (default: 2)\n";
+    std::cout << "  --max-latency <sec>     Watch mode: start a cycle at most this long after a change (default: 60)\n";
+    std::cout << "  -l, --list              List backups with file count, logical size, new data and duration\n";
     std::cout << "  -r, --restore <name>    Restore specific backup by name\n";
     std::cout << "  --restore-to <path>     Target path for restore (use with --restore)\n";
-    std::cout << "  --delete <name>         Delete specific backup by name\n\n";
+    std::cout << "  --restore-path <glob>   Restore only this path or glob inside the backup (repeatable)\n";
+    std::cout << "  --restore-mode <mode>   copy (default), swap (check out beside the target, then rename)\n";
+    std::cout << "                          or diff (rewrite only differing files, delete extra ones)\n";
+    std::cout << "  --delete <name>         Delete specific backup by name\n";
+    std::cout << "  --source <name>         Restrict --list/--restore/--delete/--verify to one named source\n";
+    std::cout << "  --verify <name|all>     Check backups against their recorded sizes and hashes\n";
+    std::cout << "  --verify-sample <n>     Verify only n random files; in daemon mode, sample one backup\n";
+    std::cout << "                          per source every hour while idle\n\n";
     std::cout << "Examples:\n";
     std::cout << "  " << programName << " --now                    # Instant backup using paths.txt\n";
     std::cout << "  " << programName << " --path C:\\MyFiles --now  # Instant backup of specific path\n";
     std::cout << "  " << programName << " --daemon --interval 60   # Run daemon with 60min interval\n";
+    std::cout << "  " << programName << " --daemon --incremental   # Daemon that only copies changed files\n";
+    std::cout << "  " << programName << " --daemon --watch         # Back up shortly after files change\n";
     std::cout << "  " << programName << " --list                   # List all backups\n";
+    std::cout << "  " << programName << " --now --remote flameup://backup-host  # Back up, then copy off-host\n";
     std::cout << "  " << programName << " --restore Backup_2024-01-01_12-00-00 --restore-to C:\\Restored\n";
+    std::cout << "  " << programName << " --restore Backup_2024-01-01_12-00-00 --restore-to C:\\Site --restore-path config/app.ini\n";
     std::cout << "  " << programName << " --delete Backup_2024-01-01_12-00-00\n";
 }
 
@@ -291,23 +10529,190 @@ BackupConfig parse_arguments(int argc, char* argv[]) {
         } else if (arg == "-m" || arg == "--max") {
             if (i + 1 < argc) {
                 config.maxBackups = std::stoul(argv[++i]);
+                if (config.maxBackups == 0) {
+                    // Retention runs after publishing, so 0 would delete the backup just made
+                    throw std::runtime_error("--max must be at least 1");
+                }
             } else {
                 throw std::runtime_error("--max requires a value");
             }
+        } else if (arg == "--retain") {
+            if (i + 1 < argc) {
+                config.retention = argv[++i];
+                parse_retention(config.retention);
+            } else {
+                throw std::runtime_error("--retain requires a value");
+            }
         } else if (arg == "-i" || arg == "--interval") {
             if (i + 1 < argc) {
                 config.interval = std::chrono::minutes(std::stoul(argv[++i]));
             } else {
-                throw std::runtime_error("--interval requires a value");
+                throw std::runtime_error("--interval requires a value");
+            }
+        } else if (arg == "-d" || arg == "--daemon") {
+            config.daemon = true;
+        } else if (arg == "-n" || arg == "--now") {
+            config.instant = true;
+        } else if (arg == "-v" || arg == "--verbose") {
+            config.verbose = true;
+        } else if (arg == "--incremental") {
+            config.incremental = true;
+        } else if (arg == "-w" || arg == "--watch") {
+            // Watch cycles only rescan changed paths, so they build on the previous snapshot
+            config.watch = true;
+            config.daemon = true;
+            config.incremental = true;
+        } else if (arg == "--quiet-period") {
+            if (i + 1 < argc) {
+                config.quietPeriod = std::chrono::seconds(std::stoul(argv[++i]));
+            } else {
+                throw std::runtime_error("--quiet-period requires a value");
+            }
+        } else if (arg == "--max-latency") {
+            if (i + 1 < argc) {
+                config.maxLatency = std::chrono::seconds(std::stoul(argv[++i]));
+            } else {
+                throw std::runtime_error("--max-latency requires a value");
+            }
+        } else if (arg == "--limit-rate") {
+            if (i + 1 < argc) {
+                config.maxMBps = std::stod(argv[++i]);
+            } else {
+                throw std::runtime_error("--limit-rate requires a value");
+            }
+        } else if (arg == "--limit-files") {
+            if (i + 1 < argc) {
+                config.maxFilesPerSecond = std::stod(argv[++i]);
+            } else {
+                throw std::runtime_error("--limit-files requires a value");
+            }
+        } else if (arg == "--adaptive") {
+            config.adaptiveThrottle = true;
+        } else if (arg == "--idle") {
+            config.idlePriority = true;
+        } else if (arg == "--status-file") {
+            if (i + 1 < argc) {
+                config.statusFile = argv[++i];
+            } else {
+                throw std::runtime_error("--status-file requires a path");
+            }
+        } else if (arg == "--metrics") {
+            if (i + 1 < argc) {
+                config.metricsListen = argv[++i];
+            } else {
+                throw std::runtime_error("--metrics requires a [address:]port");
+            }
+        } else if (arg == "--exclude" || arg == "--include") {
+            if (i + 1 < argc) {
+                std::string pattern = argv[++i];
+                config.filterRules.push_back(arg == "--include" ? "!" + pattern : pattern);
+            } else {
+                throw std::runtime_error(arg + " requires a pattern");
+            }
+        } else if (arg == "--remote") {
+            if (i + 1 < argc) {
+                config.remoteTarget = argv[++i];
+                parse_remote_target(config.remoteTarget); // Reject bad URLs before the first backup
+            } else {
+                throw std::runtime_error("--remote requires a URL");
+            }
+        } else if (arg == "--remote-token") {
+            if (i + 1 < argc) {
+                config.remoteToken = argv[++i];
+            } else {
+                throw std::runtime_error("--remote-token requires a value");
+            }
+        } else if (arg == "--remote-streams") {
+            if (i + 1 < argc) {
+                config.remoteStreams = std::stoul(argv[++i]);
+                if (config.remoteStreams < 1 || config.remoteStreams > REPLICATION_MAX_STREAMS) {
+                    throw std::runtime_error("--remote-streams must be between 1 and " +
+                                             std::to_string(REPLICATION_MAX_STREAMS));
+                }
+            } else {
+                throw std::runtime_error("--remote-streams requires a value");
+            }
+        } else if (arg == "--remote-command") {
+            if (i + 1 < argc) {
+                config.remoteCommand = argv[++i];
+            } else {
+                throw std::runtime_error("--remote-command requires a program");
+            }
+        } else if (arg == "--serve") {
+            if (i + 1 < argc) {
+                config.serveListen = argv[++i];
+            } else {
+                throw std::runtime_error("--serve requires a [address:]port");
+            }
+        } else if (arg == "--serve-stdio") {
+            config.serveStdio = true;
+        } else if (arg == "--hash") {
+            config.hashCompare = true;
+        } else if (arg == "--no-copy-hashes") {
+            config.hashCopies = false;
+        } else if (arg == "--format") {
+            if (i + 1 < argc) {
+                std::string format = argv[++i];
+                if (format == "directory") {
+                    config.format = SnapshotFormat::Directory;
+                } else if (format == "chunked") {
+                    config.format = SnapshotFormat::Chunked;
+                } else if (format == "archive") {
+                    config.format = SnapshotFormat::Archive;
+                } else {
+                    throw std::runtime_error("Unknown format: " + format);
+                }
+            } else {
+                throw std::runtime_error("--format requires a value");
+            }
+        } else if (arg == "--async-io") {
+            config.asyncIo = true;
+        } else if (arg == "--pack") {
+            if (i + 1 < argc) {
+                config.packThreshold = std::stoull(argv[++i]) * 1024;
+                if (config.packThreshold > PACK_MAX_FILE_SIZE) {
+                    throw std::runtime_error("--pack allows at most " + std::to_string(PACK_MAX_FILE_SIZE / 1024) +
+                                             " KB");
+                }
+            } else {
+                throw std::runtime_error("--pack requires a size in KB");
+            }
+        } else if (arg == "--source-snapshot") {
+            if (i + 1 < argc) {
+                std::string method = argv[++i];
+                if (method == "none") {
+                    config.sourceSnapshot = SourceSnapshotMethod::None;
+                } else if (method == "auto") {
+                    config.sourceSnapshot = SourceSnapshotMethod::Auto;
+                } else if (method == "btrfs") {
+                    config.sourceSnapshot = SourceSnapshotMethod::Btrfs;
+                } else if (method == "zfs") {
+                    config.sourceSnapshot = SourceSnapshotMethod::Zfs;
+                } else if (method == "lvm") {
+                    config.sourceSnapshot = SourceSnapshotMethod::Lvm;
+                } else if (method == "vss") {
+                    config.sourceSnapshot = SourceSnapshotMethod::Vss;
+                } else {
+                    throw std::runtime_error("Unknown snapshot method: " + method);
+                }
+            } else {
+                throw std::runtime_error("--source-snapshot requires a value");
+            }
+        } else if (arg == "-j" || arg == "--jobs") {
+            if (i + 1 < argc) {
+                config.jobs = std::stoul(argv[++i]);
+            } else {
+                throw std::runtime_error("--jobs requires a value");
             }
-        } else if (arg == "-d" || arg == "--daemon") {
-            config.daemon = true;
-        } else if (arg == "-n" || arg == "--now") {
-            config.instant = true;
-        } else if (arg == "-v" || arg == "--verbose") {
-            config.verbose = true;
         } else if (arg == "-l" || arg == "--list") {
             config.listBackups = true;
+        } else if (arg == "--source") {
+            if (i + 1 < argc) {
+                config.sourceName = argv[++i];
+                validate_source_name(config.sourceName, "--source");
+            } else {
+                throw std::runtime_error("--source requires a source name");
+            }
         } else if (arg == "-r" || arg == "--restore") {
             if (i + 1 < argc) {
                 config.restoreBackup = argv[++i];
@@ -320,17 +10725,54 @@ BackupConfig parse_arguments(int argc, char* argv[]) {
             } else {
                 throw std::runtime_error("--restore-to requires a path");
             }
+        } else if (arg == "--restore-path") {
+            if (i + 1 < argc) {
+                config.restorePaths.push_back(argv[++i]);
+            } else {
+                throw std::runtime_error("--restore-path requires a path or glob");
+            }
+        } else if (arg == "--restore-mode") {
+            if (i + 1 < argc) {
+                std::string mode = argv[++i];
+                if (mode == "copy") {
+                    config.restoreMode = RestoreMode::Copy;
+                } else if (mode == "swap") {
+                    config.restoreMode = RestoreMode::Swap;
+                } else if (mode == "diff") {
+                    config.restoreMode = RestoreMode::Diff;
+                } else {
+                    throw std::runtime_error("Unknown restore mode: " + mode);
+                }
+            } else {
+                throw std::runtime_error("--restore-mode requires a value");
+            }
         } else if (arg == "--delete") {
             if (i + 1 < argc) {
                 config.deleteBackup = argv[++i];
             } else {
                 throw std::runtime_error("--delete requires a backup name");
             }
+        } else if (arg == "--verify") {
+            if (i + 1 < argc) {
+                config.verifyBackup = argv[++i];
+            } else {
+                throw std::runtime_error("--verify requires a backup name or 'all'");
+            }
+        } else if (arg == "--verify-sample") {
+            if (i + 1 < argc) {
+                config.verifySample = std::stoul(argv[++i]);
+            } else {
+                throw std::runtime_error("--verify-sample requires a file count");
+            }
         } else {
             throw std::runtime_error("Unknown argument: " + arg);
         }
     }
 
+    if (config.maxLatency < config.quietPeriod) {
+        throw std::runtime_error("--max-latency must not be shorter than --quiet-period");
+    }
+
     // Handle restore target
     if (config.restoreBackup.has_value() && !restoreTarget.empty()) {
         // We'll handle this in main()
@@ -366,29 +10808,194 @@ void create_readme_file() {
     out << "Argument            Description\n";
     out << "---------           ------------------------------------------------\n";
     out << "-h, --help          Display help message and exit\n";
-    out << "-l, --list          List all available backups in the backup directory\n\n";
+    out << "-l, --list          List all available backups in the backup directory with file count,\n";
+    out << "                    logical size, new size and duration. New is the data a backup wrote\n";
+    out << "                    when it was created (hardlinked files and reused chunks are not\n";
+    out << "                    counted twice). It is not updated when older backups are deleted, so\n";
+    out << "                    a backup that shared files with a deleted base still shows only what\n";
+    out << "                    it added itself\n\n";
     out << "Backup Configuration\n";
     out << "--------------------\n";
     out << "Argument               Description                               Default\n";
     out << "---------              ----------------------------------------  ----------\n";
     out << "-p, --path <path>      Source path to backup (overrides config)  Uses paths.txt\n";
-    out << "-c, --config <file>    Config file path containing source path   paths.txt\n";
+    out << "-c, --config <file>    Config file listing the source paths      paths.txt\n";
     out << "-o, --output <path>    Backup output directory                   CopiedFiles\n";
-    out << "-m, --max <number>     Maximum number of backups to keep         10\n\n";
+    out << "-m, --max <number>     Maximum number of backups to keep         10\n";
+    out << "                       (expired backups are moved to <output>/.flameup_trash and deleted\n";
+    out << "                       in the background at idle priority)\n";
+    out << "--retain <tiers>       Keep backups by age instead of by count, as comma-separated\n";
+    out << "                       <bucket>:<age> tiers. all:1h,hourly:1d,daily:30d\n";
+    out << "                       keeps every backup of the last hour, the first backup of each hour\n";
+    out << "                       for a day and of each day for 30 days; older ones are expired.\n";
+    out << "                       Buckets: all, hourly, daily, weekly, monthly, yearly or a duration\n";
+    out << "                       (6h); ages: a number with m, h, d, w or y. The newest backup is\n";
+    out << "                       always kept. Incremental and chunked backups share unchanged data,\n";
+    out << "                       so the kept history costs little more than the bytes that changed\n\n";
+    out << "A backup is written as Backup_<time>.partial, flushed to disk and renamed to Backup_<time>\n";
+    out << "only when complete; old backups are expired after that. If a run is interrupted, the next\n";
+    out << "run continues the .partial directory and keeps the files that were already complete.\n";
+    out << "Backups taken within the same second get a _2, _3, ... suffix. Backups into the same\n";
+    out << "directory run one at a time (.flameup_backup.lock): a second run started meanwhile waits\n";
+    out << "for the first, and a .partial directory is only continued once its run has ended.\n\n";
+    out << "Every backup directory keeps a catalog of its backups in .flameup_catalog: names, times,\n";
+    out << "sources, sizes and verification results. --list, --delete, --verify all and retention\n";
+    out << "read it instead of scanning the directory. It is only ever appended to and survives a\n";
+    out << "crash mid-write. If it is deleted, it is rebuilt from the Backup_* directories on the next\n";
+    out << "run (earlier verification results are lost).\n\n";
+    out << "Config File\n";
+    out << "-----------\n";
+    out << "Every non-comment line of the config file is a source path, optionally followed by\n";
+    out << "settings separated by '|':\n\n";
+    out << "  C:\\Sites\\Shop | name=shop | max=20 | interval=15 | exclude=node_modules/,*.log\n";
+    out << "  C:\\Sites\\Wiki | retain=all:1d,daily:30d,monthly:1y\n";
+    out << "  D:\\Sites\\Blog\n\n";
+    out << "  name=<dir>      Subdirectory of the output directory (default: the source folder name);\n";
+    out << "                  a single directory name, without path separators or '..'\n";
+    out << "  max=<number>    Backups to keep for this source, at least 1 (default: --max)\n";
+    out << "  retain=<tiers>  Tiered retention for this source, same syntax as --retain\n";
+    out << "  interval=<min>  Daemon interval for this source (default: --interval)\n";
+    out << "  exclude=<list>  Comma-separated patterns to skip, same syntax as --exclude\n";
+    out << "  include=<list>  Comma-separated patterns to back up anyway, same as --include\n\n";
+    out << "A .flameupignore file in the root of a source adds one gitignore-style rule per line\n";
+    out << "(# comments, !pattern to re-include). Its rules come after --exclude/--include and the\n";
+    out << "config file settings, so they win when they overlap.\n\n";
+    out << "A single unnamed source is backed up straight into the output directory. With several\n";
+    out << "sources, one daemon backs up sources on different disks in parallel and sources on the\n";
+    out << "same disk one after another. --list and --verify all cover every source; --restore,\n";
+    out << "--delete and --verify <name> find the backup in whichever source has it. --source <name>\n";
+    out << "restricts them to one source.\n\n";
     out << "Backup Operations\n";
     out << "-----------------\n";
     out << "Argument               Description\n";
     out << "---------              -----------------------------------------------\n";
     out << "-n, --now             Perform instant backup and exit\n";
     out << "-d, --daemon          Run as background daemon (continuous backups)\n";
-    out << "-i, --interval <min>  Backup interval in minutes for daemon mode (default: 30)\n\n";
+    out << "-i, --interval <min>  Backup interval in minutes for daemon mode (default: 30)\n";
+    out << "--incremental         Only copy files changed since the newest backup, hardlink unchanged ones\n";
+    out << "--hash                Also compare file contents by hash in incremental mode and diff\n";
+    out << "                      restores. Source hashes are cached in <output>/.flameup_hashcache\n";
+    out << "                      and only recomputed for files whose size, mtime or ctime changed.\n";
+    out << "                      The cache is held in memory (about 90 bytes per file) and covers\n";
+    out << "                      at most 2 million files; files beyond that are hashed every run\n";
+    out << "--no-copy-hashes      Let the kernel copy files (copy_file_range, sendfile, CopyFile2)\n";
+    out << "                      without recording their content hashes. Faster on filesystems\n";
+    out << "                      without reflinks, but --verify can then only check those files'\n";
+    out << "                      sizes. By default every copied file's hash goes into the manifest;\n";
+    out << "                      reflinked copies are hashed by reading the shared data once\n";
+    out << "-j, --jobs <number>   Number of parallel copy workers for backup and restore (default: CPU count)\n";
+    out << "--limit-rate <MB/s>   Limit backup copy throughput, shared by all sources on one disk\n";
+    out << "--limit-files <n>     Limit the number of files backed up per second\n";
+    out << "--adaptive            Watch source read latency and back off while it rises above normal,\n";
+    out << "                      e.g. when a server on the same disk gets busy\n";
+    out << "--idle                Run at idle CPU and I/O priority (IOPRIO_CLASS_IDLE on Linux,\n";
+    out << "                      background mode on Windows)\n";
+    out << "--status-file <path>  Where to write the JSON status of the latest cycle of every source\n";
+    out << "                      (timings, files/bytes copied and skipped, throughput, errors).\n";
+    out << "                      Default: <output>/.flameup_status.json\n";
+    out << "--metrics <[addr:]port>  Serve the same numbers in Prometheus text format on\n";
+    out << "                      http://addr:port/metrics in daemon mode (default address 127.0.0.1)\n";
+    out << "--exclude <pattern>   Do not back up matching files or directories; excluded directories\n";
+    out << "                      are not even read. Gitignore syntax: node_modules/ (trailing / =\n";
+    out << "                      directories only), *.log (no inner / = any depth), /.next/cache\n";
+    out << "                      (inner or leading / = relative to the source root), ** spans\n";
+    out << "                      directories. Repeatable; the last matching rule wins\n";
+    out << "--include <pattern>   Back up matching paths even if an earlier rule excluded them\n";
+    out << "                      (same as !pattern). Contents of an excluded directory cannot be\n";
+    out << "                      re-included, because that directory is never read\n";
+    out << "--format <name>       Snapshot format (default: directory)\n";
+    out << "                        directory  plain copy of the source tree\n";
+    out << "                        chunked    deduplicated chunks stored once in <output>/.flameup_chunks\n";
+    out << "                        archive    one zstd-compressed, seekable archive file per backup\n";
+    out << "--pack <KB>           Directory format: files smaller than this (at most 16384) are appended\n";
+    out << "                      to shared ~32 MB files in .flameup_packs inside the backup instead of\n";
+    out << "                      being copied one by one, saving a file and a filesystem block each.\n";
+    out << "                      Restores, verification and replication read them from the packs.\n";
+    out << "                      Unchanged packed files are carried over by hardlinking their pack,\n";
+    out << "                      until less than half of a pack is still in use (default: off)\n";
+    out << "--async-io            Copy small files (up to 1 MB) in batches of asynchronous requests:\n";
+    out << "                      io_uring on Linux, overlapped I/O on a completion port on Windows.\n";
+    out << "                      Each worker keeps up to 256 opens, reads, writes and closes in\n";
+    out << "                      flight instead of waiting on each, and on Linux directory scans stat\n";
+    out << "                      their entries the same way. Helps most on network storage and NVMe,\n";
+    out << "                      where few threads with deep queues beat many blocking ones. Files are\n";
+    out << "                      hashed on the way. Without kernel support (or with a rate limit),\n";
+    out << "                      blocking I/O is used\n";
+    out << "--source-snapshot <m> Take a snapshot of the source first and copy from it, so files that\n";
+    out << "                      change during the backup are captured consistently (default: none)\n";
+    out << "                        vss    Volume Shadow Copy (Windows)\n";
+    out << "                        btrfs  read-only snapshot next to the source's subvolume\n";
+    out << "                        zfs    dataset snapshot, read through .zfs/snapshot\n";
+    out << "                        lvm    LVM snapshot volume mounted read-only in the temp directory\n";
+    out << "                        auto   whichever of these holds the source, else the live tree\n";
+    out << "                      The snapshot is removed after the copy. Needs administrator/root\n";
+    out << "-w, --watch           Daemon mode driven by filesystem change notifications (inotify /\n";
+    out << "                      ReadDirectoryChangesW): only changed paths are rescanned and cycles\n";
+    out << "                      without changes are skipped. Implies --daemon and --incremental\n";
+    out << "--quiet-period <sec>  Watch mode: wait until no change has arrived for this long, so a\n";
+    out << "                      burst of writes becomes one backup (default: 2)\n";
+    out << "--max-latency <sec>   Watch mode: back up at most this long after the first change, even\n";
+    out << "                      if changes keep arriving (default: 60)\n\n";
+    out << "Off-host Copies\n";
+    out << "---------------\n";
+    out << "Argument               Description\n";
+    out << "---------              -----------------------------------------------\n";
+    out << "--remote <url>        After every backup, send the new snapshot to another machine\n";
+    out << "                        flameup://host[:port][/dir]  a FlameUp --serve instance (port 7420)\n";
+    out << "                        ssh://[user@]host[:port]/path  runs FlameUp on the host through the\n";
+    out << "                                                     ssh client; path is its backup directory\n";
+    out << "                      Only what the remote lacks is sent: new chunks for chunked backups,\n";
+    out << "                      files that differ from its newest backup (the rest are hardlinked\n";
+    out << "                      there) for directory backups, the archive file for archives. The\n";
+    out << "                      remote keeps the same --max number of backups. S3 is not supported\n";
+    out << "                      A remote that accepts or sends nothing for 60 seconds fails the\n";
+    out << "                      replication, which is retried after the next backup\n";
+    out << "--remote-token <text> Shared secret; must match the --remote-token of the --serve side.\n";
+    out << "                      flameup:// is not encrypted: the token and all data travel in\n";
+    out << "                      plain text, so use ssh:// or a VPN across untrusted networks\n";
+    out << "--remote-streams <n>  Send a flameup:// snapshot over n connections at once (default: 4,\n";
+    out << "                      at most 16). Files larger than 16 MB are sent in parts spread over\n";
+    out << "                      all of them. ssh:// always uses one stream\n";
+    out << "--remote-command <cmd> Program to run on an ssh:// host (default: FlameUp)\n";
+    out << "--serve <[addr:]port> Receive snapshots sent with --remote and store them under --output\n";
+    out << "                      (default address 0.0.0.0). Traffic is not encrypted; use ssh://\n";
+    out << "                      or a VPN across untrusted networks. Each connection is served on\n";
+    out << "                      its own thread, up to 64 at once, and idle ones time out\n\n";
     out << "Backup Management\n";
     out << "-----------------\n";
     out << "Argument               Description\n";
     out << "---------              -----------------------------------------------\n";
     out << "-r, --restore <name>  Restore specific backup by name\n";
     out << "--restore-to <path>   Target path for restore (required with --restore)\n";
-    out << "--delete <name>       Delete specific backup by name\n\n";
+    out << "--restore-path <glob> Restore only matching entries, given relative to the backup root,\n";
+    out << "                      e.g. config/app.ini, 'logs/*.conf' or '**/.htaccess'. * and ? stay\n";
+    out << "                      within one directory, ** spans directories, a matching directory\n";
+    out << "                      brings its contents. Repeatable. Only the matching entries of the\n";
+    out << "                      target are replaced; everything else in it is left as it is\n";
+    out << "--restore-mode <mode> How an existing target is replaced (default: copy)\n";
+    out << "                        copy  delete the target, then copy the backup into place\n";
+    out << "                        swap  build the restored tree next to the target, reflinking the\n";
+    out << "                              snapshot files where the filesystem supports it (copying\n";
+    out << "                              them otherwise), then swap it in with a single rename; the\n";
+    out << "                              old tree is deleted afterwards at idle priority. Restored\n";
+    out << "                              files never share an inode with the backup\n";
+    out << "                        diff  compare the target with the backup's manifest (size and\n";
+    out << "                              mtime, plus content hash with --hash), rewrite only the files\n";
+    out << "                              that differ and delete files the backup does not contain,\n";
+    out << "                              like rsync --delete. Unchanged files are left untouched\n";
+    out << "--delete <name>       Delete specific backup by name\n";
+    out << "--source <name>       Only list, restore, delete or verify the backups of this named source\n";
+    out << "--verify <name|all>   Read back a backup (or all of them) and check every file against the\n";
+    out << "                      size and content hash in its manifest, chunks against their ids and\n";
+    out << "                      archive blocks against their checksums. Uses --jobs workers and the\n";
+    out << "                      --limit-rate/--limit-files/--adaptive limits. The result is stored\n";
+    out << "                      in the backup and shown by --list; a failure stays listed until a\n";
+    out << "                      full verify passes. Files without a recorded hash (copied with\n";
+    out << "                      --no-copy-hashes or by an older version) are reported as unverifiable:\n";
+    out << "                      only their size is checked, and the verify does not count as passed\n";
+    out << "--verify-sample <n>   Check only n randomly chosen files. In daemon mode, every hour a\n";
+    out << "                      source is idle for a minute, a sample of its least recently\n";
+    out << "                      verified backup is checked\n\n";
     out << "Output Control\n";
     out << "--------------\n";
     out << "Argument               Description\n";
@@ -399,6 +11006,7 @@ void create_readme_file() {
 }
 
 
+#if !defined(FLAMEUP_BENCH) && !defined(FLAMEUP_TEST)
 int main(int argc, char* argv[]) {
     create_readme_file();
     try {
@@ -421,12 +11029,59 @@ int main(int argc, char* argv[]) {
             }
         }
 
+        // Handle the receiving end of --remote
+        if (config.serveStdio) {
+            // stdout carries the protocol, so messages go to stderr
+            std::cout.rdbuf(std::cerr.rdbuf());
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+            _setmode(_fileno(stdout), _O_BINARY);
+            PipeStream stream(GetStdHandle(STD_INPUT_HANDLE), GetStdHandle(STD_OUTPUT_HANDLE));
+#else
+            PipeStream stream(STDIN_FILENO, STDOUT_FILENO);
+#endif
+            serve_replication_session(stream, config);
+            return 0;
+        }
+        if (!config.serveListen.empty()) {
+            serve_replication(config);
+            return 0;
+        }
+
+        // Management commands act on one named source's backups with --source. Without it they also
+        // cover the subdirectories several sources from paths.txt back up into.
+        std::vector<fs::path> managedRoots{backupRootPath};
+        if (!config.sourceName.empty()) {
+            managedRoots = {backupRootPath / config.sourceName};
+        } else {
+            for (const std::string& name : find_source_roots(backupRootPath)) {
+                managedRoots.push_back(backupRootPath / name);
+            }
+        }
+
         // Handle list operation
         if (config.listBackups) {
-            list_backups(backupRootPath);
+            for (size_t i = 0; i < managedRoots.size(); i++) {
+                // The shared root itself usually holds no backups once there are named sources
+                if (i == 0 && managedRoots.size() > 1 && SnapshotCatalog(managedRoots[0]).entries().empty()) {
+                    continue;
+                }
+                if (i > 0) {
+                    std::cout << (i > 1 ? "\n" : "") << "Source " << managedRoots[i].filename().string() << ":\n";
+                }
+                list_backups(managedRoots[i]);
+            }
             return 0;
         }
 
+        if (config.asyncIo) {
+            if (AsyncIo::create()) {
+                async_io_enabled() = true;
+            } else {
+                std::cerr << "Warning: Async I/O is not available here, using blocking I/O\n";
+            }
+        }
+
         // Handle restore operation
         if (config.restoreBackup.has_value()) {
             std::string restoreTarget;
@@ -444,12 +11099,42 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
 
-            return restore_backup(config.restoreBackup.value(), backupRootPath, restoreTarget) ? 0 : 1;
+            return restore_backup(config.restoreBackup.value(),
+                                  locate_backup_root(managedRoots, config.restoreBackup.value()), restoreTarget,
+                                  config.jobs, config.restoreMode, config.hashCompare, config.restorePaths) ? 0 : 1;
         }
 
         // Handle delete operation
         if (config.deleteBackup.has_value()) {
-            return delete_backup(config.deleteBackup.value(), backupRootPath) ? 0 : 1;
+            return delete_backup(config.deleteBackup.value(),
+                                 locate_backup_root(managedRoots, config.deleteBackup.value())) ? 0 : 1;
+        }
+
+        if (config.idlePriority) {
+            // Before any worker thread exists, so every thread started later inherits it
+            lower_process_priority();
+        }
+
+        // Handle verify operation
+        if (config.verifyBackup.has_value()) {
+            IoThrottle throttle(config.maxMBps * 1024 * 1024, config.maxFilesPerSecond, config.adaptiveThrottle);
+            if (config.verifyBackup.value() != "all") {
+                return verify_backups(config.verifyBackup.value(),
+                                      locate_backup_root(managedRoots, config.verifyBackup.value()), config.jobs,
+                                      &throttle, config.verifySample) ? 0 : 1;
+            }
+            bool allPassed = true;
+            for (size_t i = 0; i < managedRoots.size(); i++) {
+                if (i == 0 && managedRoots.size() > 1 && SnapshotCatalog(managedRoots[0]).entries().empty()) {
+                    continue;
+                }
+                if (i > 0) {
+                    std::cout << "Source " << managedRoots[i].filename().string() << ":\n";
+                }
+                allPassed = verify_backups("all", managedRoots[i], config.jobs, &throttle, config.verifySample) &&
+                            allPassed;
+            }
+            return allPassed ? 0 : 1;
         }
 
         // Handle instant backup
@@ -457,56 +11142,839 @@ int main(int argc, char* argv[]) {
             if (config.verbose) {
                 std::cout << "Performing instant backup...\n";
             }
-            return perform_backup(config) ? 0 : 1;
+            return run_sources(config, true) ? 0 : 1;
         }
 
         // Handle daemon mode
         if (config.daemon) {
             std::cout << "Starting backup daemon...\n";
             std::cout << "Backup interval: " << config.interval.count() << " minutes\n";
-            std::cout << "Max backups: " << config.maxBackups << "\n";
+            if (config.retention.empty()) {
+                std::cout << "Max backups: " << config.maxBackups << "\n";
+            } else {
+                std::cout << "Retention: " << config.retention << "\n";
+            }
             std::cout << "Backup directory: " << backupRootPath << "\n";
             std::cout << "Press Ctrl+C to stop...\n\n";
 
-            while (true) {
-                auto startTime = std::chrono::steady_clock::now();
+            run_sources(config, false);
+        } else {
+            // No specific operation specified, show help
+            print_help(argv[0]);
+            return 1;
+        }
 
-                if (config.verbose) {
-                    std::cout << "\n--- Starting backup cycle ---\n";
-                }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+#endif // !FLAMEUP_BENCH && !FLAMEUP_TEST
 
-                bool success = perform_backup(config);
+#ifdef FLAMEUP_BENCH
+// FlameUp_bench: times scanning, backup, restore and cleanup on synthetic trees and prints the
+// results as JSON so runs can be compared between releases.
 
-                if (success) {
-                    if (config.verbose) {
-                        std::cout << "Backup completed successfully.\n";
-                    }
+struct BenchOptions {
+    fs::path workDir = fs::temp_directory_path() / "flameup_bench";
+    std::optional<fs::path> outputFile;
+    std::vector<std::string> scenarios{"tiny", "huge", "deep", "website"};
+    double scale = 1.0;
+    size_t jobs = 0;
+    SnapshotFormat format = SnapshotFormat::Directory;
+    bool keep = false;
+};
+
+struct BenchResult {
+    std::string scenario;
+    std::string operation;
+    double seconds = 0;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+    uint64_t peakRssKb = 0;
+};
+
+// Deterministic generator so every run builds identical trees
+struct BenchRandom {
+    uint64_t state;
+    explicit BenchRandom(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint64_t range(uint64_t lo, uint64_t hi) { return lo + next() % (hi - lo + 1); }
+};
+
+// Function to write a file of the given size filled with incompressible data
+void bench_write_file(const fs::path& filePath, uint64_t size, BenchRandom& random) {
+    static std::vector<char> block = [] {
+        std::vector<char> data(1 << 20);
+        BenchRandom fill(42);
+        for (size_t i = 0; i < data.size(); i += 8) {
+            uint64_t v = fill.next();
+            std::memcpy(data.data() + i, &v, 8);
+        }
+        return data;
+    }();
+
+    std::ofstream out(filePath, std::ios::binary | std::ios::trunc);
+    // Start at a random offset so files do not all share the same contents
+    uint64_t offset = random.next() % block.size();
+    while (size > 0) {
+        size_t take = static_cast<size_t>(std::min<uint64_t>(size, block.size() - offset));
+        out.write(block.data() + offset, static_cast<std::streamsize>(take));
+        size -= take;
+        offset = 0;
+    }
+    if (!out) {
+        throw std::runtime_error("Cannot write benchmark file: " + filePath.string());
+    }
+}
+
+// Function to generate the synthetic source tree of a scenario
+void bench_generate_tree(const std::string& scenario, const fs::path& root, double scale) {
+    BenchRandom random(std::hash<std::string>{}(scenario));
+    auto count = [&](double n) { return static_cast<size_t>(std::max(1.0, n * scale)); };
+    fs::create_directories(root);
+
+    if (scenario == "tiny") {
+        // Many small files spread over a flat set of directories
+        size_t files = count(20000);
+        for (size_t i = 0; i < files; i++) {
+            fs::path dir = root / ("dir" + std::to_string(i % 100));
+            if (i < 100) fs::create_directories(dir);
+            bench_write_file(dir / ("file" + std::to_string(i) + ".txt"), random.range(0, 4096), random);
+        }
+    } else if (scenario == "huge") {
+        // A few files above the large-file threshold, split into chunks by the copy engine
+        size_t files = count(3);
+        for (size_t i = 0; i < files; i++) {
+            bench_write_file(root / ("huge" + std::to_string(i) + ".bin"), 128ULL << 20, random);
+        }
+    } else if (scenario == "deep") {
+        // Long directory chains with a couple of files per level
+        size_t chains = count(20);
+        for (size_t c = 0; c < chains; c++) {
+            fs::path dir = root / ("chain" + std::to_string(c));
+            for (int depth = 0; depth < 64; depth++) {
+                dir /= "level" + std::to_string(depth);
+                fs::create_directories(dir);
+                bench_write_file(dir / "a.dat", random.range(100, 8192), random);
+                bench_write_file(dir / "b.dat", random.range(100, 8192), random);
+            }
+        }
+    } else if (scenario == "website") {
+        // Mixed layout: templates and scripts, a media library and a dependency tree
+        size_t pages = count(2000);
+        for (size_t i = 0; i < pages; i++) {
+            fs::path dir = root / "public" / ("section" + std::to_string(i % 40));
+            if (i < 40) fs::create_directories(dir);
+            bench_write_file(dir / ("page" + std::to_string(i) + ".html"), random.range(2000, 60000), random);
+        }
+        fs::create_directories(root / "assets");
+        for (size_t i = 0; i < count(300); i++) {
+            bench_write_file(root / "assets" / ("script" + std::to_string(i) + ".js"), random.range(1000, 400000), random);
+        }
+        fs::create_directories(root / "media");
+        for (size_t i = 0; i < count(200); i++) {
+            bench_write_file(root / "media" / ("image" + std::to_string(i) + ".jpg"), random.range(50000, 4000000), random);
+        }
+        for (size_t i = 0; i < count(3000); i++) {
+            fs::path dir = root / "node_modules" / ("pkg" + std::to_string(i % 300)) / "lib";
+            if (i < 300) fs::create_directories(dir);
+            bench_write_file(dir / ("m" + std::to_string(i) + ".js"), random.range(200, 20000), random);
+        }
+    } else {
+        throw std::runtime_error("Unknown benchmark scenario: " + scenario);
+    }
+}
+
+// Function to read the peak resident set size in KiB since the last reset
+uint64_t bench_peak_rss_kb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize / 1024;
+    }
+    return 0;
+#elif defined(__linux__)
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("VmHWM:")) {
+            return std::stoull(line.substr(6));
+        }
+    }
+    return 0;
+#else
+    struct rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+}
+
+// Function to reset the peak RSS counter so each operation reports its own peak (Linux only;
+// elsewhere the value is the peak of the whole run so far)
+void bench_reset_peak_rss() {
+#ifdef __linux__
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5";
+#endif
+}
+
+// Function to count the files and bytes of a tree
+std::pair<uint64_t, uint64_t> bench_tree_totals(const fs::path& root) {
+    uint64_t files = 0, bytes = 0;
+    walk_tree_sorted(root, "", [&](const fs::path&, const std::string&, const FileInfo& info) {
+        if (info.type == EntryType::File) {
+            files++;
+            bytes += info.size;
+        }
+    });
+    return {files, bytes};
+}
+
+// Function to run one timed operation with its console output suppressed
+BenchResult bench_measure(const std::string& scenario, const std::string& operation, uint64_t files,
+                          uint64_t bytes, const std::function<void()>& run) {
+    std::ostringstream discard;
+    std::streambuf* original = std::cout.rdbuf(discard.rdbuf());
+    bench_reset_peak_rss();
+
+    auto start = std::chrono::steady_clock::now();
+    try {
+        run();
+    } catch (...) {
+        std::cout.rdbuf(original);
+        throw;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    std::cout.rdbuf(original);
+
+    BenchResult result;
+    result.scenario = scenario;
+    result.operation = operation;
+    result.seconds = std::chrono::duration<double>(elapsed).count();
+    result.files = files;
+    result.bytes = bytes;
+    result.peakRssKb = bench_peak_rss_kb();
+    std::cerr << "  " << std::left << std::setw(12) << operation << std::fixed << std::setprecision(3)
+              << result.seconds << " s\n";
+    return result;
+}
+
+// Snapshot folder names have one-second resolution, so consecutive backups must not share a second
+void bench_wait_for_next_second() {
+    auto now = std::chrono::system_clock::now();
+    auto next = std::chrono::floor<std::chrono::seconds>(now) + std::chrono::seconds(1);
+    std::this_thread::sleep_until(next);
+}
+
+// Function to run every operation against one scenario
+void bench_run_scenario(const std::string& scenario, const BenchOptions& options, std::vector<BenchResult>& results) {
+    fs::path base = options.workDir / scenario;
+    fs::path source = base / "source";
+    fs::path backups = base / "backups";
+    fs::path restored = base / "restored";
+    fs::remove_all(base);
+
+    std::cerr << "Scenario " << scenario << ": generating tree...\n";
+    bench_generate_tree(scenario, source, options.scale);
+    auto [files, bytes] = bench_tree_totals(source);
+
+    BackupConfig config;
+    config.sourcePath = source.string();
+    config.backupRoot = backups.string();
+    config.maxBackups = 100;
+    config.jobs = options.jobs;
+    config.format = options.format;
+    fs::create_directories(backups);
+
+    results.push_back(bench_measure(scenario, "scan", files, bytes, [&] {
+        size_t entries = 0;
+        walk_tree_sorted(source, "", [&](const fs::path&, const std::string&, const FileInfo&) { entries++; });
+    }));
+
+    results.push_back(bench_measure(scenario, "backup", files, bytes, [&] {
+        if (!perform_backup(config)) throw std::runtime_error("Backup failed");
+    }));
+
+    bench_wait_for_next_second();
+    config.incremental = true;
+    results.push_back(bench_measure(scenario, "incremental", files, bytes, [&] {
+        if (!perform_backup(config)) throw std::runtime_error("Incremental backup failed");
+    }));
+
+    auto latest = find_latest_backup(backups);
+    results.push_back(bench_measure(scenario, "restore", files, bytes, [&] {
+        if (!latest || !restore_backup(latest->filename().string(), backups, restored.string(), options.jobs,
+                                      RestoreMode::Copy, false, {})) {
+            throw std::runtime_error("Restore failed");
+        }
+    }));
+
+    // Keeping no backup removes every existing one
+    results.push_back(bench_measure(scenario, "cleanup", files * 2, bytes * 2, [&] {
+        cleanup_old_backups(backups, 0, false, nullptr);
+    }));
+
+    if (!options.keep) {
+        fs::remove_all(base);
+    }
+}
+
+// Function to escape a string for JSON output
+std::string bench_json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+// Function to print all results as one JSON document
+void bench_write_json(std::ostream& out, const BenchOptions& options, const std::vector<BenchResult>& results) {
+    const char* formats[] = {"directory", "chunked", "archive"};
+    out << "{\n";
+    out << "  \"benchmark\": \"flameup\",\n";
+    out << "  \"schema\": 1,\n";
+    out << "  \"jobs\": " << resolve_job_count(options.jobs) << ",\n";
+    out << "  \"format\": \"" << formats[static_cast<int>(options.format)] << "\",\n";
+    out << "  \"scale\": " << options.scale << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        double seconds = std::max(r.seconds, 1e-9);
+        out << "    {\"scenario\": " << bench_json_string(r.scenario)
+            << ", \"operation\": " << bench_json_string(r.operation)
+            << std::fixed << std::setprecision(6)
+            << ", \"seconds\": " << r.seconds
+            << ", \"files\": " << r.files
+            << ", \"bytes\": " << r.bytes
+            << std::setprecision(2)
+            << ", \"mb_per_second\": " << static_cast<double>(r.bytes) / (1024.0 * 1024.0) / seconds
+            << ", \"files_per_second\": " << static_cast<double>(r.files) / seconds
+            << ", \"peak_rss_kb\": " << r.peakRssKb << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+        out.unsetf(std::ios::fixed);
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+void print_bench_help(const std::string& programName) {
+    std::cout << "FlameUp benchmark suite\n";
+    std::cout << "Usage: " << programName << " [OPTIONS]\n\n";
+    std::cout << "Options:\n";
+    std::cout << "  -h, --help              Show this help message\n";
+    std::cout << "  --dir <path>            Work directory for generated trees (default: temp dir)\n";
+    std::cout << "  --out <file>            Write the JSON results to a file instead of stdout\n";
+    std::cout << "  --scenario <name>       Run only tiny, huge, deep or website (repeatable)\n";
+    std::cout << "  --scale <factor>        Multiply the generated file counts (default: 1)\n";
+    std::cout << "  -j, --jobs <number>     Number of parallel copy workers (default: CPU count)\n";
+    std::cout << "  --format <name>         Snapshot format: directory, chunked or archive\n";
+    std::cout << "  --keep                  Keep the generated trees and backups\n";
+}
+
+int run_benchmarks(int argc, char* argv[]) {
+    BenchOptions options;
+    bool scenariosGiven = false;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) throw std::runtime_error(arg + " requires a value");
+                return argv[++i];
+            };
+
+            if (arg == "-h" || arg == "--help") {
+                print_bench_help(argv[0]);
+                return 0;
+            } else if (arg == "--dir") {
+                options.workDir = value();
+            } else if (arg == "--out") {
+                options.outputFile = fs::path(value());
+            } else if (arg == "--scenario") {
+                if (!scenariosGiven) options.scenarios.clear();
+                scenariosGiven = true;
+                options.scenarios.push_back(value());
+            } else if (arg == "--scale") {
+                options.scale = std::stod(value());
+            } else if (arg == "-j" || arg == "--jobs") {
+                options.jobs = std::stoul(value());
+            } else if (arg == "--format") {
+                std::string format = value();
+                if (format == "directory") {
+                    options.format = SnapshotFormat::Directory;
+                } else if (format == "chunked") {
+                    options.format = SnapshotFormat::Chunked;
+                } else if (format == "archive") {
+                    options.format = SnapshotFormat::Archive;
                 } else {
-                    std::cout << "Backup failed, will retry in " << config.interval.count() << " minutes.\n";
+                    throw std::runtime_error("Unknown format: " + format);
                 }
+            } else if (arg == "--keep") {
+                options.keep = true;
+            } else {
+                throw std::runtime_error("Unknown argument: " + arg);
+            }
+        }
 
-                // Calculate next backup time
-                auto nextBackup = startTime + config.interval;
-                auto now = std::chrono::steady_clock::now();
+        std::vector<BenchResult> results;
+        for (const auto& scenario : options.scenarios) {
+            bench_run_scenario(scenario, options, results);
+        }
+        if (!options.keep) {
+            std::error_code ec;
+            fs::remove(options.workDir, ec);
+        }
 
-                if (nextBackup > now) {
-                    auto waitTime = std::chrono::duration_cast<std::chrono::minutes>(nextBackup - now);
-                    if (config.verbose) {
-                        std::cout << "Next backup in " << waitTime.count() << " minutes...\n";
-                    }
-                    std::this_thread::sleep_until(nextBackup);
-                }
+        if (options.outputFile) {
+            std::ofstream out(*options.outputFile);
+            if (!out) {
+                throw std::runtime_error("Cannot write results: " + options.outputFile->string());
             }
+            bench_write_json(out, options, results);
+            std::cerr << "✓ Results written to " << *options.outputFile << "\n";
         } else {
-            // No specific operation specified, show help
-            print_help(argv[0]);
-            return 1;
+            bench_write_json(std::cout, options, results);
         }
+        return 0;
 
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << "\n";
         return 1;
     }
+}
 
-    return 0;
-}
\ No newline at end of file
+int main(int argc, char* argv[]) {
+    return run_benchmarks(argc, argv);
+}
+#endif // FLAMEUP_BENCH
+
+#ifdef FLAMEUP_TEST
+// FlameUp_tests: checks of the copy paths and round trips of the on-disk formats, one ctest case
+// per test name. Each runs in a scratch directory of its own under the system temp directory.
+
+// Scratch directory removed when the test ends, pass or fail
+class TestDir {
+public:
+    explicit TestDir(const std::string& name)
+        : path_(fs::temp_directory_path() / ("flameup_test_" + name + "_" + std::to_string(std::random_device{}()))) {
+        fs::remove_all(path_);
+        fs::create_directories(path_);
+    }
+
+    TestDir(const TestDir&) = delete;
+    TestDir& operator=(const TestDir&) = delete;
+
+    ~TestDir() {
+        std::error_code ec;
+        fs::remove_all(path_, ec);
+    }
+
+    const fs::path& path() const { return path_; }
+
+private:
+    fs::path path_;
+};
+
+// Function to fail the running test with what was expected and where
+void test_expect(bool condition, const char* expression, int line) {
+    if (!condition) {
+        throw std::runtime_error("line " + std::to_string(line) + ": expected " + expression);
+    }
+}
+
+#define TEST_EXPECT(condition) test_expect((condition), #condition, __LINE__)
+
+// Function to write size bytes from a fixed seed, so every run sees the same data
+std::string test_random_bytes(size_t size, uint64_t seed) {
+    std::mt19937_64 random(seed);
+    std::string data(size, '\0');
+    for (char& c : data) {
+        c = static_cast<char>(random() & 0xFF);
+    }
+    return data;
+}
+
+void test_write_file(const fs::path& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!out) {
+        throw std::runtime_error("Cannot write test file: " + path.string());
+    }
+}
+
+// Every field of every entry type survives a v5 manifest, including hashless files and
+// negative mtimes
+void test_manifest() {
+    TestDir dir("manifest");
+    std::vector<ManifestEntry> entries(4);
+    entries[0].path = "d";
+    entries[0].type = EntryType::Directory;
+    entries[0].mode = 0755;
+    entries[1].path = "d/a.txt";
+    entries[1].size = 12345;
+    entries[1].mtimeNs = 1700000000123456789LL;
+    entries[1].fileId = 42;
+    entries[1].mode = 0644;
+    entries[1].hash = 0x0123456789ABCDEFULL;
+    entries[1].hasHash = true;
+    entries[2].path = "d/b";
+    entries[2].size = 7;
+    entries[2].mtimeNs = -5000000000LL;
+    entries[3].path = "d/link";
+    entries[3].type = EntryType::Symlink;
+    entries[3].linkTarget = "a.txt";
+
+    ManifestWriter writer(dir.path() / MANIFEST_FILE_NAME, SnapshotFormat::Chunked);
+    for (const auto& entry : entries) {
+        writer.add(entry);
+    }
+    writer.set_snapshot_stats(999, std::chrono::milliseconds(1234));
+    writer.finish();
+
+    ManifestReader reader;
+    TEST_EXPECT(reader.open(dir.path() / MANIFEST_FILE_NAME));
+    const ManifestHeader& header = reader.header();
+    TEST_EXPECT(header.version == 5);
+    TEST_EXPECT(header.format == SnapshotFormat::Chunked);
+    TEST_EXPECT(header.entryCount == 4);
+    TEST_EXPECT(header.fileCount == 2);
+    TEST_EXPECT(header.totalBytes == 12352);
+    TEST_EXPECT(header.storedBytes == 999);
+    TEST_EXPECT(header.durationMs == 1234);
+
+    ManifestEntry entry;
+    for (const auto& expected : entries) {
+        TEST_EXPECT(reader.next(entry));
+        TEST_EXPECT(entry.path == expected.path);
+        TEST_EXPECT(entry.type == expected.type);
+        TEST_EXPECT(entry.size == expected.size);
+        TEST_EXPECT(entry.mtimeNs == expected.mtimeNs);
+        TEST_EXPECT(entry.fileId == expected.fileId);
+        TEST_EXPECT(entry.mode == expected.mode);
+        TEST_EXPECT(entry.hasHash == expected.hasHash);
+        TEST_EXPECT(entry.hash == expected.hash);
+        TEST_EXPECT(entry.linkTarget == expected.linkTarget);
+    }
+    TEST_EXPECT(!reader.next(entry));
+}
+
+// Function to count the chunk files in a store
+size_t test_count_chunks(const fs::path& backupRoot) {
+    size_t count = 0;
+    for (const auto& entry : fs::recursive_directory_iterator(backupRoot / CHUNK_STORE_DIR)) {
+        if (entry.is_regular_file() && entry.path().filename() != CHUNK_REFCOUNT_FILE_NAME) count++;
+    }
+    return count;
+}
+
+// Chunks shared by two files are stored once and only deleted once neither refers to them,
+// with the refcounts surviving a reload of the store
+void test_chunk_store() {
+    TestDir dir("chunkstore");
+    std::string shared = test_random_bytes(1 << 20, 1);
+    std::string first = shared + test_random_bytes(512 << 10, 2);
+    std::string second = shared + test_random_bytes(512 << 10, 3);
+    test_write_file(dir.path() / "first", first);
+    test_write_file(dir.path() / "second", second);
+
+    std::vector<ChunkRef> firstRefs, secondRefs;
+    uint64_t hash = 0, size = 0;
+    {
+        ChunkStore store(dir.path());
+        firstRefs = store.store_file(dir.path() / "first", hash, size);
+        TEST_EXPECT(size == first.size());
+        secondRefs = store.store_file(dir.path() / "second", hash, size);
+        store.commit();
+    }
+
+    std::unordered_set<ChunkId, ChunkIdHash> firstIds, allIds;
+    for (const auto& ref : firstRefs) firstIds.insert(ref.id);
+    allIds = firstIds;
+    size_t sharedCount = 0;
+    for (const auto& ref : secondRefs) {
+        sharedCount += firstIds.contains(ref.id);
+        allIds.insert(ref.id);
+    }
+    TEST_EXPECT(sharedCount > 0);
+    TEST_EXPECT(test_count_chunks(dir.path()) == allIds.size());
+
+    {
+        ChunkStore store(dir.path());
+        store.release(firstRefs);
+        store.commit();
+        std::string rebuilt;
+        std::vector<char> data;
+        for (const auto& ref : secondRefs) {
+            TEST_EXPECT(store.has_chunk(ref));
+            store.read_chunk(ref, data);
+            rebuilt.append(data.data(), data.size());
+        }
+        TEST_EXPECT(rebuilt == second);
+    }
+    std::unordered_set<ChunkId, ChunkIdHash> secondIds;
+    for (const auto& ref : secondRefs) secondIds.insert(ref.id);
+    TEST_EXPECT(test_count_chunks(dir.path()) == secondIds.size());
+
+    {
+        ChunkStore store(dir.path());
+        store.release(secondRefs);
+        store.commit();
+    }
+    TEST_EXPECT(test_count_chunks(dir.path()) == 0);
+}
+
+// Tiered retention keeps everything in the newest tier, the oldest snapshot of each bucket in
+// older tiers and nothing past the last tier; later snapshots do not change earlier decisions
+void test_retention() {
+    const int64_t day = 86400;
+    const int64_t now = 1000 * day;
+    std::vector<int64_t> times;
+    for (int i = 0; i <= 40; i++) {
+        times.push_back(now - 10 * day + i * 6 * 3600);
+    }
+    std::vector<RetentionTier> tiers = parse_retention("daily:7d, all:1d");
+    TEST_EXPECT(tiers.size() == 2 && tiers[0].bucket == RetentionBucket::All);
+
+    std::vector<bool> keep = plan_tiered_retention(times, tiers, now);
+    std::vector<int> kept;
+    for (size_t i = 0; i < keep.size(); i++) {
+        if (keep[i]) kept.push_back(static_cast<int>(i));
+    }
+    TEST_EXPECT((kept == std::vector<int>{13, 16, 20, 24, 28, 32, 36, 37, 38, 39, 40}));
+
+    std::vector<int64_t> earlier(times.begin(), times.end() - 1);
+    std::vector<bool> keepEarlier = plan_tiered_retention(earlier, tiers, now);
+    TEST_EXPECT(std::equal(keepEarlier.begin(), keepEarlier.end(), keep.begin()));
+
+    // Past the last tier only the newest snapshot survives
+    std::vector<bool> expired = plan_tiered_retention({now - 30 * day, now - 20 * day}, tiers, now);
+    TEST_EXPECT(!expired[0] && expired[1]);
+}
+
+CatalogEntry test_catalog_entry(const std::string& name, int64_t createdNs) {
+    CatalogEntry entry;
+    entry.name = name;
+    entry.createdNs = createdNs;
+    entry.source = "/src";
+    return entry;
+}
+
+// A torn record at the end of the log is ignored on load and cut off by the next append, and a
+// log compacted by another catalog instance is reloaded instead of appended to at a stale offset
+void test_catalog() {
+    TestDir dir("catalog");
+    fs::path logPath = dir.path() / CATALOG_FILE_NAME;
+    {
+        SnapshotCatalog catalog(dir.path());
+        for (int i = 1; i <= 3; i++) {
+            catalog.add(test_catalog_entry("Backup_2024-01-0" + std::to_string(i) + "_00-00-00", i));
+        }
+    }
+    uint64_t goodSize = fs::file_size(logPath);
+
+    // A crash mid-append: the length promises more payload than was written
+    {
+        std::ofstream out(logPath, std::ios::binary | std::ios::app);
+        write_u32(out, 100);
+        out.write("torn", 4);
+    }
+    {
+        SnapshotCatalog catalog(dir.path());
+        TEST_EXPECT(catalog.entries().size() == 3);
+        catalog.add(test_catalog_entry("Backup_2024-01-04_00-00-00", 4));
+    }
+    {
+        SnapshotCatalog catalog(dir.path());
+        TEST_EXPECT(catalog.entries().size() == 4);
+        TEST_EXPECT(catalog.find("Backup_2024-01-04_00-00-00") != nullptr);
+        TEST_EXPECT(fs::file_size(logPath) > goodSize);
+    }
+
+    // Enough verify records make the second instance compact the log into a new, shorter file
+    SnapshotCatalog first(dir.path());
+    SnapshotCatalog second(dir.path());
+    for (int i = 0; i < 300; i++) {
+        VerifyRecord record;
+        record.time = 1000 + i;
+        record.entriesChecked = 1;
+        second.record_verify("Backup_2024-01-01_00-00-00", record);
+    }
+    second.remove("Backup_2024-01-02_00-00-00");
+    first.add(test_catalog_entry("Backup_2024-01-05_00-00-00", 5));
+
+    SnapshotCatalog reloaded(dir.path());
+    TEST_EXPECT(reloaded.entries().size() == 4);
+    TEST_EXPECT(reloaded.find("Backup_2024-01-02_00-00-00") == nullptr);
+    TEST_EXPECT(reloaded.find("Backup_2024-01-05_00-00-00") != nullptr);
+    const CatalogEntry* verified = reloaded.find("Backup_2024-01-01_00-00-00");
+    TEST_EXPECT(verified && verified->verified && verified->verified->time == 1299);
+
+    // A name is reserved by its stage directory, so one in flight is not handed out again
+    std::string reserved = reloaded.reserve_name("Backup_2024-01-06_00-00-00");
+    TEST_EXPECT(reserved == "Backup_2024-01-06_00-00-00");
+    TEST_EXPECT(fs::is_directory(dir.path() / (reserved + PARTIAL_SUFFIX)));
+    TEST_EXPECT(reloaded.reserve_name("Backup_2024-01-06_00-00-00") == "Backup_2024-01-06_00-00-00_2");
+}
+
+// Files packed by PackWriter come back from their pack index refs, standalone files keep pack 0,
+// and a pack index with a damaged trailer is rejected
+void test_pack_index() {
+    TestDir dir("packindex");
+    fs::path packDir = dir.path() / PACK_DIR_NAME;
+    fs::create_directories(packDir);
+    std::vector<std::string> files{test_random_bytes(1000, 4), test_random_bytes(70000, 5), std::string(),
+                                   test_random_bytes(300, 6)};
+
+    std::vector<PackRef> refs(files.size());
+    std::unordered_map<uint64_t, PackSummary> table;
+    PackWriter writer(packDir);
+    for (size_t i = 0; i < files.size(); i++) {
+        if (i == 2) continue; // stored as a file of its own
+        refs[i] = writer.append(files[i].data(), files[i].size());
+        table[refs[i].pack].liveBytes += files[i].size();
+    }
+    writer.close();
+    for (const auto& [pack, size] : writer.written()) {
+        table[pack].size = size;
+    }
+
+    fs::path indexPath = dir.path() / PACK_INDEX_FILE_NAME;
+    {
+        std::ofstream out(indexPath, std::ios::binary | std::ios::trunc);
+        write_u32(out, PACK_INDEX_MAGIC);
+        for (const auto& ref : refs) {
+            write_pack_ref(out, ref);
+        }
+        write_pack_table(out, table);
+    }
+
+    PackIndexReader reader;
+    TEST_EXPECT(reader.open(dir.path()));
+    for (size_t i = 0; i < files.size(); i++) {
+        PackRef ref;
+        reader.next(ref);
+        TEST_EXPECT(ref.pack == refs[i].pack && ref.offset == refs[i].offset);
+        if (ref.pack == 0) continue;
+        const PackSummary* summary = reader.summary(ref.pack);
+        TEST_EXPECT(summary && summary->size == table[ref.pack].size &&
+                    summary->liveBytes == table[ref.pack].liveBytes);
+        std::string data;
+        read_pack_range(packDir / pack_file_name(ref.pack), ref.offset, files[i].size(),
+                        [&](const char* piece, size_t size) { data.append(piece, size); });
+        TEST_EXPECT(data == files[i]);
+    }
+
+    fs::resize_file(indexPath, fs::file_size(indexPath) - 1);
+    bool rejected = false;
+    try {
+        PackIndexReader damaged;
+        damaged.open(dir.path());
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    TEST_EXPECT(rejected);
+}
+
+// Function to copy files with a fresh CopyEngine into targetRoot, recording their hashes;
+// returns how many files were copied and how many of those went through AsyncIo
+std::pair<size_t, size_t> test_copy_files(const fs::path& sourceRoot, const fs::path& targetRoot,
+                                const std::vector<std::string>& paths, std::vector<ManifestEntry>& entries) {
+    entries.assign(paths.size(), ManifestEntry{});
+    CopyEngine engine(4, false, true);
+    for (size_t i = 0; i < paths.size(); i++) {
+        fs::path target = targetRoot / paths[i];
+        fs::create_directories(target.parent_path());
+        entries[i].path = paths[i];
+        engine.copy(sourceRoot / paths[i], target, fs::file_size(sourceRoot / paths[i]), 1700000000000000000LL, 0644,
+                    &entries[i]);
+    }
+    engine.finish();
+    return {engine.stats().filesCopied.load(), engine.stats().filesAsync.load()};
+}
+
+std::string test_read_file(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Small files copied through AsyncIo (io_uring on Linux, where the kernel allows it) come out
+// byte for byte like the blocking copies, with the same content hashes
+void test_async_io() {
+    TestDir dir("async_io");
+    fs::path source = dir.path() / "src";
+    std::vector<std::string> paths;
+    std::mt19937_64 random(7);
+    for (int i = 0; i < 400; i++) {
+        std::string path = "d" + std::to_string(i % 7) + "/f" + std::to_string(i);
+        size_t size = i % 50 == 0 ? 0 : static_cast<size_t>(random() % (i % 10 == 0 ? 600000 : 20000));
+        fs::create_directories((source / path).parent_path());
+        test_write_file(source / path, test_random_bytes(size, 100 + i));
+        paths.push_back(path);
+    }
+
+    std::vector<ManifestEntry> blockingEntries, asyncEntries;
+    async_io_enabled() = false;
+    auto [blockingCopied, blockingAsync] = test_copy_files(source, dir.path() / "blocking", paths, blockingEntries);
+    bool available = AsyncIo::create() != nullptr;
+    async_io_enabled() = true;
+    auto [asyncCopied, asyncAsync] = test_copy_files(source, dir.path() / "async", paths, asyncEntries);
+    async_io_enabled() = false;
+
+    TEST_EXPECT(blockingCopied == paths.size() && blockingAsync == 0);
+    TEST_EXPECT(asyncCopied == paths.size());
+    if (available) {
+        TEST_EXPECT(asyncAsync > 0);
+    } else {
+        std::cout << "  (no async I/O in this kernel, only the blocking fallback was checked)\n";
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::string expected = test_read_file(source / paths[i]);
+        TEST_EXPECT(test_read_file(dir.path() / "blocking" / paths[i]) == expected);
+        TEST_EXPECT(test_read_file(dir.path() / "async" / paths[i]) == expected);
+        TEST_EXPECT(asyncEntries[i].hasHash && blockingEntries[i].hasHash);
+        TEST_EXPECT(asyncEntries[i].hash == blockingEntries[i].hash);
+        TEST_EXPECT(asyncEntries[i].size == expected.size());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const std::vector<std::pair<std::string, void (*)()>> tests{
+        {"manifest", test_manifest},
+        {"chunk_store", test_chunk_store},
+        {"retention", test_retention},
+        {"catalog", test_catalog},
+        {"pack_index", test_pack_index},
+        {"async_io", test_async_io},
+    };
+
+    // No argument runs every test
+    bool failed = false;
+    bool found = false;
+    for (const auto& [name, test] : tests) {
+        if (argc > 1 && name != argv[1]) continue;
+        found = true;
+        try {
+            test();
+            std::cout << "✓ " << name << "\n";
+        } catch (const std::exception& e) {
+            failed = true;
+            std::cerr << "✗ " << name << ": " << e.what() << "\n";
+        }
+    }
+    if (!found) {
+        std::cerr << "Unknown test: " << argv[1] << "\n";
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
+#endif // FLAMEUP_TEST